@@ -232,6 +232,10 @@ typedef struct
 #define PT_LOPROC	0x70000000
 #define PT_HIPROC	0x7fffffff
 
+#define PF_X		0x1
+#define PF_W		0x2
+#define PF_R		0x4
+
 #define DT_NULL		0x0
 #define DT_NEEDED	0x1
 #define DT_PLTRELSZ	0x2
@@ -269,7 +273,23 @@ typedef struct
 	} d_un;
 } Elf32_Dyn;
 
+/** \brief Most program headers an executable may have */
+#define ELF_PHDR_MAX	0x40
+/** \brief Lowest address a program may be loaded at, the first page stays out */
+#define ELF_USER_START	0x1000
+/** \brief Where the user stack ends, right below the kernel */
+#define ELF_STACK_TOP	0xC0000000
+/** \brief How far the user stack may grow, pages only come in when touched */
+#define ELF_STACK_SIZE	0x100000
+
+struct vfile;
+struct task;
+
 int core_symbols_init(struct multiboot_elf_section_header_table* table);
+int elf_exec(struct vfile* file, const char* name, struct task** task);
+#ifdef ELF_TEST
+int elf_test();
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,66 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ANDROMEDA_KTHREAD_H
+#define __ANDROMEDA_KTHREAD_H
+
+#include <andromeda/sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup kthread
+ * @{
+ */
+
+#define KTHREAD_STACK_SIZE 0x2000
+
+/**
+ * \struct kthread
+ * \brief A task that only ever runs kernel code, on a stack of its own
+ *
+ * The task comes first, so a struct task of a kernel thread can be cast back.
+ */
+struct kthread {
+        struct task task;
+        struct thread_state thread;
+
+        void (*fn)(void* arg);
+        void* arg;
+        const char* name;
+
+        struct kthread* next_dead;
+};
+
+struct task* kthread_create(void (*fn)(void*), void* arg, const char* name);
+struct task* kthread_run(void (*fn)(void*), void* arg, const char* name);
+void kthread_destroy(struct task* task);
+int kthread_bind(struct task* task, int cpu);
+void kthread_exit() __attribute__((noreturn));
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
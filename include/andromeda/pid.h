@@ -0,0 +1,70 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ANDROMEDA_PID_H
+#define __ANDROMEDA_PID_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup pid
+ * @{
+ */
+
+#define PID_BITS 8
+#define PID_FANOUT (1 << PID_BITS)
+#define PID_MASK (PID_FANOUT - 1)
+#define PID_LEVELS 3
+/** \brief One past the highest pid */
+#define PID_MAX (1 << (PID_BITS * PID_LEVELS))
+#define PID_WORDS (PID_FANOUT / 32)
+
+struct task;
+
+/**
+ * \struct pid_node
+ * \brief A node of the pid tree
+ * \var full
+ * \brief Bit n is set if slot n holds a task, or a node with no room left
+ * \var slot
+ * \brief Tasks in the leaves, nodes one level down in the others
+ */
+struct pid_node {
+        uint32_t full[PID_WORDS];
+        void* volatile slot[PID_FANOUT];
+};
+
+int pid_alloc(struct task* task, uint32_t* pid);
+int pid_free(uint32_t pid);
+#ifdef PID_TEST
+int pid_test();
+#endif
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
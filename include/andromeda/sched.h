@@ -22,6 +22,9 @@
 #include <stdlib.h>
 #include <types.h>
 #include <arch/x86/task.h>
+#ifdef X86
+#include <arch/x86/percpu.h>
+#endif
 #include <mm/paging.h>
 
 #ifdef __cplusplus
@@ -30,28 +33,57 @@ extern "C" {
 /** STD_STACK_SIZE speaks for itself */
 #define STD_STACK_SIZE 0x8000
 
-/** Defines the standard size of a list element */
-#define SCHED_LIST_SIZE 0x10
-
-/** Defines the standard size of a task list element */
-#define TASK_LIST_SIZE 0x100
+/** Threads a task holds without allocating a table for them */
+#define THREAD_TABLE_INLINE 1
+/** The first table allocated holds this many */
+#define THREAD_TABLE_MIN 0x8
+/** Thread ids go up to here */
+#define THREAD_TABLE_MAX 0x100000
+/** run_index of a thread that isn't runnable */
+#define THREAD_NOT_RUNNABLE 0xFFFFFFFF
 
 /*
  * Algorithm defs
  */
 #define SCHED_PRIO_SIZE 40
-#define SCHED_REALTIME_LIST 0x0
+/** \brief Priority levels of the real-time classes, 0 being the highest */
+#define SCHED_RT_PRIO_SIZE 32
+/** \brief Milliseconds a round-robin task runs before the next one's turn */
+#define SCHED_RR_SLICE 10
+/** \brief Fixed point shift of the deadline bandwidth */
+#define SCHED_DL_BW_SHIFT 10
+/** \brief Share of a cpu the deadline tasks together may reserve, 95% */
+#define SCHED_DL_BW_LIMIT ((95 << SCHED_DL_BW_SHIFT) / 100)
+
+/*
+ * What cpu time is spent on. Tasks are charged the first three, cpus all
+ * four.
+ */
+#define SCHED_TIME_KERNEL 0
+#define SCHED_TIME_USER 1
+#define SCHED_TIME_IRQ 2
+#define SCHED_TIME_IDLE 3
+#define SCHED_TIMES 3
 #define SCHED_GRAB_BOX 0x1
 #define SCHED_EPOCH_SIZE 0x10
+/** \brief The priority new tasks start out with */
+#define SCHED_PRIO_DEFAULT 20
+#define SCHED_BITMAP_WORDS ((SCHED_PRIO_SIZE + 31) / 32)
 
 /**
- * tast_list_type is used to note down the type of __TASK_BRANCH_NODE.
- * It fulfills the task of typeof in OO languages
+ * \enum sched_policy
+ * \brief The scheduling classes
+ *
+ * Deadline tasks go before the fixed priority real-time tasks, which go
+ * before the normal tasks. A runnable task of a higher class always preempts
+ * one of a lower class.
  */
-enum task_list_type
+enum sched_policy
 {
-        task_list,
-        branch_list
+        SCHED_NORMAL,
+        SCHED_FIFO,
+        SCHED_RR,
+        SCHED_DEADLINE
 };
 
 enum task_status
@@ -72,21 +104,57 @@ struct thread_state
         void* ss;
         addr_t ss_size;
 
+        /** Saved fpu and SSE registers, NULL until the thread first uses them */
+        void* fpu;
+        /** The cpu that last loaded them */
+        int fpu_cpu;
+
         enum task_status state;
+
+        /** Our id within the task, and our place in its runnable array */
+        uint32_t id;
+        uint32_t run_index;
 };
 
 /**
- * It's kinda handy to keep track of which threads you're running
- * This is done by keeping a list of lists of thread states. Can you still keep
- * up?
+ * \struct thread_table
+ * \brief The threads of a task
+ * \var slots
+ * \brief Indexed by thread id. A free slot holds the next free id, shifted
+ * left by one with the lowest bit set.
+ * \var free
+ * \brief The first free id, or size if none is free
+ * \var runnable
+ * \brief The runnable threads, packed at the front
+ *
+ * Finding a thread by id, adding and removing it all take constant time. The
+ * arrays double when they fill up, and start out inline, so a task with a
+ * single thread never allocates them. That also means a table can't be copied
+ * or moved, only set up again with thread_table_init.
  */
-struct thread_list
+struct thread_table
 {
-        struct thread_state* thread[SCHED_LIST_SIZE];
-        enum task_status state;
+        spinlock_t lock;
+        addr_t* slots;
+        struct thread_state** runnable;
+        uint32_t size;
+        uint32_t free;
+        uint32_t count;
+        uint32_t runnable_count;
+
+        addr_t inline_slots[THREAD_TABLE_INLINE];
+        struct thread_state* inline_runnable[THREAD_TABLE_INLINE];
+};
+
+struct task;
+struct sched_array;
+
+struct task_head
+{
+        struct task_head* next;
+        struct task_head* prev;
 
-        struct thread_list* next;
-        struct thread_list* prev;
+        struct task* task;
 };
 
 /**
@@ -95,25 +163,50 @@ struct thread_list
 struct task
 {
         /** Keep track of threads and task level registers */
-        struct thread_list* threads;
-        uint8_t current_thread;
+        struct thread_table threads;
+        struct thread_state* current_thread;
         struct prog_regs regs;
         //REGS* registers;
 
         /** What state are we in */
         enum task_status state;
 
-        /** Who's your daddy? */
+        /** Our id, and who's your daddy? */
+        uint32_t pid;
         uint16_t parent_id;
 
         /** speaks for itself */
         uint8_t priority;
         uint8_t ring_level;
 
+        /** Scheduling class, and the priority within the real-time ones */
+        uint8_t policy;
+        uint8_t rt_priority;
+        /** Deadline class: the runtime granted every period, in ms */
+        time_t dl_runtime;
+        time_t dl_period;
+        /** Deadline class: end of the current period */
+        time_t dl_deadline;
+        /** Cpu tick at which a real-time task was last woken, 0 if running */
+        uint64_t wake_tick;
+        /** Cpu ticks spent per SCHED_TIME, and what we spend them on now */
+        uint64_t cpu_time[SCHED_TIMES];
+        uint8_t time_mode;
+
         /** We're keeping track of how much time you used. It needs to be fair! */
         uint32_t time_used;
         uint32_t time_granted;
 
+        /** Where we are in the run queue, sched_array is NULL if not queued */
+        struct task_head sched_node;
+        struct sched_array* sched_array;
+        /** The cpu we last ran or are queued on, its run queue lock guards us */
+        int cpu;
+        /** Set while a cpu runs us, or is still switching away from us */
+        volatile int on_cpu;
+        /** Bit mask of the cpus we may run on, 0 for any */
+        uint32_t affinity;
+
         /** Where can we find more code if we swapped some out? */
         char *path_to_bin;
 
@@ -129,27 +222,6 @@ struct task
         struct vm_descriptor* virtual_memory;
 };
 
-/** Structure for keeping track of threads in the shape of a tree. */
-struct task_branch_node
-{
-        uint16_t full; /** Bitmap of which entries are full */
-        enum task_list_type type;
-
-        struct task_branch_node* parent;
-        union {
-                struct task_state*       task   [TASK_LIST_SIZE];
-                struct task_branch_node* branch [TASK_LIST_SIZE];
-        };
-};
-
-struct task_head
-{
-        struct task_head* next;
-        struct task_head* prev;
-
-        struct task* task;
-};
-
 struct task_list_head
 {
         struct task_list_head *next;
@@ -160,10 +232,71 @@ struct task_list_head
         uint32_t size;
 };
 
-/** Some things that might need sharing in the future */
-extern struct task_list_head task_stack[SCHED_PRIO_SIZE];
+/**
+ * \struct sched_array
+ * \brief One list of tasks per priority level
+ * \var bitmap
+ * \brief Bit n is set when queue n holds any tasks
+ */
+struct sched_array
+{
+        uint32_t bitmap[SCHED_BITMAP_WORDS];
+        struct task_list_head queue[SCHED_PRIO_SIZE];
+        uint32_t size;
+};
+
+/**
+ * \struct sched_rq
+ * \brief A run queue
+ * \var active
+ * \brief The tasks that still have time left in this epoch
+ * \var expired
+ * \brief The tasks that used up their time, waiting for the next epoch
+ * \var rt
+ * \brief The FIFO and round-robin tasks, by real-time priority
+ * \var dl
+ * \brief The deadline tasks, earliest deadline first
+ * \var dl_bw
+ * \brief The bandwidth reserved by the deadline tasks of this cpu
+ * \var rt_latency
+ * \brief Cpu ticks from wakeup to running, summed over rt_wakeups
+ *
+ * One per cpu, cache line aligned so the locks of two cpus don't share a line.
+ */
+struct sched_rq
+{
+        spinlock_t lock;
+        struct sched_array arrays[2];
+        struct sched_array* active;
+        struct sched_array* expired;
+        uint32_t epoch;
+        int cpu;
+
+        struct sched_array rt;
+        struct task_list_head dl;
+        uint32_t dl_bw;
+
+        uint32_t rt_wakeups;
+        uint32_t rt_latency_max;
+        uint64_t rt_latency;
+} __attribute__((aligned(64)));
+
 extern struct task *current_task;
 
+#ifdef X86
+/* Every cpu runs a task of its own */
+static inline struct task*
+get_current_task()
+{
+        return x86_percpu_read(task);
+}
+
+static inline void
+set_current_task(struct task *task)
+{
+        x86_percpu_write(task, task);
+}
+#else
 static inline struct task*
 get_current_task()
 {
@@ -175,12 +308,47 @@ set_current_task(struct task *task)
 {
         current_task = task;
 }
+#endif
+
+void sched_rq_init(struct sched_rq* rq);
+void sched_rq_add(struct sched_rq* rq, struct task* task);
+void sched_rq_del(struct sched_rq* rq, struct task* task);
+struct task* sched_rq_pick(struct sched_rq* rq);
+
+int sched_init();
+void sched_finish();
+int sched_can_sleep();
+int sched_enqueue(struct task* task);
+int sched_dequeue(struct task* task);
+void sched_tick();
+int sched_set_priority(struct task* task, uint8_t priority);
+int sched_set_affinity(struct task* task, uint32_t affinity);
+int sched_set_scheduler(struct task* task, int policy, uint8_t priority);
+int sched_set_deadline(struct task* task, time_t runtime, time_t period);
+#ifdef SCHED_BENCH
+void sched_bench();
+#endif
+#ifdef SCHED_RT_TEST
+int sched_rt_test();
+#endif
 
 extern void sched();
 extern int fork();    /** Copy the current task to a new one */
 extern void sig(int); /** Send a signal to the current task */
 extern void kill(int);
 
+void thread_table_init(struct thread_table* table);
+void thread_table_free(struct thread_table* table);
+int thread_table_add(struct thread_table* table, struct thread_state* thread);
+int thread_table_del(struct thread_table* table, struct thread_state* thread);
+struct thread_state* thread_table_get(struct thread_table* table,
+                uint32_t id);
+int thread_table_set_state(struct thread_table* table,
+                struct thread_state* thread, enum task_status state);
+#ifdef THREAD_TEST
+int thread_table_test();
+#endif
+
 int task_init(); /** Can we please initialise some administration? */
 
 void print_task_stack(); /** Can you show me a proccess dump? */
@@ -58,6 +58,10 @@ struct sys_mmu_range {
 struct sys_mmu {
         int (*set_page)(void* phys, void* virt, int privilege);
         int (*reset_page)(void* virt);
+        int (*reset_page_lazy)(void* virt);
+        int (*flush)(void);
+        int (*test_accessed)(void* virt);
+        int (*test_dirty)(void* virt);
         void* (*get_phys)(void* virt);
         int (*set_range)(struct sys_mmu_range*);
         int (*reset_range)(struct sys_mmu_range*);
@@ -70,16 +74,25 @@ struct sys_timer {
         int (*subscribe)(time_t time, uint16_t id, handler call_back,
                         struct sys_timer* timer);
         int (*set_freq)(time_t freq, struct sys_timer* timer);
+        /*
+         * One shot timers only interrupt when asked to. This arms the timer
+         * for the given time, or for as long as it can if that's -1.
+         * Periodic timers leave it NULL.
+         */
+        int (*set_next)(time_t time, struct sys_timer* timer);
 
         struct tree_root* events;
 
         time_t freq;
         volatile time_t time;
         atomic_t tick;
+        /* The time a one shot timer is armed for */
+        volatile time_t next;
 
         uint16_t interrupt_id;
 
-        mutex_t timer_lock;
+        /* Guards time, which is read far more often than it ticks */
+        seqlock_t timer_lock;
 };
 
 struct sys_cpu_scheduler {
@@ -245,7 +258,14 @@ static inline time_t getTime(struct sys_timer* timer)
         if (timer == NULL) {
                 return -1;
         }
-        return timer->time;
+        /* A 64 bit time can't be read in one go on 32 bit machines */
+        time_t time;
+        unsigned int seq;
+        do {
+                seq = seqlock_read_begin(&timer->timer_lock);
+                time = timer->time;
+        } while (seqlock_read_retry(&timer->timer_lock, seq));
+        return time;
 }
 
 static inline int subscribe_global_timer(int16_t irq_no, time_t time,
@@ -356,6 +376,78 @@ static inline int page_unmap(int cpu, void* virt)
         return core.arch->cpu[cpu]->mmu->reset_page(virt);
 }
 
+/**
+ * \fn page_unmap_lazy
+ * \brief Unmap a page without invalidating the translation caches
+ * \param cpu
+ * \param virt
+ * \return A standard error code
+ *
+ * The old translation may linger until page_flush is called, so the virtual
+ * address must not be handed out again before then.
+ */
+static inline int page_unmap_lazy(int cpu, void* virt)
+{
+        if (!hascpu(cpu))
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu == NULL)
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu->reset_page_lazy == NULL)
+                return core.arch->cpu[cpu]->mmu->reset_page(virt);
+        return core.arch->cpu[cpu]->mmu->reset_page_lazy(virt);
+}
+
+/**
+ * \fn page_flush
+ * \brief Invalidate all non-global translations of the cpu
+ * \param cpu
+ * \return A standard error code
+ */
+static inline int page_flush(int cpu)
+{
+        if (!hascpu(cpu))
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu == NULL)
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu->flush == NULL)
+                return -E_SUCCESS;
+        return core.arch->cpu[cpu]->mmu->flush();
+}
+
+/**
+ * \fn page_test_accessed
+ * \brief Test and clear the accessed state of a mapped page
+ * \param cpu
+ * \param virt
+ * \return 1 if accessed since the last call, 0 if not, or an error code
+ */
+static inline int page_test_accessed(int cpu, void* virt)
+{
+        if (!hascpu(cpu))
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu == NULL ||
+                        core.arch->cpu[cpu]->mmu->test_accessed == NULL)
+                return -E_NULL_PTR;
+        return core.arch->cpu[cpu]->mmu->test_accessed(virt);
+}
+
+/**
+ * \fn page_test_dirty
+ * \brief Test and clear the dirty state of a mapped page
+ * \param cpu
+ * \param virt
+ * \return 1 if written to since the last call, 0 if not, or an error code
+ */
+static inline int page_test_dirty(int cpu, void* virt)
+{
+        if (!hascpu(cpu))
+                return -E_NULL_PTR;
+        if (core.arch->cpu[cpu]->mmu == NULL ||
+                        core.arch->cpu[cpu]->mmu->test_dirty == NULL)
+                return -E_NULL_PTR;
+        return core.arch->cpu[cpu]->mmu->test_dirty(virt);
+}
+
 static inline int page_unmap_range(int cpu, struct sys_mmu_range* range)
 {
         if (!hascpu(cpu) || range == NULL)
@@ -400,6 +492,8 @@ int interrupt_test(int interrupt_no);
 
 int cpu_timer_init(int cpuid, time_t freq, int16_t irq_no);
 int andromeda_timer_init(time_t freq, int16_t irq_no);
+int timer_advance(struct sys_timer* timer, time_t now, int16_t irq_no);
+time_t timer_next_event(struct sys_timer* timer);
 struct sys_timer* get_global_timer(int16_t irq_no);
 struct sys_timer* get_cpu_timer(int16_t cpu);
 #ifdef TIMER_DBG
@@ -24,5 +24,9 @@
 #include <andromeda/sched.h>
 
 extern int switch_context(struct thread_state *thread);
+int context_switch(uint32_t cpuid, struct task* task);
+#ifdef CTX_BENCH
+void context_switch_bench();
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ANDROMEDA_WORKQUEUE_H
+#define __ANDROMEDA_WORKQUEUE_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup workqueue
+ * @{
+ */
+
+struct work;
+typedef void (*work_func_t)(struct work* work);
+
+/**
+ * \struct work
+ * \brief Something to be done later, by a worker thread
+ * \var pending
+ * \brief Set from queueing until the worker starts on it
+ *
+ * Usually embedded in whatever the work is about, so fn can get back to it.
+ */
+struct work {
+        work_func_t fn;
+        struct work* next;
+        volatile uint32_t pending;
+};
+
+#define WORK_INIT(f) {(f), NULL, 0}
+
+void work_init(struct work* work, work_func_t fn);
+int work_queue(struct work* work);
+int work_queue_on(int cpu, struct work* work);
+int workqueue_init();
+#ifdef WORK_TEST
+int workqueue_test();
+#endif
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
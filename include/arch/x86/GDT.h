@@ -20,10 +20,36 @@
 #ifndef __GDT_H
 #define __GDT_H
 
+#include <types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Selectors of the ring 3 segments, with the requested privilege level set */
+#define X86_USER_CS 0x1B
+#define X86_USER_DS 0x23
+
+/*
+ * Every cpu has a task state segment in its per cpu area. All it is used for
+ * is the stack the cpu switches to when an interrupt comes in from ring 3.
+ */
+#define X86_TSS_ENTRY 6
+#define X86_TSS_SEL (X86_TSS_ENTRY << 3)
+
+struct x86_tss
+{
+  uint32_t link;
+  uint32_t esp0;
+  uint32_t ss0;
+  uint32_t esp1, ss1, esp2, ss2;
+  uint32_t cr3, eip, eflags;
+  uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+  uint32_t es, cs, ss, ds, fs, gs, ldt;
+  uint16_t trap;
+  uint16_t iomap_base;
+} __attribute__((packed));
+
 #ifdef FAST
 // Here goes the GDT entry data structure
 struct gdtEntry
@@ -64,6 +90,9 @@ typedef struct gdtPtr gdt_t;
 // The load gdt instruction
 extern void lgdt(gdt_t*);
 
+void setGDT();
+void x86_gdt_cpu_init(int cpu);
+
 #endif
 
 #ifdef __cplusplus
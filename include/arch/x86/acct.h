@@ -0,0 +1,74 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_ACCT_H
+#define __ARCH_X86_ACCT_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_acct
+ * @{
+ */
+
+/** \brief Events kept per cpu, a power of two */
+#define X86_TRACE_SIZE 0x100
+
+enum x86_trace_type {
+        X86_TRACE_SWITCH_OUT,
+        X86_TRACE_SWITCH_IN,
+        X86_TRACE_WAKEUP,
+        X86_TRACE_MIGRATE
+};
+
+struct task;
+
+/**
+ * \struct x86_trace_event
+ * \brief A scheduler event, as recorded by the cpu it happened on
+ * \var arg
+ * \brief The state switched out with, the cpu woken on, or the cpu migrated
+ * from in the upper and to in the lower half
+ */
+struct x86_trace_event {
+        uint64_t tick;
+        uint32_t pid;
+        uint16_t type;
+        uint16_t cpu;
+        uint32_t arg;
+};
+
+int x86_acct_enter(int mode);
+void x86_acct_exit(int mode);
+void x86_acct_switch(struct task* prev, struct task* next);
+void x86_trace(int type, struct task* task, uint32_t arg);
+int x86_acct_init();
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
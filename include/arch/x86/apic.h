@@ -0,0 +1,125 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_APIC_H
+#define __ARCH_X86_APIC_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_apic
+ * @{
+ */
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+/* Local APIC registers, as offsets into the MMIO page */
+#define LAPIC_ID                0x020
+#define LAPIC_VERSION           0x030
+#define LAPIC_TPR               0x080
+#define LAPIC_EOI               0x0B0
+#define LAPIC_SVR               0x0F0
+#define LAPIC_ESR               0x280
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_LVT_TIMER         0x320
+#define LAPIC_TIMER_INIT        0x380
+#define LAPIC_TIMER_CURRENT     0x390
+#define LAPIC_TIMER_DIVIDE      0x3E0
+
+#define LAPIC_SVR_ENABLE        (1<<8)
+#define LAPIC_SPURIOUS_VECTOR   0xFF
+
+/* Interrupt command register bits */
+#define LAPIC_ICR_FIXED         (0<<8)
+#define LAPIC_ICR_NMI           (4<<8)
+#define LAPIC_ICR_INIT          (5<<8)
+#define LAPIC_ICR_STARTUP       (6<<8)
+#define LAPIC_ICR_PENDING       (1<<12)
+#define LAPIC_ICR_ASSERT        (1<<14)
+#define LAPIC_ICR_LEVEL         (1<<15)
+#define LAPIC_ICR_SELF          (1<<18)
+#define LAPIC_ICR_ALL           (2<<18)
+#define LAPIC_ICR_ALL_BUT_SELF  (3<<18)
+
+/* Timer local vector table entry */
+#define LAPIC_LVT_MASKED        (1<<16)
+#define LAPIC_TIMER_ONE_SHOT    (0<<17)
+#define LAPIC_TIMER_PERIODIC    (1<<17)
+#define LAPIC_TIMER_TSC_DEADLINE (2<<17)
+#define LAPIC_TIMER_DIV_16      0x3
+
+#define LAPIC_TIMER_VECTOR      0xEF
+/** \brief Milliseconds of PIT time to calibrate the timer against */
+#define LAPIC_TIMER_CALIBRATE   50
+/** \brief Never sleep longer than this, in milliseconds */
+#define LAPIC_TIMER_MAX_IDLE    500
+
+#define X86_MSR_TSC_DEADLINE    0x6E0
+
+/** \brief Number of polls before giving up on IPI delivery */
+#define LAPIC_IPI_TIMEOUT       0x100000
+
+/* I/O APIC registers, accessed through the select and window registers */
+#define IOAPIC_REGSEL           0x00
+#define IOAPIC_WIN              0x10
+#define IOAPIC_ID               0x00
+#define IOAPIC_VERSION          0x01
+#define IOAPIC_REDTBL(pin)      (0x10 + 2 * (pin))
+
+#define IOAPIC_VERSION_PINS(v)  ((((v) >> 16) & 0xFF) + 1)
+
+/* Redirection entry bits, low word */
+#define IOAPIC_RED_LOW          (1<<13)
+#define IOAPIC_RED_LEVEL        (1<<15)
+#define IOAPIC_RED_MASKED       (1<<16)
+
+int lapic_init(addr_t base);
+int lapic_available();
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t val);
+uint8_t lapic_id();
+void lapic_eoi();
+int lapic_send_ipi(uint8_t apic_id, uint32_t icr);
+
+int lapic_timer_init();
+uint32_t lapic_timer_interrupts(int cpu);
+
+int ioapic_init();
+int ioapic_enabled();
+int ioapic_isa_gsi(uint8_t irq, uint32_t* flags);
+int ioapic_route(uint32_t gsi, uint8_t vector, int cpu, uint32_t flags);
+int ioapic_mask(uint32_t gsi, int masked);
+
+/* Interrupt entry points, in smp.asm */
+extern void lapic_spurious();
+extern void lapic_timer_irq();
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,137 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_ATOMIC_H
+#define __ARCH_X86_ATOMIC_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_atomic
+ * @{
+ *
+ * Lock prefixed primitives. The 32 bit ones need a 486, the 64 bit ones use
+ * cmpxchg8b and need a Pentium.
+ */
+
+/**
+ * \fn x86_atomic_xadd
+ * \brief Add to a word and return what was there before
+ */
+static inline uint32_t x86_atomic_xadd(volatile uint32_t* ptr, uint32_t val)
+{
+        asm volatile ("lock xaddl %0, %1"
+                        : "+r" (val), "+m" (*ptr)
+                        :
+                        : "memory", "cc");
+        return val;
+}
+
+/**
+ * \fn x86_atomic_xadd16
+ * \brief Add to a half word and return what was there before
+ */
+static inline uint16_t x86_atomic_xadd16(volatile uint16_t* ptr, uint16_t val)
+{
+        asm volatile ("lock xaddw %0, %1"
+                        : "+r" (val), "+m" (*ptr)
+                        :
+                        : "memory", "cc");
+        return val;
+}
+
+/**
+ * \fn x86_atomic_cmpxchg
+ * \brief Replace old with new if ptr holds old
+ * \return The value ptr held, equal to old if the exchange took place
+ */
+static inline uint32_t x86_atomic_cmpxchg(volatile uint32_t* ptr, uint32_t old,
+                uint32_t new)
+{
+        uint32_t prev;
+        asm volatile ("lock cmpxchgl %2, %1"
+                        : "=a" (prev), "+m" (*ptr)
+                        : "r" (new), "0" (old)
+                        : "memory", "cc");
+        return prev;
+}
+
+/**
+ * \fn x86_atomic_xchg
+ * \brief Store a word and return the previous one (xchg is always locked)
+ */
+static inline uint32_t x86_atomic_xchg(volatile uint32_t* ptr, uint32_t val)
+{
+        asm volatile ("xchgl %0, %1"
+                        : "+r" (val), "+m" (*ptr)
+                        :
+                        : "memory");
+        return val;
+}
+
+/**
+ * \fn x86_atomic_cmpxchg64
+ * \brief Replace old with new if ptr holds old
+ * \return The value ptr held, equal to old if the exchange took place
+ */
+static inline int64_t x86_atomic_cmpxchg64(volatile int64_t* ptr, int64_t old,
+                int64_t new)
+{
+        int64_t prev;
+        asm volatile ("lock cmpxchg8b %1"
+                        : "=A" (prev), "+m" (*ptr)
+                        : "b" ((uint32_t)new), "c" ((uint32_t)(new >> 32)),
+                          "0" (old)
+                        : "memory", "cc");
+        return prev;
+}
+
+/**
+ * \fn x86_atomic_read64
+ * \brief Read a 64 bit value in one go
+ *
+ * A failing cmpxchg8b loads the current value without tearing. If the value
+ * happens to be equal it gets written back unchanged.
+ */
+static inline int64_t x86_atomic_read64(volatile int64_t* ptr)
+{
+        return x86_atomic_cmpxchg64(ptr, 0, 0);
+}
+
+/**
+ * \fn x86_pause
+ * \brief Spin loop hint (rep nop, so safe on cpus that predate it)
+ */
+static inline void x86_pause()
+{
+        asm volatile ("pause" ::: "memory");
+}
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -71,6 +71,21 @@ extern uint32_t x86_get_vendor();
 extern uint32_t x86_eflags_test(uint32_t);
 
 #define x86_cpuid_available() x86_eflags_test(X86_FLAGS_CPUID_TEST_BIT)
+
+/* cpuid(1) feature bits */
+#define X86_CPUID_EDX_APIC (1<<9)
+#define X86_CPUID_EDX_FXSR (1<<24)
+#define X86_CPUID_EDX_SSE (1<<25)
+#define X86_CPUID_EDX_SSE2 (1<<26)
+#define X86_CPUID_ECX_TSC_DEADLINE (1<<24)
+
+#define X86_CR0_MP (1<<1)
+#define X86_CR0_EM (1<<2)
+#define X86_CR0_TS (1<<3)
+#define X86_CR4_OSFXSR (1<<9)
+#define X86_CR4_OSXMMEXCPT (1<<10)
+
+int x86_sse_init();
 #if 0
 /* LOCKS */
 static void /* lock spin lock */
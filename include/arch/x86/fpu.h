@@ -0,0 +1,53 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_FPU_H
+#define __ARCH_X86_FPU_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_fpu
+ * @{
+ */
+
+/** \brief Size of the fxsave area, which has to be 16 byte aligned */
+#define X86_FPU_AREA 512
+#define X86_FPU_ALIGN 16
+
+struct thread_state;
+
+int x86_fpu_init();
+int x86_fpu_enabled();
+void x86_fpu_switch(struct thread_state* prev, struct thread_state* next);
+int x86_fpu_trap();
+void x86_fpu_release(struct thread_state* thread);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
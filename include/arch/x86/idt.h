@@ -58,6 +58,7 @@ int install_irq_vector(struct irq_data *);
 int alloc_idt_entry();
 extern void installIDT(struct idt*);
 extern addr_t get_idt();
+int x86_idt_set_gate(uint16_t num, void (*isr)());
 
 #ifdef __cplusplus
 }
@@ -40,7 +40,7 @@ typedef struct isr_stack ol_isr_stack_t;
 
 struct irq_stack
 {
-	uint32_t ds;
+	uint32_t ds; /* %gs of the interrupted code in the upper 16 bits */
 	uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
 //         uint32_t interruptHandler;
 	uint32_t eip;
@@ -0,0 +1,75 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_IRQ_BALANCE_H
+#define __ARCH_X86_IRQ_BALANCE_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_irq_balance
+ * @{
+ */
+
+#define IRQ_ROUTES 0x100
+/** \brief Milliseconds between two balancing passes */
+#define IRQ_BALANCE_INTERVAL 1000
+#define IRQ_AFFINITY_ALL 0xFFFFFFFF
+
+/**
+ * \struct irq_route
+ * \brief Where a device interrupt is delivered
+ * \var affinity
+ * \brief Bit mask of the cpus the interrupt may be sent to
+ * \var count
+ * \brief Number of interrupts since the last balancing pass
+ * \var retarget
+ * \brief Reprogram the interrupt source to deliver to another cpu
+ * \var data
+ * \brief Whatever retarget needs to find the source, e.g. the pin
+ */
+struct irq_route {
+        int used;
+        uint8_t vector;
+        int cpu;
+        uint32_t affinity;
+        volatile uint32_t count;
+        int (*retarget)(struct irq_route* route, int cpu);
+        void* data;
+};
+
+int irq_route_register(uint8_t vector, int cpu,
+                int (*retarget)(struct irq_route*, int), void* data);
+int irq_route_unregister(uint8_t vector);
+int irq_set_affinity(uint8_t vector, uint32_t affinity);
+void irq_route_account(uint8_t vector);
+int irq_balance();
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
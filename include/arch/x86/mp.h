@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <andromeda/system.h>
 
 #ifndef __MP_H
 #define __MP_H
@@ -29,6 +30,33 @@ extern "C" {
 
 #define MP_CONFIG_ENTRY_COUNT_OFFSET 0x22
 
+#define MP_FP_SIGNATURE 0x5F504D5F /* "_MP_" */
+#define MP_CONFIG_SIGNATURE 0x504D4350 /* "PCMP" */
+
+#define MP_ENTRY_PROC 0
+#define MP_ENTRY_BUS 1
+#define MP_ENTRY_IOAPIC 2
+#define MP_ENTRY_IO_INT 3
+#define MP_ENTRY_LOCAL_INT 4
+
+#define MP_PROC_ENABLED (1<<0)
+#define MP_PROC_BSP (1<<1)
+#define MP_IOAPIC_ENABLED (1<<0)
+#define MP_FP_IMCRP (1<<7)
+
+/* Interrupt assignment types and flags */
+#define MP_INT_VECTORED 0
+#define MP_INT_POLARITY_MASK 0x3
+#define MP_INT_POLARITY_LOW 0x3
+#define MP_INT_TRIGGER_MASK 0xC
+#define MP_INT_TRIGGER_LEVEL 0xC
+
+#define MP_IOAPIC_LIMIT 0x8
+#define MP_IO_INT_LIMIT 0x40
+
+#define MP_DEFAULT_LAPIC 0xFEE00000
+#define MP_DEFAULT_IOAPIC 0xFEC00000
+
 struct mp_config_header
 {
         uint32_t signature;
@@ -37,9 +65,15 @@ struct mp_config_header
                           */
         uint8_t rev;
         uint8_t checksum;
+        char oem[8];
+        char product[12];
+        uint32_t oem_table;
+        uint16_t oem_size;
+        uint16_t entries;
+        uint32_t lapic;
         uint16_t ex_length;
-        uint16_t ex_checksum;
-        
+        uint8_t ex_checksum;
+        uint8_t reserved;
 } __attribute((packed));
 
 struct mp_fp_header
@@ -64,9 +98,71 @@ typedef struct mp_proc_entry
 
         uint32_t signature;
         uint32_t features;
-} MP_PROC_ENTRY;
+        uint32_t reserved[2];
+} __attribute((packed)) MP_PROC_ENTRY;
+
+struct mp_bus_entry
+{
+        uint8_t type;
+        uint8_t id;
+        char bus_type[6];
+} __attribute((packed));
+
+struct mp_ioapic_entry
+{
+        uint8_t type;
+        uint8_t id;
+        uint8_t version;
+        uint8_t flags;
+        uint32_t addr;
+} __attribute((packed));
+
+struct mp_io_int_entry
+{
+        uint8_t type;
+        uint8_t int_type;
+        uint16_t flags;
+        uint8_t src_bus;
+        uint8_t src_irq;
+        uint8_t dst_ioapic;
+        uint8_t dst_pin;
+} __attribute((packed));
+
+/**
+ * \struct mp_info
+ * \brief What the MP tables told us about the machine
+ * \var cpus
+ * \brief Number of enabled processors, the boot processor comes first
+ * \var apic_id
+ * \brief Local APIC id of each processor
+ * \var lapic
+ * \brief Physical address of the local APICs
+ * \var imcr
+ * \brief Non-zero if the IMCR has to be switched to leave PIC mode
+ * \var isa_bus
+ * \brief Bus id of the ISA bus, -1 if there is none
+ * \var io_ints
+ * \brief Interrupt assignments, for routing through the I/O APICs
+ */
+struct mp_info
+{
+        int cpus;
+        uint8_t apic_id[CPU_LIMIT];
+        addr_t lapic;
+        int imcr;
+        int isa_bus;
+
+        int ioapics;
+        struct mp_ioapic_entry ioapic[MP_IOAPIC_LIMIT];
+
+        int io_ints;
+        struct mp_io_int_entry io_int[MP_IO_INT_LIMIT];
+};
+
+extern struct mp_info mp_info;
 
 extern void mp_parse_table(struct mp_fp_header *table);
+int mp_init();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,198 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_PERCPU_H
+#define __ARCH_X86_PERCPU_H
+
+#include <types.h>
+#include <arch/x86/GDT.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_percpu
+ * @{
+ *
+ * Every cpu has a GDT entry of its own at X86_PERCPU_ENTRY, with its base set
+ * to the per cpu area of that cpu. The kernel keeps %gs loaded with it, so a
+ * field of the calling cpu is read or written with a single %gs relative
+ * move, without knowing which cpu that is.
+ *
+ * The interrupt stubs save %gs of the interrupted code in the upper half of
+ * the ds slot of the stack frame and load X86_PERCPU_SEL.
+ */
+
+#define X86_PERCPU_ENTRY 5
+#define X86_PERCPU_SEL (X86_PERCPU_ENTRY << 3)
+#define X86_CACHE_LINE 64
+/** \brief Number of free pages a cpu keeps for itself */
+#define X86_PERCPU_PAGES 8
+
+struct task;
+struct thread_state;
+struct sys_timer;
+
+/**
+ * \struct x86_percpu
+ * \brief State only ever touched by the cpu it belongs to
+ * \var self
+ * \brief Linear address of the area, for whatever can't go through %gs
+ * \var task
+ * \brief The task running on the cpu
+ * \var idle
+ * \brief The task the cpu falls back to when nothing else is runnable
+ * \var prev
+ * \brief The task being switched out, until sched_finish
+ * \var migrate
+ * \brief A task to move to another cpu once it is switched out
+ * \var need_resched
+ * \brief Set when the running task should make way at the next chance
+ * \var sched_start
+ * \brief When the running task was last accounted for
+ * \var preempt_at
+ * \brief Cpu timer time of the earliest preemption event, -1 if none
+ * \var fpu_owner
+ * \brief The thread whose fpu state is in the registers of the cpu
+ * \var timer
+ * \brief The cpu timer, NULL until the local timer runs
+ * \var tsc_base
+ * \brief TSC value at timer_base, kept by the local APIC timer
+ * \var acct_tick
+ * \brief TSC value at which the cpu was last accounted for
+ * \var acct_mode
+ * \brief What the cpu is charging its time to, a SCHED_TIME value
+ * \var acct
+ * \brief TSC cycles spent per SCHED_TIME value
+ * \var idle_halted
+ * \brief Set while halted in x86_idle, interrupts leave scheduling to it
+ * \var idle_cycles
+ * \brief TSC cycles spent halted in x86_idle
+ * \var pages
+ * \brief Number of pages in page_cache
+ * \var page_cache
+ * \brief Freed pages handed out again by page_alloc without locking
+ * \var tss
+ * \brief Holds the kernel stack of the running thread, for ring 3 interrupts
+ *
+ * Aligned to a cache line, so two cpus never write to the same line.
+ */
+struct x86_percpu {
+        struct x86_percpu* self;
+        int cpu;
+        struct task* task;
+        struct task* idle;
+        struct task* prev;
+        struct task* migrate;
+        uint32_t need_resched;
+        time_t sched_start;
+        time_t preempt_at;
+        struct thread_state* fpu_owner;
+
+        struct sys_timer* timer;
+        uint64_t tsc_base;
+        time_t timer_base;
+        uint32_t timer_interrupts;
+
+        uint64_t acct_tick;
+        uint32_t acct_mode;
+        uint64_t acct[4];
+
+        uint32_t idle_halted;
+        uint64_t idle_cycles;
+        uint32_t idle_wakeups;
+
+        uint32_t pages;
+        void* page_cache[X86_PERCPU_PAGES];
+
+        struct x86_tss tss;
+
+        /* Statistics */
+        uint32_t interrupts;
+        uint32_t page_cache_hits;
+        uint32_t page_cache_misses;
+        uint32_t fpu_traps;
+} __attribute__((aligned(X86_CACHE_LINE)));
+
+extern struct x86_percpu x86_percpu[];
+
+#define x86_percpu_offset(field) __builtin_offsetof(struct x86_percpu, field)
+
+/**
+ * \fn x86_percpu_read
+ * \brief Read a field of the per cpu area of the calling cpu
+ * \param field
+ *
+ * Only for the 32 bit fields.
+ */
+#define x86_percpu_read(field) ({ \
+        __typeof__(((struct x86_percpu*)0)->field) __pcpu_val; \
+        asm volatile ("movl %%gs:%P1, %0" : "=r" (__pcpu_val) \
+                        : "i" (x86_percpu_offset(field))); \
+        __pcpu_val; \
+})
+
+/**
+ * \fn x86_percpu_write
+ * \brief Write a field of the per cpu area of the calling cpu
+ * \param field
+ * \param val
+ */
+#define x86_percpu_write(field, val) ({ \
+        __typeof__(((struct x86_percpu*)0)->field) __pcpu_val = (val); \
+        asm volatile ("movl %0, %%gs:%P1" : : "r" (__pcpu_val), \
+                        "i" (x86_percpu_offset(field)) : "memory"); \
+})
+
+/**
+ * \fn x86_percpu_inc
+ * \brief Count a statistic of the calling cpu
+ * \param field
+ *
+ * A single instruction, so an interrupt can't come in halfway. No lock prefix
+ * needed, no other cpu writes to the field.
+ */
+#define x86_percpu_inc(field) \
+        asm volatile ("incl %%gs:%P0" : : "i" (x86_percpu_offset(field)) \
+                        : "memory")
+
+/**
+ * \fn x86_percpu_this
+ * \brief The per cpu area of the calling cpu as a normal pointer
+ */
+static inline struct x86_percpu* x86_percpu_this()
+{
+        return x86_percpu_read(self);
+}
+
+void x86_percpu_setup(int cpu);
+void x86_percpu_load();
+#ifdef PERCPU_DBG
+void x86_percpu_dump();
+#endif
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -22,10 +22,15 @@
 #include <andromeda/system.h>
 
 int x86_pte_unset_page(void* virt);
+int x86_pte_unset_page_lazy(void* virt);
+int x86_pte_flush();
+int x86_pte_test_accessed(void* virt);
+int x86_pte_test_dirty(void* virt);
 int x86_pte_set_page(void* virt, void* phys, int cpl);
 int x86_pte_unload_range(struct sys_mmu_range* range);
 int x86_pte_load_range(struct sys_mmu_range* range);
 void* x86_pte_get_phys(void* virt);
 int x86_page_cleanup_range(struct sys_mmu_range* range);
+int x86_pte_pt_pool_refill();
 
 #endif
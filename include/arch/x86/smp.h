@@ -0,0 +1,87 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_SMP_H
+#define __ARCH_X86_SMP_H
+
+#include <types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_smp
+ * @{
+ */
+
+/** \brief Physical page the application processors start executing in */
+#define SMP_TRAMPOLINE_ADDR 0x7000
+/** \brief Vector used to kick an idle cpu */
+#define SMP_IPI_WAKEUP 0xF0
+/** \brief Vector used to have a cpu flush its TLB */
+#define SMP_IPI_FLUSH 0xF1
+/** \brief Milliseconds to wait for a cpu to show up */
+#define SMP_BOOT_TIMEOUT 100
+
+/**
+ * \struct smp_trampoline_args
+ * \brief Filled in by the boot cpu for each application processor
+ * \var cr3
+ * \brief The page directory to switch to
+ * \var stack
+ * \brief Top of the stack to run on
+ * \var entry
+ * \brief The C function to jump to
+ * \var cpu
+ * \brief The logical id, passed on to entry
+ */
+struct smp_trampoline_args {
+        uint32_t cr3;
+        uint32_t stack;
+        uint32_t entry;
+        uint32_t cpu;
+} __attribute__((packed));
+
+int smp_init();
+int smp_cpus();
+int smp_cpu_id();
+int smp_cpu_present(int cpu);
+int smp_apic_id(int cpu);
+int smp_call(int cpu, void (*call)(void*), void* arg);
+int smp_wake(int cpu);
+void smp_wakeup_interrupt();
+int smp_flush_tlbs();
+void smp_flush_interrupt();
+
+/* In smp.asm */
+extern char smp_trampoline[];
+extern char smp_trampoline_args[];
+extern char smp_trampoline_end[];
+extern void smp_ipi_wakeup();
+extern void smp_ipi_flush();
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
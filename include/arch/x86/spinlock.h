@@ -0,0 +1,92 @@
+/*
+    Andromeda
+    Copyright (C) 2015  Bart Kuivenhoven
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __ARCH_X86_SPINLOCK_H
+#define __ARCH_X86_SPINLOCK_H
+
+#include <types.h>
+#include <thread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x86_spinlock
+ * @{
+ *
+ * A spinlock_t is a ticket lock. The low half word holds the next ticket to
+ * hand out, the high half word holds the ticket currently being served. Both
+ * are 0 for a fresh lock, so mutex_unlocked still is a valid initialiser, and
+ * mutex_locked describes a lock with one holder.
+ */
+
+#define SPINLOCK_TICKET(a) ((a) & 0xFFFF)
+#define SPINLOCK_OWNER(a) (((a) >> 16) & 0xFFFF)
+
+/** \brief Pause instructions per waiter ahead of us in the queue */
+#define SPINLOCK_BACKOFF 0x20
+/** \brief Never back off for longer than this between polls */
+#define SPINLOCK_BACKOFF_MAX 0x400
+
+#ifdef LOCK_STATS
+#define SPINLOCK_SITES 0x40
+#define SPINLOCK_HELD 0x10
+
+/**
+ * \struct spinlock_stats
+ * \brief Contention statistics for a single call site
+ * \var site
+ * \brief Return address of the mutex_lock call
+ * \var acquired
+ * \brief Number of times the lock was taken from here
+ * \var contended
+ * \brief Number of times it had to wait for it
+ * \var wait
+ * \brief Total number of cycles spent waiting
+ * \var hold
+ * \brief Total number of cycles the lock was held
+ */
+struct spinlock_stats {
+        addr_t site;
+        uint32_t acquired;
+        uint32_t contended;
+        uint64_t wait;
+        uint64_t hold;
+        uint32_t wait_max;
+        uint32_t hold_max;
+};
+
+int spinlock_get_stats(struct spinlock_stats* stats, int idx);
+void spinlock_dump_stats();
+#endif
+
+#ifdef LOCK_TEST
+int spinlock_stress(int cpus);
+int spinlock_test();
+#endif
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -40,13 +40,18 @@ typedef struct general_registers
 
 struct isr_regs
 {
-        uint32_t ds;
+        uint32_t ds; /* %gs of the interrupted code in the upper 16 bits */
         uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
         uint32_t funcPtr, errCode;
         uint32_t eip, cs, eflags, procesp, ss;
 } __attribute__((packed));
 typedef struct isr_regs isrVal_t;
 
+struct thread_state;
+int x86_thread_setup(struct thread_state* thread, void (*entry)(void*),
+                void* arg);
+void x86_user_start(addr_t entry, addr_t stack) __attribute__((noreturn));
+
 #ifdef __cplusplus
 }
 #endif
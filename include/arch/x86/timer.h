@@ -27,6 +27,28 @@ struct cpu_time
 };
 
 unsigned long long get_cpu_tick();
+
+/* A full 16 bit count of the PIT lasts just under 55 ms */
+#define X86_PIT_ONE_SHOT_MAX 54
+int x86_pit_one_shot(time_t ms);
+time_t x86_pit_one_shot_fired();
+time_t x86_pit_one_shot_cancel();
 //static int __get_cpu_tick_inline();
 
+/**
+ * \fn x86_div64_32
+ * \brief Divide a 64 bit number without help from libgcc
+ *
+ * The quotient has to fit in 32 bits, or the cpu raises a divide error.
+ */
+static inline uint32_t x86_div64_32(uint64_t n, uint32_t d)
+{
+        uint32_t q, r;
+        __asm__ ("divl %4"
+                        : "=a" (q), "=d" (r)
+                        : "a" ((uint32_t)n), "d" ((uint32_t)(n >> 32)),
+                        "rm" (d));
+        return q;
+}
+
 #endif
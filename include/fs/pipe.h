@@ -68,6 +68,8 @@ struct pipe {
 
         atomic_t ref_cnt;
         mutex_t lock;
+        /* Readers sleeping until something gets written */
+        struct wait_queue data_wait;
 
         struct tree_root* data;
 
@@ -81,6 +83,7 @@ struct pipe {
 
         int (*write)(struct pipe*, char*, size_t);
         int (*read)(struct pipe*, char*, size_t);
+        int (*read_block)(struct pipe*, char*, size_t);
         int (*seek_write)(struct pipe*, int);
         int (*seek_read)(struct pipe*, int);
         int (*purge)(struct pipe*);
@@ -0,0 +1,57 @@
+/*
+ *  Andromeda
+ *  Copyright (C) 2015  Bart Kuivenhoven
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FS_PROCFS_H
+#define __FS_PROCFS_H
+
+#include <types.h>
+#include <fs/vfs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup procfs
+ * @{
+ */
+
+#define PROC_FS_FILES 0x10
+#define PROC_FS_NAME_SIZE 0x20
+/** \brief The most a single file can show */
+#define PROC_FS_FILE_SIZE 0x4000
+
+/**
+ * \fn proc_fs_show_t
+ * \brief Write the contents of a file to buf
+ * \return The number of bytes written, at most size
+ */
+typedef size_t (*proc_fs_show_t)(char* buf, size_t size);
+
+int proc_fs_register(char* name, proc_fs_show_t show);
+struct vfile* proc_fs_open_file(char* name);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
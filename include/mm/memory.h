@@ -30,6 +30,9 @@ extern "C" {
 void paging();
 void memset(void*, int, size_t);
 void memcpy(void*, void*, size_t);
+void memmove(void*, void*, size_t);
+void clear_page(void*);
+void copy_page(void*, void*);
 int memcmp(void*, void*, size_t);
 #ifdef SLOB
 int init_heap();
@@ -41,6 +44,13 @@ size_t strlen(char* string);
 #ifdef __INTEL
 void setGDT();
 #endif
+#ifdef X86
+void mem_enable_sse2();
+void mem_disable_sse2();
+#endif
+#ifdef MEM_BENCH
+void mem_bench();
+#endif
 
 extern unsigned int mboot;
 extern unsigned int end;
@@ -35,6 +35,13 @@ extern "C"  {
 /** \warning Signed integer hack down here */
 #define PAGE_LIST_MARKED        (unsigned long)(1 << ((sizeof(long)*8)-1))
 #define PAGE_LIST_END           (unsigned long)(0)
+/** \brief Free, but held in the page cache of a cpu */
+#define PAGE_LIST_CACHED        (unsigned long)(PAGE_LIST_MARKED + 1)
+
+/** \brief Number of pre-zeroed pages to keep around at most */
+#define PAGE_ZERO_POOL_SIZE     0x20
+/** \brief The idle loop stops refilling once the pool holds this many */
+#define PAGE_ZERO_POOL_LOW      0x18
 
 int   page_alloc_init           (multiboot_memory_map_t* map, int map_size);
 void* page_alloc                ();
@@ -45,6 +52,11 @@ int   page_unmark               (void* page);
 int   page_alloc_register       ();
 void* page_claim                (void* page);
 
+void* page_alloc_zeroed         ();
+int   page_zero_refill          ();
+int   page_zero_drain           ();
+int   page_cache_drain          ();
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,9 @@
 
 #include <mm/paging.h>
 #include <defines.h>
+#ifdef X86
+#include <arch/x86/percpu.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,6 +40,22 @@ extern "C" {
 #define VM_MEM_SIZE (PTE_SIZE*PAGESIZE)
 #define SEGMENT_NAME_LENGTH 0x20
 
+/**
+ * \def VM_VMAP_BASE
+ * \brief Start of the window used by the kernel virtual area allocator
+ * \def VM_VMAP_SIZE
+ * \brief Size of that window
+ */
+#define VM_VMAP_BASE 0xE0000000
+#define VM_VMAP_SIZE 0x10000000
+
+/**
+ * \def VM_SWAP_BATCH
+ * \brief Number of allocator blocks (PAGE_ALLOC_FACTOR bytes each) to
+ * reclaim when running out of memory
+ */
+#define VM_SWAP_BATCH 0x10
+
 extern int mm_vm_range_buffer_start;
 
 #ifdef X86
@@ -49,6 +68,7 @@ extern struct tree_root* vm_loaded[];
 
 struct vm_descriptor;
 struct vm_segment;
+struct vfile;
 
 struct vm_range_descriptor{
         /* Base pointer */
@@ -100,6 +120,17 @@ struct vm_segment {
          * \brief An integer indicating the condition of the page table entry
          * \var swappable
          * \brief Indicator for page swapping to be allowed or not
+         * \var swapped
+         * \brief Page index to swap slot map of the pages swapped out
+         * \var file
+         * \brief The file backing this segment, if any
+         * \var file_offset
+         * \brief The offset into the file at which the segment starts
+         * \var file_private
+         * \brief Changes stay in memory and never go back to the file
+         * \var file_size
+         * \brief For private mappings, the number of bytes backed by the
+         * file, the rest of the segment reads as zero
          */
         struct vm_descriptor* parent;
 
@@ -114,6 +145,11 @@ struct vm_segment {
         struct vm_range_descriptor* mapped;
 
         struct sys_mmu_range* pages;
+        struct tree_root* swapped;
+        struct vfile* file;
+        size_t file_offset;
+        size_t file_size;
+        bool file_private;
 
         char name[SEGMENT_NAME_LENGTH];
 
@@ -139,6 +175,38 @@ struct vm_descriptor {
         mutex_t lock;
 };
 
+/**
+ * \struct vm_vmap_stats
+ * \brief Statistics of the kernel virtual area allocator
+ *
+ * The sizes are in bytes and include the guard pages.
+ */
+struct vm_vmap_stats {
+        size_t allocations;
+        size_t frees;
+        size_t purges;
+        size_t areas;
+
+        size_t busy;
+        size_t lazy;
+        size_t free;
+};
+
+/**
+ * \def VM_FAULT_HIST_SIZE
+ * \brief Number of power of two buckets in the fault latency histogram
+ * \struct vm_fault_stats
+ * \brief How the fault handlers found their segments, and how long they took
+ */
+#define VM_FAULT_HIST_SIZE 32
+struct vm_fault_stats {
+        uint32_t last_hits;
+        uint32_t slot_hits;
+        uint32_t misses;
+
+        uint32_t hist[VM_FAULT_HIST_SIZE];
+};
+
 extern struct vm_descriptor vm_core;
 
 /* Generic functions */
@@ -153,6 +221,37 @@ void* vm_get_kernel_heap_pages(size_t size);
 int vm_free_kernel_heap_pages(void* ptr);
 void* vm_map_heap(void* phys, size_t size);
 int vm_unmap_heap(void* virt);
+void* vm_segment_alloc(struct vm_segment* s, size_t size);
+int vm_segment_free(struct vm_segment* s, void* ptr);
+
+/* Kernel virtual area allocator */
+int vm_vmap_init();
+void* vmalloc(size_t size);
+int vfree(void* ptr);
+void* vmap(void* phys, size_t size);
+int vunmap(void* virt);
+int vm_vmap_get_stats(struct vm_vmap_stats* stats);
+
+/* Swap functions */
+int vm_swap_enable(struct vfile* dev, size_t size);
+int vm_swap_disable();
+int vm_swap_in(int cpu, struct vm_segment* s, void* virt);
+int vm_swap_release(struct vm_segment* s);
+size_t vm_reclaim(int cpu, size_t blocks);
+void* vm_evict_block(int cpu, void* virt);
+
+/* File mapping functions */
+int vm_segment_map_file(struct vm_segment* s, struct vfile* file,
+                size_t offset);
+struct vm_segment* vm_mmap(struct vm_descriptor* p, void* virt, size_t size,
+                struct vfile* file, size_t offset);
+struct vm_segment* vm_mmap_private(struct vm_descriptor* p, void* virt,
+                size_t size, struct vfile* file, size_t offset,
+                size_t file_size);
+int vm_file_fault(int cpu, struct vm_segment* s, void* virt);
+int vm_file_evict(int cpu, struct vm_segment* s, void* virt);
+int vm_msync(int cpu, struct vm_segment* s);
+int vm_munmap(int cpu, struct vm_segment* s);
 
 /* Range allocator functions */
 int vm_range_alloc_init();
@@ -161,6 +260,15 @@ int vm_range_free(struct vm_range_descriptor* descriptor);
 int vm_range_update();
 
 /* Specialised functions */
+#ifdef X86
+/** \brief The cpu we're running on, straight from the per cpu area */
+static inline int get_cpu()
+{
+        return x86_percpu_read(cpu);
+}
+#else
+int get_cpu();
+#endif
 int vm_init();
 void* vm_get_phys(int cpu, void* virt);
 void* x86_pte_get_phys(void* virt);
@@ -179,9 +287,12 @@ int vm_user_fault_write(addr_t fault_addr, int mapped);
 int vm_kernel_fault_write(addr_t fault_addr, int mapped);
 int vm_user_fault_read(addr_t fault_addr, int mapped);
 int vm_kernel_fault_read(addr_t fault_addr, int mapped, addr_t eip);
+void vm_fault_account(uint64_t cycles);
+int vm_get_fault_stats(struct vm_fault_stats* stats);
 
 #ifdef VM_DBG
 int vm_dump(struct vm_descriptor*);
+void vm_fault_dump();
 struct vm_segment* vm_find_segment(char*);
 #endif
 #ifdef VM_TEST
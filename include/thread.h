@@ -23,6 +23,10 @@
 #ifndef __THREAD_H
 #define __THREAD_H
 
+#ifdef X86
+#include <arch/x86/atomic.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -56,21 +60,79 @@ typedef void (*thread_t)(void *argv);
 typedef volatile unsigned int spinlock_t;
 #define mutex_t spinlock_t
 
+/*
+ * The lock is only used where there's no 64 bit compare and swap.
+ */
 typedef volatile struct {
         int64_t cnt;
         spinlock_t lock;
 } atomic_t;
 
+struct task;
+struct sys_timer;
+
+/**
+ * \struct wait_entry
+ * \brief A task sleeping on a wait queue, lives on the sleeper's stack
+ */
+struct wait_entry {
+        struct task* task;
+        volatile int woken;
+        struct wait_entry* next;
+};
+
+/**
+ * \struct wait_queue
+ * \brief A FIFO of tasks waiting for something to happen
+ */
+struct wait_queue {
+        spinlock_t lock;
+        struct wait_entry* head;
+        struct wait_entry* tail;
+};
+
 typedef volatile struct {
         int64_t cnt;
         spinlock_t lock;
         int64_t upper_limit;
         int64_t lower_limit;
+        /* Tasks waiting for the count to go up and down respectively */
+        struct wait_queue inc_wait;
+        struct wait_queue dec_wait;
 }semaphore_t;
 
+/**
+ * \typedef rwlock_t
+ * \brief A lock for many readers or a single writer
+ *
+ * The top bit is set while a writer holds the lock, the rest of the word
+ * counts the readers. Readers only ever wait for a writer that actually holds
+ * the lock, so read locks may nest and may be taken from interrupt handlers.
+ * Writers can be starved by a steady stream of readers, which is fine for the
+ * read mostly tables this is meant for.
+ */
+typedef volatile unsigned int rwlock_t;
+#define rwlock_unlocked 0
+#define RWLOCK_WRITER 0x80000000
+
+/**
+ * \typedef seqlock_t
+ * \brief A sequence counter for data that is read far more often than written
+ *
+ * Readers don't write to the lock at all. They note the sequence number, read
+ * the data and try again if the number changed in the mean time. The number is
+ * odd while a writer is busy. Writers serialise on the spinlock.
+ */
+typedef volatile struct {
+        unsigned int seq;
+        spinlock_t lock;
+} seqlock_t;
+
 extern void mutex_lock(spinlock_t*);
 extern unsigned int mutex_test(spinlock_t*);
 extern void mutex_unlock(spinlock_t*);
+int mutex_lock_irqsave(spinlock_t* lock);
+void mutex_unlock_irqrestore(spinlock_t* lock, int state);
 
 int64_t atomic_add(atomic_t* d, int cnt);
 int64_t atomic_sub(atomic_t* d, int cnt);
@@ -80,6 +142,12 @@ int64_t atomic_inc(atomic_t* d);
 int64_t atomic_dec(atomic_t* d);
 int64_t atomic_get(atomic_t* d);
 void atomic_init(atomic_t* d, uint64_t cnt);
+int64_t atomic_cas(atomic_t* d, int64_t old, int64_t new);
+int64_t atomic_xchg(atomic_t* d, int64_t val);
+int64_t atomic_fetch_or(atomic_t* d, int64_t mask);
+#ifdef ATOMIC_BENCH
+void atomic_bench();
+#endif
 void semaphore_init(semaphore_t*, uint64_t, uint64_t, uint64_t);
 int64_t semaphore_try_inc(semaphore_t *s);
 int64_t semaphore_inc(semaphore_t* s);
@@ -88,6 +156,56 @@ int64_t semaphore_dec(semaphore_t* s);
 int64_t semaphore_get(semaphore_t* s);
 int64_t semaphore_try_get(semaphore_t* s);
 
+void wait_queue_init(struct wait_queue* wq);
+int wait_queue_sleep(struct wait_queue* wq, int (*cond)(void* arg), void* arg,
+                int io);
+int wait_queue_sleep_timeout(struct wait_queue* wq, int (*cond)(void* arg),
+                void* arg, int io, struct sys_timer* timer, time_t timeout);
+int wait_queue_wake(struct wait_queue* wq);
+int wait_queue_wake_all(struct wait_queue* wq);
+
+void rwlock_read_lock(rwlock_t* lock);
+void rwlock_read_unlock(rwlock_t* lock);
+void rwlock_write_lock(rwlock_t* lock);
+void rwlock_write_unlock(rwlock_t* lock);
+int rwlock_write_lock_irqsave(rwlock_t* lock);
+void rwlock_write_unlock_irqrestore(rwlock_t* lock, int state);
+
+void seqlock_write_lock(seqlock_t* s);
+void seqlock_write_unlock(seqlock_t* s);
+
+/**
+ * \fn seqlock_read_begin
+ * \brief Start reading the data protected by a seqlock
+ * \param s
+ * \return The sequence number to pass to seqlock_read_retry
+ */
+static inline unsigned int seqlock_read_begin(seqlock_t* s)
+{
+        unsigned int seq;
+        /* Wait for a writer that is busy right now */
+        while ((seq = s->seq) & 1) {
+#ifdef X86
+                x86_pause();
+#endif
+        }
+        asm volatile ("" ::: "memory");
+        return seq;
+}
+
+/**
+ * \fn seqlock_read_retry
+ * \brief Find out whether a writer got in the way
+ * \param s
+ * \param seq
+ * \return Non-zero if the data has to be read again
+ */
+static inline int seqlock_read_retry(seqlock_t* s, unsigned int seq)
+{
+        asm volatile ("" ::: "memory");
+        return s->seq != seq;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -18,6 +18,9 @@ do
 			SERIAL=1;
 			ARG_FLAGS="$ARG_FLAGS -serial stdio";
 			;;
+		-smp=*)
+			ARG_FLAGS="$ARG_FLAGS -smp ${arg#-smp=}";
+			;;
 	esac
 done
 
@@ -21,56 +21,160 @@
 #include <thread.h>
 #include <andromeda/system.h>
 
-int64_t atomic_add(atomic_t* d, int cnt)
+#ifdef X86
+#include <arch/x86/atomic.h>
+#endif
+#ifdef ATOMIC_BENCH
+#include <arch/x86/smp.h>
+#include <arch/x86/timer.h>
+#endif
+
+/**
+ * \fn atomic_cmpxchg
+ * \brief Compare and swap a 64 bit counter
+ * \param ptr
+ * \param old
+ * \param new
+ * \return The previous value, equal to old if the swap took place
+ *
+ * All other atomic operations are built on top of this one. On x86 it is a
+ * single lock cmpxchg8b, so there's no need to disable interrupts or to take
+ * a lock.
+ */
+#ifndef X86
+static spinlock_t cmpxchg_lock = mutex_unlocked;
+#endif
+
+static inline int64_t
+atomic_cmpxchg(volatile int64_t* ptr, int64_t old, int64_t new)
 {
-        /* Make sure we can't be interrupted, (avoids interrupt blocking issues) */
+#ifdef X86
+        return x86_atomic_cmpxchg64(ptr, old, new);
+#else
         int intState = cpu_disable_interrupts(0);
-        /* Make sure no other CPU can access this code */
-        mutex_lock(&d->lock);
-        /* Do the actual arithmetic */
-        d->cnt += cnt;
-        int64_t ret = d->cnt;
-        /* Allow other CPU's */
-        mutex_unlock(&d->lock);
-        /* If interrupts were previously enabled, reenable */
+        mutex_lock(&cmpxchg_lock);
+        int64_t ret = *ptr;
+        if (ret == old)
+                *ptr = new;
+        mutex_unlock(&cmpxchg_lock);
         if (intState)
                 cpu_enable_interrupts(0);
         return ret;
+#endif
 }
 
-uint64_t atomic_set(atomic_t *atom)
+/**
+ * \fn atomic_cmpxchg32
+ * \brief Compare and swap a single word, as used by the rwlocks
+ * \return The previous value
+ */
+static inline unsigned int
+atomic_cmpxchg32(volatile unsigned int* ptr, unsigned int old, unsigned int new)
 {
-        /* Avoid blocking issues with other interrupts! */
+#ifdef X86
+        return x86_atomic_cmpxchg(ptr, old, new);
+#else
         int intState = cpu_disable_interrupts(0);
-        /* Forbid other CPU's to touch our data */
-        mutex_lock(&atom->lock);
-        /* Set the bits! */
-        uint64_t ret = atom->cnt;
-        atom->cnt = 1;
-        /* Allow touching of this memory again */
-        mutex_unlock(&atom->lock);
-        /* If interrupts were previously allowed, allow them again */
+        mutex_lock(&cmpxchg_lock);
+        unsigned int ret = *ptr;
+        if (ret == old)
+                *ptr = new;
+        mutex_unlock(&cmpxchg_lock);
         if (intState)
                 cpu_enable_interrupts(0);
         return ret;
+#endif
+}
+
+/**
+ * \fn atomic_xadd32
+ * \brief Add to a single word
+ * \return The previous value
+ */
+static inline unsigned int
+atomic_xadd32(volatile unsigned int* ptr, unsigned int val)
+{
+#ifdef X86
+        return x86_atomic_xadd(ptr, val);
+#else
+        unsigned int old = *ptr;
+        unsigned int prev;
+        while ((prev = atomic_cmpxchg32(ptr, old, old + val)) != old)
+                old = prev;
+        return old;
+#endif
+}
+
+/**
+ * \fn atomic_relax
+ * \brief Give the other cpus a break while spinning
+ */
+static inline void atomic_relax()
+{
+#ifdef X86
+        x86_pause();
+#endif
+}
+
+/**
+ * \fn atomic_cas
+ * \brief Set the atomic to new, but only if it currently holds old
+ * \return The previous value
+ */
+int64_t atomic_cas(atomic_t* d, int64_t old, int64_t new)
+{
+        return atomic_cmpxchg(&d->cnt, old, new);
+}
+
+/**
+ * \fn atomic_xchg
+ * \brief Store a new value
+ * \return The previous value
+ */
+int64_t atomic_xchg(atomic_t* d, int64_t val)
+{
+        /*
+         * The first read may tear, but then the compare fails and we retry
+         * with the value the cpu handed back.
+         */
+        int64_t old = d->cnt;
+        int64_t prev;
+        while ((prev = atomic_cmpxchg(&d->cnt, old, val)) != old)
+                old = prev;
+        return old;
+}
+
+/**
+ * \fn atomic_fetch_or
+ * \brief Set bits in the atomic
+ * \return The previous value
+ */
+int64_t atomic_fetch_or(atomic_t* d, int64_t mask)
+{
+        int64_t old = d->cnt;
+        int64_t prev;
+        while ((prev = atomic_cmpxchg(&d->cnt, old, old | mask)) != old)
+                old = prev;
+        return old;
+}
+
+int64_t atomic_add(atomic_t* d, int cnt)
+{
+        int64_t old = d->cnt;
+        int64_t prev;
+        while ((prev = atomic_cmpxchg(&d->cnt, old, old + cnt)) != old)
+                old = prev;
+        return old + cnt;
+}
+
+uint64_t atomic_set(atomic_t *atom)
+{
+        return atomic_xchg(atom, 1);
 }
 
 uint64_t atomic_reset(atomic_t *atom)
 {
-        /* Atomic services, can I have your interrupts please? */
-        int intState = cpu_disable_interrupts(0);
-        /* I'll lock the door for you, please relax */
-        mutex_lock(&atom->lock);
-        /* Let's massage your bits to the correct value */
-        uint64_t ret = atom->cnt;
-        atom->cnt = 0;
-        /* We may be disturbed again */
-        mutex_unlock(&atom->lock);
-        /* And here are your interrupts */
-        if (intState)
-                cpu_enable_interrupts(0);
-        /* We hope to see you soon! */
-        return ret;
+        return atomic_xchg(atom, 0);
 }
 
 int64_t atomic_sub(atomic_t* d, int cnt)
@@ -90,17 +194,8 @@ int64_t atomic_dec(atomic_t* d)
 
 int64_t atomic_get(atomic_t* d)
 {
-        /* Save and disable interrupt state */
-        int intState = cpu_disable_interrupts(0);
-        /* BLOCK!!! */
-        mutex_lock(&d->lock);
-        int64_t ret = d->cnt;
-        /* UNBLOCK!!! */
-        mutex_unlock(&d->lock);
-        /* Return to previous interrupt state */
-        if (intState)
-                cpu_enable_interrupts(0);
-        return ret;
+        /* A compare that is bound to fail, reads all 64 bits in one go */
+        return atomic_cmpxchg(&d->cnt, 0, 0);
 }
 
 void atomic_init(atomic_t* d, uint64_t cnt)
@@ -120,113 +215,351 @@ void semaphore_init(
         s->lower_limit = (int64_t)lower_limit;
         s->upper_limit = (int64_t)upper_limit;
         s->lock = mutex_unlocked;
+        wait_queue_init((struct wait_queue*)&s->inc_wait);
+        wait_queue_init((struct wait_queue*)&s->dec_wait);
 }
 
-int64_t semaphore_try_inc(semaphore_t* s)
+/**
+ * \fn semaphore_step
+ * \brief Move the count one step up or down, within the limits
+ * \return The previous count or -E_OUT_OF_RESOURCES
+ */
+static int64_t semaphore_step(semaphore_t* s, int up)
 {
-        int64_t ret = 0;
-        int intState;
-
-        /* Fetch lock, no interrupts please */
-        intState = cpu_disable_interrupts(0);
-        int locked = mutex_test(&s->lock);
-        if (locked == mutex_locked) {
-                ret = -E_LOCKED;
-                goto cleanup;
-        }
-        /* Try to do our job */
-        if (s->cnt < s->upper_limit) {
-                ret = s->cnt++;
-        } else {
-                ret = -E_OUT_OF_RESOURCES;
+        int64_t old = s->cnt;
+        int64_t prev;
+        while (1) {
+                if (up && old >= s->upper_limit)
+                        return -E_OUT_OF_RESOURCES;
+                if (!up && old <= s->lower_limit)
+                        return -E_OUT_OF_RESOURCES;
+                prev = atomic_cmpxchg(&s->cnt, old, (up) ? old + 1 : old - 1);
+                if (prev == old)
+                        return old;
+                /* Somebody beat us to it, try again with the new count */
+                old = prev;
         }
+}
 
-        /* Apparently doing our job wasn't possible. Allow interrupts
-         * and try again.
-         */
-        mutex_unlock(&s->lock);
-        cleanup: if (intState)
-                cpu_enable_interrupts(0);
+int64_t semaphore_try_inc(semaphore_t* s)
+{
+        int64_t ret = semaphore_step(s, 1);
+        /* There's room to go down again */
+        if (ret >= 0)
+                wait_queue_wake((struct wait_queue*)&s->dec_wait);
+        return ret;
+}
 
+int64_t semaphore_try_dec(semaphore_t* s)
+{
+        int64_t ret = semaphore_step(s, 0);
+        if (ret >= 0)
+                wait_queue_wake((struct wait_queue*)&s->inc_wait);
         return ret;
 }
 
+/**
+ * \struct semaphore_wait
+ * \brief Hands the result of a try from the wait condition to the sleeper
+ */
+struct semaphore_wait {
+        semaphore_t* s;
+        int up;
+        int64_t ret;
+};
+
+/*
+ * Runs with the wait queue locked, so it must not wake the other queue, or
+ * two cpus going in opposite directions could deadlock.
+ */
+static int semaphore_cond(void* arg)
+{
+        struct semaphore_wait* w = arg;
+        w->ret = semaphore_step(w->s, w->up);
+        return w->ret >= 0;
+}
+
+/**
+ * \fn semaphore_sleep
+ * \brief Sleep until the count can be moved, then wake the other side
+ */
+static int64_t semaphore_sleep(semaphore_t* s, int up)
+{
+        struct semaphore_wait w;
+        w.s = s;
+        w.up = up;
+        w.ret = 0;
+
+        struct wait_queue* wait = (struct wait_queue*)((up) ? &s->inc_wait
+                        : &s->dec_wait);
+        struct wait_queue* other = (struct wait_queue*)((up) ? &s->dec_wait
+                        : &s->inc_wait);
+
+        wait_queue_sleep(wait, semaphore_cond, &w, 0);
+        wait_queue_wake(other);
+
+        return w.ret;
+}
+
 int64_t semaphore_inc(semaphore_t* s)
 {
-        int64_t ret = 0;
+        return semaphore_sleep(s, 1);
+}
 
-        /* While we didn't complete our action */
-        while (1) {
-                ret = semaphore_try_inc(s);
-                if (ret >= 0)
-                        break;
-                /**
-                 * \todo Replace the iowait statement with a scheduler yield.
-                 */
-                iowait();
-        }
+int64_t semaphore_dec(semaphore_t *s)
+{
+        return semaphore_sleep(s, 0);
+}
 
-        return ret;
+int64_t semaphore_try_get(semaphore_t* s)
+{
+        return atomic_cmpxchg(&s->cnt, 0, 0);
 }
 
-int64_t semaphore_try_dec(semaphore_t* s)
+int64_t semaphore_get(semaphore_t *s)
 {
-        /* This code is similar to the above function, look there for comments */
-        int64_t ret = 0;
-        int intState;
+        /* Reading the count can't fail any more, there's no lock to wait on */
+        return semaphore_try_get(s);
+}
 
-        intState = cpu_disable_interrupts(0);
-        int locked = mutex_test(&s->lock);
-        if (locked == mutex_locked) {
-                ret = -E_LOCKED;
-                goto cleanup;
+/**
+ * \fn rwlock_read_lock
+ * \brief Take the lock for reading
+ * \param lock
+ *
+ * Without a writer around this costs a single lock xadd.
+ */
+void rwlock_read_lock(rwlock_t* lock)
+{
+        while (atomic_xadd32(lock, 1) & RWLOCK_WRITER) {
+                /* Back out again and wait for the writer to finish */
+                atomic_xadd32(lock, -1);
+                while (*lock & RWLOCK_WRITER)
+                        atomic_relax();
         }
+        asm volatile ("" ::: "memory");
+}
 
-        if (s->cnt > s->lower_limit) {
-                ret = s->cnt--;
-        } else {
-                ret = -E_OUT_OF_RESOURCES;
+void rwlock_read_unlock(rwlock_t* lock)
+{
+        asm volatile ("" ::: "memory");
+        atomic_xadd32(lock, -1);
+}
+
+/**
+ * \fn rwlock_write_lock
+ * \brief Wait until there are no readers or writers left and take the lock
+ * \param lock
+ */
+void rwlock_write_lock(rwlock_t* lock)
+{
+        while (atomic_cmpxchg32(lock, rwlock_unlocked, RWLOCK_WRITER)
+                        != rwlock_unlocked) {
+                while (*lock != rwlock_unlocked)
+                        atomic_relax();
         }
+        asm volatile ("" ::: "memory");
+}
 
-        mutex_unlock(&s->lock);
+void rwlock_write_unlock(rwlock_t* lock)
+{
+        asm volatile ("" ::: "memory");
+        atomic_xadd32(lock, -RWLOCK_WRITER);
+}
+
+/**
+ * \fn rwlock_write_lock_irqsave
+ * \brief Disable interrupts and take the lock for writing
+ * \return The previous interrupt state
+ *
+ * Use this one if the readers include interrupt handlers, or the handler
+ * would spin on the writer it interrupted.
+ */
+int rwlock_write_lock_irqsave(rwlock_t* lock)
+{
+        int state = cpu_disable_interrupts(0);
+        rwlock_write_lock(lock);
+        return state;
+}
 
-        cleanup: if (intState)
+void rwlock_write_unlock_irqrestore(rwlock_t* lock, int state)
+{
+        rwlock_write_unlock(lock);
+        if (state)
                 cpu_enable_interrupts(0);
+}
 
-        return ret;
+void seqlock_write_lock(seqlock_t* s)
+{
+        mutex_lock(&s->lock);
+        s->seq++;
+        asm volatile ("" ::: "memory");
 }
 
-int64_t semaphore_dec(semaphore_t *s)
+void seqlock_write_unlock(seqlock_t* s)
 {
-        int64_t ret = 0;
-        while (1) {
-                ret = semaphore_try_dec(s);
-                if (ret >= 0)
-                        break;
-                iowait();
-        }
+        asm volatile ("" ::: "memory");
+        s->seq++;
+        mutex_unlock(&s->lock);
+}
+
+#ifdef ATOMIC_BENCH
+#define ATOMIC_BENCH_RUNS 0x10000
+
+/**
+ * \fn atomic_add_locked
+ * \brief The interrupt disabling, spinlock based add, for comparison
+ */
+static int64_t atomic_add_locked(atomic_t* d, int cnt)
+{
+        int intState = cpu_disable_interrupts(0);
+        mutex_lock(&d->lock);
+        d->cnt += cnt;
+        int64_t ret = d->cnt;
+        mutex_unlock(&d->lock);
+        if (intState)
+                cpu_enable_interrupts(0);
         return ret;
 }
 
-int64_t semaphore_try_get(semaphore_t* s)
+/**
+ * \struct atomic_bench_cpu
+ * \brief Cycles a cpu spent in each of the read side loops
+ */
+struct atomic_bench_cpu {
+        uint64_t mutex;
+        uint64_t rwlock;
+        uint64_t seqlock;
+};
+
+static struct atomic_bench_cpu atomic_bench_cpus[CPU_LIMIT];
+static spinlock_t atomic_bench_mutex = mutex_unlocked;
+static rwlock_t atomic_bench_rwlock = rwlock_unlocked;
+static seqlock_t atomic_bench_seqlock;
+static volatile unsigned int atomic_bench_arrived = 0;
+
+/**
+ * \fn atomic_bench_sync
+ * \brief Wait for all cpus taking part to get here
+ * \param round
+ * \brief Arrivals to wait for, kept by the caller across calls
+ * \param cpus
+ */
+static void atomic_bench_sync(unsigned int* round, unsigned int cpus)
 {
-        int locked = mutex_test(&s->lock);
-        if (locked == mutex_locked)
-                return -E_LOCKED;
+        *round += cpus;
+        atomic_xadd32(&atomic_bench_arrived, 1);
+        while (atomic_bench_arrived < *round)
+                atomic_relax();
+}
 
-        int64_t ret = s->cnt;
+/**
+ * \fn atomic_bench_readers
+ * \brief Run the read side loops in step with the other cpus
+ * \param arg
+ * \brief The number of cpus taking part
+ *
+ * Every loop starts on all cpus at once, so they contend for the locks the
+ * whole time. Once this returns on one cpu, all cpus have their results in.
+ */
+static void atomic_bench_readers(void* arg)
+{
+        unsigned int cpus = (unsigned int)arg;
+        struct atomic_bench_cpu* r = &atomic_bench_cpus[smp_cpu_id()];
+        unsigned int round = 0;
+        int i;
 
-        mutex_unlock(&s->lock);
-        return ret;
+        atomic_bench_sync(&round, cpus);
+        uint64_t start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++) {
+                mutex_lock(&atomic_bench_mutex);
+                mutex_unlock(&atomic_bench_mutex);
+        }
+        r->mutex = get_cpu_tick() - start;
+
+        atomic_bench_sync(&round, cpus);
+        start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++) {
+                rwlock_read_lock(&atomic_bench_rwlock);
+                rwlock_read_unlock(&atomic_bench_rwlock);
+        }
+        r->rwlock = get_cpu_tick() - start;
+
+        atomic_bench_sync(&round, cpus);
+        start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++) {
+                unsigned int seq;
+                do {
+                        seq = seqlock_read_begin(&atomic_bench_seqlock);
+                } while (seqlock_read_retry(&atomic_bench_seqlock, seq));
+        }
+        r->seqlock = get_cpu_tick() - start;
+
+        atomic_bench_sync(&round, cpus);
 }
 
-int64_t semaphore_get(semaphore_t *s)
+/**
+ * \fn atomic_bench
+ * \brief Measure the cost of the atomic operations in cpu cycles
+ *
+ * The atomic operations are timed on the calling cpu alone. The read sides of
+ * the locks run on all cpus at the same time, to see how they scale.
+ */
+void atomic_bench()
 {
-        while (1) {
-                int64_t ret = semaphore_try_get(s);
-                if (ret >= 0)
-                        return ret;
+        atomic_t a;
+        atomic_init(&a, 0);
+        int i;
+
+        uint64_t start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++)
+                atomic_add_locked(&a, 1);
+        uint64_t locked = get_cpu_tick() - start;
+
+        start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++)
+                atomic_inc(&a);
+        uint64_t inc = get_cpu_tick() - start;
+
+        start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++)
+                atomic_get(&a);
+        uint64_t get = get_cpu_tick() - start;
+
+        start = get_cpu_tick();
+        for (i = 0; i < ATOMIC_BENCH_RUNS; i++)
+                atomic_cas(&a, 2 * ATOMIC_BENCH_RUNS + i,
+                                2 * ATOMIC_BENCH_RUNS + i + 1);
+        uint64_t cas = get_cpu_tick() - start;
+
+        if (atomic_get(&a) != 3 * ATOMIC_BENCH_RUNS)
+                warning("Atomic counter is off: %X\n", (int)atomic_get(&a));
+
+        printf("Cycles per atomic op:\n"
+                        "locked add: %i\n"
+                        "inc:        %i\n"
+                        "get:        %i\n"
+                        "cas:        %i\n",
+                        (int)(locked / ATOMIC_BENCH_RUNS),
+                        (int)(inc / ATOMIC_BENCH_RUNS),
+                        (int)(get / ATOMIC_BENCH_RUNS),
+                        (int)(cas / ATOMIC_BENCH_RUNS));
+
+        /* Read side of the locks for read mostly data, on every cpu at once */
+        int cpus = smp_cpus();
+        atomic_bench_arrived = 0;
+        for (i = 1; i < cpus; i++)
+                smp_call(i, atomic_bench_readers, (void*)cpus);
+        atomic_bench_readers((void*)cpus);
+
+        printf("Cycles per read side critical section, %i cpus:\n"
+                        "cpu  mutex  rwlock  seqlock\n", cpus);
+        for (i = 0; i < cpus; i++) {
+                struct atomic_bench_cpu* r = &atomic_bench_cpus[i];
+                printf("%i    %i  %i  %i\n", i,
+                                (int)(r->mutex / ATOMIC_BENCH_RUNS),
+                                (int)(r->rwlock / ATOMIC_BENCH_RUNS),
+                                (int)(r->seqlock / ATOMIC_BENCH_RUNS));
         }
-        /* Return only here to keep compiler happy */
-        return -E_CORRUPT;
 }
+#endif
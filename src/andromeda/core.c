@@ -20,8 +20,12 @@
 
 #include <stdlib.h>
 #include <andromeda/core.h>
+#include <andromeda/elf.h>
+#include <andromeda/pid.h>
 #include <andromeda/sched.h>
 #include <andromeda/system.h>
+#include <andromeda/task.h>
+#include <andromeda/workqueue.h>
 #include <fs/path.h>
 #include <andromeda/syscall.h>
 #include <andromeda/drivers.h>
@@ -29,8 +33,15 @@
 #include <networking/net.h>
 #include <lib/tree.h>
 #include <mm/cache.h>
+#include <mm/page_alloc.h>
 #include <mm/vm.h>
 #include <stdio.h>
+#ifdef X86
+#include <arch/x86/idle.h>
+#include <arch/x86/irq_balance.h>
+#include <arch/x86/pte.h>
+#include <arch/x86/spinlock.h>
+#endif
 
 #define RL_SHUTDOWN     0x0
 #define RL_RUN0         0x1
@@ -160,12 +171,6 @@ void core_loop()
         mm_cache_test();
 #endif
 #endif
-#ifdef RR_EXP
-        extern void task_testA();
-        extern void task_testB();
-        rr_thread_init(task_testA);
-        rr_thread_init(task_testB);
-#endif
 #ifdef PT_DBG
         addr_t ptb = (addr_t)(&page_table_boot) + 0xC0000000;
         printf( "page table boot: %X\n"
@@ -187,6 +192,42 @@ void core_loop()
 #endif
 #ifdef INTERRUPT_TEST
         interrupt_test(80);
+#endif
+#ifdef ATOMIC_BENCH
+        atomic_bench();
+#endif
+#ifdef MEM_BENCH
+        mem_bench();
+#endif
+#ifdef LOCK_TEST
+        if (spinlock_test() != -E_SUCCESS)
+                panic("Failure in spinlock test code!");
+#endif
+#ifdef SCHED_BENCH
+        sched_bench();
+#endif
+#ifdef CTX_BENCH
+        context_switch_bench();
+#endif
+#ifdef WORK_TEST
+        if (workqueue_test() != -E_SUCCESS)
+                panic("Failure in workqueue test code!");
+#endif
+#ifdef THREAD_TEST
+        if (thread_table_test() != -E_SUCCESS)
+                panic("Failure in thread table test code!");
+#endif
+#ifdef PID_TEST
+        if (pid_test() != -E_SUCCESS)
+                panic("Failure in pid test code!");
+#endif
+#ifdef ELF_TEST
+        if (elf_test() != -E_SUCCESS)
+                panic("Failure in ELF loader test code!");
+#endif
+#ifdef SCHED_RT_TEST
+        if (sched_rt_test() != -E_SUCCESS)
+                panic("Failure in real-time scheduler test code!");
 #endif
         debug ("Entering core loop\n");
         while (TRUE) // Infinite loop, to make the kernel wait when there is nothing to do
@@ -198,10 +239,7 @@ void core_loop()
                 case RL_RUN2:
                 case RL_RUN3:
                 case RL_RUN4:
-                     halt();
-#ifdef RR_EXP
-                     rr_sched();
-#endif
+                        sched();
                         break;
 
                 case RL_REBOOT:
@@ -210,6 +248,17 @@ void core_loop()
                 case RL_SHUTDOWN:
                         break;
                 }
+#ifdef X86
+                /* Nothing to do, so prepare page tables for later use */
+                x86_pte_pt_pool_refill();
+                irq_balance();
+#endif
+                page_zero_refill();
+#ifdef X86
+                /* Halts without the tick if every cpu is idle */
+                x86_idle(NULL, NULL);
+#else
                 halt(); // Puts the CPU in idle state until next interrupt
+#endif
         }
 }
@@ -31,7 +31,8 @@ static int drv_setup_vfile(struct vfile* file, fs_read_hook_t read,
 
 struct device dev_root;
 int32_t dev_id = 0;
-mutex_t dev_id_lock;
+/* Lookups by id are frequent, new devices only show up during probing */
+static rwlock_t dev_tree_lock = rwlock_unlocked;
 
 unsigned int virt_bus = 0;
 unsigned int lgcy_bus = 0;
@@ -131,7 +132,9 @@ int device_detach(struct device* this, struct device* child)
 struct device*
 device_find_id(unsigned int id)
 {
+        rwlock_read_lock(&dev_tree_lock);
         struct device* dev = (struct device*) dev_tree->find(id, dev_tree);
+        rwlock_read_unlock(&dev_tree_lock);
         return dev;
 }
 
@@ -146,16 +149,16 @@ int device_id_alloc(struct device* dev)
 
         int32_t idx = dev_id;
 
-        mutex_lock(&dev_id_lock);
+        rwlock_write_lock(&dev_tree_lock);
         int overflow = FALSE;
-        while (device_find_id(idx) != NULL ) {
+        while (dev_tree->find(idx, dev_tree) != NULL ) {
                 idx++;
                 if (idx < 0 && !overflow) {
                         overflow = TRUE;
                         idx = 1;
                 }
                 if (idx < 0 && overflow) {
-                        mutex_unlock(&dev_id_lock);
+                        rwlock_write_unlock(&dev_tree_lock);
                         return -E_OUT_OF_RESOURCES;
                 }
         }
@@ -163,7 +166,7 @@ int device_id_alloc(struct device* dev)
         dev_id = idx + 1;
         if (dev_id < 0)
                 dev_id = 1;
-        mutex_unlock(&dev_id_lock);
+        rwlock_write_unlock(&dev_tree_lock);
 
         dev->dev_id = idx;
         return idx;
@@ -0,0 +1,408 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/elf.h>
+#include <andromeda/error.h>
+#include <andromeda/kthread.h>
+#include <andromeda/sched.h>
+#include <andromeda/syscall.h>
+#include <andromeda/system.h>
+#include <fs/vfs.h>
+#include <mm/page_alloc.h>
+#include <mm/vm.h>
+#ifdef X86
+#include <arch/x86/task.h>
+#endif
+
+/**
+ * \addtogroup elf
+ * @{
+ *
+ * Starting a program reads nothing but its ELF and program headers. Every
+ * PT_LOAD segment becomes a private mapping of the file, so the page fault
+ * handler reads a page in the first time the program touches it, and the part
+ * of a segment past its file data, the bss, comes up zeroed. The stack is
+ * plain memory, filled in the same way. A large binary starts as fast as a
+ * small one, it only pays for the pages it uses.
+ *
+ * A user task is a kernel thread that drops to ring 3 as soon as it runs. Its
+ * kernel stack is where the cpu goes on interrupts and system calls, and
+ * SYS_EXIT ends it like any other kernel thread, address space and all.
+ *
+ * Every cpu shares the same page tables, and the segments of a task are
+ * swapped in and out of them on task switches. Two user tasks running on two
+ * cpus at once would trample each other, so for now they all run on the boot
+ * cpu.
+ */
+
+#ifdef ELF_TEST
+static volatile int elf_test_exit = -1;
+#endif
+
+/**
+ * \fn elf_read
+ * \brief Read a part of the file, all of it or nothing
+ * \param file
+ * \param buf
+ * \param offset
+ * \param len
+ * \return A standard error code
+ */
+static int elf_read(struct vfile* file, void* buf, size_t offset, size_t len)
+{
+        mutex_lock(&file->file_lock);
+        size_t read = file->fs_data.read(file, buf, offset, len);
+        mutex_unlock(&file->file_lock);
+
+        return (read == len) ? -E_SUCCESS : -E_STREAM_FAILURE;
+}
+
+/**
+ * \fn elf_check
+ * \brief See whether an ELF header describes something we can run
+ * \param hdr
+ * \return -E_CORRUPT if it doesn't
+ */
+static int elf_check(Elf32_Ehdr* hdr)
+{
+        if (hdr->e_ident[EI_MAG0] != ELFMAG0 ||
+                        hdr->e_ident[EI_MAG1] != ELFMAG1 ||
+                        hdr->e_ident[EI_MAG2] != ELFMAG2 ||
+                        hdr->e_ident[EI_MAG3] != ELFMAG3)
+                return -E_CORRUPT;
+        if (hdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+                        hdr->e_ident[EI_DATA] != ELFDATA2LSB)
+                return -E_CORRUPT;
+        /* Statically linked i386 executables only */
+        if (hdr->e_type != ET_EXEC || hdr->e_machine != EM_386 ||
+                        hdr->e_version != EV_CURRENT)
+                return -E_CORRUPT;
+        if (hdr->e_phentsize != sizeof(Elf32_Phdr) || hdr->e_phnum == 0 ||
+                        hdr->e_phnum > ELF_PHDR_MAX)
+                return -E_CORRUPT;
+        if (hdr->e_entry < ELF_USER_START ||
+                        hdr->e_entry >= ELF_STACK_TOP - ELF_STACK_SIZE)
+                return -E_OUTOFBOUNDS;
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn elf_map
+ * \brief Map the PT_LOAD segments of an executable
+ * \param vm
+ * \param file
+ * \param phdr
+ * \param count
+ * \return A standard error code
+ *
+ * The segments have to be sorted by address, as the spec demands. The vm
+ * rounds every segment up to PAGE_ALLOC_FACTOR, two may not share that much.
+ * Linking with -z max-page-size=0x4000 takes care of that.
+ */
+static int elf_map(struct vm_descriptor* vm, struct vfile* file,
+                Elf32_Phdr* phdr, int count)
+{
+        addr_t end = 0;
+        int loaded = 0;
+        int i = 0;
+        for (; i < count; i++) {
+                Elf32_Phdr* p = &phdr[i];
+                if (p->p_type != PT_LOAD || p->p_memsz == 0)
+                        continue;
+                if (p->p_filesz > p->p_memsz)
+                        return -E_CORRUPT;
+                if (p->p_vaddr % PAGE_SIZE != p->p_offset % PAGE_SIZE)
+                        return -E_CORRUPT;
+
+                addr_t limit = ELF_STACK_TOP - ELF_STACK_SIZE;
+                if (p->p_vaddr < ELF_USER_START || p->p_vaddr >= limit ||
+                                p->p_memsz > limit - p->p_vaddr)
+                        return -E_OUTOFBOUNDS;
+
+                addr_t base = p->p_vaddr & ~(PAGE_SIZE - 1);
+                size_t lead = p->p_vaddr - base;
+                if (base < end)
+                        return -E_CONFLICT;
+
+                size_t file_size = (p->p_filesz == 0) ? 0 : lead + p->p_filesz;
+                struct vm_segment* s = vm_mmap_private(vm, (void*)base,
+                                lead + p->p_memsz, file, p->p_offset - lead,
+                                file_size);
+                if (s == NULL)
+                        return -E_NOMEM;
+                s->code = (p->p_flags & PF_X) ? TRUE : FALSE;
+
+                end = base + s->size;
+                if (end > limit)
+                        return -E_OUTOFBOUNDS;
+                loaded++;
+        }
+
+        return (loaded == 0) ? -E_CORRUPT : -E_SUCCESS;
+}
+
+/**
+ * \fn elf_start
+ * \brief Where the thread of a user task starts, still in the kernel
+ * \param entry
+ */
+static void elf_start(void* entry)
+{
+#ifdef X86
+        /*
+         * The stack page comes up zeroed, which reads as argc 0 followed by
+         * empty argument, environment and auxiliary vectors.
+         */
+        x86_user_start((addr_t)entry, ELF_STACK_TOP - 0x10);
+#endif
+}
+
+/**
+ * \fn elf_exec
+ * \brief Start an executable as a new user task
+ * \param file
+ * \brief Has to stay around until the task is gone, pages are read lazily
+ * \param name
+ * \param task
+ * \brief Filled in with the new task, if not NULL
+ * \return A standard error code
+ */
+int elf_exec(struct vfile* file, const char* name, struct task** task)
+{
+        if (file == NULL || file->fs_data.read == NULL)
+                return -E_NULL_PTR;
+
+        Elf32_Ehdr hdr;
+        int ret = elf_read(file, &hdr, 0, sizeof(hdr));
+        if (ret != -E_SUCCESS)
+                return ret;
+        ret = elf_check(&hdr);
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        size_t phdr_size = hdr.e_phnum * sizeof(Elf32_Phdr);
+        Elf32_Phdr* phdr = kmalloc(phdr_size);
+        if (phdr == NULL)
+                return -E_NOMEM;
+        ret = elf_read(file, phdr, hdr.e_phoff, phdr_size);
+        if (ret != -E_SUCCESS)
+                goto err;
+
+        struct vm_descriptor* vm = vm_new(0);
+        if (vm == NULL) {
+                ret = -E_NOMEM;
+                goto err;
+        }
+        ret = elf_map(vm, file, phdr, hdr.e_phnum);
+        if (ret != -E_SUCCESS)
+                goto err_vm;
+        if (vm_new_segment((void*)(ELF_STACK_TOP - ELF_STACK_SIZE),
+                        ELF_STACK_SIZE, vm) == NULL) {
+                ret = -E_NOMEM;
+                goto err_vm;
+        }
+
+        struct task* t = kthread_create(elf_start, (void*)hdr.e_entry, name);
+        if (t == NULL) {
+                ret = -E_NOMEM;
+                goto err_vm;
+        }
+        vm->pid = t->pid;
+        t->virtual_memory = vm;
+        t->ring_level = VM_CPL_USER;
+        kthread_bind(t, 0);
+
+        ret = sched_enqueue(t);
+        if (ret != -E_SUCCESS) {
+                /* Takes the address space along */
+                kthread_destroy(t);
+                goto err;
+        }
+        kfree(phdr);
+
+        if (task != NULL)
+                *task = t;
+        return -E_SUCCESS;
+
+err_vm:
+        vm_free(vm);
+err:
+        kfree(phdr);
+        return ret;
+}
+
+/**
+ * \fn elf_exit_sc
+ * \brief SYS_EXIT, end the calling user task
+ * \param code
+ * \return Only if the caller isn't a user task
+ */
+static int elf_exit_sc(int code, int arg2 __attribute__((unused)),
+                int arg3 __attribute__((unused)))
+{
+        struct task* task = get_current_task();
+        if (task == NULL || task->ring_level != VM_CPL_USER)
+                return -E_NORIGHTS;
+
+        debug("pid %i exited with %i\n", task->pid, code);
+#ifdef ELF_TEST
+        elf_test_exit = code;
+#endif
+        kthread_exit();
+}
+
+/**
+ * \fn elf_sc_init
+ * \brief Install the system calls of user tasks
+ * \return A standard error code
+ */
+int elf_sc_init()
+{
+        return sc_install(SYS_EXIT, elf_exit_sc, 3);
+}
+
+#ifdef ELF_TEST
+#define ELF_TEST_BASE 0x08048000
+#define ELF_TEST_CODE 0x60
+#define ELF_TEST_DATA 0x90
+#define ELF_TEST_SIZE 0x94
+#define ELF_TEST_BSS (ELF_TEST_BASE + 2 * PAGE_SIZE)
+
+static uint8_t elf_test_image[ELF_TEST_SIZE];
+static struct vfile elf_test_file;
+
+static size_t elf_test_read(struct vfile* file __attribute__((unused)),
+                char* buf, size_t start, size_t len)
+{
+        if (start >= ELF_TEST_SIZE)
+                return 0;
+        if (start + len > ELF_TEST_SIZE)
+                len = ELF_TEST_SIZE - start;
+        memcpy(buf, elf_test_image + start, len);
+        return len;
+}
+
+static void elf_test_put(uint8_t* dst, uint32_t val)
+{
+        memcpy(dst, &val, sizeof(val));
+}
+
+/**
+ * \fn elf_test_build
+ * \brief Put together an executable with a text, data and bss part
+ *
+ * The program adds the data word to the bss word before and after
+ * incrementing it, pushes and pops the result to touch the stack, and exits
+ * with it. That takes a page read from the file, a zeroed bss page and a
+ * zeroed stack page, anything else makes it exit with something else.
+ */
+static void elf_test_build()
+{
+        static uint8_t code[] = {
+                0xA1, 0, 0, 0, 0,               /* mov eax, [bss] */
+                0x03, 0x05, 0, 0, 0, 0,         /* add eax, [data] */
+                0xFF, 0x05, 0, 0, 0, 0,         /* inc dword [bss] */
+                0x03, 0x05, 0, 0, 0, 0,         /* add eax, [bss] */
+                0x50,                           /* push eax */
+                0x5B,                           /* pop ebx */
+                0xB8, SYS_EXIT, 0, 0, 0,        /* mov eax, SYS_EXIT */
+                0xCD, INT_SYSCALL,              /* int 0x80 */
+                0xEB, 0xFE,                     /* jmp $ */
+        };
+        memset(elf_test_image, 0, ELF_TEST_SIZE);
+
+        Elf32_Ehdr* hdr = (Elf32_Ehdr*)elf_test_image;
+        hdr->e_ident[EI_MAG0] = ELFMAG0;
+        hdr->e_ident[EI_MAG1] = ELFMAG1;
+        hdr->e_ident[EI_MAG2] = ELFMAG2;
+        hdr->e_ident[EI_MAG3] = ELFMAG3;
+        hdr->e_ident[EI_CLASS] = ELFCLASS32;
+        hdr->e_ident[EI_DATA] = ELFDATA2LSB;
+        hdr->e_ident[EI_VERSION] = EV_CURRENT;
+        hdr->e_type = ET_EXEC;
+        hdr->e_machine = EM_386;
+        hdr->e_version = EV_CURRENT;
+        hdr->e_entry = ELF_TEST_BASE + ELF_TEST_CODE;
+        hdr->e_phoff = sizeof(*hdr);
+        hdr->e_ehsize = sizeof(*hdr);
+        hdr->e_phentsize = sizeof(Elf32_Phdr);
+        hdr->e_phnum = 1;
+
+        Elf32_Phdr* phdr = (Elf32_Phdr*)(elf_test_image + sizeof(*hdr));
+        phdr->p_type = PT_LOAD;
+        phdr->p_offset = 0;
+        phdr->p_vaddr = ELF_TEST_BASE;
+        phdr->p_paddr = ELF_TEST_BASE;
+        phdr->p_filesz = ELF_TEST_SIZE;
+        phdr->p_memsz = 3 * PAGE_SIZE;
+        phdr->p_flags = PF_R | PF_W | PF_X;
+        phdr->p_align = PAGE_SIZE;
+
+        uint8_t* text = elf_test_image + ELF_TEST_CODE;
+        memcpy(text, code, sizeof(code));
+        elf_test_put(text + 1, ELF_TEST_BSS);
+        elf_test_put(text + 7, ELF_TEST_BASE + ELF_TEST_DATA);
+        elf_test_put(text + 13, ELF_TEST_BSS);
+        elf_test_put(text + 19, ELF_TEST_BSS);
+        elf_test_put(elf_test_image + ELF_TEST_DATA, 40);
+}
+
+/**
+ * \fn elf_test
+ * \brief Run a tiny executable in ring 3, and refuse a broken one
+ * \return A standard error code
+ */
+int elf_test()
+{
+        memset(&elf_test_file, 0, sizeof(elf_test_file));
+        elf_test_file.type = FILE;
+        elf_test_file.fs_data.read = elf_test_read;
+
+        elf_test_build();
+        elf_test_image[EI_MAG1] = 'F';
+        int ret = elf_exec(&elf_test_file, "elf-test", NULL);
+        if (ret != -E_CORRUPT) {
+                warning("elf: broken header gave %X\n", -ret);
+                return -E_GENERIC;
+        }
+        elf_test_image[EI_MAG1] = ELFMAG1;
+
+        elf_test_exit = -1;
+        ret = elf_exec(&elf_test_file, "elf-test", NULL);
+        if (ret != -E_SUCCESS) {
+                warning("elf: could not start the test program: %X\n", -ret);
+                return ret;
+        }
+        while (elf_test_exit == -1)
+                sched();
+
+        if (elf_test_exit != 41) {
+                warning("elf: test program exited with %i\n", elf_test_exit);
+                return -E_GENERIC;
+        }
+        debug("elf: test program ran in ring 3\n");
+        return -E_SUCCESS;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
@@ -18,6 +18,10 @@
 #include <stdio.h>
 #include <andromeda/system.h>
 #include <arch/x86/cpu.h>
+#ifdef X86
+#include <andromeda/sched.h>
+#include <arch/x86/acct.h>
+#endif
 
 #ifdef SLAB
 static struct mm_cache* interrupt_cache;
@@ -35,7 +39,8 @@ struct interrupt {
         struct interrupt* next;
 };
 
-static mutex_t interrupt_lock = mutex_unlocked;
+/* Interrupts read the table all the time, it is only written at setup */
+static rwlock_t interrupt_lock = rwlock_unlocked;
 
 #define INTERRUPTS 255
 
@@ -85,8 +90,7 @@ int32_t interrupt_register(uint16_t interrupt_no,
         }
 
         int32_t id = 0;
-        volatile int int_state = cpu_disable_interrupts(0);
-        mutex_lock(&interrupt_lock);
+        int int_state = rwlock_write_lock_irqsave(&interrupt_lock);
         /* If the root node is empty, use that */
         if (interrupts[interrupt_no].procedure == NULL) {
                 interrupts[interrupt_no].procedure = procedure;
@@ -122,11 +126,7 @@ int32_t interrupt_register(uint16_t interrupt_no,
         i->procedure = procedure;
         i->args = args;
 
-        unlock: mutex_unlock(&interrupt_lock);
-        if (int_state == INTERRUPTS_ENABLED) {
-                cpu_enable_interrupts(0);
-                //hw_interrupt_end(interrupt_no);
-        }
+        unlock: rwlock_write_unlock_irqrestore(&interrupt_lock, int_state);
 
         return (int32_t) id;
 }
@@ -136,8 +136,7 @@ int32_t interrupt_deregister(uint16_t interrupt_no, int32_t interrupt_id)
         if (interrupt_no >= INTERRUPTS || interrupt_id >= ((1 << 16) - 1))
                 return -E_OUTOFBOUNDS;
 
-        volatile int int_state = disableInterrupts();
-        mutex_lock(&interrupt_lock);
+        int int_state = rwlock_write_lock_irqsave(&interrupt_lock);
         int32_t ret = -E_SUCCESS;
 
         struct interrupt* i = &interrupts[interrupt_no];
@@ -171,10 +170,7 @@ int32_t interrupt_deregister(uint16_t interrupt_no, int32_t interrupt_id)
                 }
         }
 
-        unlock: mutex_unlock(&interrupt_lock);
-        if (int_state == INTERRUPTS_ENABLED) {
-                enableInterrupts();
-        }
+        unlock: rwlock_write_unlock_irqrestore(&interrupt_lock, int_state);
         return ret;
 }
 
@@ -188,6 +184,10 @@ int do_interrupt(uint16_t interrupt_no, uint64_t r1, uint64_t r2, uint64_t r3,
         }
 
         int interrupt_state = cpu_disable_interrupts(0);
+#ifdef X86
+        int mode = x86_acct_enter(SCHED_TIME_IRQ);
+#endif
+        rwlock_read_lock(&interrupt_lock);
 
         struct interrupt* i = &interrupts[interrupt_no];
         for (; i != NULL && i->procedure != NULL ; i = i->next) {
@@ -203,6 +203,10 @@ int do_interrupt(uint16_t interrupt_no, uint64_t r1, uint64_t r2, uint64_t r3,
                                         "this shouldn't happen!");
                 }
         }
+        rwlock_read_unlock(&interrupt_lock);
+#ifdef X86
+        x86_acct_exit(mode);
+#endif
         if (interrupt_state != 0) {
                 cpu_enable_interrupts(0);
         }
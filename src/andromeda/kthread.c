@@ -0,0 +1,230 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/kthread.h>
+#include <andromeda/pid.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <mm/vm.h>
+#ifdef X86
+#include <arch/x86/fpu.h>
+#include <arch/x86/task.h>
+#endif
+
+/**
+ * \addtogroup kthread
+ * @{
+ *
+ * Kernel threads are ordinary tasks to the scheduler, they just never leave
+ * the kernel and share its address space. That makes them the place for work
+ * that is too long or needs to sleep, and so can't be done in an interrupt
+ * handler.
+ *
+ * A thread can't free the stack it is running on. One that exits goes on the
+ * dead list, and is freed by the next kthread_create once it is entirely off
+ * its cpu.
+ */
+
+static struct kthread* kthread_dead = NULL;
+static spinlock_t kthread_dead_lock = mutex_unlocked;
+
+static void kthread_free(struct kthread* k)
+{
+#ifdef X86
+        x86_fpu_release(&k->thread);
+#endif
+        pid_free(k->task.pid);
+        /* User tasks take their address space with them */
+        if (k->task.virtual_memory != NULL)
+                vm_free(k->task.virtual_memory);
+        thread_table_free(&k->task.threads);
+        kfree_s(k->thread.ss, k->thread.ss_size);
+        kfree(k);
+}
+
+/**
+ * \fn kthread_reap
+ * \brief Free the threads that have exited and have been switched out
+ */
+static void kthread_reap()
+{
+        int state = mutex_lock_irqsave(&kthread_dead_lock);
+        struct kthread* gone = NULL;
+        struct kthread** k = &kthread_dead;
+        while (*k != NULL) {
+                struct kthread* dead = *k;
+                if (dead->task.on_cpu) {
+                        k = &dead->next_dead;
+                        continue;
+                }
+                *k = dead->next_dead;
+                dead->next_dead = gone;
+                gone = dead;
+        }
+        mutex_unlock_irqrestore(&kthread_dead_lock, state);
+
+        while (gone != NULL) {
+                struct kthread* next = gone->next_dead;
+                kthread_free(gone);
+                gone = next;
+        }
+}
+
+/**
+ * \fn kthread_entry
+ * \brief Where every kernel thread starts, right after its first switch
+ */
+static void kthread_entry(void* arg)
+{
+        struct kthread* k = arg;
+        sched_finish();
+        cpu_enable_interrupts(0);
+
+        k->fn(k->arg);
+        kthread_exit();
+}
+
+/**
+ * \fn kthread_create
+ * \brief Set up a kernel thread, without starting it
+ * \param fn
+ * \brief What the thread runs, it exits when fn returns
+ * \param arg
+ * \param name
+ * \return The task of the thread, or NULL if there's no memory or pid left
+ *
+ * The task starts out WAITING. Bind or prioritise it, then sched_enqueue it.
+ */
+struct task* kthread_create(void (*fn)(void*), void* arg, const char* name)
+{
+        if (fn == NULL)
+                return NULL;
+        kthread_reap();
+
+        struct kthread* k = kmalloc(sizeof(*k));
+        if (k == NULL)
+                return NULL;
+        memset(k, 0, sizeof(*k));
+        void* stack = kmalloc(KTHREAD_STACK_SIZE);
+        if (stack == NULL) {
+                kfree(k);
+                return NULL;
+        }
+
+        k->fn = fn;
+        k->arg = arg;
+        k->name = name;
+        k->thread.ss = stack;
+        k->thread.ss_size = KTHREAD_STACK_SIZE;
+        k->thread.state = RUNNABLE;
+        /* A single thread fits in the table without allocating */
+        thread_table_init(&k->task.threads);
+        thread_table_add(&k->task.threads, &k->thread);
+        k->task.current_thread = &k->thread;
+        k->task.state = WAITING;
+        k->task.priority = SCHED_PRIO_DEFAULT;
+        k->task.cpu = get_cpu();
+
+        if (pid_alloc(&k->task, &k->task.pid) != -E_SUCCESS) {
+                kfree_s(stack, KTHREAD_STACK_SIZE);
+                kfree(k);
+                return NULL;
+        }
+#ifdef X86
+        if (x86_thread_setup(&k->thread, kthread_entry, k) != -E_SUCCESS) {
+                pid_free(k->task.pid);
+                kfree_s(stack, KTHREAD_STACK_SIZE);
+                kfree(k);
+                return NULL;
+        }
+#endif
+        return &k->task;
+}
+
+/**
+ * \fn kthread_run
+ * \brief Set up a kernel thread and make it runnable right away
+ */
+struct task* kthread_run(void (*fn)(void*), void* arg, const char* name)
+{
+        struct task* task = kthread_create(fn, arg, name);
+        if (task != NULL && sched_enqueue(task) != -E_SUCCESS) {
+                kthread_free((struct kthread*)task);
+                return NULL;
+        }
+        return task;
+}
+
+/**
+ * \fn kthread_destroy
+ * \brief Free a thread that was created, but never enqueued
+ * \param task
+ */
+void kthread_destroy(struct task* task)
+{
+        if (task != NULL)
+                kthread_free((struct kthread*)task);
+}
+
+/**
+ * \fn kthread_bind
+ * \brief Only let a thread run on a single cpu
+ * \param task
+ * \param cpu
+ * \return A standard error code
+ */
+int kthread_bind(struct task* task, int cpu)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (cpu < 0 || cpu >= 32)
+                return -E_INVALID_ARG;
+        int ret = sched_set_affinity(task, 1U << cpu);
+        if (ret == -E_SUCCESS && task->sched_array == NULL && !task->on_cpu)
+                /* Not running yet, start out on the right cpu */
+                task->cpu = cpu;
+        return ret;
+}
+
+/**
+ * \fn kthread_exit
+ * \brief End the calling kernel thread
+ */
+void kthread_exit()
+{
+        struct kthread* k = (struct kthread*)get_current_task();
+        /* Hand back a deadline reservation */
+        sched_set_scheduler(&k->task, SCHED_NORMAL, k->task.priority);
+
+        int state = mutex_lock_irqsave(&kthread_dead_lock);
+        k->task.state = DEAD;
+        k->next_dead = kthread_dead;
+        kthread_dead = k;
+        mutex_unlock_irqrestore(&kthread_dead_lock, state);
+
+        /* DEAD tasks aren't queued again, so this never comes back */
+        sched();
+        panic("A dead kernel thread got scheduled");
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -0,0 +1,312 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/pid.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#ifdef PID_TEST
+#include <arch/x86/timer.h>
+#endif
+
+/**
+ * \addtogroup pid
+ * @{
+ *
+ * Pids index a radix tree of PID_LEVELS levels, PID_BITS of the pid per
+ * level. Every node has a bit per slot that tells whether there's any room
+ * left below it, so the lowest free pid is found by following the first
+ * clear bit down from the root, one node per level.
+ *
+ * Looking up a task takes no lock at all. Nodes are cleared before they are
+ * hooked into the tree and are never freed, so a lookup racing with an
+ * allocation or free finds either the old or the new task, never garbage.
+ * The task itself may still be on its way out, the caller has to cope with
+ * that.
+ *
+ * Pid 0 belongs to the idle tasks and never resolves to a task.
+ */
+
+/*
+ * Pid 0 is taken from the start. Only the leaf knows, a bit higher up would
+ * mark every pid below it as taken too. The path down to it has to be there
+ * from the start for that, one node per level below the root.
+ */
+#if PID_LEVELS != 3
+#error "The path to pid 0 needs a node per level"
+#endif
+static struct pid_node pid_zero_leaf = { {1}, {NULL} };
+static struct pid_node pid_zero_mid = { {0}, {&pid_zero_leaf} };
+static struct pid_node pid_root = { {0}, {&pid_zero_mid} };
+static spinlock_t pid_lock = mutex_unlocked;
+
+#define pid_barrier() asm volatile ("" ::: "memory")
+
+static int pid_is_full(struct pid_node* node)
+{
+        int i = 0;
+        for (; i < PID_WORDS; i++) {
+                if (node->full[i] != 0xFFFFFFFF)
+                        return 0;
+        }
+        return 1;
+}
+
+/**
+ * \fn pid_first_free
+ * \brief Find the lowest slot of a node with room left
+ * \return The slot, or -1 if the node is full
+ */
+static int pid_first_free(struct pid_node* node)
+{
+        int i = 0;
+        for (; i < PID_WORDS; i++) {
+                if (node->full[i] != 0xFFFFFFFF)
+                        return i * 32 + __builtin_ctz(~node->full[i]);
+        }
+        return -1;
+}
+
+/**
+ * \fn pid_alloc
+ * \brief Give a task the lowest free pid
+ * \param task
+ * \param pid
+ * \brief Filled in with the pid
+ * \return A standard error code
+ *
+ * May allocate nodes, so not for interrupt handlers. The allocation is done
+ * with the tree unlocked, after which the walk starts over.
+ */
+int pid_alloc(struct task* task, uint32_t* pid)
+{
+        if (task == NULL || pid == NULL)
+                return -E_NULL_PTR;
+
+        struct pid_node* path[PID_LEVELS];
+        int slots[PID_LEVELS];
+        struct pid_node* spare = NULL;
+        uint32_t id;
+        int level;
+        struct pid_node* node;
+
+retry:
+        id = 0;
+        mutex_lock(&pid_lock);
+        node = &pid_root;
+        for (level = 0; level < PID_LEVELS; level++) {
+                int slot = pid_first_free(node);
+                if (slot < 0) {
+                        mutex_unlock(&pid_lock);
+                        if (spare != NULL)
+                                kfree(spare);
+                        return -E_OUT_OF_RESOURCES;
+                }
+                path[level] = node;
+                slots[level] = slot;
+                id = (id << PID_BITS) | slot;
+                if (level == PID_LEVELS - 1)
+                        break;
+
+                struct pid_node* child = node->slot[slot];
+                if (child == NULL) {
+                        if (spare == NULL) {
+                                mutex_unlock(&pid_lock);
+                                spare = kmalloc(sizeof(*spare));
+                                if (spare == NULL)
+                                        return -E_NOMEM;
+                                memset(spare, 0, sizeof(*spare));
+                                /* The tree may have changed meanwhile */
+                                goto retry;
+                        }
+                        child = spare;
+                        spare = NULL;
+                        /* Cleared before anyone can find it */
+                        pid_barrier();
+                        node->slot[slot] = child;
+                }
+                node = child;
+        }
+
+        node->slot[slots[level]] = task;
+        /* Mark the way up as full for as long as the nodes fill up */
+        for (; level >= 0; level--) {
+                node = path[level];
+                node->full[slots[level] / 32] |= 1U << (slots[level] % 32);
+                if (!pid_is_full(node))
+                        break;
+        }
+        mutex_unlock(&pid_lock);
+
+        /* Someone else hooked in the node we came for */
+        if (spare != NULL)
+                kfree(spare);
+        *pid = id;
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn pid_free
+ * \brief Make a pid available again
+ * \param pid
+ * \return A standard error code
+ */
+int pid_free(uint32_t pid)
+{
+        if (pid == 0 || pid >= PID_MAX)
+                return -E_INVALID_ARG;
+
+        mutex_lock(&pid_lock);
+        struct pid_node* path[PID_LEVELS];
+        struct pid_node* node = &pid_root;
+        int level = 0;
+        for (; level < PID_LEVELS; level++) {
+                path[level] = node;
+                if (level == PID_LEVELS - 1)
+                        break;
+                int shift = PID_BITS * (PID_LEVELS - 1 - level);
+                node = node->slot[(pid >> shift) & PID_MASK];
+                if (node == NULL) {
+                        mutex_unlock(&pid_lock);
+                        return -E_NOT_FOUND;
+                }
+        }
+        if (node->slot[pid & PID_MASK] == NULL) {
+                mutex_unlock(&pid_lock);
+                return -E_NOT_FOUND;
+        }
+
+        node->slot[pid & PID_MASK] = NULL;
+        /* None of the nodes on the way down is full any more */
+        for (; level >= 0; level--) {
+                int shift = PID_BITS * (PID_LEVELS - 1 - level);
+                int slot = (pid >> shift) & PID_MASK;
+                path[level]->full[slot / 32] &= ~(1U << (slot % 32));
+        }
+        mutex_unlock(&pid_lock);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn find_task
+ * \brief Look up a task by pid
+ * \param pid
+ * \return The task, or NULL if the pid isn't in use
+ *
+ * Takes no lock, safe from interrupt handlers.
+ */
+struct task* find_task(uint32_t pid)
+{
+        if (pid >= PID_MAX)
+                return NULL;
+
+        struct pid_node* node = &pid_root;
+        int shift = PID_BITS * (PID_LEVELS - 1);
+        for (; shift > 0; shift -= PID_BITS) {
+                node = node->slot[(pid >> shift) & PID_MASK];
+                if (node == NULL)
+                        return NULL;
+        }
+        return node->slot[pid & PID_MASK];
+}
+
+#ifdef PID_TEST
+#define PID_TEST_TASKS 100000
+
+/**
+ * \fn pid_test
+ * \brief Hand out PID_TEST_TASKS pids, and check they come back lowest first
+ * \return A standard error code
+ *
+ * Every pid points at the same dummy task, only the tree is tested. The
+ * nodes stay around afterwards.
+ */
+int pid_test()
+{
+        static struct task dummy;
+        uint32_t first = 0;
+        uint32_t pid = 0;
+        int i = 0;
+        int ret = -E_GENERIC;
+
+        /* Pid 0 stays reserved */
+        if (find_task(0) != NULL || pid_free(0) == -E_SUCCESS)
+                goto fail;
+
+        uint64_t start = get_cpu_tick();
+        for (; i < PID_TEST_TASKS; i++) {
+                if (pid_alloc(&dummy, &pid) != -E_SUCCESS)
+                        goto fail;
+                if (i == 0)
+                        first = pid;
+                else if (pid != first + i)
+                        goto fail;
+        }
+        uint64_t alloc = get_cpu_tick() - start;
+
+        /*
+         * Handing out pids started at 1, and the tasks since have taken all
+         * of the ones below ours
+         */
+        if (first == 0)
+                goto fail;
+        uint32_t taken = 1;
+        for (; taken < first; taken++) {
+                if (find_task(taken) == NULL)
+                        goto fail;
+        }
+
+        start = get_cpu_tick();
+        for (i = 0; i < PID_TEST_TASKS; i++) {
+                if (find_task(first + i) != &dummy)
+                        goto fail;
+        }
+        uint64_t lookup = get_cpu_tick() - start;
+
+        /* Freed pids come back lowest first */
+        uint32_t a = first + PID_TEST_TASKS / 2;
+        uint32_t b = first + PID_TEST_TASKS / 4;
+        if (pid_free(a) != -E_SUCCESS || pid_free(b) != -E_SUCCESS)
+                goto fail;
+        if (find_task(a) != NULL)
+                goto fail;
+        if (pid_alloc(&dummy, &pid) != -E_SUCCESS || pid != b)
+                goto fail;
+        if (pid_alloc(&dummy, &pid) != -E_SUCCESS || pid != a)
+                goto fail;
+
+        debug("pid: %i pids, alloc %i, lookup %i cycles\n", PID_TEST_TASKS,
+                        x86_div64_32(alloc, PID_TEST_TASKS),
+                        x86_div64_32(lookup, PID_TEST_TASKS));
+        ret = -E_SUCCESS;
+        goto out;
+
+fail:
+        warning("pid: %X went wrong, got pid %X\n", i, pid);
+out:
+        for (i = 0; i < PID_TEST_TASKS; i++)
+                pid_free(first + i);
+        return ret;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
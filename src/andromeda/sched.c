@@ -0,0 +1,1322 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <andromeda/task.h>
+#include <fs/procfs.h>
+#include <mm/vm.h>
+#ifdef X86
+#include <arch/x86/acct.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/timer.h>
+#endif
+#ifdef SCHED_RT_TEST
+#include <andromeda/kthread.h>
+#endif
+
+/**
+ * \addtogroup sched
+ * @{
+ *
+ * Runnable tasks sit in one list per priority level, 0 being the highest. A
+ * bitmap tells which lists hold anything, so picking the next task is a
+ * matter of finding the first set bit, no matter how many tasks there are.
+ *
+ * Every epoch grants a task time_granted milliseconds, more for the higher
+ * priorities. Once a task has used it up, it moves to the expired lists with
+ * a fresh grant. When no task is left in the active lists, the expired lists
+ * take their place and the next epoch starts. The low priorities always get
+ * their turn that way.
+ *
+ * The timer interrupt only marks the running task for preemption, the switch
+ * itself happens once the interrupt has been acknowledged.
+ *
+ * Every cpu has a run queue of its own, with its own lock. A task that wakes
+ * up goes back to the cpu it last ran on if its affinity allows it, and a cpu
+ * that runs out of work steals from the busiest queue.
+ *
+ * On top of that come the real-time classes, which always go first. Deadline
+ * tasks reserve a runtime every period, and the one with the earliest
+ * deadline runs. Admission control keeps the reservations of a cpu below
+ * SCHED_DL_BW_LIMIT, so every deadline can be met. One that uses up its
+ * runtime has its deadline postponed by a period, which makes way for the
+ * others without throttling it. Deadline tasks stay on the cpu they were
+ * admitted on.
+ *
+ * After them come the FIFO and round-robin tasks, at fixed priorities. A FIFO
+ * task runs until it blocks, a round-robin one makes way for its equals after
+ * SCHED_RR_SLICE. Neither takes part in the epochs.
+ */
+
+#ifdef X86
+#define sched_cpu() x86_percpu_this()
+#define sched_cpu_of(cpu) (&x86_percpu[cpu])
+#define sched_cpus() smp_cpus()
+#define sched_kick(cpu) smp_wake(cpu)
+#define sched_trace(type, task, arg) x86_trace(type, task, arg)
+#else
+struct sched_cpu {
+        struct task* task;
+        struct task* idle;
+        struct task* prev;
+        struct task* migrate;
+        uint32_t need_resched;
+        time_t sched_start;
+        time_t preempt_at;
+};
+static struct sched_cpu sched_boot_cpu;
+#define sched_cpu() (&sched_boot_cpu)
+#define sched_cpu_of(cpu) (&sched_boot_cpu)
+#define sched_cpus() 1
+#define sched_kick(cpu)
+#define sched_trace(type, task, arg)
+#endif
+
+static struct sched_rq sched_rqs[CPU_LIMIT];
+static volatile int sched_ready = 0;
+
+static struct task sched_idle[CPU_LIMIT];
+static struct thread_state sched_idle_state[CPU_LIMIT];
+
+/**
+ * \fn sched_slice
+ * \brief The time an epoch grants a priority level
+ * \param priority
+ * \return The time in milliseconds
+ */
+static uint32_t sched_slice(uint8_t priority)
+{
+        return SCHED_EPOCH_SIZE + (SCHED_PRIO_SIZE - 1 - priority)
+                        * (SCHED_EPOCH_SIZE / 4);
+}
+
+static time_t sched_clock()
+{
+#ifdef X86
+        return getTime(get_global_timer(X86_8259_INTERRUPT_BASE));
+#else
+        return 0;
+#endif
+}
+
+void sched_rq_init(struct sched_rq* rq)
+{
+        if (rq == NULL)
+                return;
+        memset(rq, 0, sizeof(*rq));
+        rq->lock = mutex_unlocked;
+        rq->active = &rq->arrays[0];
+        rq->expired = &rq->arrays[1];
+}
+
+/**
+ * \fn sched_level
+ * \brief The list of a sched_array a task goes in
+ */
+static int sched_level(struct task* task)
+{
+        if (task->policy == SCHED_FIFO || task->policy == SCHED_RR)
+                return task->rt_priority;
+        return task->priority;
+}
+
+/**
+ * \fn sched_class
+ * \brief Rank the class of a task, 0 goes first
+ */
+static int sched_class(struct task* task)
+{
+        switch (task->policy) {
+        case SCHED_DEADLINE:
+                return 0;
+        case SCHED_FIFO:
+        case SCHED_RR:
+                return 1;
+        default:
+                return 2;
+        }
+}
+
+/**
+ * \fn sched_preempts
+ * \brief Tell whether a task should take the cpu from the running one
+ */
+static int sched_preempts(struct task* task, struct task* current)
+{
+        int class = sched_class(task);
+        if (class != sched_class(current))
+                return class < sched_class(current);
+        switch (class) {
+        case 0:
+                return task->dl_deadline < current->dl_deadline;
+        case 1:
+                return task->rt_priority < current->rt_priority;
+        default:
+                return task->priority < current->priority;
+        }
+}
+
+/**
+ * \fn sched_out_of_time
+ * \brief Tell whether a task used up what it was granted
+ *
+ * FIFO tasks are never out of time.
+ */
+static int sched_out_of_time(struct task* task)
+{
+        if (task->policy == SCHED_FIFO)
+                return 0;
+        return task->time_used >= task->time_granted;
+}
+
+/**
+ * \fn sched_array_add
+ * \brief Append a task to the list of its priority
+ */
+static void sched_array_add(struct sched_array* a, struct task* task)
+{
+        int level = sched_level(task);
+        struct task_list_head* q = &a->queue[level];
+        struct task_head* node = &task->sched_node;
+
+        node->task = task;
+        node->next = NULL;
+        node->prev = q->tail;
+        if (q->tail == NULL)
+                q->head = node;
+        else
+                q->tail->next = node;
+        q->tail = node;
+        q->size++;
+
+        a->bitmap[level / 32] |= 1U << (level % 32);
+        a->size++;
+        task->sched_array = a;
+}
+
+/**
+ * \fn sched_dl_add
+ * \brief Queue a deadline task behind the ones with an earlier deadline
+ */
+static void sched_dl_add(struct sched_rq* rq, struct task* task)
+{
+        struct task_list_head* q = &rq->dl;
+        struct task_head* node = &task->sched_node;
+        struct task_head* at = q->head;
+        /* Equal deadlines take turns */
+        while (at != NULL && at->task->dl_deadline <= task->dl_deadline)
+                at = at->next;
+
+        node->task = task;
+        node->next = at;
+        node->prev = (at == NULL) ? q->tail : at->prev;
+        if (node->prev == NULL)
+                q->head = node;
+        else
+                node->prev->next = node;
+        if (at == NULL)
+                q->tail = node;
+        else
+                at->prev = node;
+        q->size++;
+
+        /* It isn't in an array, but has to be seen as queued */
+        task->sched_array = &rq->rt;
+}
+
+/**
+ * \fn sched_dl_wake
+ * \brief Start a new period for a deadline task that slept past its deadline
+ */
+static void sched_dl_wake(struct task* task, time_t now)
+{
+        if (task->dl_deadline > now)
+                return;
+        task->dl_deadline = now + task->dl_period;
+        task->time_used = 0;
+}
+
+/**
+ * \fn sched_rq_add
+ * \brief Queue a runnable task, with the run queue lock held
+ * \param rq
+ * \param task
+ *
+ * A normal task that used up its time is granted a new slice, but has to
+ * wait for the next epoch to use it. The real-time tasks don't have epochs.
+ */
+void sched_rq_add(struct sched_rq* rq, struct task* task)
+{
+        switch (task->policy) {
+        case SCHED_DEADLINE:
+                task->time_granted = task->dl_runtime;
+                if (task->time_used >= task->time_granted) {
+                        /* Carry on in the next period */
+                        task->time_used = 0;
+                        task->dl_deadline += task->dl_period;
+                }
+                sched_dl_add(rq, task);
+                return;
+        case SCHED_RR:
+                task->time_granted = SCHED_RR_SLICE;
+                if (task->time_used >= task->time_granted)
+                        task->time_used = 0;
+                sched_array_add(&rq->rt, task);
+                return;
+        case SCHED_FIFO:
+                sched_array_add(&rq->rt, task);
+                return;
+        }
+
+        struct sched_array* a = rq->active;
+        if (task->priority >= SCHED_PRIO_SIZE)
+                task->priority = SCHED_PRIO_SIZE - 1;
+
+        if (task->time_granted == 0) {
+                task->time_granted = sched_slice(task->priority);
+        } else if (task->time_used >= task->time_granted) {
+                task->time_used = 0;
+                task->time_granted = sched_slice(task->priority);
+                a = rq->expired;
+        }
+        sched_array_add(a, task);
+}
+
+/**
+ * \fn sched_rq_del
+ * \brief Take a task off the run queue, with the run queue lock held
+ * \param rq
+ * \param task
+ */
+void sched_rq_del(struct sched_rq* rq, struct task* task)
+{
+        struct sched_array* a = task->sched_array;
+        if (a == NULL)
+                return;
+
+        int level = sched_level(task);
+        struct task_list_head* q = (task->policy == SCHED_DEADLINE) ? &rq->dl
+                        : &a->queue[level];
+        struct task_head* node = &task->sched_node;
+        if (node->prev == NULL)
+                q->head = node->next;
+        else
+                node->prev->next = node->next;
+        if (node->next == NULL)
+                q->tail = node->prev;
+        else
+                node->next->prev = node->prev;
+        node->next = NULL;
+        node->prev = NULL;
+        q->size--;
+        task->sched_array = NULL;
+        if (task->policy == SCHED_DEADLINE)
+                return;
+
+        if (q->head == NULL)
+                a->bitmap[level / 32] &= ~(1U << (level % 32));
+        a->size--;
+}
+
+/**
+ * \fn sched_array_first
+ * \brief Find the first task of the highest priority list of an array
+ */
+static struct task* sched_array_first(struct sched_array* a)
+{
+        int i = 0;
+        for (; i < SCHED_BITMAP_WORDS; i++) {
+                if (a->bitmap[i] == 0)
+                        continue;
+                int prio = i * 32 + __builtin_ctz(a->bitmap[i]);
+                return a->queue[prio].head->task;
+        }
+        return NULL;
+}
+
+/**
+ * \fn sched_rq_pick
+ * \brief Take the highest priority task off the run queue
+ * \param rq
+ * \return The task or NULL if nothing is runnable
+ *
+ * Deadline tasks go first, then the fixed priority real-time tasks, then the
+ * normal ones. Expects the run queue lock to be held.
+ */
+struct task* sched_rq_pick(struct sched_rq* rq)
+{
+        struct task* task = NULL;
+        if (rq->dl.head != NULL)
+                task = rq->dl.head->task;
+        else
+                task = sched_array_first(&rq->rt);
+        if (task != NULL) {
+                sched_rq_del(rq, task);
+                return task;
+        }
+
+        if (rq->active->size == 0) {
+                if (rq->expired->size == 0)
+                        return NULL;
+                /* Start the next epoch */
+                struct sched_array* a = rq->active;
+                rq->active = rq->expired;
+                rq->expired = a;
+                rq->epoch++;
+        }
+
+        task = sched_array_first(rq->active);
+        if (task != NULL)
+                sched_rq_del(rq, task);
+        return task;
+}
+
+/**
+ * \fn sched_idle_task
+ * \brief Find the idle task of the calling cpu
+ *
+ * Whatever the cpu was running before the scheduler first got to it becomes
+ * its idle task, which is where the cpu returns to when nothing else is
+ * runnable.
+ */
+static struct task* sched_idle_task()
+{
+        struct task* idle = sched_cpu()->idle;
+        if (idle != NULL)
+                return idle;
+
+        int cpu = get_cpu();
+        idle = &sched_idle[cpu];
+        memset(idle, 0, sizeof(*idle));
+        sched_idle_state[cpu].state = RUNNABLE;
+        thread_table_init(&idle->threads);
+        thread_table_add(&idle->threads, &sched_idle_state[cpu]);
+        idle->current_thread = &sched_idle_state[cpu];
+        idle->state = RUNNABLE;
+        idle->priority = SCHED_PRIO_SIZE - 1;
+        idle->cpu = cpu;
+        idle->on_cpu = 1;
+
+        sched_cpu()->idle = idle;
+        sched_cpu()->preempt_at = -1;
+        if (get_current_task() == NULL)
+                set_current_task(idle);
+        return idle;
+}
+
+/**
+ * \fn sched_account
+ * \brief Charge the running task for the time since it was last accounted
+ */
+static void sched_account(struct task* task, time_t now)
+{
+        time_t start = sched_cpu()->sched_start;
+        sched_cpu()->sched_start = now;
+        if (task == NULL || task == sched_cpu()->idle || now <= start)
+                return;
+        task->time_used += now - start;
+}
+
+static int sched_preempt(int16_t timer_id, time_t time, int16_t irq_id);
+
+/**
+ * \fn sched_arm
+ * \brief Make the cpu timer go off when the running task runs out of time
+ * \param task
+ *
+ * Timer events can't be cancelled. If an earlier event is still pending,
+ * that one will do. One that turns out to be too early just arms the timer
+ * again.
+ */
+static void sched_arm(struct task* task)
+{
+#ifdef X86
+        struct sys_timer* timer = x86_percpu_read(timer);
+        if (timer == NULL || task->policy == SCHED_FIFO ||
+                        task->time_used >= task->time_granted)
+                return;
+
+        time_t at = getTime(timer) + task->time_granted - task->time_used;
+        time_t pending = sched_cpu()->preempt_at;
+        if (pending >= 0 && pending <= at)
+                return;
+        if (timer->subscribe(at, 0, sched_preempt, timer) == -E_SUCCESS)
+                sched_cpu()->preempt_at = at;
+#endif
+}
+
+/**
+ * \fn sched_tick
+ * \brief Account the running task and see if it should make way
+ *
+ * Called from the timer interrupt, so it doesn't switch itself.
+ */
+void sched_tick()
+{
+        struct task* task = get_current_task();
+        if (task == NULL)
+                return;
+
+        sched_account(task, sched_clock());
+        if (task != sched_cpu()->idle && sched_out_of_time(task))
+                sched_cpu()->need_resched = 1;
+}
+
+static int sched_preempt(int16_t timer_id __attribute__((unused)),
+                time_t time, int16_t irq_id __attribute__((unused)))
+{
+        time_t pending = sched_cpu()->preempt_at;
+        /* Overtaken by an earlier event */
+        if (pending < 0 || time < pending)
+                return -E_SUCCESS;
+        sched_cpu()->preempt_at = -1;
+
+        sched_tick();
+        struct task* task = get_current_task();
+        if (!sched_cpu()->need_resched && task != sched_cpu()->idle)
+                sched_arm(task);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_allowed
+ * \brief Tell whether a task may run on a cpu
+ */
+static int sched_allowed(struct task* task, int cpu)
+{
+        if (cpu < 0 || cpu >= sched_cpus())
+                return 0;
+        /* No affinity set means anywhere */
+        if (task->affinity == 0 || cpu >= 32)
+                return 1;
+        return (task->affinity & (1U << cpu)) != 0;
+}
+
+/**
+ * \fn sched_cpu_takes
+ * \brief Tell whether a cpu should switch to a task right away
+ */
+static int sched_cpu_takes(struct task* task, int cpu)
+{
+        struct task* current = sched_cpu_of(cpu)->task;
+        return current == NULL || current == sched_cpu_of(cpu)->idle ||
+                        sched_preempts(task, current);
+}
+
+/**
+ * \fn sched_check_preempt
+ * \brief Have a cpu reschedule if a task just queued there should run now
+ */
+static void sched_check_preempt(struct task* task, int cpu)
+{
+        if (!sched_cpu_takes(task, cpu))
+                return;
+        sched_cpu_of(cpu)->need_resched = 1;
+        if (cpu != get_cpu())
+                sched_kick(cpu);
+}
+
+/**
+ * \fn sched_select_cpu
+ * \brief Find the run queue for a task that becomes runnable
+ *
+ * The cpu it last ran on is preferred, as its caches may still be warm. A
+ * FIFO or round-robin task would rather go to a cpu it can run on right
+ * away, deadline tasks stay where they were admitted.
+ */
+static int sched_select_cpu(struct task* task)
+{
+        if (task->policy == SCHED_DEADLINE)
+                return task->cpu;
+
+        int cpu = 0;
+        if (sched_class(task) == 1 && !(sched_allowed(task, task->cpu) &&
+                        sched_cpu_takes(task, task->cpu))) {
+                for (; cpu < sched_cpus(); cpu++) {
+                        if (sched_allowed(task, cpu) &&
+                                        sched_cpu_takes(task, cpu))
+                                return cpu;
+                }
+        }
+        if (sched_allowed(task, task->cpu))
+                return task->cpu;
+
+        for (cpu = 0; cpu < sched_cpus(); cpu++) {
+                if (sched_allowed(task, cpu))
+                        return cpu;
+        }
+        return get_cpu();
+}
+
+/**
+ * \fn sched_task_lock
+ * \brief Lock the run queue a task belongs to
+ * \param task
+ * \param state
+ * \brief Filled in with the interrupt state to restore
+ * \return The locked run queue
+ *
+ * The task may be stolen while we wait for the lock, so check afterwards.
+ */
+static struct sched_rq* sched_task_lock(struct task* task, int* state)
+{
+        for (;;) {
+                struct sched_rq* rq = &sched_rqs[task->cpu];
+                *state = mutex_lock_irqsave(&rq->lock);
+                if (rq == &sched_rqs[task->cpu])
+                        return rq;
+                mutex_unlock_irqrestore(&rq->lock, *state);
+        }
+}
+
+/**
+ * \fn sched_enqueue
+ * \brief Make a task runnable
+ * \param task
+ * \return A standard error code
+ *
+ * The task goes to the run queue of a cpu it may run on. If that cpu is
+ * idle or running something it should preempt, it is told to reschedule.
+ */
+int sched_enqueue(struct task* task)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (!sched_ready)
+                return -E_NOT_YET_INITIALISED;
+
+        int state;
+        struct sched_rq* rq = sched_task_lock(task, &state);
+        task->state = RUNNABLE;
+        /* A running task is queued again when it is switched out */
+        if (task->sched_array != NULL || task->on_cpu) {
+                mutex_unlock_irqrestore(&rq->lock, state);
+                return -E_SUCCESS;
+        }
+        if (task->policy == SCHED_DEADLINE)
+                sched_dl_wake(task, sched_clock());
+#ifdef X86
+        if (sched_class(task) < 2)
+                task->wake_tick = get_cpu_tick();
+#endif
+        int cpu = sched_select_cpu(task);
+        sched_trace(X86_TRACE_WAKEUP, task, cpu);
+        if (cpu != task->cpu) {
+                sched_trace(X86_TRACE_MIGRATE, task, (task->cpu << 16) | cpu);
+                /*
+                 * Hand the task over to the new queue before letting go of
+                 * the old one, so other wakers go there too. One of them
+                 * may get the new lock first, only queue the task if none
+                 * of them did, or took it elsewhere.
+                 */
+                task->cpu = cpu;
+                mutex_unlock(&rq->lock);
+                rq = &sched_rqs[cpu];
+                mutex_lock(&rq->lock);
+                if (task->cpu != cpu || task->sched_array != NULL ||
+                                task->on_cpu) {
+                        mutex_unlock_irqrestore(&rq->lock, state);
+                        return -E_SUCCESS;
+                }
+        }
+        sched_rq_add(rq, task);
+        mutex_unlock(&rq->lock);
+
+        sched_check_preempt(task, cpu);
+
+        if (state)
+                cpu_enable_interrupts(0);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_dequeue
+ * \brief Take a task off the run queue, e.g. when it blocks
+ * \param task
+ * \return A standard error code
+ */
+int sched_dequeue(struct task* task)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (!sched_ready)
+                return -E_NOT_YET_INITIALISED;
+
+        int state;
+        struct sched_rq* rq = sched_task_lock(task, &state);
+        sched_rq_del(rq, task);
+        mutex_unlock_irqrestore(&rq->lock, state);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_set_priority
+ * \brief Move a task to another priority level
+ * \param task
+ * \param priority
+ * \return A standard error code
+ *
+ * The new level only changes the time granted from the next epoch on. Real
+ * time tasks keep it for when they become normal again.
+ */
+int sched_set_priority(struct task* task, uint8_t priority)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (priority >= SCHED_PRIO_SIZE)
+                return -E_INVALID_ARG;
+        if (!sched_ready) {
+                task->priority = priority;
+                return -E_SUCCESS;
+        }
+
+        int state;
+        struct sched_rq* rq = sched_task_lock(task, &state);
+        if (task->sched_array != NULL && task->policy == SCHED_NORMAL) {
+                struct sched_array* a = task->sched_array;
+                sched_rq_del(rq, task);
+                task->priority = priority;
+                sched_array_add(a, task);
+        } else {
+                task->priority = priority;
+        }
+        mutex_unlock_irqrestore(&rq->lock, state);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_set_affinity
+ * \brief Restrict the cpus a task may run on
+ * \param task
+ * \param affinity
+ * \brief Bit mask of cpus, 0 for any
+ * \return A standard error code
+ *
+ * A queued task on a cpu it may no longer use is moved right away, a running
+ * one once it is switched out. Deadline tasks can't move, their bandwidth is
+ * reserved on their cpu.
+ */
+int sched_set_affinity(struct task* task, uint32_t affinity)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (task->policy == SCHED_DEADLINE)
+                return -E_INVALID_ARG;
+        uint32_t online = (sched_cpus() >= 32) ? 0xFFFFFFFF
+                        : (1U << sched_cpus()) - 1;
+        if (affinity != 0 && (affinity & online) == 0)
+                return -E_INVALID_ARG;
+        if (!sched_ready) {
+                task->affinity = affinity;
+                return -E_SUCCESS;
+        }
+
+        int state;
+        struct sched_rq* rq = sched_task_lock(task, &state);
+        task->affinity = affinity;
+        int queued = (task->sched_array != NULL && !sched_allowed(task,
+                        task->cpu));
+        if (queued)
+                sched_rq_del(rq, task);
+        mutex_unlock_irqrestore(&rq->lock, state);
+
+        if (queued)
+                return sched_enqueue(task);
+        return -E_SUCCESS;
+}
+
+static uint32_t sched_dl_bw(time_t runtime, time_t period)
+{
+        return ((uint32_t)runtime << SCHED_DL_BW_SHIFT) / (uint32_t)period;
+}
+
+/**
+ * \fn sched_set_scheduler
+ * \brief Move a task to the normal, FIFO or round-robin class
+ * \param task
+ * \param policy
+ * \param priority
+ * \brief The priority within the class, 0 being the highest
+ * \return A standard error code
+ *
+ * A deadline task gives up its bandwidth.
+ */
+int sched_set_scheduler(struct task* task, int policy, uint8_t priority)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        switch (policy) {
+        case SCHED_NORMAL:
+                if (priority >= SCHED_PRIO_SIZE)
+                        return -E_INVALID_ARG;
+                break;
+        case SCHED_FIFO:
+        case SCHED_RR:
+                if (priority >= SCHED_RT_PRIO_SIZE)
+                        return -E_INVALID_ARG;
+                break;
+        default:
+                /* Deadline tasks go through sched_set_deadline */
+                return -E_INVALID_ARG;
+        }
+
+        int state = 0;
+        struct sched_rq* rq = NULL;
+        int queued = 0;
+        if (sched_ready) {
+                rq = sched_task_lock(task, &state);
+                queued = (task->sched_array != NULL);
+                if (queued)
+                        sched_rq_del(rq, task);
+                if (task->policy == SCHED_DEADLINE)
+                        rq->dl_bw -= sched_dl_bw(task->dl_runtime,
+                                        task->dl_period);
+        }
+
+        task->policy = policy;
+        if (policy == SCHED_NORMAL)
+                task->priority = priority;
+        else
+                task->rt_priority = priority;
+        /* Start with a fresh grant of the new class */
+        task->time_used = 0;
+        task->time_granted = 0;
+
+        if (rq == NULL)
+                return -E_SUCCESS;
+        if (queued)
+                sched_rq_add(rq, task);
+        mutex_unlock_irqrestore(&rq->lock, state);
+        if (queued)
+                sched_check_preempt(task, task->cpu);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_set_deadline
+ * \brief Move a task to the deadline class
+ * \param task
+ * \param runtime
+ * \brief The time in ms it needs every period
+ * \param period
+ * \brief In ms, the deadline is at the end of it
+ * \return A standard error code, -E_OUT_OF_RESOURCES if the cpu can't take it
+ *
+ * The task is admitted on the cpu it last ran on, so bind it first.
+ */
+int sched_set_deadline(struct task* task, time_t runtime, time_t period)
+{
+        if (task == NULL)
+                return -E_NULL_PTR;
+        if (runtime <= 0 || period < runtime)
+                return -E_INVALID_ARG;
+        if (period > (1 << (31 - SCHED_DL_BW_SHIFT)))
+                return -E_TOOLARGE_ARG;
+        if (!sched_ready)
+                return -E_NOT_YET_INITIALISED;
+
+        int state;
+        struct sched_rq* rq = sched_task_lock(task, &state);
+        uint32_t bw = rq->dl_bw + sched_dl_bw(runtime, period);
+        if (task->policy == SCHED_DEADLINE)
+                bw -= sched_dl_bw(task->dl_runtime, task->dl_period);
+        if (bw > SCHED_DL_BW_LIMIT) {
+                mutex_unlock_irqrestore(&rq->lock, state);
+                return -E_OUT_OF_RESOURCES;
+        }
+
+        int queued = (task->sched_array != NULL);
+        if (queued)
+                sched_rq_del(rq, task);
+        rq->dl_bw = bw;
+        task->policy = SCHED_DEADLINE;
+        task->dl_runtime = runtime;
+        task->dl_period = period;
+        task->dl_deadline = sched_clock() + period;
+        task->time_used = 0;
+        task->time_granted = runtime;
+        if (queued)
+                sched_rq_add(rq, task);
+        mutex_unlock_irqrestore(&rq->lock, state);
+
+        if (queued)
+                sched_check_preempt(task, task->cpu);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn sched_steal
+ * \brief Take a task from the busiest run queue
+ * \param cpu
+ * \brief The idle cpu doing the stealing
+ * \return The stolen task or NULL
+ *
+ * A single queued task is left alone if its cpu is idle, that cpu is about
+ * to run it anyway. Queues that are locked right now are skipped. Deadline
+ * tasks are never stolen.
+ */
+static struct task* sched_steal(int cpu)
+{
+        int busiest = -1;
+        uint32_t most = 0;
+        int i = 0;
+        for (; i < sched_cpus(); i++) {
+                struct sched_rq* rq = &sched_rqs[i];
+                uint32_t queued = rq->rt.size + rq->active->size +
+                                rq->expired->size;
+                if (i == cpu || queued <= most)
+                        continue;
+                if (queued == 1 && sched_cpu_of(i)->task ==
+                                sched_cpu_of(i)->idle)
+                        continue;
+                busiest = i;
+                most = queued;
+        }
+        if (busiest < 0)
+                return NULL;
+
+        struct sched_rq* rq = &sched_rqs[busiest];
+        /* A successful test takes the lock */
+        if (mutex_test(&rq->lock) != mutex_unlocked)
+                return NULL;
+
+        struct task* task = NULL;
+        /* Look for the highest priority task allowed on this cpu */
+        struct sched_array* arrays[3];
+        arrays[0] = &rq->rt;
+        arrays[1] = rq->active;
+        arrays[2] = rq->expired;
+        int a = 0;
+        for (; a < 3 && task == NULL; a++) {
+                int prio = 0;
+                for (; prio < SCHED_PRIO_SIZE && task == NULL; prio++) {
+                        struct task_head* n = arrays[a]->queue[prio].head;
+                        for (; n != NULL; n = n->next) {
+                                if (sched_allowed(n->task, cpu)) {
+                                        task = n->task;
+                                        break;
+                                }
+                        }
+                }
+        }
+        if (task != NULL) {
+                sched_rq_del(rq, task);
+                sched_trace(X86_TRACE_MIGRATE, task, (busiest << 16) | cpu);
+                task->on_cpu = 1;
+                task->cpu = cpu;
+        }
+        mutex_unlock(&rq->lock);
+
+        return task;
+}
+
+/**
+ * \fn sched_put_prev
+ * \brief Queue the task being switched out again if it is still runnable
+ *
+ * Expects the run queue of the cpu to be locked. A task that may no longer
+ * run here is moved by sched_finish, once it is off the cpu.
+ */
+static void sched_put_prev(struct sched_rq* rq, struct task* prev, int cpu)
+{
+        if (prev == sched_cpu()->idle || prev->state != RUNNABLE ||
+                        prev->sched_array != NULL)
+                return;
+        if (sched_allowed(prev, cpu))
+                sched_rq_add(rq, prev);
+        else
+                sched_cpu()->migrate = prev;
+}
+
+/**
+ * \fn sched_rt_latency
+ * \brief Account the time from waking a real-time task up to running it
+ *
+ * Expects the run queue lock to be held.
+ */
+static void sched_rt_latency(struct sched_rq* rq, struct task* task)
+{
+#ifdef X86
+        if (task->wake_tick == 0)
+                return;
+        uint64_t ticks = get_cpu_tick() - task->wake_tick;
+        task->wake_tick = 0;
+        /* Woken on another cpu, whose TSC may be a bit ahead */
+        if ((int64_t)ticks < 0)
+                return;
+
+        rq->rt_wakeups++;
+        rq->rt_latency += ticks;
+        if (ticks > rq->rt_latency_max)
+                rq->rt_latency_max = (ticks >> 32) ? 0xFFFFFFFF : ticks;
+#endif
+}
+
+/**
+ * \fn sched_finish
+ * \brief Complete a switch, in the context of the task switched to
+ *
+ * The run queue lock is held from picking the next task until the previous
+ * one is entirely off the cpu, so nobody else can run or queue it halfway
+ * through. A task that starts running for the first time has to call this
+ * before anything else.
+ */
+void sched_finish()
+{
+        struct task* prev = sched_cpu()->prev;
+        struct task* migrate = sched_cpu()->migrate;
+        sched_cpu()->prev = NULL;
+        sched_cpu()->migrate = NULL;
+        if (prev != NULL)
+                prev->on_cpu = 0;
+        mutex_unlock(&sched_rqs[get_cpu()].lock);
+
+        if (migrate != NULL)
+                sched_enqueue(migrate);
+}
+
+/**
+ * \fn sched
+ * \brief Hand the cpu to the highest priority runnable task
+ *
+ * The running task goes to the back of its list if it is still runnable, so
+ * tasks of the same priority take turns. With nothing left in its own run
+ * queue, the cpu tries to steal work from the busiest one.
+ */
+void sched()
+{
+        if (!sched_ready)
+                return;
+
+        int state = cpu_disable_interrupts(0);
+        int cpu = get_cpu();
+        struct task* idle = sched_idle_task();
+        struct task* prev = get_current_task();
+        struct sched_rq* rq = &sched_rqs[cpu];
+
+        sched_account(prev, sched_clock());
+        sched_cpu()->need_resched = 0;
+
+        mutex_lock(&rq->lock);
+        sched_put_prev(rq, prev, cpu);
+        struct task* next = sched_rq_pick(rq);
+        if (next == NULL) {
+                /* Never hold two run queue locks at once */
+                mutex_unlock(&rq->lock);
+                next = sched_steal(cpu);
+                mutex_lock(&rq->lock);
+
+                /* Something may have woken up in the mean time */
+                sched_put_prev(rq, prev, cpu);
+                if (next == NULL)
+                        next = sched_rq_pick(rq);
+        }
+        if (next == NULL)
+                next = idle;
+        next->on_cpu = 1;
+        next->cpu = cpu;
+
+        if (next != prev) {
+                if (next != idle)
+                        sched_arm(next);
+                sched_rt_latency(rq, next);
+#ifdef X86
+                x86_acct_switch(prev, next);
+#endif
+                sched_cpu()->prev = prev;
+                context_switch(cpu, next);
+        }
+        sched_finish();
+
+        if (state)
+                cpu_enable_interrupts(0);
+}
+
+/**
+ * \fn sched_can_sleep
+ * \brief Tell whether the caller can give up its cpu while it waits
+ *
+ * The idle task has to stay runnable, it halts the cpu instead.
+ */
+int sched_can_sleep()
+{
+        if (!sched_ready)
+                return 0;
+        struct task* task = get_current_task();
+        return task != NULL && task != sched_cpu()->idle;
+}
+
+static char* sched_policy_names[] = {
+        "normal",
+        "fifo",
+        "rr",
+        "deadline",
+};
+
+static size_t sched_show_task(char* buf, struct task* task, char* state)
+{
+        return sprintf(buf, "pid %i cpu %i %s %i %s kernel %i user %i irq %i "
+                        "Kcycles\n", task->pid, task->cpu,
+                        sched_policy_names[task->policy & 3],
+                        (task->policy == SCHED_NORMAL) ? task->priority
+                                        : task->rt_priority, state,
+                        (uint32_t)(task->cpu_time[SCHED_TIME_KERNEL] >> 10),
+                        (uint32_t)(task->cpu_time[SCHED_TIME_USER] >> 10),
+                        (uint32_t)(task->cpu_time[SCHED_TIME_IRQ] >> 10));
+}
+
+/**
+ * \fn sched_show
+ * \brief Show the running and runnable tasks of every cpu, for procfs
+ *
+ * Sleeping tasks aren't on any run queue, so they don't show up.
+ */
+static size_t sched_show(char* buf, size_t size)
+{
+        size_t len = 0;
+        int cpu = 0;
+        for (; cpu < sched_cpus(); cpu++) {
+                struct sched_rq* rq = &sched_rqs[cpu];
+                int state = mutex_lock_irqsave(&rq->lock);
+                struct task* running = sched_cpu_of(cpu)->task;
+                if (running != NULL && running != sched_cpu_of(cpu)->idle &&
+                                size - len >= 0x80)
+                        len += sched_show_task(buf + len, running, "running");
+
+                struct task_list_head* lists[SCHED_PRIO_SIZE * 3 + 1];
+                int n = 0;
+                lists[n++] = &rq->dl;
+                int prio = 0;
+                for (; prio < SCHED_PRIO_SIZE; prio++) {
+                        lists[n++] = &rq->rt.queue[prio];
+                        lists[n++] = &rq->active->queue[prio];
+                        lists[n++] = &rq->expired->queue[prio];
+                }
+                int i = 0;
+                for (; i < n; i++) {
+                        struct task_head* h = lists[i]->head;
+                        for (; h != NULL && size - len >= 0x80; h = h->next)
+                                len += sched_show_task(buf + len, h->task,
+                                                "queued");
+                }
+                mutex_unlock_irqrestore(&rq->lock, state);
+        }
+        return len;
+}
+
+/**
+ * \fn sched_init
+ * \brief Set up the run queues and adopt the calling context as idle task
+ * \return A standard error code
+ *
+ * The other cpus adopt their idle task the first time they call sched.
+ */
+int sched_init()
+{
+        int cpu = 0;
+        for (; cpu < CPU_LIMIT; cpu++) {
+                sched_rq_init(&sched_rqs[cpu]);
+                sched_rqs[cpu].cpu = cpu;
+        }
+        sched_idle_task();
+        sched_cpu()->sched_start = sched_clock();
+        sched_ready = 1;
+        return proc_fs_register("sched", sched_show);
+}
+
+#ifdef SCHED_BENCH
+#define SCHED_BENCH_TASKS 10000
+#define SCHED_BENCH_RUNS 0x10000
+
+/**
+ * \fn sched_bench
+ * \brief Measure picking the next task with SCHED_BENCH_TASKS runnable
+ *
+ * Runs on a run queue of its own, with tasks that never actually run. Every
+ * picked task is charged part of its slice and put back, so epochs come and
+ * go during the run.
+ */
+void sched_bench()
+{
+        size_t size = sizeof(struct task) * SCHED_BENCH_TASKS;
+        struct sched_rq* rq = kmalloc(sizeof(*rq));
+        struct task* tasks = kmalloc(size);
+        if (rq == NULL || tasks == NULL) {
+                warning("Not enough memory for the scheduler benchmark\n");
+                if (rq != NULL)
+                        kfree(rq);
+                if (tasks != NULL)
+                        kfree_s(tasks, size);
+                return;
+        }
+        memset(tasks, 0, size);
+        sched_rq_init(rq);
+
+        int i = 0;
+        for (; i < SCHED_BENCH_TASKS; i++) {
+                tasks[i].priority = i % SCHED_PRIO_SIZE;
+                tasks[i].state = RUNNABLE;
+                sched_rq_add(rq, &tasks[i]);
+        }
+
+        uint64_t pick = 0;
+        uint64_t worst = 0;
+        for (i = 0; i < SCHED_BENCH_RUNS; i++) {
+                uint64_t start = get_cpu_tick();
+                struct task* t = sched_rq_pick(rq);
+                uint64_t spent = get_cpu_tick() - start;
+                pick += spent;
+                if (spent > worst)
+                        worst = spent;
+
+                t->time_used += SCHED_EPOCH_SIZE / 2;
+                sched_rq_add(rq, t);
+        }
+
+        printf("sched: %i tasks, %i cycles per pick, worst %i, %i epochs\n",
+                        SCHED_BENCH_TASKS,
+                        x86_div64_32(pick, SCHED_BENCH_RUNS),
+                        (uint32_t)worst, rq->epoch);
+
+        kfree_s(tasks, size);
+        kfree(rq);
+}
+#endif
+
+#ifdef SCHED_RT_TEST
+#define SCHED_RT_TEST_WAKEUPS 0x100
+
+static struct task* sched_rt_test_task;
+static volatile int sched_rt_test_done;
+
+static int sched_rt_test_wake(int16_t timer_id __attribute__((unused)),
+                time_t time __attribute__((unused)),
+                int16_t irq_id __attribute__((unused)))
+{
+        sched_enqueue(sched_rt_test_task);
+        return -E_SUCCESS;
+}
+
+/* Keeps a cpu busy with normal work until the real-time thread is done */
+static void sched_rt_test_load(void* arg __attribute__((unused)))
+{
+        while (!sched_rt_test_done)
+                ;
+}
+
+/* Sleeps until the next timer event, over and over */
+static void sched_rt_test_rt(void* arg __attribute__((unused)))
+{
+        int i = 0;
+        for (; i < SCHED_RT_TEST_WAKEUPS; i++) {
+                struct sys_timer* timer = x86_percpu_read(timer);
+                if (timer == NULL)
+                        timer = get_global_timer(X86_8259_INTERRUPT_BASE);
+
+                /* A wakeup before the switch just keeps us runnable */
+                get_current_task()->state = WAITING;
+                if (timer->subscribe(getTime(timer) + 1, 0,
+                                sched_rt_test_wake, timer) != -E_SUCCESS) {
+                        get_current_task()->state = RUNNABLE;
+                        break;
+                }
+                sched();
+        }
+        sched_rt_test_done = 1;
+}
+
+/**
+ * \fn sched_rt_test
+ * \brief Check deadline admission, and measure real-time wakeup latency
+ * \return A standard error code
+ *
+ * A FIFO thread is woken by a timer event over and over, while a normal
+ * thread keeps every cpu busy. The latency is from the wakeup in the timer
+ * interrupt to the switch to the thread.
+ */
+int sched_rt_test()
+{
+        int cpu = get_cpu();
+        struct sched_rq* rq = &sched_rqs[cpu];
+
+        /* No cpu can take two tasks that each need 60% of it */
+        static struct task dl[2];
+        memset(dl, 0, sizeof(dl));
+        dl[0].cpu = dl[1].cpu = cpu;
+        dl[0].state = dl[1].state = WAITING;
+        uint32_t bw = rq->dl_bw;
+        int first = sched_set_deadline(&dl[0], 6, 10);
+        int second = sched_set_deadline(&dl[1], 6, 10);
+        sched_set_scheduler(&dl[0], SCHED_NORMAL, SCHED_PRIO_DEFAULT);
+        sched_set_scheduler(&dl[1], SCHED_NORMAL, SCHED_PRIO_DEFAULT);
+        if (first != -E_SUCCESS || second != -E_OUT_OF_RESOURCES ||
+                        rq->dl_bw != bw) {
+                warning("deadline admission: %X, %X\n", first, second);
+                return -E_GENERIC;
+        }
+
+        sched_rt_test_done = 0;
+        sched_rt_test_task = kthread_create(sched_rt_test_rt, NULL, "rt-test");
+        if (sched_rt_test_task == NULL)
+                return -E_NOMEM;
+        kthread_bind(sched_rt_test_task, cpu);
+        sched_set_scheduler(sched_rt_test_task, SCHED_FIFO, 0);
+
+        int i = 0;
+        for (; i < sched_cpus(); i++) {
+                struct task* load = kthread_create(sched_rt_test_load, NULL,
+                                "rt-load");
+                if (load == NULL)
+                        break;
+                kthread_bind(load, i);
+                sched_enqueue(load);
+        }
+
+        int state = mutex_lock_irqsave(&rq->lock);
+        uint32_t wakeups = rq->rt_wakeups;
+        uint64_t latency = rq->rt_latency;
+        rq->rt_latency_max = 0;
+        mutex_unlock_irqrestore(&rq->lock, state);
+
+        sched_enqueue(sched_rt_test_task);
+        while (!sched_rt_test_done)
+                sched();
+
+        wakeups = rq->rt_wakeups - wakeups;
+        latency = rq->rt_latency - latency;
+        if (wakeups == 0) {
+                warning("The real-time thread never got woken\n");
+                return -E_GENERIC;
+        }
+        printf("sched: rt wakeup to run %i cycles, worst %i, %i busy cpus\n",
+                        x86_div64_32(latency, wakeups), rq->rt_latency_max,
+                        i);
+        return -E_SUCCESS;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
@@ -27,6 +27,8 @@
 #define SC_LIST_SIZE 0x100
 
 struct syscall sc_list[SC_LIST_SIZE];
+/* Every system call reads the list, writes only happen at install time */
+static seqlock_t sc_lock;
 int sc_initialised = 0;
 
 int sc_write(int file, int string, int count)
@@ -51,6 +53,8 @@ int sc_init()
         sc_initialised = 1;
         if (file_sc_init() != -E_SUCCESS)
                 panic("File calls not initialised!");
+        if (elf_sc_init() != -E_SUCCESS)
+                panic("Process calls not initialised!");
 
         return 0;
 }
@@ -64,34 +68,66 @@ int sc_install (uint16_t idx, sc call, uint8_t cpl)
                 return -E_INVALID_ARG;
         if (call == NULL)
                 return -E_NULL_PTR;
-        if (sc_list[idx].syscall != NULL)
+
+        seqlock_write_lock(&sc_lock);
+        if (sc_list[idx].syscall != NULL) {
+                seqlock_write_unlock(&sc_lock);
                 return -E_ALREADY_INITIALISED;
+        }
 
         sc_list[idx].syscall = call;
         sc_list[idx].cpl = cpl;
+        seqlock_write_unlock(&sc_lock);
         return -E_SUCCESS;
 }
 
 int sc_uninstall(uint16_t idx)
 {
-        if (idx < SC_LIST_SIZE)
+        if (idx >= SC_LIST_SIZE)
                 return -E_INVALID_ARG;
 
+        seqlock_write_lock(&sc_lock);
         sc_list[idx].cpl = 0;
         sc_list[idx].syscall = NULL;
+        seqlock_write_unlock(&sc_lock);
         return -E_SUCCESS;
 }
 
-extern int arch_syscall(int,int,int,int);
-
-int sc_call(uint16_t idx, uint8_t cpl, reg reg1, reg reg2, reg reg3)
+/**
+ * \fn sc_get
+ * \brief Take a consistent copy of a system call descriptor
+ * \param idx
+ * \param call
+ * \return -E_NULL_PTR if no call was installed at idx
+ */
+int sc_get(uint16_t idx, struct syscall* call)
 {
         if (idx >= SC_LIST_SIZE)
                 return -E_INVALID_ARG;
+        if (call == NULL)
+                return -E_NULL_PTR;
 
-        if (sc_list[idx].syscall == NULL)
+        unsigned int seq;
+        do {
+                seq = seqlock_read_begin(&sc_lock);
+                call->syscall = sc_list[idx].syscall;
+                call->cpl = sc_list[idx].cpl;
+        } while (seqlock_read_retry(&sc_lock, seq));
+
+        if (call->syscall == NULL)
                 return -E_NULL_PTR;
-        if (sc_list[idx].cpl < cpl)
+        return -E_SUCCESS;
+}
+
+extern int arch_syscall(int,int,int,int);
+
+int sc_call(uint16_t idx, uint8_t cpl, reg reg1, reg reg2, reg reg3)
+{
+        struct syscall call;
+        int ret = sc_get(idx, &call);
+        if (ret != -E_SUCCESS)
+                return ret;
+        if (call.cpl < cpl)
                 return -E_UNAUTHORISED;
 
         return arch_syscall(idx, reg1, reg2, reg3);
@@ -0,0 +1,410 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#ifdef THREAD_TEST
+#include <arch/x86/timer.h>
+#endif
+
+/**
+ * \addtogroup thread_table
+ * @{
+ *
+ * A thread id is the index of its slot. The free slots form a list through
+ * the slots themselves, so handing out and giving back an id is a matter of
+ * popping and pushing the head of that list. Thread states are aligned, so a
+ * slot with its lowest bit set can't be a thread.
+ *
+ * The runnable threads are kept packed in an array of their own. A thread
+ * knows its place in it, so it is taken out by moving the last one into its
+ * place. Going over the runnable threads never touches the others.
+ *
+ * Both arrays double in size when the ids run out. Allocating is done with
+ * the table unlocked, so adding a thread may not be done from an interrupt
+ * handler once the task has more than THREAD_TABLE_INLINE threads.
+ */
+
+#define THREAD_SLOT_FREE(next) ((((addr_t)(next)) << 1) | 1)
+#define thread_slot_is_free(slot) ((slot) & 1)
+#define thread_slot_next(slot) ((uint32_t)((slot) >> 1))
+/** The end of the free list, never a valid id */
+#define THREAD_FREE_END THREAD_TABLE_MAX
+
+/**
+ * \fn thread_table_link
+ * \brief Put the ids from start up to the size on the free list
+ *
+ * Expects the table to be locked.
+ */
+static void thread_table_link(struct thread_table* table, uint32_t start)
+{
+        uint32_t id = table->size;
+        while (id > start) {
+                id--;
+                table->slots[id] = THREAD_SLOT_FREE(table->free);
+                table->free = id;
+        }
+}
+
+/**
+ * \fn thread_table_init
+ * \brief Set up an empty table, using the inline arrays
+ * \param table
+ */
+void thread_table_init(struct thread_table* table)
+{
+        if (table == NULL)
+                return;
+        memset(table, 0, sizeof(*table));
+        table->lock = mutex_unlocked;
+        table->slots = table->inline_slots;
+        table->runnable = table->inline_runnable;
+        table->size = THREAD_TABLE_INLINE;
+        table->free = THREAD_FREE_END;
+        thread_table_link(table, 0);
+}
+
+/**
+ * \fn thread_table_free
+ * \brief Give back the arrays of a table, the threads are left alone
+ * \param table
+ */
+void thread_table_free(struct thread_table* table)
+{
+        if (table == NULL)
+                return;
+        if (table->slots != table->inline_slots)
+                kfree_s(table->slots, table->size * sizeof(*table->slots));
+        if (table->runnable != table->inline_runnable)
+                kfree_s(table->runnable,
+                                table->size * sizeof(*table->runnable));
+        thread_table_init(table);
+}
+
+/**
+ * \fn thread_table_grow
+ * \brief Double the size of a table
+ * \param table
+ * \param size
+ * \brief The size the caller found full
+ * \return A standard error code
+ *
+ * Does nothing if someone else grew the table in the mean time.
+ */
+static int thread_table_grow(struct thread_table* table, uint32_t size)
+{
+        uint32_t new_size = (size < THREAD_TABLE_MIN) ? THREAD_TABLE_MIN
+                        : size * 2;
+        if (new_size > THREAD_TABLE_MAX)
+                return -E_OUT_OF_RESOURCES;
+
+        addr_t* slots = kmalloc(new_size * sizeof(*slots));
+        struct thread_state** runnable = kmalloc(new_size * sizeof(*runnable));
+        if (slots == NULL || runnable == NULL) {
+                if (slots != NULL)
+                        kfree_s(slots, new_size * sizeof(*slots));
+                if (runnable != NULL)
+                        kfree_s(runnable, new_size * sizeof(*runnable));
+                return -E_NOMEM;
+        }
+
+        int state = mutex_lock_irqsave(&table->lock);
+        if (table->size == size) {
+                memcpy(slots, table->slots, size * sizeof(*slots));
+                memcpy(runnable, table->runnable,
+                                table->runnable_count * sizeof(*runnable));
+
+                addr_t* old_slots = table->slots;
+                struct thread_state** old_runnable = table->runnable;
+                table->slots = slots;
+                table->runnable = runnable;
+                table->size = new_size;
+                thread_table_link(table, size);
+
+                /* Give back the old arrays instead */
+                slots = (old_slots == table->inline_slots) ? NULL : old_slots;
+                runnable = (old_runnable == table->inline_runnable) ? NULL
+                                : old_runnable;
+                new_size = size;
+        }
+        mutex_unlock_irqrestore(&table->lock, state);
+
+        if (slots != NULL)
+                kfree_s(slots, new_size * sizeof(*slots));
+        if (runnable != NULL)
+                kfree_s(runnable, new_size * sizeof(*runnable));
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn thread_table_unrun
+ * \brief Take a thread out of the runnable array, with the table locked
+ */
+static void thread_table_unrun(struct thread_table* table,
+                struct thread_state* thread)
+{
+        uint32_t i = thread->run_index;
+        if (i == THREAD_NOT_RUNNABLE)
+                return;
+        struct thread_state* last = table->runnable[--table->runnable_count];
+        table->runnable[i] = last;
+        last->run_index = i;
+        thread->run_index = THREAD_NOT_RUNNABLE;
+}
+
+/**
+ * \fn thread_table_run
+ * \brief Keep the runnable array in line with the state of a thread
+ *
+ * Expects the table to be locked.
+ */
+static void thread_table_run(struct thread_table* table,
+                struct thread_state* thread)
+{
+        if (thread->state != RUNNABLE) {
+                thread_table_unrun(table, thread);
+                return;
+        }
+        if (thread->run_index != THREAD_NOT_RUNNABLE)
+                return;
+        thread->run_index = table->runnable_count;
+        table->runnable[table->runnable_count++] = thread;
+}
+
+/**
+ * \fn thread_table_owns
+ * \brief Tell whether a thread is in a table, with the table locked
+ */
+static int thread_table_owns(struct thread_table* table,
+                struct thread_state* thread)
+{
+        return thread->id < table->size &&
+                        table->slots[thread->id] == (addr_t)thread;
+}
+
+/**
+ * \fn thread_table_add
+ * \brief Give a thread an id in a table
+ * \param table
+ * \param thread
+ * \return A standard error code
+ *
+ * The id is stored in the thread. The lowest free id is not necessarily the
+ * one handed out, ids given back are reused first.
+ */
+int thread_table_add(struct thread_table* table, struct thread_state* thread)
+{
+        if (table == NULL || thread == NULL)
+                return -E_NULL_PTR;
+        if (((addr_t)thread & 1) != 0)
+                return -E_INVALID_ARG;
+
+        for (;;) {
+                int state = mutex_lock_irqsave(&table->lock);
+                uint32_t id = table->free;
+                if (id != THREAD_FREE_END) {
+                        table->free = thread_slot_next(table->slots[id]);
+                        table->slots[id] = (addr_t)thread;
+                        table->count++;
+                        thread->id = id;
+                        thread->run_index = THREAD_NOT_RUNNABLE;
+                        thread_table_run(table, thread);
+                        mutex_unlock_irqrestore(&table->lock, state);
+                        return -E_SUCCESS;
+                }
+                uint32_t size = table->size;
+                mutex_unlock_irqrestore(&table->lock, state);
+
+                int ret = thread_table_grow(table, size);
+                if (ret != -E_SUCCESS)
+                        return ret;
+        }
+}
+
+/**
+ * \fn thread_table_del
+ * \brief Take a thread out of a table, its id becomes free
+ * \param table
+ * \param thread
+ * \return A standard error code
+ */
+int thread_table_del(struct thread_table* table, struct thread_state* thread)
+{
+        if (table == NULL || thread == NULL)
+                return -E_NULL_PTR;
+
+        int state = mutex_lock_irqsave(&table->lock);
+        if (!thread_table_owns(table, thread)) {
+                mutex_unlock_irqrestore(&table->lock, state);
+                return -E_NOT_FOUND;
+        }
+        thread_table_unrun(table, thread);
+        table->slots[thread->id] = THREAD_SLOT_FREE(table->free);
+        table->free = thread->id;
+        table->count--;
+        mutex_unlock_irqrestore(&table->lock, state);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn thread_table_get
+ * \brief Find a thread by id
+ * \param table
+ * \param id
+ * \return The thread, or NULL if the id isn't in use
+ */
+struct thread_state* thread_table_get(struct thread_table* table, uint32_t id)
+{
+        if (table == NULL)
+                return NULL;
+
+        struct thread_state* thread = NULL;
+        int state = mutex_lock_irqsave(&table->lock);
+        if (id < table->size && !thread_slot_is_free(table->slots[id]))
+                thread = (struct thread_state*)table->slots[id];
+        mutex_unlock_irqrestore(&table->lock, state);
+        return thread;
+}
+
+/**
+ * \fn thread_table_set_state
+ * \brief Change the state of a thread in a table
+ * \param table
+ * \param thread
+ * \param state
+ * \return A standard error code
+ *
+ * Moves it in or out of the runnable array.
+ */
+int thread_table_set_state(struct thread_table* table,
+                struct thread_state* thread, enum task_status state)
+{
+        if (table == NULL || thread == NULL)
+                return -E_NULL_PTR;
+
+        int irq = mutex_lock_irqsave(&table->lock);
+        if (!thread_table_owns(table, thread)) {
+                mutex_unlock_irqrestore(&table->lock, irq);
+                return -E_NOT_FOUND;
+        }
+        thread->state = state;
+        thread_table_run(table, thread);
+        mutex_unlock_irqrestore(&table->lock, irq);
+        return -E_SUCCESS;
+}
+
+#ifdef THREAD_TEST
+#define THREAD_TEST_THREADS 50000
+
+/**
+ * \fn thread_table_test
+ * \brief Fill a table with THREAD_TEST_THREADS threads and take half out
+ * \return A standard error code
+ *
+ * Checks every lookup and the runnable array on the way, and reports the
+ * cycles per operation.
+ */
+int thread_table_test()
+{
+        size_t size = THREAD_TEST_THREADS * sizeof(struct thread_state);
+        struct thread_table* table = kmalloc(sizeof(*table));
+        struct thread_state* threads = kmalloc(size);
+        int ret = -E_GENERIC;
+        if (table == NULL || threads == NULL) {
+                ret = -E_NOMEM;
+                goto out;
+        }
+        memset(threads, 0, size);
+        thread_table_init(table);
+
+        /* Every third thread sleeps */
+        uint64_t start = get_cpu_tick();
+        int i = 0;
+        for (; i < THREAD_TEST_THREADS; i++) {
+                threads[i].state = (i % 3 == 0) ? WAITING : RUNNABLE;
+                if (thread_table_add(table, &threads[i]) != -E_SUCCESS)
+                        goto fail;
+        }
+        uint64_t add = get_cpu_tick() - start;
+
+        start = get_cpu_tick();
+        for (i = 0; i < THREAD_TEST_THREADS; i++) {
+                if (thread_table_get(table, threads[i].id) != &threads[i])
+                        goto fail;
+        }
+        uint64_t get = get_cpu_tick() - start;
+
+        start = get_cpu_tick();
+        for (i = 0; i < THREAD_TEST_THREADS; i += 2) {
+                if (thread_table_del(table, &threads[i]) != -E_SUCCESS)
+                        goto fail;
+        }
+        uint64_t del = get_cpu_tick() - start;
+
+        /* Of the odd ones left, a third sleeps */
+        uint32_t runnable = 0;
+        for (i = 1; i < THREAD_TEST_THREADS; i += 2)
+                runnable += (i % 3 != 0);
+        if (table->count != THREAD_TEST_THREADS / 2 ||
+                        table->runnable_count != runnable)
+                goto fail;
+        uint32_t r = 0;
+        for (; r < table->runnable_count; r++) {
+                struct thread_state* t = table->runnable[r];
+                if (t->state != RUNNABLE || t->run_index != r ||
+                                thread_table_get(table, t->id) != t)
+                        goto fail;
+        }
+
+        /* Freed ids are handed out again before the table grows */
+        uint32_t table_size = table->size;
+        for (i = 0; i < THREAD_TEST_THREADS; i += 2) {
+                if (thread_table_add(table, &threads[i]) != -E_SUCCESS)
+                        goto fail;
+        }
+        if (table->size != table_size)
+                goto fail;
+
+        debug("thread table: %X threads, add %i, get %i, del %i cycles\n",
+                        THREAD_TEST_THREADS,
+                        x86_div64_32(add, THREAD_TEST_THREADS),
+                        x86_div64_32(get, THREAD_TEST_THREADS),
+                        x86_div64_32(del, THREAD_TEST_THREADS / 2));
+        ret = -E_SUCCESS;
+        goto out;
+
+fail:
+        warning("thread table: thread %X went wrong\n", i);
+out:
+        if (table != NULL) {
+                thread_table_free(table);
+                kfree(table);
+        }
+        if (threads != NULL)
+                kfree_s(threads, size);
+        return ret;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
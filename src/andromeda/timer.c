@@ -20,6 +20,9 @@
 #include <stdio.h>
 #include <andromeda/system.h>
 #include <lib/tree.h>
+#ifdef X86
+#include <arch/x86/percpu.h>
+#endif
 
 #define FREQUENCY_DIVIDER 1000 /* Sets the timer accuracy, requires higher timer speed though */
 
@@ -32,8 +35,104 @@ struct event {
         struct event* next;
 };
 
+/**
+ * \fn timer_first_event
+ * \brief Find the time of the earliest pending event
+ * \return The time or -1 if nothing is pending
+ */
+static time_t timer_first_event(struct sys_timer* timer)
+{
+        struct tree_root* root = timer->events;
+        time_t first = -1;
+
+        mutex_lock(&root->mutex);
+        struct tree* t = root->tree;
+        while (t != NULL && t->left != NULL)
+                t = t->left;
+        if (t != NULL)
+                first = t->key;
+        mutex_unlock(&root->mutex);
+
+        return first;
+}
+
+/**
+ * \fn timer_next_event
+ * \brief Tell when a timer has to go off next
+ * \param timer
+ * \return The time of the earliest event, -1 if there is none
+ */
+time_t timer_next_event(struct sys_timer* timer)
+{
+        if (timer == NULL || timer->events == NULL)
+                return -1;
+        return timer_first_event(timer);
+}
+
+/**
+ * \fn timer_run_events
+ * \brief Call back everything that is due by the current time of the timer
+ */
+static void timer_run_events(struct sys_timer* timer, int16_t irq_no)
+{
+        time_t key;
+        while ((key = timer_first_event(timer)) >= 0 && key <= timer->time) {
+                /* Find our appropriate event */
+                struct event* event = timer->events->find(key, timer->events);
+                /* Delete the events */
+                timer->events->delete(key, timer->events);
+
+                while (event != NULL ) {
+                        if (event->time > timer->time) {
+                                timer_subscribe_event(event->time, event->id,
+                                                event->event_call_back, timer);
+                                struct event* last = event;
+                                event = event->next;
+                                kfree(last);
+                                continue;
+                        }
+
+                        event->event_call_back(event->id, timer->time, irq_no);
+
+                        struct event* last = event;
+                        event = event->next;
+                        kfree(last);
+                }
+        }
+}
+
+/**
+ * \fn timer_advance
+ * \brief Move a one shot timer forward and arm it for the next event
+ * \param timer
+ * \param now
+ * \brief The current time, as measured by the hardware
+ * \param irq_no
+ * \return A standard error code
+ *
+ * A one shot timer doesn't tick, so the time can skip ahead. Everything that
+ * became due in the mean time is called back in order.
+ */
+int timer_advance(struct sys_timer* timer, time_t now, int16_t irq_no)
+{
+        if (timer == NULL || timer->events == NULL)
+                return -E_NULL_PTR;
+
+        if (now > timer->time) {
+                seqlock_write_lock(&(timer->timer_lock));
+                timer->time = now;
+                seqlock_write_unlock(&(timer->timer_lock));
+        }
+
+        timer_run_events(timer, irq_no);
+
+        if (timer->set_next != NULL)
+                return timer->set_next(timer_first_event(timer), timer);
+        return -E_SUCCESS;
+}
+
 static int timer_callback(uint16_t irq_no, uint16_t id, uint64_t r1,
-                uint64_t r2, uint64_t r3 __attribute__((unused)),
+                uint64_t r2, uint64_t r3,
                 uint64_t r4 __attribute__((unused)),
                 void* args __attribute__((unused)))
 {
@@ -43,12 +142,11 @@ static int timer_callback(uint16_t irq_no, uint16_t id, uint64_t r1,
                 /* GLOBAL */
                 timer = get_global_timer(irq_no);
         } else {
-                /* Local CPU timer */
-                warning("CPUID is static in timer interrupt, "
-                                "change this up please!\n");
-
+                /* Local CPU timer, r1 holds the cpu it went off on */
                 timer = get_cpu_timer((int16_t) r1);
-                timer = get_cpu_timer(0);
+                /* Every cpu registers on the same vector, skip the others */
+                if (timer != NULL && timer->interrupt_id != id)
+                        return -E_SUCCESS;
         }
         if (timer == NULL) {
                 panic("Invalid timer found!");
@@ -59,43 +157,26 @@ static int timer_callback(uint16_t irq_no, uint16_t id, uint64_t r1,
                 panic("Something happened to our interrupt ID!");
         }
 
+        /* A one shot timer hands us the time, in r3 */
+        if (timer->set_next != NULL)
+                return timer_advance(timer, (time_t) r3, irq_no);
+
         /* Atomically increment the timer value */
-        mutex_lock(&(timer->timer_lock));
         time_t tick = atomic_inc(&(timer->tick));
         if (tick == (uint32_t) (timer->freq) / FREQUENCY_DIVIDER) {
+                seqlock_write_lock(&(timer->timer_lock));
                 timer->time++;
+                seqlock_write_unlock(&(timer->timer_lock));
                 atomic_sub(&(timer->tick),
                                 (uint32_t) (timer->freq) / FREQUENCY_DIVIDER);
         }
-        mutex_unlock(&(timer->timer_lock));
 
         //printf("tick: %X  \ttimer: %X\n", (int32_t)tick, timer->time);
         /* Now go do something with the available events */
         if (timer->events == NULL) {
                 warning("No events could be found due to NULL pointer\n");
         } else {
-                /* Find our appropriate event */
-                struct event* event = timer->events->find(timer->time,
-                                timer->events);
-                /* Delete the events */
-                timer->events->delete(timer->time, timer->events);
-
-                while (event != NULL ) {
-                        if (event->time != timer->time) {
-                                timer_subscribe_event(event->time, event->id,
-                                                event->event_call_back, timer);
-                                struct event* last = event;
-                                event = event->next;
-                                kfree(last);
-                                continue;
-                        }
-
-                        event->event_call_back(event->id, timer->time, irq_no);
-
-                        struct event* last = event;
-                        event = event->next;
-                        kfree(last);
-                }
+                timer_run_events(timer, irq_no);
         }
 
         return -E_SUCCESS;
@@ -148,6 +229,21 @@ static int timer_subscribe_event(time_t time, uint16_t id, handler call_back,
         return -E_SUCCESS;
 }
 
+/**
+ * \fn timer_subscribe_one_shot
+ * \brief Subscribe, and bring the interrupt forward if the event is earlier
+ */
+static int timer_subscribe_one_shot(time_t time, uint16_t id,
+                handler call_back, struct sys_timer* timer)
+{
+        int ret = timer_subscribe_event(time, id, call_back, timer);
+        if (ret != -E_SUCCESS)
+                return ret;
+        if (timer->set_next != NULL && (timer->next < 0 || time < timer->next))
+                return timer->set_next(time, timer);
+        return -E_SUCCESS;
+}
+
 #ifdef TIMER_DBG
 
 #define DEBUG_TIMER_INTERVAL 500
@@ -201,6 +297,7 @@ static struct sys_timer* init_timer(time_t freq, int32_t interrupt_id)
         timer->set_freq = timer_set_freq_dummy;
         timer->subscribe = timer_subscribe_event;
         timer->interrupt_id = interrupt_id;
+        timer->next = -1;
 
         return timer;
 }
@@ -245,6 +342,8 @@ int cpu_timer_init(int cpuid, time_t freq, int16_t irq_no)
         }
 
         struct sys_timer* timer = init_timer(freq, id);
+        /* The set_next call is filled in by the architecture */
+        timer->subscribe = timer_subscribe_one_shot;
 
         cpu->pic->timers = timer;
 
@@ -252,7 +351,7 @@ int cpu_timer_init(int cpuid, time_t freq, int16_t irq_no)
         local_timer_initialised = 1;
 #endif
 
-        return -E_NOFUNCTION;
+        return -E_SUCCESS;
 }
 
 struct sys_timer* get_global_timer(int16_t irq_no)
@@ -276,6 +375,14 @@ struct sys_timer* get_global_timer(int16_t irq_no)
 
 struct sys_timer* get_cpu_timer(int16_t cpu)
 {
+#ifdef X86
+        /* Asking for our own timer is the common case */
+        if (cpu == x86_percpu_read(cpu)) {
+                struct sys_timer* timer = x86_percpu_read(timer);
+                if (timer != NULL)
+                        return timer;
+        }
+#endif
         struct sys_cpu* c = getcpu(cpu);
 
         if (c->pic == NULL) {
@@ -0,0 +1,268 @@
+/*
+ *  Andromeda
+ *  Copyright (C) 2015  Bart Kuivenhoven
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <thread.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+
+/**
+ * \addtogroup wait
+ * @{
+ *
+ * Wait queues let a task sleep until some condition holds.
+ *
+ * The condition is checked with the queue lock held, and wakers update their
+ * state before they take that same lock to wake the queue, so a wake up can't
+ * get lost between the check and going to sleep. The lock is taken with
+ * interrupts disabled, as interrupt handlers are typical wakers.
+ *
+ * A sleeping task is marked WAITING or IO_WAITING and leaves the run queue
+ * until it is woken, so its cpu can run something else. Without a timeout
+ * nothing would put a sleeping task back in time, so it keeps yielding until
+ * it's woken or out of time. The idle task can't sleep, it halts the cpu
+ * until an interrupt comes in instead of spinning.
+ */
+
+void wait_queue_init(struct wait_queue* wq)
+{
+        if (wq == NULL)
+                return;
+        wq->lock = mutex_unlocked;
+        wq->head = NULL;
+        wq->tail = NULL;
+}
+
+/* Both of these expect the queue lock to be held */
+static void wait_enqueue(struct wait_queue* wq, struct wait_entry* e)
+{
+        e->next = NULL;
+        if (wq->tail == NULL)
+                wq->head = e;
+        else
+                wq->tail->next = e;
+        wq->tail = e;
+}
+
+static void wait_dequeue(struct wait_queue* wq, struct wait_entry* e)
+{
+        struct wait_entry* prev = NULL;
+        struct wait_entry* i = wq->head;
+        for (; i != NULL; prev = i, i = i->next) {
+                if (i != e)
+                        continue;
+                if (prev == NULL)
+                        wq->head = i->next;
+                else
+                        prev->next = i->next;
+                if (wq->tail == i)
+                        wq->tail = prev;
+                return;
+        }
+}
+
+/**
+ * \fn wait_block
+ * \brief Sleep until the entry is woken or the deadline passes
+ * \return -E_TIMEOUT if the deadline passed first
+ */
+static int wait_block(struct wait_entry* e, struct sys_timer* timer,
+                time_t deadline)
+{
+        int sleep = sched_can_sleep();
+        while (!e->woken) {
+                if (timer != NULL && getTime(timer) >= deadline)
+                        return -E_TIMEOUT;
+
+                if (sleep) {
+                        /*
+                         * Off the run queue until woken, or just yield if
+                         * there's a deadline to keep an eye on.
+                         */
+                        if (timer != NULL)
+                                e->task->state = RUNNABLE;
+                        sched();
+                        continue;
+                }
+
+                int state = cpu_disable_interrupts(0);
+                if (e->woken) {
+                        if (state)
+                                cpu_enable_interrupts(0);
+                        break;
+                }
+                if (!state)
+                        /* Only another cpu can wake us now */
+                        continue;
+#ifdef X86
+                /*
+                 * sti only takes effect after the next instruction, so no
+                 * interrupt can come in between the check and the hlt.
+                 */
+                asm volatile ("sti\n\thlt" ::: "memory");
+#else
+                cpu_enable_interrupts(0);
+#endif
+        }
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn wait_wake_task
+ * \brief Make a woken task runnable again
+ */
+static void wait_wake_task(struct task* task)
+{
+        if (task == NULL)
+                return;
+        if (sched_enqueue(task) != -E_SUCCESS)
+                task->state = RUNNABLE;
+}
+
+/**
+ * \fn wait_queue_sleep_timeout
+ * \brief Sleep until a condition holds, or the timer passes a deadline
+ * \param wq
+ * \param cond
+ * \brief Returns non-zero once the wait is over, called with the queue locked
+ * \param arg
+ * \param io
+ * \brief Non-zero if waiting on a device, for the task state
+ * \param timer
+ * \brief The clock to measure the time out with, NULL to wait forever
+ * \param timeout
+ * \brief Number of ticks of timer to wait at most
+ * \return -E_SUCCESS when the condition holds, or -E_TIMEOUT
+ */
+int wait_queue_sleep_timeout(struct wait_queue* wq, int (*cond)(void* arg),
+                void* arg, int io, struct sys_timer* timer, time_t timeout)
+{
+        if (wq == NULL || cond == NULL)
+                return -E_NULL_PTR;
+
+        time_t deadline = 0;
+        if (timer != NULL)
+                deadline = getTime(timer) + timeout;
+
+        struct task* task = get_current_task();
+        struct wait_entry e;
+        e.task = task;
+
+        while (1) {
+                int state = mutex_lock_irqsave(&wq->lock);
+                if (cond(arg)) {
+                        mutex_unlock_irqrestore(&wq->lock, state);
+                        break;
+                }
+                e.woken = 0;
+                wait_enqueue(wq, &e);
+                if (task != NULL)
+                        task->state = (io) ? IO_WAITING : WAITING;
+                mutex_unlock_irqrestore(&wq->lock, state);
+
+                int ret = wait_block(&e, timer, deadline);
+
+                state = mutex_lock_irqsave(&wq->lock);
+                if (!e.woken)
+                        wait_dequeue(wq, &e);
+                if (task != NULL)
+                        task->state = RUNNABLE;
+                mutex_unlock_irqrestore(&wq->lock, state);
+
+                if (ret == -E_TIMEOUT)
+                        return ret;
+        }
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn wait_queue_sleep
+ * \brief Sleep until a condition holds
+ * \param wq
+ * \param cond
+ * \param arg
+ * \param io
+ * \return A standard error code
+ */
+int wait_queue_sleep(struct wait_queue* wq, int (*cond)(void* arg), void* arg,
+                int io)
+{
+        return wait_queue_sleep_timeout(wq, cond, arg, io, NULL, 0);
+}
+
+/**
+ * \fn wait_queue_wake
+ * \brief Wake up the task that has been waiting the longest
+ * \param wq
+ * \return The number of tasks woken
+ */
+int wait_queue_wake(struct wait_queue* wq)
+{
+        if (wq == NULL)
+                return 0;
+
+        int state = mutex_lock_irqsave(&wq->lock);
+        struct wait_entry* e = wq->head;
+        if (e == NULL) {
+                mutex_unlock_irqrestore(&wq->lock, state);
+                return 0;
+        }
+        wq->head = e->next;
+        if (wq->head == NULL)
+                wq->tail = NULL;
+        wait_wake_task(e->task);
+        /* The entry may be gone the moment the sleeper sees this */
+        e->woken = 1;
+        mutex_unlock_irqrestore(&wq->lock, state);
+
+        return 1;
+}
+
+/**
+ * \fn wait_queue_wake_all
+ * \brief Wake up every task on the queue
+ * \param wq
+ * \return The number of tasks woken
+ */
+int wait_queue_wake_all(struct wait_queue* wq)
+{
+        if (wq == NULL)
+                return 0;
+
+        int woken = 0;
+        int state = mutex_lock_irqsave(&wq->lock);
+        struct wait_entry* e = wq->head;
+        wq->head = NULL;
+        wq->tail = NULL;
+        while (e != NULL) {
+                struct wait_entry* next = e->next;
+                wait_wake_task(e->task);
+                e->woken = 1;
+                e = next;
+                woken++;
+        }
+        mutex_unlock_irqrestore(&wq->lock, state);
+
+        return woken;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -0,0 +1,248 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/kthread.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <andromeda/workqueue.h>
+#include <mm/vm.h>
+#ifdef X86
+#include <arch/x86/atomic.h>
+#include <arch/x86/smp.h>
+#endif
+
+/**
+ * \addtogroup workqueue
+ * @{
+ *
+ * Every cpu runs a worker thread with a FIFO of work. An interrupt handler
+ * queues whatever takes long, like processing packets or calling back the
+ * waiter of a finished transfer, and returns right away. The worker of the
+ * same cpu picks it up once the interrupt is done, with the caches still
+ * warm.
+ *
+ * The queues are locked with interrupts disabled, as interrupt handlers are
+ * the main users. The work itself runs with interrupts enabled and may
+ * sleep.
+ */
+
+#ifdef X86
+#define work_cpus() smp_cpus()
+#define work_claim(w) (x86_atomic_cmpxchg(&(w)->pending, 0, 1) == 0)
+#else
+#define work_cpus() 1
+static int work_claim(struct work* w)
+{
+        int state = cpu_disable_interrupts(0);
+        int claimed = !w->pending;
+        w->pending = 1;
+        if (state)
+                cpu_enable_interrupts(0);
+        return claimed;
+}
+#endif
+
+/**
+ * \struct worker
+ * \brief The worker thread of a cpu and its queue
+ * \var idle
+ * \brief Set while the worker sleeps, so it needs to be woken
+ */
+struct worker {
+        spinlock_t lock;
+        struct work* head;
+        struct work* tail;
+        struct task* task;
+        int idle;
+        uint32_t done;
+} __attribute__((aligned(64)));
+
+static struct worker workers[CPU_LIMIT];
+static volatile int workers_ready = 0;
+
+void work_init(struct work* work, work_func_t fn)
+{
+        if (work == NULL)
+                return;
+        work->fn = fn;
+        work->next = NULL;
+        work->pending = 0;
+}
+
+/**
+ * \fn worker_main
+ * \brief The loop of a worker thread
+ */
+static void worker_main(void* arg)
+{
+        struct worker* w = arg;
+        for (;;) {
+                int state = mutex_lock_irqsave(&w->lock);
+                struct work* work = w->head;
+                if (work == NULL) {
+                        /* work_queue_on wakes us once the lock is free */
+                        w->idle = 1;
+                        w->task->state = WAITING;
+                        mutex_unlock_irqrestore(&w->lock, state);
+                        sched();
+                        continue;
+                }
+                w->head = work->next;
+                if (w->head == NULL)
+                        w->tail = NULL;
+                mutex_unlock_irqrestore(&w->lock, state);
+
+                /* Cleared first, so the work may queue itself again */
+                work->pending = 0;
+                work->fn(work);
+                w->done++;
+        }
+}
+
+/**
+ * \fn work_queue_on
+ * \brief Have the worker of a cpu do something
+ * \param cpu
+ * \param work
+ * \return A standard error code
+ *
+ * Work that is still pending isn't queued a second time, it only runs once.
+ * Safe to call from interrupt handlers.
+ */
+int work_queue_on(int cpu, struct work* work)
+{
+        if (work == NULL || work->fn == NULL)
+                return -E_NULL_PTR;
+        if (!workers_ready)
+                return -E_NOT_YET_INITIALISED;
+        if (cpu < 0 || cpu >= work_cpus() || workers[cpu].task == NULL)
+                return -E_INVALID_ARG;
+        if (!work_claim(work))
+                return -E_SUCCESS;
+
+        struct worker* w = &workers[cpu];
+        int state = mutex_lock_irqsave(&w->lock);
+        work->next = NULL;
+        if (w->tail == NULL)
+                w->head = work;
+        else
+                w->tail->next = work;
+        w->tail = work;
+        int wake = w->idle;
+        w->idle = 0;
+        mutex_unlock_irqrestore(&w->lock, state);
+
+        if (wake)
+                sched_enqueue(w->task);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn work_queue
+ * \brief Have the worker of the calling cpu do something
+ * \param work
+ * \return A standard error code
+ */
+int work_queue(struct work* work)
+{
+        return work_queue_on(get_cpu(), work);
+}
+
+/**
+ * \fn workqueue_init
+ * \brief Start a worker thread on every cpu
+ * \return A standard error code
+ *
+ * Has to run after sched_init, and after the other cpus are up.
+ */
+int workqueue_init()
+{
+        if (workers_ready)
+                return -E_ALREADY_INITIALISED;
+
+        int cpu = 0;
+        for (; cpu < work_cpus(); cpu++) {
+                struct worker* w = &workers[cpu];
+                memset(w, 0, sizeof(*w));
+                w->lock = mutex_unlocked;
+
+                w->task = kthread_create(worker_main, w, "worker");
+                if (w->task == NULL)
+                        return -E_NOMEM;
+                kthread_bind(w->task, cpu);
+                sched_enqueue(w->task);
+        }
+
+        workers_ready = 1;
+        return -E_SUCCESS;
+}
+
+#ifdef WORK_TEST
+#define WORK_TEST_ITEMS 0x40
+
+struct work_test {
+        struct work work;
+        int cpu;
+        volatile int done;
+};
+
+static void work_test_fn(struct work* work)
+{
+        struct work_test* t = (struct work_test*)work;
+        t->cpu = get_cpu();
+        t->done = 1;
+}
+
+/**
+ * \fn workqueue_test
+ * \brief Hand work to every worker and check it all ran on the right cpu
+ * \return A standard error code
+ */
+int workqueue_test()
+{
+        struct work_test items[WORK_TEST_ITEMS];
+        int i = 0;
+        for (; i < WORK_TEST_ITEMS; i++) {
+                work_init(&items[i].work, work_test_fn);
+                items[i].cpu = -1;
+                items[i].done = 0;
+                int ret = work_queue_on(i % work_cpus(), &items[i].work);
+                if (ret != -E_SUCCESS)
+                        return ret;
+        }
+
+        for (i = 0; i < WORK_TEST_ITEMS; i++) {
+                while (!items[i].done)
+                        sched();
+                if (items[i].cpu != i % work_cpus()) {
+                        warning("work %X ran on cpu %X\n", i, items[i].cpu);
+                        return -E_GENERIC;
+                }
+        }
+
+        debug("workqueue: %X items done\n", WORK_TEST_ITEMS);
+        return -E_SUCCESS;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
@@ -62,59 +62,3 @@ writeCR3:
         pop eax
 
         return
-
-[GLOBAL mutex_lock]
-mutex_lock:
-        enter
-
-        push eax
-        push ebx
-
-        mov eax, 1
-        mov ebx, [ebp+8]
-.spin:
-	mfence
-        xchg [ebx], eax
-	mfence
-        test eax, eax
-        jnz .spin
-
-        pop ebx
-        pop eax
-
-        return
-
-[GLOBAL mutex_test] ; // Return 0 if mutex was unlocked, 1 if locked
-mutex_test:
-        enter
-
-        push ebx
-
-        mov eax, 1
-        mov ebx, [ebp+8]
-	mfence
-        xchg [ebx], eax
-	mfence
-
-        pop ebx
-
-        return
-
-
-[GLOBAL mutex_unlock]
-mutex_unlock:
-        enter
-
-        push eax
-        push ebx
-
-        xor eax, eax
-        mov ebx, [ebp+8]
-	mfence
-        mov [ebx], eax
-
-        pop ebx
-        pop eax
-
-        return
-
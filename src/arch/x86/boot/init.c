@@ -44,6 +44,7 @@
 #include <sys/dev/pci.h>
 #include <sys/sys.h>
 
+#include <arch/x86/acct.h>
 #include <arch/x86/cpu.h>
 #include <arch/x86/mp.h>
 #include <arch/x86/idt.h>
@@ -53,6 +54,8 @@
 #include <arch/x86/system.h>
 #include <arch/x86/pte.h>
 #include <arch/x86/bios.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/smp.h>
 
 #include <interrupts/int.h>
 
@@ -65,6 +68,7 @@
 #include <andromeda/error.h>
 #include <andromeda/system.h>
 #include <andromeda/syscall.h>
+#include <andromeda/workqueue.h>
 #include <mm/page_alloc.h>
 
 #include <lib/byteorder.h>
@@ -96,6 +100,10 @@ int system_x86_mmu_init(struct sys_cpu* cpu)
 
         cpu->mmu->get_phys = x86_pte_get_phys;
         cpu->mmu->reset_page = x86_pte_unset_page;
+        cpu->mmu->reset_page_lazy = x86_pte_unset_page_lazy;
+        cpu->mmu->flush = x86_pte_flush;
+        cpu->mmu->test_accessed = x86_pte_test_accessed;
+        cpu->mmu->test_dirty = x86_pte_test_dirty;
         cpu->mmu->set_page = x86_pte_set_page;
         cpu->mmu->set_range = x86_pte_load_range;
         cpu->mmu->reset_range = x86_pte_unload_range;
@@ -108,15 +116,9 @@ int system_x86_cpu_init(int cpuid)
 {
         if (getcpu(cpuid) != NULL)
                 panic("Something went wrong in CPU initialisation!");
-        /**
-         * \todo  Detetct availability of CPU.
-         */
-        if (cpuid != 0) {
-                /**
-                 * \todo If CPU present, return CPUQ
-                 */
+        /* The other cpus are only known once smp_init has found them */
+        if (cpuid != 0 && !smp_cpu_present(cpuid))
                 return -E_SUCCESS;
-        }
         struct sys_cpu* cpu = kmalloc(sizeof(*cpu));
         if (cpu == NULL)
                 panic("Out of memory!");
@@ -143,17 +145,13 @@ static void init_pic()
         if (is_available) {
                 struct x86_gen_regs registers;
                 x86_cpuid(1, &registers);
-                if (registers.edx && (1 << 8)) {
-                        /* An APIC is present */
-                        /** \todo Initialise the Local APIC */
-                        /** \todo Initialise the IO APIC */
-                        debug("An APIC system was found!!!\n");
-                        warning("No APIC code available. "
-                                        "Still to be implemented\n");
-
-                        warning("Enabling 8259 PIC instead :(\n");
+                if (registers.edx & X86_CPUID_EDX_APIC) {
+                        /*
+                         * The APICs take over once smp_init and ioapic_init
+                         * have run, the PIC and PIT are needed until then.
+                         */
+                        debug("An APIC system was found\n");
                         pic_8259_init();
-                        /** \todo Start other CPU cores here */
                         return;
 
                 } else {
@@ -233,6 +231,17 @@ int init(unsigned long magic, multiboot_info_t* hdr)
 
         cpu_enable_interrupts(0);
 
+        /* Needs the timer interrupt to time the start up sequence */
+        smp_init();
+        ioapic_init();
+        if (lapic_timer_init() != -E_SUCCESS)
+                debug("No per cpu timers, only the PIT is ticking\n");
+        sched_init();
+        if (x86_acct_init() != -E_SUCCESS)
+                warning("Cpu time and scheduler trace not in procfs\n");
+        if (workqueue_init() != -E_SUCCESS)
+                panic("Couldn't start the worker threads");
+
         sys_setup_fs();
         sys_setup_modules();
         sys_setup_devices();
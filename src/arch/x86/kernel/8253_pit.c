@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <andromeda/system.h>
+#include <arch/x86/timer.h>
 
 #define X86_8253_PIT_BASE               1193182
 
@@ -45,22 +46,106 @@
 #define X86_8253_PIT_COMMAND_ACCESS_LO          (1 << 4)
 #define X86_8253_PIT_COMMAND_ACCESS_HI          (1 << 5)
 
-int x86_pit_8253_init(int irq_no, time_t freq)
-{
-        int16_t divider = (int32_t)X86_8253_PIT_BASE / (int32_t)freq;
+/* Read back the status of channel 0, without latching the count */
+#define X86_8254_PIT_READBACK_STATUS_0          0xE2
+#define X86_8254_PIT_STATUS_OUT                 (1 << 7)
 
+#define X86_8253_PIT_PER_MS     (X86_8253_PIT_BASE / 1000)
+
+/*
+ * When every cpu is idle, the PIT can be put in one shot mode to skip the
+ * ticks up to the next event. Only the boot cpu touches it, with interrupts
+ * disabled.
+ */
+static uint16_t pit_divider = 0;
+static uint32_t pit_one_shot = 0;
+
+static void pit_program(uint8_t mode, uint16_t count)
+{
         uint8_t command = X86_8253_PIT_COMMAND_ACCESS_HI;
         command |= X86_8253_PIT_COMMAND_ACCESS_LO;
-        command |= X86_8253_PIT_COMMAND_MODE_SQUARE_1;
+        command |= mode;
         outb(X86_8253_PIT_COMMAND_PORT, command);
 
-        uint8_t low = (uint8_t)(divider & 0xFF);
-        uint8_t high = (uint8_t)(divider >> 8);
+        outb(X86_8253_PIT_CHANNEL_0, (uint8_t)(count & 0xFF));
+        outb(X86_8253_PIT_CHANNEL_0, (uint8_t)(count >> 8));
+}
 
-        outb(X86_8253_PIT_CHANNEL_0, low);
-        outb(X86_8253_PIT_CHANNEL_0, high);
+int x86_pit_8253_init(int irq_no, time_t freq)
+{
+        pit_divider = (int32_t)X86_8253_PIT_BASE / (int32_t)freq;
+        pit_program(X86_8253_PIT_COMMAND_MODE_SQUARE_1, pit_divider);
 
         andromeda_timer_init(freq, irq_no);
 
         return -E_SUCCESS;
 }
+
+/**
+ * \fn x86_pit_one_shot
+ * \brief Stop ticking, and interrupt once after a number of milliseconds
+ * \param ms
+ * \brief Capped at X86_PIT_ONE_SHOT_MAX
+ * \return A standard error code
+ */
+int x86_pit_one_shot(time_t ms)
+{
+        if (pit_divider == 0)
+                return -E_NOT_YET_INITIALISED;
+        if (ms < 0 || ms > X86_PIT_ONE_SHOT_MAX)
+                ms = X86_PIT_ONE_SHOT_MAX;
+        if (ms < 2)
+                /* Not worth the trouble */
+                return -E_INVALID_ARG;
+
+        pit_one_shot = ms * X86_8253_PIT_PER_MS;
+        pit_program(X86_8253_PIT_COMMAND_MODE_CNT_DOWN, pit_one_shot);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn x86_pit_one_shot_fired
+ * \brief Go back to ticking from the PIT interrupt
+ * \return The milliseconds the one shot covered, 0 if it was a normal tick
+ */
+time_t x86_pit_one_shot_fired()
+{
+        if (pit_one_shot == 0)
+                return 0;
+        time_t ms = pit_one_shot / X86_8253_PIT_PER_MS;
+        pit_one_shot = 0;
+        pit_program(X86_8253_PIT_COMMAND_MODE_SQUARE_1, pit_divider);
+        return ms;
+}
+
+/**
+ * \fn x86_pit_one_shot_cancel
+ * \brief Go back to ticking before the one shot went off
+ * \return The milliseconds that passed and still have to be accounted for
+ *
+ * If the one shot went off but its interrupt is still pending, that
+ * interrupt accounts for the last millisecond as a normal tick.
+ */
+time_t x86_pit_one_shot_cancel()
+{
+        if (pit_one_shot == 0)
+                return 0;
+
+        uint32_t passed = pit_one_shot;
+        outb(X86_8253_PIT_COMMAND_PORT, X86_8254_PIT_READBACK_STATUS_0);
+        if (inb(X86_8253_PIT_CHANNEL_0) & X86_8254_PIT_STATUS_OUT) {
+                passed -= X86_8253_PIT_PER_MS;
+        } else {
+                /* Latch the count, so both halves belong together */
+                outb(X86_8253_PIT_COMMAND_PORT,
+                                X86_8253_PIT_COMMAND_CHANNEL_0);
+                uint16_t left = inb(X86_8253_PIT_CHANNEL_0);
+                left |= (uint16_t)inb(X86_8253_PIT_CHANNEL_0) << 8;
+                passed = (left < passed) ? passed - left : 0;
+        }
+        pit_one_shot = 0;
+        pit_program(X86_8253_PIT_COMMAND_MODE_SQUARE_1, pit_divider);
+
+        /* Round, the periodic mode starts counting afresh */
+        return (passed + X86_8253_PIT_PER_MS / 2) / X86_8253_PIT_PER_MS;
+}
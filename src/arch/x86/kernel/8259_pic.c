@@ -23,6 +23,7 @@
 #include <andromeda/error.h>
 #include <andromeda/system.h>
 
+#include <arch/x86/apic.h>
 #include <arch/x86/pic.h>
 #include <arch/x86/irq.h>
 
@@ -80,6 +81,9 @@ void pic_8259_eoi(uint8_t irq)
 
 int pic_8259_set_irq_mask(uint8_t irq)
 {
+        if (ioapic_enabled())
+                return ioapic_mask(ioapic_isa_gsi(irq, NULL), 1);
+
         uint16_t port = (irq < 8) ? X86_8259_PIC1_DATA : X86_8259_PIC2_DATA;
         uint16_t mask = inb(port);
         iowait();
@@ -91,6 +95,9 @@ int pic_8259_set_irq_mask(uint8_t irq)
 
 int pic_8259_clear_irq_mask(uint8_t irq)
 {
+        if (ioapic_enabled())
+                return ioapic_mask(ioapic_isa_gsi(irq, NULL), 0);
+
         uint16_t port = (irq < 8) ? X86_8259_PIC1_DATA : X86_8259_PIC2_DATA;
         uint8_t mask = inb(port) & ~(BIT((irq < 8) ? irq : (irq - 8)));
         iowait();
@@ -144,5 +151,6 @@ void pic_8259_init()
         core.arch->pic = pic;
 
 
-        x86_pit_8253_init(X86_8259_INTERRUPT_BASE, 2000);
+        /* Only the global clock runs off the PIT, one tick per ms is enough */
+        x86_pit_8253_init(X86_8259_INTERRUPT_BASE, 1000);
 }
@@ -0,0 +1,233 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <arch/x86/acct.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/timer.h>
+#include <fs/procfs.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_acct
+ * @{
+ *
+ * Every cpu charges the TSC cycles between two accounting points to what it
+ * was doing: kernel, user or interrupt time of the running task. Time of the
+ * idle task counts as idle time of the cpu. The points are the task switches
+ * and entering or leaving an interrupt handler or system call, so nothing is
+ * sampled and short bursts are counted as well as long ones.
+ *
+ * Next to that, every cpu records its scheduler events in a ring, which
+ * overwrites the oldest events. Both show up in procfs, as cputime and
+ * schedtrace.
+ *
+ * Everything here runs with interrupts disabled, and only touches the state
+ * of the calling cpu.
+ */
+
+/**
+ * \struct x86_trace_ring
+ * \brief The most recent events of a cpu
+ * \var head
+ * \brief Count of events ever recorded, the next goes at head modulo size
+ */
+struct x86_trace_ring {
+        struct x86_trace_event events[X86_TRACE_SIZE];
+        uint32_t head;
+} __attribute__((aligned(X86_CACHE_LINE)));
+
+static struct x86_trace_ring x86_trace_rings[CPU_LIMIT];
+
+static char* x86_trace_names[] = {
+        "switch-out",
+        "switch-in",
+        "wakeup",
+        "migrate",
+};
+
+/**
+ * \fn x86_acct_charge
+ * \brief Charge the cycles since the last accounting point
+ * \param p
+ * \param task
+ * \brief The task the cycles were spent on
+ */
+static void x86_acct_charge(struct x86_percpu* p, struct task* task)
+{
+        uint64_t now = get_cpu_tick();
+        uint64_t last = p->acct_tick;
+        p->acct_tick = now;
+        /* Nothing to charge the time before the first point to */
+        if (last == 0 || now < last)
+                return;
+
+        uint64_t spent = now - last;
+        int mode = p->acct_mode;
+        if (task == NULL || task == p->idle) {
+                if (mode == SCHED_TIME_KERNEL)
+                        mode = SCHED_TIME_IDLE;
+                p->acct[mode] += spent;
+                return;
+        }
+        p->acct[mode] += spent;
+        task->cpu_time[mode] += spent;
+}
+
+/**
+ * \fn x86_acct_enter
+ * \brief Start charging the calling cpu for something else
+ * \param mode
+ * \brief A SCHED_TIME value
+ * \return The mode before, to hand to x86_acct_exit
+ */
+int x86_acct_enter(int mode)
+{
+        struct x86_percpu* p = x86_percpu_this();
+        x86_acct_charge(p, p->task);
+        int prev = p->acct_mode;
+        p->acct_mode = mode;
+        return prev;
+}
+
+/**
+ * \fn x86_acct_exit
+ * \brief Go back to charging what was charged before x86_acct_enter
+ * \param mode
+ */
+void x86_acct_exit(int mode)
+{
+        x86_acct_enter(mode);
+}
+
+/**
+ * \fn x86_trace
+ * \brief Record a scheduler event on the calling cpu
+ * \param type
+ * \param task
+ * \param arg
+ */
+void x86_trace(int type, struct task* task, uint32_t arg)
+{
+        int cpu = get_cpu();
+        struct x86_trace_ring* r = &x86_trace_rings[cpu];
+        struct x86_trace_event* e = &r->events[r->head % X86_TRACE_SIZE];
+        e->tick = get_cpu_tick();
+        e->pid = (task == NULL) ? 0 : task->pid;
+        e->type = type;
+        e->cpu = cpu;
+        e->arg = arg;
+        r->head++;
+}
+
+/**
+ * \fn x86_acct_switch
+ * \brief Account a task switch, right before it happens
+ * \param prev
+ * \param next
+ *
+ * A task picks up in the mode it was switched out in.
+ */
+void x86_acct_switch(struct task* prev, struct task* next)
+{
+        struct x86_percpu* p = x86_percpu_this();
+        x86_acct_charge(p, prev);
+        if (prev != NULL) {
+                prev->time_mode = p->acct_mode;
+                x86_trace(X86_TRACE_SWITCH_OUT, prev, prev->state);
+        }
+        p->acct_mode = next->time_mode;
+        x86_trace(X86_TRACE_SWITCH_IN, next, 0);
+}
+
+/**
+ * \fn x86_acct_show
+ * \brief Show the time of every cpu, for procfs
+ */
+static size_t x86_acct_show(char* buf, size_t size)
+{
+        size_t len = 0;
+        int cpu = 0;
+        for (; cpu < smp_cpus() && size - len >= 0x80; cpu++) {
+                struct x86_percpu* p = &x86_percpu[cpu];
+                len += sprintf(buf + len, "cpu %i: user %i kernel %i "
+                                "irq %i idle %i Mcycles\n", cpu,
+                                (uint32_t)(p->acct[SCHED_TIME_USER] >> 20),
+                                (uint32_t)(p->acct[SCHED_TIME_KERNEL] >> 20),
+                                (uint32_t)(p->acct[SCHED_TIME_IRQ] >> 20),
+                                (uint32_t)(p->acct[SCHED_TIME_IDLE] >> 20));
+        }
+        return len;
+}
+
+/**
+ * \fn x86_trace_show
+ * \brief Show the events of every cpu, oldest first, for procfs
+ *
+ * The rings aren't locked, an event recorded while they're shown may show up
+ * halfway written.
+ */
+static size_t x86_trace_show(char* buf, size_t size)
+{
+        size_t len = 0;
+        int cpu = 0;
+        for (; cpu < smp_cpus(); cpu++) {
+                struct x86_trace_ring* r = &x86_trace_rings[cpu];
+                uint32_t head = r->head;
+                uint32_t i = (head > X86_TRACE_SIZE) ? head - X86_TRACE_SIZE
+                                : 0;
+                for (; i < head; i++) {
+                        if (size - len < 0x80)
+                                return len;
+                        struct x86_trace_event* e =
+                                        &r->events[i % X86_TRACE_SIZE];
+                        if (e->type > X86_TRACE_MIGRATE)
+                                continue;
+                        len += sprintf(buf + len,
+                                        "%08X%08X cpu %i %s pid %i %X\n",
+                                        (uint32_t)(e->tick >> 32),
+                                        (uint32_t)e->tick, e->cpu,
+                                        x86_trace_names[e->type],
+                                        e->pid, e->arg);
+                }
+        }
+        return len;
+}
+
+/**
+ * \fn x86_acct_init
+ * \brief Make the accounting and the trace show up in procfs
+ * \return A standard error code
+ */
+int x86_acct_init()
+{
+        int ret = proc_fs_register("cputime", x86_acct_show);
+        if (ret != -E_SUCCESS)
+                return ret;
+        return proc_fs_register("schedtrace", x86_trace_show);
+}
+
+/**
+ * @}
+ * \file
+ */
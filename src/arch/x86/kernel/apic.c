@@ -0,0 +1,129 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <mm/page_alloc.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_apic
+ * @{
+ *
+ * Every cpu has its own local APIC, but they all show up at the same physical
+ * address. The page is mapped once and each cpu talks to its own unit
+ * through that mapping.
+ */
+
+static volatile uint32_t* lapic = NULL;
+
+uint32_t lapic_read(uint32_t reg)
+{
+        return lapic[reg >> 2];
+}
+
+void lapic_write(uint32_t reg, uint32_t val)
+{
+        lapic[reg >> 2] = val;
+}
+
+int lapic_available()
+{
+        return lapic != NULL;
+}
+
+/**
+ * \fn lapic_init
+ * \brief Enable the local APIC of the calling cpu
+ * \param base
+ * \brief Physical address of the registers, 0 for the default
+ * \return A standard error code
+ *
+ * The boot cpu maps the registers, the others only have to switch their unit
+ * on.
+ */
+int lapic_init(addr_t base)
+{
+        if (lapic == NULL) {
+                if (base == 0)
+                        base = LAPIC_DEFAULT_BASE;
+                void* regs = vmap((void*)base, PAGE_SIZE);
+                if (regs == NULL)
+                        return -E_NOMEM;
+                lapic = regs;
+        }
+
+        /* Accept every priority and software enable the unit */
+        lapic_write(LAPIC_TPR, 0);
+        lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+        /* The error status register has to be written before reading it */
+        lapic_write(LAPIC_ESR, 0);
+        lapic_read(LAPIC_ESR);
+
+        return -E_SUCCESS;
+}
+
+uint8_t lapic_id()
+{
+        return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi()
+{
+        lapic_write(LAPIC_EOI, 0);
+}
+
+/**
+ * \fn lapic_send_ipi
+ * \brief Send an inter processor interrupt and wait for it to be accepted
+ * \param apic_id
+ * \param icr
+ * \brief Delivery mode, vector and shorthand bits for the low ICR word
+ * \return -E_TIMEOUT if the interrupt wasn't delivered
+ */
+int lapic_send_ipi(uint8_t apic_id, uint32_t icr)
+{
+        if (lapic == NULL)
+                return -E_NOT_YET_INITIALISED;
+
+        /* An interrupt in between the two writes could clobber the high word */
+        int state = disableInterrupts();
+        lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+        lapic_write(LAPIC_ICR_LOW, icr);
+
+        int ret = -E_SUCCESS;
+        int i = 0;
+        while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+                if (++i > LAPIC_IPI_TIMEOUT) {
+                        ret = -E_TIMEOUT;
+                        break;
+                }
+                x86_pause();
+        }
+        if (state)
+                enableInterrupts();
+        return ret;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
 #include <andromeda/system.h>
 #include <andromeda/sched.h>
 
@@ -84,9 +85,50 @@ void x86_cpu_init(ol_cpu_t cpu)
         cpus = cpu;
         // cpu_num = cpu_get_num();
         cpu->unlock(&cpu_lock);
+
+        if (x86_sse_init() == -E_SUCCESS) {
+                mem_enable_sse2();
+                x86_fpu_init();
+        }
         return;
 }
 
+/**
+ * \fn x86_sse_init
+ * \brief Turn on SSE, if the cpu has both SSE and SSE2
+ * \return -E_NOFUNCTION if SSE2 isn't supported
+ *
+ * The fpu and xmm registers are switched lazily from then on, see
+ * x86_fpu_switch.
+ */
+int x86_sse_init()
+{
+        if (!x86_eflags_test(X86_FLAGS_CPUID_TEST_BIT))
+                return -E_NOFUNCTION;
+
+        struct x86_gen_regs regs;
+        x86_cpuid(1, &regs);
+        uint32_t needed = X86_CPUID_EDX_FXSR | X86_CPUID_EDX_SSE
+                        | X86_CPUID_EDX_SSE2;
+        if ((regs.edx & needed) != needed)
+                return -E_NOFUNCTION;
+
+        uint32_t cr;
+        __asm__ __volatile__("mov %%cr0, %0" : "=r" (cr));
+        cr &= ~X86_CR0_EM;
+        cr |= X86_CR0_MP;
+        __asm__ __volatile__("mov %0, %%cr0" : : "r" (cr));
+
+        __asm__ __volatile__("mov %%cr4, %0" : "=r" (cr));
+        cr |= X86_CR4_OSFXSR | X86_CR4_OSXMMEXCPT;
+        __asm__ __volatile__("mov %0, %%cr4" : : "r" (cr));
+
+#ifdef __CPU_DBG
+        printf("SSE2 enabled\n");
+#endif
+        return -E_SUCCESS;
+}
+
 static void __cpuid(volatile struct x86_gen_regs* regs)
 {
         __asm__ __volatile__("movl (%4), %%eax \n\t"
@@ -17,7 +17,225 @@
  */
 
 #include <stdlib.h>
-
+#include <andromeda/error.h>
 #include <arch/x86/mp.h>
+#include <mm/paging.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_mp
+ * @{
+ *
+ * The MP floating pointer structure is found by scanning the places the MP
+ * specification allows it to be in. It points to the configuration table,
+ * which lists the processors, I/O APICs and interrupt assignments.
+ */
 
 static const uint8_t table_len[] = { 0x14, 0x8, 0x8, 0x8, 0x8 };
+
+struct mp_info mp_info;
+
+#define MP_BDA_EBDA_SEG 0x40E
+#define MP_BDA_BASE_MEM 0x413
+#define MP_BIOS_ROM 0xF0000
+#define MP_BIOS_ROM_SIZE 0x10000
+
+/* The first MiB is also mapped at three GiB */
+#define MP_LOW(a) ((void*)((addr_t)(a) + THREE_GIB))
+
+static int mp_checksum(void* table, size_t len)
+{
+        uint8_t sum = 0;
+        uint8_t* p = table;
+        size_t i = 0;
+        for (; i < len; i++)
+                sum += p[i];
+        return sum;
+}
+
+/**
+ * \fn mp_scan
+ * \brief Look for the floating pointer structure in a range of low memory
+ * \return The structure (through its virtual address) or NULL
+ */
+static struct mp_fp_header* mp_scan(addr_t base, size_t len)
+{
+        addr_t p = base;
+        for (; p + sizeof(struct mp_fp_header) <= base + len; p += 0x10) {
+                struct mp_fp_header* fp = MP_LOW(p);
+                if (fp->signature != MP_FP_SIGNATURE)
+                        continue;
+                if (fp->length == 0 || mp_checksum(fp, fp->length * 0x10))
+                        continue;
+                return fp;
+        }
+        return NULL;
+}
+
+static struct mp_fp_header* mp_find()
+{
+        struct mp_fp_header* fp;
+
+        addr_t ebda = *(uint16_t*)MP_LOW(MP_BDA_EBDA_SEG);
+        ebda <<= 4;
+        if (ebda != 0 && (fp = mp_scan(ebda, 0x400)) != NULL)
+                return fp;
+
+        addr_t base_mem = *(uint16_t*)MP_LOW(MP_BDA_BASE_MEM);
+        base_mem *= 0x400;
+        if (base_mem == 0 || base_mem > 0xA0000)
+                base_mem = 0xA0000;
+        if ((fp = mp_scan(base_mem - 0x400, 0x400)) != NULL)
+                return fp;
+
+        return mp_scan(MP_BIOS_ROM, MP_BIOS_ROM_SIZE);
+}
+
+/* Slot 0 belongs to the boot cpu, wherever it shows up in the table */
+static int mp_bsp_found = 0;
+
+static void mp_add_proc(MP_PROC_ENTRY* proc)
+{
+        if (!(proc->flags & MP_PROC_ENABLED))
+                return;
+        if (proc->flags & MP_PROC_BSP) {
+                mp_info.apic_id[0] = proc->id;
+                if (!mp_bsp_found)
+                        mp_info.cpus++;
+                mp_bsp_found = 1;
+                return;
+        }
+
+        int slot = mp_info.cpus + (mp_bsp_found ? 0 : 1);
+        if (slot >= CPU_LIMIT) {
+                warning("More cpus than CPU_LIMIT, ignoring apic %X\n",
+                                proc->id);
+                return;
+        }
+        mp_info.apic_id[slot] = proc->id;
+        mp_info.cpus++;
+}
+
+/**
+ * \fn mp_parse_table
+ * \brief Collect the processors and interrupt routing from the tables
+ * \param table
+ */
+void mp_parse_table(struct mp_fp_header* table)
+{
+        mp_info.imcr = table->imcrp & MP_FP_IMCRP;
+        mp_info.isa_bus = -1;
+
+        if (table->config_type != 0 || table->mp_header == NULL) {
+                /* One of the default configurations, always two cpus */
+                mp_info.isa_bus = 0;
+                mp_info.cpus = 2;
+                mp_info.apic_id[0] = 0;
+                mp_info.apic_id[1] = 1;
+                mp_info.lapic = MP_DEFAULT_LAPIC;
+                mp_info.ioapics = 1;
+                mp_info.ioapic[0].id = 2;
+                mp_info.ioapic[0].flags = MP_IOAPIC_ENABLED;
+                mp_info.ioapic[0].addr = MP_DEFAULT_IOAPIC;
+                return;
+        }
+
+        addr_t phys = (addr_t)table->mp_header;
+        int mapped = 0;
+        struct mp_config_header* hdr = MP_LOW(phys);
+        if (phys + MP_CONFIG_HEADER_SIZE > SIZE_MEG) {
+                hdr = vmap((void*)phys, MP_CONFIG_HEADER_SIZE);
+                if (hdr == NULL)
+                        return;
+                mapped = 1;
+        }
+        if (hdr->signature != MP_CONFIG_SIGNATURE) {
+                warning("Invalid MP configuration table\n");
+                goto out;
+        }
+        if (phys + hdr->length > SIZE_MEG) {
+                size_t len = hdr->length;
+                if (mapped)
+                        vunmap(hdr);
+                hdr = vmap((void*)phys, len);
+                if (hdr == NULL)
+                        return;
+                mapped = 1;
+        }
+        if (mp_checksum(hdr, hdr->length) != 0) {
+                warning("MP configuration table checksum mismatch\n");
+                goto out;
+        }
+
+        mp_info.lapic = hdr->lapic;
+
+        uint8_t* entry = (uint8_t*)hdr + MP_CONFIG_HEADER_SIZE;
+        uint8_t* end = (uint8_t*)hdr + hdr->length;
+        int i = 0;
+        for (; i < hdr->entries && entry < end; i++) {
+                if (*entry > MP_ENTRY_LOCAL_INT) {
+                        warning("Unknown MP table entry %X\n", *entry);
+                        break;
+                }
+                switch (*entry) {
+                case MP_ENTRY_PROC:
+                        mp_add_proc((MP_PROC_ENTRY*)entry);
+                        break;
+                case MP_ENTRY_BUS:
+                        if (memcmp(((struct mp_bus_entry*)entry)->bus_type,
+                                        "ISA", 3) == 0)
+                                mp_info.isa_bus = entry[1];
+                        break;
+                case MP_ENTRY_IOAPIC:
+                        if (mp_info.ioapics >= MP_IOAPIC_LIMIT)
+                                break;
+                        memcpy(&mp_info.ioapic[mp_info.ioapics++], entry,
+                                        sizeof(struct mp_ioapic_entry));
+                        break;
+                case MP_ENTRY_IO_INT:
+                        if (mp_info.io_ints >= MP_IO_INT_LIMIT)
+                                break;
+                        memcpy(&mp_info.io_int[mp_info.io_ints++], entry,
+                                        sizeof(struct mp_io_int_entry));
+                        break;
+                }
+                entry += table_len[*entry];
+        }
+        if (!mp_bsp_found && mp_info.cpus != 0) {
+                /* No entry was flagged as the boot cpu, fill its slot */
+                warning("MP table doesn't name the boot cpu\n");
+                mp_info.apic_id[0] = mp_info.apic_id[mp_info.cpus];
+        }
+
+out:
+        if (mapped)
+                vunmap(hdr);
+}
+
+/**
+ * \fn mp_init
+ * \brief Find and parse the MP tables
+ * \return -E_NOTFOUND if this isn't an MP system
+ */
+int mp_init()
+{
+        if (mp_info.cpus != 0)
+                return -E_ALREADY_INITIALISED;
+
+        struct mp_fp_header* fp = mp_find();
+        if (fp == NULL)
+                return -E_NOTFOUND;
+
+        mp_parse_table(fp);
+        if (mp_info.cpus == 0)
+                return -E_NOTFOUND;
+
+        debug("MP tables: %i cpus, %i I/O APICs\n", mp_info.cpus,
+                        mp_info.ioapics);
+        return -E_SUCCESS;
+}
+
+/**
+ * @}
+ * \file
+ */
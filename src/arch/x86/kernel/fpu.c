@@ -0,0 +1,196 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/percpu.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_fpu
+ * @{
+ *
+ * The x87 and SSE registers are only handed over when a thread actually
+ * uses them. A switch to a thread whose state isn't in the registers sets
+ * CR0.TS, so its first floating point or SSE instruction traps (#NM). Only
+ * then is its state restored with fxrstor, and TS cleared again. Threads
+ * that never touch the fpu never pay for it.
+ *
+ * The state is saved when its owner is switched out, as the thread may run
+ * on another cpu next. The registers keep holding it though, so a thread
+ * that comes back to the same cpu with nobody else having used the fpu in
+ * the mean time gets TS cleared right away.
+ *
+ * TS is only ever clear while the running thread owns the registers. The
+ * memory copies clear it for the duration of an SSE chunk and put it back.
+ */
+
+/* The last 48 bytes of the area are free for software, keep the kmalloc
+ * pointer there */
+#define X86_FPU_ALLOC_OFFSET 508
+/* Defaults set by fninit and a reset of MXCSR */
+#define X86_FPU_FCW 0x037F
+#define X86_FPU_MXCSR 0x1F80
+
+static int fpu_lazy = 0;
+
+static inline uint32_t x86_cr0_read()
+{
+        uint32_t cr0;
+        __asm__ __volatile__ ("mov %%cr0, %0" : "=r" (cr0));
+        return cr0;
+}
+
+static inline void x86_fpu_stts(uint32_t cr0)
+{
+        __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (cr0 | X86_CR0_TS)
+                        : "memory");
+}
+
+static inline void x86_fpu_clts()
+{
+        __asm__ __volatile__ ("clts" ::: "memory");
+}
+
+static inline void x86_fxsave(void* area)
+{
+        __asm__ __volatile__ ("fxsave (%0)" : : "r" (area) : "memory");
+}
+
+static inline void x86_fxrstor(void* area)
+{
+        __asm__ __volatile__ ("fxrstor (%0)" : : "r" (area) : "memory");
+}
+
+/**
+ * \fn x86_fpu_init
+ * \brief Start switching the fpu lazily, once SSE is known to work
+ * \return A standard error code
+ */
+int x86_fpu_init()
+{
+        fpu_lazy = 1;
+        return -E_SUCCESS;
+}
+
+int x86_fpu_enabled()
+{
+        return fpu_lazy;
+}
+
+/**
+ * \fn x86_fpu_switch
+ * \brief Hand the fpu over on a context switch
+ * \param prev
+ * \param next
+ *
+ * Called with interrupts disabled, before the stacks are swapped.
+ */
+void x86_fpu_switch(struct thread_state* prev, struct thread_state* next)
+{
+        if (!fpu_lazy || next == NULL)
+                return;
+
+        uint32_t cr0 = x86_cr0_read();
+        struct thread_state* owner = x86_percpu_read(fpu_owner);
+        if (!(cr0 & X86_CR0_TS) && owner == prev && prev != NULL)
+                x86_fxsave(prev->fpu);
+
+        if (owner == next && next->fpu_cpu == get_cpu()) {
+                if (cr0 & X86_CR0_TS)
+                        x86_fpu_clts();
+        } else if (!(cr0 & X86_CR0_TS)) {
+                x86_fpu_stts(cr0);
+        }
+}
+
+/**
+ * \fn x86_fpu_trap
+ * \brief Give the running thread the fpu, called on #NM
+ * \return -E_SUCCESS if the instruction can be retried
+ *
+ * A thread that uses the fpu for the first time gets its save area here,
+ * filled with the state the registers have after a reset.
+ */
+int x86_fpu_trap()
+{
+        if (!fpu_lazy)
+                return -E_NOFUNCTION;
+        struct task* task = get_current_task();
+        if (task == NULL || task->current_thread == NULL)
+                return -E_NULL_PTR;
+        struct thread_state* t = task->current_thread;
+
+        if (t->fpu == NULL) {
+                char* alloc = kmalloc(X86_FPU_AREA + X86_FPU_ALIGN);
+                if (alloc == NULL)
+                        return -E_NOMEM;
+                char* area = (char*)(((addr_t)alloc + X86_FPU_ALIGN - 1)
+                                & ~(X86_FPU_ALIGN - 1));
+                memset(area, 0, X86_FPU_AREA);
+                *(uint16_t*)area = X86_FPU_FCW;
+                *(uint32_t*)(area + 24) = X86_FPU_MXCSR;
+                *(char**)(area + X86_FPU_ALLOC_OFFSET) = alloc;
+                t->fpu = area;
+        }
+
+        x86_fpu_clts();
+        x86_fxrstor(t->fpu);
+        x86_percpu_write(fpu_owner, t);
+        t->fpu_cpu = get_cpu();
+        x86_percpu_inc(fpu_traps);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn x86_fpu_release
+ * \brief Forget the fpu state of a thread that is going away
+ * \param thread
+ *
+ * No cpu may think the thread owns its registers afterwards, or a new thread
+ * at the same address could end up with them.
+ */
+void x86_fpu_release(struct thread_state* thread)
+{
+        if (thread == NULL)
+                return;
+
+        int cpu = 0;
+        for (; cpu < CPU_LIMIT; cpu++)
+                x86_atomic_cmpxchg((volatile uint32_t*)
+                                &x86_percpu[cpu].fpu_owner,
+                                (uint32_t)thread, 0);
+
+        if (thread->fpu != NULL) {
+                char* alloc = *(char**)((char*)thread->fpu
+                                + X86_FPU_ALLOC_OFFSET);
+                kfree_s(alloc, X86_FPU_AREA + X86_FPU_ALIGN);
+                thread->fpu = NULL;
+        }
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -0,0 +1,148 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/idle.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/timer.h>
+
+/**
+ * \addtogroup x86_idle
+ * @{
+ *
+ * An idle cpu halts until the next interrupt. The local APIC timers are one
+ * shot already, so that's the next event of the cpu. The PIT keeps the global
+ * time though, and ticks every millisecond on the boot cpu.
+ *
+ * Once every cpu is idle, the boot cpu puts the PIT in one shot mode up to the
+ * next global event instead, and accounts for the skipped ticks when it wakes
+ * up. A cpu that wakes up in the mean time kicks the boot cpu, so the clock
+ * ticks again whenever anything runs.
+ */
+
+static volatile uint32_t idle_cpus = 0;
+static volatile int idle_tickless = 0;
+
+/**
+ * \fn idle_tickless_enter
+ * \brief Stop the PIT ticks up to the next global event, if every cpu idles
+ * \return Non-zero if the PIT is in one shot mode now
+ */
+static int idle_tickless_enter()
+{
+        struct sys_timer* pit = get_global_timer(X86_8259_INTERRUPT_BASE);
+        if (pit == NULL)
+                return 0;
+
+        /* Announce first, a cpu waking up after the count will kick us */
+        idle_tickless = 1;
+        if (x86_atomic_xadd(&idle_cpus, 0) != (uint32_t)smp_cpus()) {
+                idle_tickless = 0;
+                return 0;
+        }
+
+        time_t next = timer_next_event(pit);
+        time_t ms = (next < 0) ? -1 : next - getTime(pit);
+        if (x86_pit_one_shot(ms) != -E_SUCCESS) {
+                idle_tickless = 0;
+                return 0;
+        }
+        return 1;
+}
+
+static void idle_tickless_exit()
+{
+        time_t ms = x86_pit_one_shot_cancel();
+        if (ms > 0) {
+                struct sys_timer* pit = get_global_timer(
+                                X86_8259_INTERRUPT_BASE);
+                timer_advance(pit, getTime(pit) + ms,
+                                X86_8259_INTERRUPT_BASE);
+        }
+        idle_tickless = 0;
+}
+
+/**
+ * \fn x86_idle
+ * \brief Halt the calling cpu until there's something to do
+ * \param wake
+ * \brief Tells whether the caller has work waiting as well, may be NULL
+ * \param arg
+ * \brief Passed on to wake
+ *
+ * Returns right away if the scheduler or wake already has something waiting.
+ * Both are checked with interrupts off, so the interrupt announcing new work
+ * can't slip in between the check and the halt. The interrupt that wakes the
+ * cpu doesn't switch tasks itself, the caller is expected to call sched once
+ * this returns.
+ */
+void x86_idle(int (*wake)(void*), void* arg)
+{
+        struct x86_percpu* p = x86_percpu_this();
+        int cpu = p->cpu;
+
+        disableInterrupts();
+        if (p->need_resched || (wake != NULL && wake(arg))) {
+                enableInterrupts();
+                return;
+        }
+
+        x86_atomic_xadd(&idle_cpus, 1);
+        int tickless = (cpu == 0) ? idle_tickless_enter() : 0;
+
+        uint64_t start = get_cpu_tick();
+        p->idle_halted = 1;
+        /* No interrupt can sneak in between the sti and the hlt */
+        asm volatile ("sti\n\thlt\n\tcli" ::: "memory");
+        p->idle_halted = 0;
+        p->idle_cycles += get_cpu_tick() - start;
+        p->idle_wakeups++;
+
+        if (tickless)
+                idle_tickless_exit();
+        x86_atomic_xadd(&idle_cpus, (uint32_t)-1);
+        if (cpu != 0 && idle_tickless)
+                smp_wake(0);
+
+        enableInterrupts();
+}
+
+uint64_t x86_idle_cycles(int cpu)
+{
+        if (cpu < 0 || cpu >= CPU_LIMIT)
+                return 0;
+        return x86_percpu[cpu].idle_cycles;
+}
+
+uint32_t x86_idle_wakeups(int cpu)
+{
+        if (cpu < 0 || cpu >= CPU_LIMIT)
+                return 0;
+        return x86_percpu[cpu].idle_wakeups;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -50,7 +50,8 @@ static void install_exceptions(struct idt* idt)
         x86_idt_install_entry(17, (uint32_t) alligned, 0x08, 0x8E, idt);
         x86_idt_install_entry(18, (uint32_t) machine, 0x08, 0x8E, idt);
         x86_idt_install_entry(19, (uint32_t) simd, 0x08, 0x8E, idt);
-        x86_idt_install_entry(INT_SYSCALL, (uint32_t) asm_syscall, 0x08, 0x8E,
+        /* Ring 3 has to be able to make system calls */
+        x86_idt_install_entry(INT_SYSCALL, (uint32_t) asm_syscall, 0x08, 0xEE,
                         idt);
 }
 
@@ -131,6 +132,26 @@ void setIDT()
         installIDT(idt);
 }
 
+/**
+ * \fn x86_idt_set_gate
+ * \brief Point a vector in the active IDT to an interrupt handler
+ * \param num
+ * \param isr
+ * \return A standard error code
+ */
+int x86_idt_set_gate(uint16_t num, void (*isr)())
+{
+        struct idt* idt = (struct idt*)get_idt();
+        if (idt == NULL || idt->baseptr == NULL || isr == NULL)
+                return -E_NULL_PTR;
+        if ((num + 1) * sizeof(struct idt_entry) > (size_t)idt->limit + 1)
+                return -E_INVALID_ARG;
+
+        x86_idt_install_entry(num, (uint32_t)isr, 0x08,
+                        IDT_PRESENT_BIT | IDT_INTERRUPT_GATE, idt);
+        return -E_SUCCESS;
+}
+
 #if 0
 void dump_idt()
 {
@@ -0,0 +1,301 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <io.h>
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/irq_balance.h>
+#include <arch/x86/mp.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+#include <mm/page_alloc.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_apic
+ * @{
+ *
+ * Once the I/O APICs are set up, the 8259 PICs are masked and the ISA
+ * interrupts come in through the redirection tables instead, on the same
+ * vectors as before. Every pin is numbered globally (GSI), with the pins of
+ * the first I/O APIC coming first.
+ *
+ * The end of interrupt then goes to the local APIC, which is a single MMIO
+ * write instead of port I/O to one or both PICs.
+ */
+
+#define IMCR_SELECT 0x22
+#define IMCR_DATA 0x23
+#define IMCR_APIC 0x01
+
+struct ioapic {
+        volatile uint32_t* regs;
+        uint8_t id;
+        uint32_t gsi_base;
+        int pins;
+};
+
+static struct ioapic ioapic[MP_IOAPIC_LIMIT];
+static int ioapics = 0;
+static int ioapic_active = 0;
+static spinlock_t ioapic_lock = mutex_unlocked;
+
+/* Both expect the lock to be held, as the select register is shared */
+static uint32_t ioapic_read(struct ioapic* io, uint8_t reg)
+{
+        io->regs[IOAPIC_REGSEL >> 2] = reg;
+        return io->regs[IOAPIC_WIN >> 2];
+}
+
+static void ioapic_write(struct ioapic* io, uint8_t reg, uint32_t val)
+{
+        io->regs[IOAPIC_REGSEL >> 2] = reg;
+        io->regs[IOAPIC_WIN >> 2] = val;
+}
+
+static struct ioapic* ioapic_find(uint32_t gsi)
+{
+        int i = 0;
+        for (; i < ioapics; i++) {
+                if (gsi >= ioapic[i].gsi_base &&
+                                gsi < ioapic[i].gsi_base + ioapic[i].pins)
+                        return &ioapic[i];
+        }
+        return NULL;
+}
+
+int ioapic_enabled()
+{
+        return ioapic_active;
+}
+
+/**
+ * \fn ioapic_route
+ * \brief Program a redirection entry
+ * \param gsi
+ * \param vector
+ * \param cpu
+ * \brief Logical id of the cpu to deliver to
+ * \param flags
+ * \brief IOAPIC_RED_LEVEL, IOAPIC_RED_LOW and IOAPIC_RED_MASKED
+ * \return A standard error code
+ */
+int ioapic_route(uint32_t gsi, uint8_t vector, int cpu, uint32_t flags)
+{
+        struct ioapic* io = ioapic_find(gsi);
+        if (io == NULL)
+                return -E_INVALID_ARG;
+        int apic_id = smp_apic_id(cpu);
+        if (apic_id < 0)
+                return -E_INVALID_ARG;
+
+        uint8_t pin = gsi - io->gsi_base;
+        flags &= IOAPIC_RED_LEVEL | IOAPIC_RED_LOW | IOAPIC_RED_MASKED;
+
+        int state = mutex_lock_irqsave(&ioapic_lock);
+        /* Mask while the destination and vector are out of sync */
+        ioapic_write(io, IOAPIC_REDTBL(pin), IOAPIC_RED_MASKED);
+        ioapic_write(io, IOAPIC_REDTBL(pin) + 1, (uint32_t)apic_id << 24);
+        ioapic_write(io, IOAPIC_REDTBL(pin), flags | vector);
+        mutex_unlock_irqrestore(&ioapic_lock, state);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn ioapic_mask
+ * \brief Mask or unmask a pin
+ * \param gsi
+ * \param masked
+ * \return A standard error code
+ */
+int ioapic_mask(uint32_t gsi, int masked)
+{
+        struct ioapic* io = ioapic_find(gsi);
+        if (io == NULL)
+                return -E_INVALID_ARG;
+        uint8_t pin = gsi - io->gsi_base;
+
+        int state = mutex_lock_irqsave(&ioapic_lock);
+        uint32_t red = ioapic_read(io, IOAPIC_REDTBL(pin));
+        if (masked)
+                red |= IOAPIC_RED_MASKED;
+        else
+                red &= ~IOAPIC_RED_MASKED;
+        ioapic_write(io, IOAPIC_REDTBL(pin), red);
+        mutex_unlock_irqrestore(&ioapic_lock, state);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn ioapic_retarget
+ * \brief Move a pin to another cpu, the retarget call for the balancer
+ */
+static int ioapic_retarget(struct irq_route* route, int cpu)
+{
+        uint32_t gsi = (uint32_t)route->data;
+        struct ioapic* io = ioapic_find(gsi);
+        if (io == NULL)
+                return -E_INVALID_ARG;
+        int apic_id = smp_apic_id(cpu);
+        if (apic_id < 0)
+                return -E_INVALID_ARG;
+
+        int state = mutex_lock_irqsave(&ioapic_lock);
+        ioapic_write(io, IOAPIC_REDTBL(gsi - io->gsi_base) + 1,
+                        (uint32_t)apic_id << 24);
+        mutex_unlock_irqrestore(&ioapic_lock, state);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn ioapic_isa_gsi
+ * \brief Find the pin an ISA interrupt is wired to
+ * \param irq
+ * \param flags
+ * \brief Filled in with the polarity and trigger mode of the pin
+ * \return The GSI or an error code
+ */
+int ioapic_isa_gsi(uint8_t irq, uint32_t* flags)
+{
+        if (flags != NULL)
+                *flags = 0;
+
+        int i = 0;
+        for (; i < mp_info.io_ints; i++) {
+                struct mp_io_int_entry* e = &mp_info.io_int[i];
+                if (e->int_type != MP_INT_VECTORED ||
+                                e->src_bus != mp_info.isa_bus ||
+                                e->src_irq != irq)
+                        continue;
+
+                /* ISA defaults to edge triggered, active high */
+                if (flags != NULL) {
+                        if ((e->flags & MP_INT_POLARITY_MASK) ==
+                                        MP_INT_POLARITY_LOW)
+                                *flags |= IOAPIC_RED_LOW;
+                        if ((e->flags & MP_INT_TRIGGER_MASK) ==
+                                        MP_INT_TRIGGER_LEVEL)
+                                *flags |= IOAPIC_RED_LEVEL;
+                }
+
+                int j = 0;
+                for (; j < ioapics; j++) {
+                        /* 0xFF means all of them, take the first */
+                        if (e->dst_ioapic == 0xFF ||
+                                        e->dst_ioapic == ioapic[j].id)
+                                return ioapic[j].gsi_base + e->dst_pin;
+                }
+                return -E_NOTFOUND;
+        }
+
+        /* Nothing listed, assume the identity wiring of the first I/O APIC */
+        if (mp_info.io_ints == 0 && ioapics > 0 && irq < ioapic[0].pins)
+                return irq;
+        return -E_NOTFOUND;
+}
+
+/**
+ * \fn ioapic_init
+ * \brief Take over the ISA interrupts from the 8259 PICs
+ * \return A standard error code
+ *
+ * Has to be called after smp_init, which found the I/O APICs and enabled the
+ * local APIC of the boot cpu. All ISA interrupts start out on cpu 0.
+ */
+int ioapic_init()
+{
+        if (ioapic_active)
+                return -E_ALREADY_INITIALISED;
+        if (!lapic_available() || mp_info.ioapics == 0)
+                return -E_NOTFOUND;
+
+        uint32_t gsi = 0;
+        int i = 0;
+        for (; i < mp_info.ioapics; i++) {
+                struct mp_ioapic_entry* e = &mp_info.ioapic[i];
+                if (!(e->flags & MP_IOAPIC_ENABLED))
+                        continue;
+                void* regs = vmap((void*)(addr_t)e->addr, PAGE_SIZE);
+                if (regs == NULL)
+                        return -E_NOMEM;
+
+                struct ioapic* io = &ioapic[ioapics];
+                io->regs = regs;
+                io->id = e->id;
+                io->gsi_base = gsi;
+                io->pins = IOAPIC_VERSION_PINS(ioapic_read(io,
+                                IOAPIC_VERSION));
+                gsi += io->pins;
+                ioapics++;
+
+                int pin = 0;
+                for (; pin < io->pins; pin++)
+                        ioapic_write(io, IOAPIC_REDTBL(pin),
+                                        IOAPIC_RED_MASKED);
+        }
+        if (ioapics == 0)
+                return -E_NOTFOUND;
+
+        int state = disableInterrupts();
+        /* Whatever the PICs had masked stays masked */
+        uint16_t masked = inb(X86_8259_PIC1_DATA);
+        masked |= inb(X86_8259_PIC2_DATA) << 8;
+        pic_8259_disable();
+        if (mp_info.imcr) {
+                /* Connect the interrupt lines to the APICs */
+                outb(IMCR_SELECT, 0x70);
+                outb(IMCR_DATA, inb(IMCR_DATA) | IMCR_APIC);
+        }
+
+        uint8_t irq = 0;
+        for (; irq < MAX_ISA_IRQ_NUM; irq++) {
+                uint32_t flags;
+                int line = ioapic_isa_gsi(irq, &flags);
+                /* The cascade line doesn't exist without the PICs */
+                if (line < 0 || irq == 2)
+                        continue;
+                uint8_t vector = X86_8259_INTERRUPT_BASE + irq;
+                if (masked & BIT(irq))
+                        flags |= IOAPIC_RED_MASKED;
+                if (ioapic_route(line, vector, 0, flags) != -E_SUCCESS)
+                        continue;
+                irq_route_register(vector, 0, ioapic_retarget,
+                                (void*)line);
+        }
+        /* The PIT drives the global clock, it stays on the boot cpu */
+        irq_set_affinity(X86_8259_INTERRUPT_BASE, 1);
+
+        ioapic_active = 1;
+        if (state)
+                enableInterrupts();
+
+        debug("%i I/O APIC pins now handle the ISA interrupts\n", gsi);
+        return -E_SUCCESS;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -280,6 +280,9 @@ irqStub:
 	mov ebp, esp
 	mov eax, [ebp+32]
 
+	; ds in the low half, gs in the high half
+	mov dx, gs
+	shl edx, 16
 	mov dx, ds
 	push edx
 	mov dx, 0x10	; kernel ring
@@ -287,7 +290,9 @@ irqStub:
 	mov ds, dx
 	mov es, dx
 	mov fs, dx
+	mov dx, 0x28	; per cpu area, see percpu.h
 	mov gs, dx
+	cld	; the C code expects the direction flag clear
 
 	push esp
 
@@ -298,7 +303,8 @@ irqStub:
 	pop edx
 	mov ds, dx
 	mov es, dx
-	mov gs, dx
+	mov fs, dx
+	shr edx, 16
 	mov gs, dx
 
 	popad
@@ -312,7 +318,8 @@ irqStub:
 gen_irq_stub:
         cli
         pushad
-        xor edx, edx
+        mov dx, gs
+        shl edx, 16
         mov dx, ds
         push edx
 
@@ -320,7 +327,9 @@ gen_irq_stub:
         mov ds, dx
         mov es, dx
         mov fs, dx
+        mov dx, 0x28
         mov gs, dx
+        cld             ; the C code expects the direction flag clear
 
 
         call label
@@ -336,6 +345,7 @@ gen_irq_stub:
         mov ds, dx
         mov es, dx
         mov fs, dx
+        shr edx, 16
         mov gs, dx
         sti
         popad
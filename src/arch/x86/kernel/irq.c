@@ -20,10 +20,14 @@
 #include <text.h>
 #include <stdlib.h>
 
+#include <arch/x86/apic.h>
 #include <arch/x86/idt.h>
 #include <arch/x86/interrupts.h>
 #include <arch/x86/irq.h>
+#include <arch/x86/irq_balance.h>
+#include <arch/x86/percpu.h>
 #include <arch/x86/pic.h>
+#include <arch/x86/timer.h>
 
 #include <interrupts/int.h>
 
@@ -31,6 +35,7 @@
 #include <sys/dev/ps2.h>
 #include <sys/dev/pci.h>
 
+#include <andromeda/sched.h>
 #include <andromeda/system.h>
 
 #if !defined __PIE__ && !defined __PIC__
@@ -44,11 +49,43 @@ bool isSleeping = FALSE;
 struct irq_data irq_data[MAX_IRQ_NUM];
 uint32_t irqs[IRQ_BASE];
 
+/**
+ * \fn irq_eoi
+ * \brief Acknowledge an ISA interrupt to whichever controller delivered it
+ * \param irq
+ */
+static void irq_eoi(uint8_t irq)
+{
+        x86_percpu_inc(interrupts);
+        if (ioapic_enabled()) {
+                irq_route_account(X86_8259_INTERRUPT_BASE + irq);
+                lapic_eoi();
+        } else {
+                pic_8259_eoi(irq);
+        }
+}
+
 void cIRQ0(irq_stack_t* regs)
 {
+        /* Account for the ticks skipped by a tickless idle, the last one
+         * is this tick */
+        time_t skipped = x86_pit_one_shot_fired();
+        if (skipped > 1) {
+                struct sys_timer* pit = get_global_timer(
+                                X86_8259_INTERRUPT_BASE);
+                timer_advance(pit, getTime(pit) + skipped - 1,
+                                X86_8259_INTERRUPT_BASE);
+        }
         do_interrupt(X86_8259_INTERRUPT_BASE, 0, 1, 0, 0);
-        pic_8259_eoi(0);
+        /* Without a timer of its own, the boot cpu schedules on the PIT */
+        int local = (x86_percpu_read(timer) == NULL);
+        if (local)
+                sched_tick();
+        irq_eoi(0);
 
+        if (local && x86_percpu_read(need_resched) &&
+                        !x86_percpu_read(idle_halted))
+                sched();
         return;
 }
 
@@ -57,51 +94,52 @@ void cIRQ1(irq_stack_t* regs)
         do_interrupt(X86_8259_INTERRUPT_BASE + 1, 0, 0, 0, 0);
         uint8_t c = ol_ps2_get_keyboard_scancode();
         kb_handle(c);
-        pic_8259_eoi(1);
+        irq_eoi(1);
         return;
 }
 
 void cIRQ2(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 2, 0, 0, 0, 0);
-        pic_8259_eoi(2);
+        irq_eoi(2);
         return;
 }
 
 void cIRQ3(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 3, 0, 0, 0, 0);
-        pic_8259_eoi(3);
+        irq_eoi(3);
         return;
 }
 
 void cIRQ4(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 4, 0, 0, 0, 0);
-        pic_8259_eoi(4);
+        irq_eoi(4);
         return;
 }
 
 void cIRQ5(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 5, 0, 0, 0, 0);
-        pic_8259_eoi(5);
+        irq_eoi(5);
         return;
 }
 
 void cIRQ6(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 6, 0, 0, 0, 0);
-        pic_8259_eoi(6);
+        irq_eoi(6);
         return;
 }
 
 void cIRQ7(irq_stack_t* regs)
 {
-        int spurious = pic_8259_detect_spurious(7);
+        /* Only the PIC sends spurious interrupts on this vector */
+        int spurious = !ioapic_enabled() && pic_8259_detect_spurious(7);
         do_interrupt(X86_8259_INTERRUPT_BASE + 7, 0, 0, 0, 0);
         if (!spurious) {
-                pic_8259_eoi(7);
+                irq_eoi(7);
         }
         return;
 }
@@ -112,7 +150,7 @@ void cIRQ8(irq_stack_t* regs)
         printf("test\n");
         outb(CMOS_SELECT, CMOS_RTC_IRQ);
         inb(CMOS_DATA);
-        pic_8259_eoi(8);
+        irq_eoi(8);
         return;
 }
 
@@ -120,35 +158,35 @@ void cIRQ9(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 9, 0, 0, 0, 0);
         putc('a');
-        pic_8259_eoi(9);
+        irq_eoi(9);
         return;
 }
 
 void cIRQ10(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 10, 0, 0, 0, 0);
-        pic_8259_eoi(10);
+        irq_eoi(10);
         return;
 }
 
 void cIRQ11(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 11, 0, 0, 0, 0);
-        pic_8259_eoi(11);
+        irq_eoi(11);
         return;
 }
 
 void cIRQ12(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 12, 0, 0, 0, 0);
-        pic_8259_eoi(12);
+        irq_eoi(12);
         return;
 }
 
 void cIRQ13(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 13, 0, 0, 0, 0);
-        pic_8259_eoi(13);
+        irq_eoi(13);
         return;
 }
 
@@ -156,24 +194,30 @@ void cIRQ14(irq_stack_t* regs)
 {
         do_interrupt(X86_8259_INTERRUPT_BASE + 14, 0, 0, 0, 0);
         putc('a');
-        pic_8259_eoi(14);
+        irq_eoi(14);
         return;
 }
 
 void cIRQ15(irq_stack_t* regs)
 {
-        int spurious = pic_8259_detect_spurious(15);
+        int spurious = !ioapic_enabled() && pic_8259_detect_spurious(15);
         do_interrupt(X86_8259_INTERRUPT_BASE + 15, 0, 0, 0, 0);
         putc('b');
         if (spurious) {
-                pic_8259_eoi(7);
+                irq_eoi(7);
         } else {
-                pic_8259_eoi(15);
+                irq_eoi(15);
         }
         return;
 }
 
 int hw_interrupt_end(uint16_t irq_no) {
+        if (ioapic_enabled()) {
+                /* Also covers the MSI vectors, they all end at the LAPIC */
+                irq_route_account(irq_no);
+                lapic_eoi();
+                return -E_SUCCESS;
+        }
         irq_no -= X86_8259_INTERRUPT_BASE;
         if (irq_no > 0xF) {
                 return -E_SUCCESS;
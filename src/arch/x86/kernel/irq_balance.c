@@ -0,0 +1,225 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/irq_balance.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+
+/**
+ * \addtogroup x86_irq_balance
+ * @{
+ *
+ * Every device interrupt that can be steered to another cpu registers a route
+ * here, keyed by its vector. The end of interrupt path counts how often each
+ * vector fires, and every IRQ_BALANCE_INTERVAL the busiest interrupts are
+ * handed out one by one to the least loaded cpu they're allowed on.
+ *
+ * The route itself doesn't know how to reprogram the source, that's up to
+ * the retarget callback of the I/O APIC or MSI code.
+ */
+
+static struct irq_route irq_routes[IRQ_ROUTES];
+static uint32_t irq_balance_load[IRQ_ROUTES];
+static spinlock_t irq_route_lock = mutex_unlocked;
+static time_t irq_balance_last = 0;
+
+static uint32_t irq_online_mask()
+{
+        int cpus = smp_cpus();
+        if (cpus >= 32)
+                return IRQ_AFFINITY_ALL;
+        return (1 << cpus) - 1;
+}
+
+/**
+ * \fn irq_route_register
+ * \brief Make an interrupt source known to the balancer
+ * \param vector
+ * \param cpu
+ * \brief The cpu the source currently delivers to
+ * \param retarget
+ * \param data
+ * \return A standard error code
+ */
+int irq_route_register(uint8_t vector, int cpu,
+                int (*retarget)(struct irq_route*, int), void* data)
+{
+        if (retarget == NULL)
+                return -E_NULL_PTR;
+
+        struct irq_route* r = &irq_routes[vector];
+        mutex_lock(&irq_route_lock);
+        r->vector = vector;
+        r->cpu = cpu;
+        r->affinity = IRQ_AFFINITY_ALL;
+        r->count = 0;
+        r->retarget = retarget;
+        r->data = data;
+        r->used = 1;
+        mutex_unlock(&irq_route_lock);
+
+        return -E_SUCCESS;
+}
+
+int irq_route_unregister(uint8_t vector)
+{
+        mutex_lock(&irq_route_lock);
+        memset(&irq_routes[vector], 0, sizeof(irq_routes[vector]));
+        mutex_unlock(&irq_route_lock);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn irq_set_affinity
+ * \brief Restrict the cpus an interrupt may be delivered to
+ * \param vector
+ * \param affinity
+ * \brief Bit mask of logical cpu ids
+ * \return A standard error code
+ *
+ * If the interrupt currently goes to a cpu outside the mask, it is moved
+ * right away. Otherwise it stays put until the next balancing pass.
+ */
+int irq_set_affinity(uint8_t vector, uint32_t affinity)
+{
+        uint32_t allowed = affinity & irq_online_mask();
+        if (allowed == 0)
+                return -E_INVALID_ARG;
+
+        struct irq_route* r = &irq_routes[vector];
+        int ret = -E_SUCCESS;
+
+        mutex_lock(&irq_route_lock);
+        if (!r->used) {
+                mutex_unlock(&irq_route_lock);
+                return -E_NOTFOUND;
+        }
+        r->affinity = affinity;
+        if (!(allowed & (1 << r->cpu))) {
+                int cpu = 0;
+                while (!(allowed & (1 << cpu)))
+                        cpu++;
+                ret = r->retarget(r, cpu);
+                if (ret == -E_SUCCESS)
+                        r->cpu = cpu;
+        }
+        mutex_unlock(&irq_route_lock);
+
+        return ret;
+}
+
+/**
+ * \fn irq_route_account
+ * \brief Count an interrupt, called from the end of interrupt path
+ * \param vector
+ */
+void irq_route_account(uint8_t vector)
+{
+        if (irq_routes[vector].used)
+                x86_atomic_xadd(&irq_routes[vector].count, 1);
+}
+
+/**
+ * \fn irq_balance
+ * \brief Spread the device interrupts over the online cpus
+ * \return The number of interrupts moved, or an error code
+ *
+ * Meant to be called from the idle loop, it does nothing until
+ * IRQ_BALANCE_INTERVAL has passed since the last time it did any work.
+ */
+int irq_balance()
+{
+        int cpus = smp_cpus();
+        if (cpus < 2)
+                return 0;
+
+        struct sys_timer* timer = get_global_timer(X86_8259_INTERRUPT_BASE);
+        if (timer == NULL)
+                return -E_NOT_YET_INITIALISED;
+        time_t now = getTime(timer);
+        if (now - irq_balance_last < IRQ_BALANCE_INTERVAL)
+                return 0;
+        irq_balance_last = now;
+
+        uint32_t cpu_load[CPU_LIMIT];
+        memset(cpu_load, 0, sizeof(cpu_load));
+        uint32_t online = irq_online_mask();
+        int moved = 0;
+
+        if (mutex_test(&irq_route_lock) != mutex_unlocked)
+                /* Someone is changing the routes, try again next time */
+                return 0;
+
+        int i = 0;
+        for (; i < IRQ_ROUTES; i++) {
+                if (irq_routes[i].used)
+                        irq_balance_load[i] = x86_atomic_xchg(
+                                        &irq_routes[i].count, 0);
+                else
+                        irq_balance_load[i] = 0;
+        }
+
+        /* Busiest first, so the big ones are spread before the small ones */
+        for (;;) {
+                int busiest = -1;
+                for (i = 0; i < IRQ_ROUTES; i++) {
+                        if (irq_balance_load[i] == 0)
+                                continue;
+                        if (busiest < 0 || irq_balance_load[i] >
+                                        irq_balance_load[busiest])
+                                busiest = i;
+                }
+                if (busiest < 0)
+                        break;
+
+                struct irq_route* r = &irq_routes[busiest];
+                uint32_t allowed = r->affinity & online;
+                int best = -1;
+                int cpu = 0;
+                for (; cpu < cpus; cpu++) {
+                        if (!(allowed & (1 << cpu)))
+                                continue;
+                        if (best < 0 || cpu_load[cpu] < cpu_load[best])
+                                best = cpu;
+                }
+                /* Don't move an interrupt for nothing */
+                if (best < 0 || ((allowed & (1 << r->cpu))
+                                && cpu_load[r->cpu] == cpu_load[best]))
+                        best = r->cpu;
+
+                if (best != r->cpu && r->retarget(r, best) == -E_SUCCESS) {
+                        r->cpu = best;
+                        moved++;
+                }
+                if (r->cpu >= 0 && r->cpu < CPU_LIMIT)
+                        cpu_load[r->cpu] += irq_balance_load[busiest];
+                irq_balance_load[busiest] = 0;
+        }
+        mutex_unlock(&irq_route_lock);
+
+        return moved;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -141,6 +141,8 @@ isrStub:
 	mov ebp, esp
 	mov eax, [ebp+32]
 
+	mov dx, gs
+	shl edx, 16
 	mov dx, ds
 	push edx
 	mov dx, 0x10	; kernel ring
@@ -148,7 +150,9 @@ isrStub:
 	mov ds, dx
 	mov es, dx
 	mov fs, dx
+	mov dx, 0x28	; per cpu area, see percpu.h
 	mov gs, dx
+	cld	; the C code expects the direction flag clear
 
 	push esp
 
@@ -159,8 +163,9 @@ isrStub:
 	pop edx
 	mov ds, dx
 	mov es, dx
+	mov fs, dx
+	shr edx, 16
 	mov gs, dx
-	mov es, dx
 
 	popad
 	add esp, 8	; pop error num + routine
@@ -179,6 +184,8 @@ asm_syscall:
         mov ebp, esp
         mov eax, [ebp+32]
 
+        mov dx, gs
+        shl edx, 16
         mov dx, ds
         push edx
         mov dx, 0x10    ; kernel ring
@@ -186,7 +193,9 @@ asm_syscall:
         mov ds, dx
         mov es, dx
         mov fs, dx
+        mov dx, 0x28    ; per cpu area, see percpu.h
         mov gs, dx
+        cld             ; the C code expects the direction flag clear
 
         push esp
 
@@ -200,8 +209,9 @@ asm_syscall:
         pop edx
         mov ds, dx
         mov es, dx
+        mov fs, dx
+        shr edx, 16
         mov gs, dx
-        mov es, dx
 
         popad
 
@@ -20,6 +20,10 @@
 #include <stdlib.h>
 #include <mm/paging.h>
 #include <andromeda/cpu.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <arch/x86/acct.h>
+#include <arch/x86/fpu.h>
 #include <arch/x86/task.h>
 #include <andromeda/syscall.h>
 #include <andromeda/system.h>
@@ -75,7 +79,7 @@ void cBreakp(isrVal_t* regs)
 
         printf("eax\tebx\tecx\tedx\n%X\t%X\t%X\t%X\n", regs->eax, regs->ebx,
                         regs->ecx, regs->edx);
-        printf("\nds\n%X\n", regs->ds);
+        printf("\nds\tgs\n%X\t%X\n", regs->ds & 0xFFFF, regs->ds >> 16);
         printf("\nedi\tesi\tebp\tesp\n%X\t%X\t%X\t%X\n", regs->edi, regs->esi,
                         regs->ebp, regs->esp);
         printf("\neip\tcs\teflags\tuseresp\tss\n%X\t%X\t%X\t%X\t%X\n",
@@ -117,6 +121,9 @@ void cInvalOp(isrVal_t* regs)
 
 void cNoMath(isrVal_t* regs)
 {
+        /* The running thread wants the fpu back, see x86_fpu_switch */
+        if (x86_fpu_trap() == -E_SUCCESS)
+                return;
         do_interrupt(7, (uint64_t) regs->eax, (uint64_t) regs->ebx,
                         (uint64_t) regs->ecx, (uint64_t) regs->edx);
         printf("NM\n");
@@ -228,17 +235,21 @@ void cSimd(isrVal_t* regs)
 
 int cSyscall(isrVal_t* regs)
 {
+        int mode = x86_acct_enter(SCHED_TIME_KERNEL);
         do_interrupt(80, (uint64_t) regs->eax, (uint64_t) regs->ebx,
                          (uint64_t) regs->ecx, (uint64_t) regs->edx);
-        if (sc_list[(uint16_t) regs->eax].syscall != NULL) {
-                if (sc_list[(uint16_t) regs->eax].cpl <= -4) {
+        struct syscall call;
+        int ret = -E_NOT_FOUND;
+        if (sc_get((uint16_t) regs->eax, &call) == -E_SUCCESS) {
+                if (call.cpl <= -4) {
                         /**
                          * \todo Replace -4 by current task privilege check
                          */
-                        return -E_NORIGHTS;
+                        ret = -E_NORIGHTS;
+                } else {
+                        ret = call.syscall(regs->ebx, regs->ecx, regs->edx);
                 }
-                return sc_list[(uint16_t) regs->eax].syscall(regs->ebx,
-                                regs->ecx, regs->edx);
         }
-        return -E_NOT_FOUND;
+        x86_acct_exit(mode);
+        return ret;
 }
@@ -0,0 +1,257 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/timer.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_apic
+ * @{
+ *
+ * Every cpu runs its own timer from its local APIC, in one shot mode. It is
+ * armed for the next pending event of the cpu timer, or LAPIC_TIMER_MAX_IDLE
+ * from now if there is none, so an idle cpu isn't woken up every tick.
+ *
+ * The time itself comes from the TSC, which is calibrated against the PIT
+ * together with the APIC timer. Deadlines are kept as TSC values, so the time
+ * spent handling the interrupt doesn't add up to drift. Where the cpu
+ * supports it, the deadline is handed to the APIC as is (TSC deadline mode).
+ *
+ * The state of each timer lives in the per cpu area, as only the cpu itself
+ * ever touches it.
+ */
+
+/* Keep the milliseconds since tsc_base small enough for x86_div64_32 */
+#define LAPIC_TIMER_REBASE 0x10000000
+
+static uint32_t lapic_per_ms = 0;
+static uint32_t tsc_per_ms = 0;
+static int tsc_deadline = 0;
+
+static time_t lapic_timer_now(struct x86_percpu* lt)
+{
+        uint64_t delta = get_cpu_tick() - lt->tsc_base;
+        uint32_t ms = x86_div64_32(delta, tsc_per_ms);
+        if (ms >= LAPIC_TIMER_REBASE) {
+                lt->tsc_base += (uint64_t)ms * tsc_per_ms;
+                lt->timer_base += ms;
+                ms = 0;
+        }
+        return lt->timer_base + ms;
+}
+
+/**
+ * \fn lapic_timer_set_next
+ * \brief Arm the timer of the calling cpu
+ * \param next
+ * \brief The time of the next event, -1 if there is none
+ * \param timer
+ * \return A standard error code
+ *
+ * Only the cpu itself can program its APIC. An event subscribed from another
+ * cpu is picked up when the timer goes off anyway, at most
+ * LAPIC_TIMER_MAX_IDLE later than it should.
+ */
+static int lapic_timer_set_next(time_t next, struct sys_timer* timer)
+{
+        if (x86_percpu_read(timer) != timer)
+                return -E_SUCCESS;
+        struct x86_percpu* lt = x86_percpu_this();
+
+        int state = disableInterrupts();
+        time_t now = lapic_timer_now(lt);
+        if (next < 0 || next - now > LAPIC_TIMER_MAX_IDLE)
+                next = now + LAPIC_TIMER_MAX_IDLE;
+        timer->next = next;
+
+        uint64_t deadline = lt->tsc_base;
+        if (next > lt->timer_base)
+                deadline += (uint64_t)(next - lt->timer_base) * tsc_per_ms;
+
+        if (tsc_deadline) {
+                /* A deadline in the past goes off right away */
+                cpu_write_msr(X86_MSR_TSC_DEADLINE, deadline);
+        } else {
+                uint64_t tsc = get_cpu_tick();
+                uint32_t count = 1;
+                if (deadline > tsc)
+                        count = x86_div64_32((deadline - tsc) * lapic_per_ms,
+                                        tsc_per_ms);
+                lapic_write(LAPIC_TIMER_INIT, (count == 0) ? 1 : count);
+        }
+
+        if (state)
+                enableInterrupts();
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn lapic_timer_interrupt
+ * \brief Called from lapic_timer_irq, with interrupts disabled
+ */
+void lapic_timer_interrupt()
+{
+        x86_percpu_inc(timer_interrupts);
+        if (x86_percpu_read(timer) != NULL)
+                do_interrupt(LAPIC_TIMER_VECTOR, get_cpu(), 0,
+                                lapic_timer_now(x86_percpu_this()), 0);
+        lapic_eoi();
+
+        /* The events may have found the running task out of time */
+        if (x86_percpu_read(need_resched) && !x86_percpu_read(idle_halted))
+                sched();
+}
+
+uint32_t lapic_timer_interrupts(int cpu)
+{
+        if (cpu < 0 || cpu >= CPU_LIMIT)
+                return 0;
+        return x86_percpu[cpu].timer_interrupts;
+}
+
+/**
+ * \fn lapic_timer_calibrate
+ * \brief Count APIC timer and TSC ticks for LAPIC_TIMER_CALIBRATE of PIT time
+ * \return A standard error code
+ */
+static int lapic_timer_calibrate()
+{
+        struct sys_timer* pit = get_global_timer(X86_8259_INTERRUPT_BASE);
+        if (pit == NULL)
+                return -E_NOT_YET_INITIALISED;
+
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+        /* Start right at a PIT tick */
+        time_t start = getTime(pit);
+        while (getTime(pit) == start)
+                x86_pause();
+        start++;
+
+        uint64_t tsc = get_cpu_tick();
+        lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+        while (getTime(pit) < start + LAPIC_TIMER_CALIBRATE)
+                x86_pause();
+        uint32_t count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+        tsc = get_cpu_tick() - tsc;
+        lapic_write(LAPIC_TIMER_INIT, 0);
+
+        lapic_per_ms = count / LAPIC_TIMER_CALIBRATE;
+        tsc_per_ms = x86_div64_32(tsc, LAPIC_TIMER_CALIBRATE);
+        if (lapic_per_ms == 0 || tsc_per_ms == 0)
+                return -E_GENERIC;
+
+        debug("APIC timer: %X ticks per ms, TSC: %X per ms\n", lapic_per_ms,
+                        tsc_per_ms);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn lapic_timer_setup
+ * \brief Start the timer of the calling cpu
+ * \param cpu
+ * \return A standard error code
+ */
+static int lapic_timer_setup(int cpu)
+{
+        struct sys_cpu* c = getcpu(cpu);
+        if (c == NULL)
+                return -E_NOT_YET_INITIALISED;
+        if (c->pic == NULL) {
+                c->pic = kmalloc(sizeof(*c->pic));
+                if (c->pic == NULL)
+                        return -E_NOMEM;
+                memset(c->pic, 0, sizeof(*c->pic));
+        }
+
+        int ret = cpu_timer_init(cpu, 1000, LAPIC_TIMER_VECTOR);
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        struct x86_percpu* lt = x86_percpu_this();
+        int state = disableInterrupts();
+        lt->tsc_base = get_cpu_tick();
+        lt->timer_base = 0;
+        lt->timer = get_cpu_timer(cpu);
+        lt->timer->set_next = lapic_timer_set_next;
+
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR | ((tsc_deadline) ?
+                        LAPIC_TIMER_TSC_DEADLINE : LAPIC_TIMER_ONE_SHOT));
+        lapic_timer_set_next(-1, lt->timer);
+        if (state)
+                enableInterrupts();
+
+        return -E_SUCCESS;
+}
+
+static void lapic_timer_ap(void* arg __attribute__((unused)))
+{
+        int cpu = get_cpu();
+        if (lapic_timer_setup(cpu) != -E_SUCCESS)
+                warning("cpu %X runs without a timer\n", cpu);
+}
+
+/**
+ * \fn lapic_timer_init
+ * \brief Calibrate the APIC timers and start them on every cpu
+ * \return A standard error code
+ *
+ * Runs on the boot cpu, after the PIT is up and interrupts are enabled.
+ */
+int lapic_timer_init()
+{
+        if (!lapic_available())
+                return -E_NOFUNCTION;
+
+        struct x86_gen_regs regs;
+        x86_cpuid(1, &regs);
+        tsc_deadline = (regs.ecx & X86_CPUID_ECX_TSC_DEADLINE) != 0;
+
+        int ret = lapic_timer_calibrate();
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        x86_idt_set_gate(LAPIC_TIMER_VECTOR, lapic_timer_irq);
+        ret = lapic_timer_setup(0);
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        int cpu = 1;
+        for (; cpu < smp_cpus(); cpu++)
+                smp_call(cpu, lapic_timer_ap, NULL);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * @}
+ * \file
+ */
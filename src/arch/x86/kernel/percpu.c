@@ -0,0 +1,76 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/system.h>
+#include <arch/x86/percpu.h>
+
+/**
+ * \addtogroup x86_percpu
+ * @{
+ */
+
+struct x86_percpu x86_percpu[CPU_LIMIT];
+
+/**
+ * \fn x86_percpu_setup
+ * \brief Clear the per cpu area of a cpu before it is first loaded
+ * \param cpu
+ */
+void x86_percpu_setup(int cpu)
+{
+        if (cpu < 0 || cpu >= CPU_LIMIT)
+                return;
+
+        struct x86_percpu* p = &x86_percpu[cpu];
+        memset(p, 0, sizeof(*p));
+        p->self = p;
+        p->cpu = cpu;
+}
+
+/**
+ * \fn x86_percpu_load
+ * \brief Point %gs at the per cpu entry of the GDT just loaded
+ */
+void x86_percpu_load()
+{
+        asm volatile ("movw %w0, %%gs" : : "r" (X86_PERCPU_SEL) : "memory");
+}
+
+#ifdef PERCPU_DBG
+void x86_percpu_dump()
+{
+        int cpu = 0;
+        for (; cpu < CPU_LIMIT; cpu++) {
+                struct x86_percpu* p = &x86_percpu[cpu];
+                if (p->self == NULL)
+                        continue;
+                printf("cpu %X: %X interrupts, page cache %X hits %X misses\n",
+                                cpu, p->interrupts, p->page_cache_hits,
+                                p->page_cache_misses);
+                printf("cpu %X: woke up %X times, idle for %X Mcycles\n",
+                                cpu, p->idle_wakeups,
+                                (uint32_t)(p->idle_cycles >> 20));
+        }
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
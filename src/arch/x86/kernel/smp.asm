@@ -0,0 +1,127 @@
+;
+;    Application processor start up code.
+;    Copyright (C) 2015 Bart Kuivenhoven
+;
+;    This program is free software: you can redistribute it and/or modify
+;    it under the terms of the GNU General Public License as published by
+;    the Free Software Foundation, either version 3 of the License, or
+;    (at your option) any later version.
+;
+;    This program is distributed in the hope that it will be useful,
+;    but WITHOUT ANY WARRANTY; without even the implied warranty of
+;    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;    GNU General Public License for more details.
+;
+;    You should have received a copy of the GNU General Public License
+;    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+;
+
+; Has to match SMP_TRAMPOLINE_ADDR in arch/x86/smp.h
+SMP_TRAMPOLINE_ADDR equ 0x7000
+
+; The trampoline is copied to SMP_TRAMPOLINE_ADDR before it is used, so every
+; absolute address in it has to be translated.
+%define TRAMPOLINE(x) (SMP_TRAMPOLINE_ADDR + (x) - smp_trampoline)
+
+[EXTERN lapic_eoi]
+[EXTERN lapic_timer_interrupt]
+
+[SECTION .text]
+align 16
+[GLOBAL smp_trampoline]
+[BITS 16]
+smp_trampoline:
+        cli
+        cld
+        xor ax, ax
+        mov ds, ax
+
+        o32 lgdt [TRAMPOLINE(smp_gdtr)]
+        mov eax, cr0
+        or eax, 1
+        mov cr0, eax
+        jmp dword 0x08:TRAMPOLINE(smp_pm)
+
+[BITS 32]
+smp_pm:
+        mov ax, 0x10
+        mov ds, ax
+        mov es, ax
+        mov fs, ax
+        mov gs, ax
+        mov ss, ax
+
+        ; The boot page directory still maps the trampoline 1:1
+        mov eax, [TRAMPOLINE(smp_trampoline_args)]
+        mov cr3, eax
+        mov eax, cr0
+        or eax, 0x80000000
+        mov cr0, eax
+
+        mov esp, [TRAMPOLINE(smp_trampoline_args)+4]
+        xor ebp, ebp
+        push dword [TRAMPOLINE(smp_trampoline_args)+12]
+        push dword 0 ; smp_ap_main never returns
+        jmp [TRAMPOLINE(smp_trampoline_args)+8]
+
+align 8
+smp_gdt:
+        dq 0
+        dq 0x00CF9A000000FFFF ; code, flat 4 GiB
+        dq 0x00CF92000000FFFF ; data, flat 4 GiB
+smp_gdtr:
+        dw smp_gdtr - smp_gdt - 1
+        dd TRAMPOLINE(smp_gdt)
+
+; Filled in by smp_boot_ap: cr3, stack, entry, cpu
+align 4
+[GLOBAL smp_trampoline_args]
+smp_trampoline_args:
+        dd 0, 0, 0, 0
+
+[GLOBAL smp_trampoline_end]
+smp_trampoline_end:
+
+; Gets a halted cpu out of its hlt, or a busy one to preempt its task
+[GLOBAL smp_ipi_wakeup]
+smp_ipi_wakeup:
+        pushad
+        push gs
+        mov ax, 0x28            ; per cpu area, see percpu.h
+        mov gs, ax
+        cld
+        call smp_wakeup_interrupt
+        pop gs
+        popad
+        iretd
+
+; Has a cpu drop its translations, see smp_flush_tlbs
+[GLOBAL smp_ipi_flush]
+smp_ipi_flush:
+        pushad
+        push gs
+        mov ax, 0x28            ; per cpu area, see percpu.h
+        mov gs, ax
+        cld
+        call smp_flush_interrupt
+        pop gs
+        popad
+        iretd
+
+; The C side sends the EOI
+[GLOBAL lapic_timer_irq]
+lapic_timer_irq:
+        pushad
+        push gs
+        mov ax, 0x28            ; per cpu area, see percpu.h
+        mov gs, ax
+        cld
+        call lapic_timer_interrupt
+        pop gs
+        popad
+        iretd
+
+; Spurious interrupts don't need an EOI
+[GLOBAL lapic_spurious]
+lapic_spurious:
+        iretd
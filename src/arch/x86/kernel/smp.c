@@ -0,0 +1,428 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/cpu.h>
+#include <andromeda/error.h>
+#include <andromeda/sched.h>
+#include <andromeda/system.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/GDT.h>
+#include <arch/x86/idle.h>
+#include <arch/x86/idt.h>
+#include <arch/x86/mp.h>
+#include <arch/x86/percpu.h>
+#include <arch/x86/pic.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/system.h>
+#include <mm/vm.h>
+
+/**
+ * \addtogroup x86_smp
+ * @{
+ *
+ * Application processors are started one at a time. The boot cpu copies a
+ * trampoline into low memory, fills in where the cpu should go and sends it
+ * INIT and STARTUP IPIs. The trampoline switches to protected mode with
+ * paging, and calls smp_ap_main on a stack of its own.
+ *
+ * Once up, an application processor loads its own GDT, the shared IDT and
+ * sits in its idle loop. It is halted until another cpu hands it a function
+ * through smp_call or queues a task for it, and kicks it with an IPI.
+ *
+ * Unmapping kernel memory only invalidates the translations of the cpu doing
+ * it. smp_flush_tlbs has the others flush theirs too, and waits for all of
+ * them to be done before the addresses can be handed out again.
+ */
+
+/**
+ * \struct smp_cpu
+ * \brief Bookkeeping for a single cpu
+ * \var call
+ * \brief Function to run next, NULL if there is nothing to do
+ * \var flush
+ * \brief Set while the cpu still owes a TLB flush
+ */
+struct smp_cpu {
+        uint8_t apic_id;
+        volatile int online;
+        void* stack;
+        volatile uint32_t flush;
+
+        spinlock_t call_lock;
+        void (*volatile call)(void*);
+        void* volatile call_arg;
+};
+
+static struct smp_cpu smp_cpu[CPU_LIMIT];
+static volatile int smp_online = 1;
+static int smp_present = 1;
+static int8_t smp_apic_cpu[0x100];
+static struct idt smp_idt;
+
+static spinlock_t smp_flush_lock = mutex_unlocked;
+static volatile uint32_t smp_flush_acks = 0;
+
+/**
+ * \fn smp_cpu_id
+ * \brief Find out which cpu we're running on
+ * \return The logical id, 0 being the boot cpu
+ */
+int smp_cpu_id()
+{
+        if (!lapic_available())
+                return 0;
+        int cpu = smp_apic_cpu[lapic_id()];
+        return (cpu < 0) ? 0 : cpu;
+}
+
+int smp_cpus()
+{
+        return smp_online;
+}
+
+/**
+ * \fn smp_cpu_present
+ * \brief Tell whether a logical cpu id belongs to a processor in the system
+ */
+int smp_cpu_present(int cpu)
+{
+        return cpu >= 0 && cpu < smp_present;
+}
+
+/**
+ * \fn smp_apic_id
+ * \brief The local APIC id to send interrupts for a logical cpu to
+ */
+int smp_apic_id(int cpu)
+{
+        if (cpu < 0 || cpu >= smp_online)
+                return -E_INVALID_ARG;
+        return smp_cpu[cpu].apic_id;
+}
+
+static void smp_delay(time_t ms)
+{
+        struct sys_timer* timer = get_global_timer(X86_8259_INTERRUPT_BASE);
+        /* The first tick may come in right away, so wait one more */
+        time_t end = getTime(timer) + ms + 1;
+        while (getTime(timer) < end)
+                x86_pause();
+}
+
+static int smp_call_pending(void* arg)
+{
+        struct smp_cpu* c = arg;
+        return c->call != NULL;
+}
+
+/**
+ * \fn smp_idle
+ * \brief The idle loop of an application processor
+ */
+static void smp_idle(int cpu) __attribute__((noreturn));
+static void smp_idle(int cpu)
+{
+        struct smp_cpu* c = &smp_cpu[cpu];
+        for (;;) {
+                void (*call)(void*) = c->call;
+                if (call != NULL) {
+                        call(c->call_arg);
+                        /* Only now can the next call be queued */
+                        c->call = NULL;
+                        continue;
+                }
+                /* Work may have been queued here, or be up for stealing */
+                sched();
+                x86_idle(smp_call_pending, c);
+        }
+}
+
+/**
+ * \fn smp_ap_main
+ * \brief Where application processors end up after the trampoline
+ * \param cpu
+ */
+void smp_ap_main(int cpu) __attribute__((noreturn));
+void smp_ap_main(int cpu)
+{
+        x86_gdt_cpu_init(cpu);
+        installIDT(&smp_idt);
+        x86_sse_init();
+        lapic_init(0);
+
+        smp_cpu[cpu].online = 1;
+        cpu_enable_interrupts(cpu);
+
+        smp_idle(cpu);
+}
+
+/**
+ * \fn smp_call
+ * \brief Have an application processor run a function from its idle loop
+ * \param cpu
+ * \param call
+ * \param arg
+ * \return A standard error code
+ *
+ * The call is asynchronous, the caller only waits for earlier calls to the
+ * same cpu to start.
+ */
+int smp_call(int cpu, void (*call)(void*), void* arg)
+{
+        if (call == NULL)
+                return -E_NULL_PTR;
+        if (cpu <= 0 || cpu >= smp_online)
+                return -E_INVALID_ARG;
+
+        struct smp_cpu* c = &smp_cpu[cpu];
+        mutex_lock(&c->call_lock);
+        while (c->call != NULL)
+                x86_pause();
+        c->call_arg = arg;
+        c->call = call;
+        mutex_unlock(&c->call_lock);
+
+        return lapic_send_ipi(c->apic_id, LAPIC_ICR_FIXED | SMP_IPI_WAKEUP);
+}
+
+/**
+ * \fn smp_wake
+ * \brief Get another cpu out of its halt, e.g. to run a task just queued
+ * \param cpu
+ * \return A standard error code
+ */
+int smp_wake(int cpu)
+{
+        if (cpu < 0 || cpu >= smp_online || cpu == get_cpu())
+                return -E_INVALID_ARG;
+        return lapic_send_ipi(smp_cpu[cpu].apic_id,
+                        LAPIC_ICR_FIXED | SMP_IPI_WAKEUP);
+}
+
+/**
+ * \fn smp_wakeup_interrupt
+ * \brief Handle the wakeup IPI
+ *
+ * A halted cpu reschedules in its idle loop. A busy one switches here, as a
+ * task that should preempt the running one was just queued.
+ */
+void smp_wakeup_interrupt()
+{
+        lapic_eoi();
+        if (x86_percpu_read(need_resched) && !x86_percpu_read(idle_halted))
+                sched();
+}
+
+/**
+ * \fn smp_flush_ack
+ * \brief Flush the TLB of this cpu if it was asked to, and say so
+ * \param cpu
+ */
+static void smp_flush_ack(int cpu)
+{
+        /* Whoever clears the request does the flushing */
+        if (x86_atomic_xchg(&smp_cpu[cpu].flush, 0) == 0)
+                return;
+        page_flush(cpu);
+        x86_atomic_xadd(&smp_flush_acks, 1);
+}
+
+/**
+ * \fn smp_flush_tlbs
+ * \brief Flush the TLBs of all online cpus
+ * \return A standard error code
+ *
+ * Sends a single IPI to every other cpu, and only returns once all of them
+ * have flushed. Translations removed before the call are gone everywhere
+ * afterwards.
+ */
+int smp_flush_tlbs()
+{
+        int cpu = get_cpu();
+        page_flush(cpu);
+        if (smp_online < 2)
+                return -E_SUCCESS;
+
+        /* Whoever flushes now may be waiting for us to do the same */
+        while (mutex_test(&smp_flush_lock) != mutex_unlocked) {
+                smp_flush_ack(cpu);
+                x86_pause();
+        }
+
+        int ret = -E_SUCCESS;
+        uint32_t sent = 0;
+        smp_flush_acks = 0;
+        int i = 0;
+        for (; i < smp_online; i++) {
+                if (i == cpu)
+                        continue;
+                struct smp_cpu* c = &smp_cpu[i];
+                c->flush = 1;
+                sent++;
+                if (lapic_send_ipi(c->apic_id, LAPIC_ICR_FIXED
+                                | SMP_IPI_FLUSH) == -E_SUCCESS)
+                        continue;
+                /* If the request is still there, nobody will answer it */
+                if (x86_atomic_xchg(&c->flush, 0) != 0) {
+                        warning("cpu %i missed a TLB flush\n", i);
+                        ret = -E_TIMEOUT;
+                        sent--;
+                }
+        }
+        while (smp_flush_acks != sent)
+                x86_pause();
+
+        mutex_unlock(&smp_flush_lock);
+        return ret;
+}
+
+/**
+ * \fn smp_flush_interrupt
+ * \brief Handle the TLB flush IPI
+ */
+void smp_flush_interrupt()
+{
+        smp_flush_ack(get_cpu());
+        lapic_eoi();
+}
+
+/**
+ * \fn smp_boot_ap
+ * \brief Start an application processor and wait for it to come up
+ * \param cpu
+ * \brief The logical id to give it
+ * \param apic_id
+ * \return A standard error code
+ */
+static int smp_boot_ap(int cpu, uint8_t apic_id)
+{
+        struct smp_cpu* c = &smp_cpu[cpu];
+        if (c->stack == NULL) {
+                c->stack = kmalloc(STD_STACK_SIZE);
+                if (c->stack == NULL)
+                        return -E_NOMEM;
+        }
+        if (!hascpu(cpu))
+                system_x86_cpu_init(cpu);
+
+        c->apic_id = apic_id;
+        c->online = 0;
+        c->call = NULL;
+        c->call_lock = mutex_unlocked;
+        c->flush = 0;
+        smp_apic_cpu[apic_id] = cpu;
+
+        struct smp_trampoline_args* args = (void*)(SMP_TRAMPOLINE_ADDR
+                        + (smp_trampoline_args - smp_trampoline));
+        args->cr3 = getCR3();
+        args->stack = (addr_t)c->stack + STD_STACK_SIZE;
+        args->entry = (addr_t)smp_ap_main;
+        args->cpu = cpu;
+
+        lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT
+                        | LAPIC_ICR_LEVEL);
+        smp_delay(10);
+        lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL);
+
+        /* The second STARTUP is only for cpus that missed the first one */
+        int i = 0;
+        for (; i < 2 && !c->online; i++) {
+                lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP
+                                | (SMP_TRAMPOLINE_ADDR >> 12));
+                smp_delay(1);
+        }
+
+        time_t waited = 0;
+        for (; !c->online && waited < SMP_BOOT_TIMEOUT; waited++)
+                smp_delay(1);
+
+        if (!c->online) {
+                smp_apic_cpu[apic_id] = -1;
+                return -E_TIMEOUT;
+        }
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn smp_init
+ * \brief Find the other processors and start them up
+ * \return A standard error code
+ */
+int smp_init()
+{
+        struct x86_gen_regs regs;
+        if (!x86_eflags_test(X86_FLAGS_CPUID_TEST_BIT))
+                return -E_NOFUNCTION;
+        x86_cpuid(1, &regs);
+        if (!(regs.edx & X86_CPUID_EDX_APIC))
+                return -E_NOFUNCTION;
+
+        if (mp_init() != -E_SUCCESS) {
+                debug("No MP tables, running on the boot cpu only\n");
+                return -E_NOTFOUND;
+        }
+
+        memset(smp_apic_cpu, -1, sizeof(smp_apic_cpu));
+        int ret = lapic_init(mp_info.lapic);
+        if (ret != -E_SUCCESS)
+                return ret;
+        x86_idt_set_gate(LAPIC_SPURIOUS_VECTOR, lapic_spurious);
+        x86_idt_set_gate(SMP_IPI_WAKEUP, smp_ipi_wakeup);
+        x86_idt_set_gate(SMP_IPI_FLUSH, smp_ipi_flush);
+
+        smp_cpu[0].apic_id = lapic_id();
+        smp_cpu[0].online = 1;
+        smp_apic_cpu[smp_cpu[0].apic_id] = 0;
+
+        if (mp_info.cpus < 2)
+                return -E_SUCCESS;
+
+        /* The trampoline runs from an identity mapped page */
+        addr_t tramp = SMP_TRAMPOLINE_ADDR;
+        if ((addr_t)get_phys(0, (void*)tramp) != tramp)
+                page_map(0, (void*)tramp, (void*)tramp, VM_CPL_CORE);
+        memcpy((void*)tramp, smp_trampoline,
+                        smp_trampoline_end - smp_trampoline);
+        memcpy(&smp_idt, (void*)get_idt(), sizeof(smp_idt));
+
+        smp_present = mp_info.cpus;
+        int i = 1;
+        for (; i < mp_info.cpus; i++) {
+                uint8_t apic_id = mp_info.apic_id[i];
+                if (apic_id == smp_cpu[0].apic_id)
+                        continue;
+                if (smp_boot_ap(smp_online, apic_id) != -E_SUCCESS) {
+                        warning("cpu with apic id %X didn't come up\n",
+                                        apic_id);
+                        continue;
+                }
+                smp_online++;
+        }
+        smp_present = smp_online;
+
+        printf("%i cpus online\n", smp_online);
+        return -E_SUCCESS;
+}
+
+/**
+ * @}
+ * \file
+ */
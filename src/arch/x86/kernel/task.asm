@@ -19,3 +19,33 @@
 [GLOBAL LoadTask]
 LoadTask:
 ret
+
+[SECTION .text]
+
+; void x86_switch_stack(void** old, void* new)
+; Only the registers a C function has to preserve are saved, the caller
+; already expects the rest to be clobbered.
+[GLOBAL x86_switch_stack]
+x86_switch_stack:
+	mov eax, [esp+4]
+	mov edx, [esp+8]
+	push ebp
+	push ebx
+	push esi
+	push edi
+	mov [eax], esp
+	mov esp, edx
+	pop edi
+	pop esi
+	pop ebx
+	pop ebp
+	ret
+
+; A new thread gets here from its first x86_switch_stack, see
+; x86_thread_setup. The entry point is in ebx, its argument in esi.
+[GLOBAL x86_thread_start]
+x86_thread_start:
+	push esi
+	call ebx
+	; There's nothing to return to
+	ud2
@@ -21,74 +21,230 @@
 #include <andromeda/task.h>
 #include <andromeda/sched.h>
 #include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <arch/x86/acct.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/GDT.h>
 #include <mm/vm.h>
 #include <mm/paging.h>
+#ifdef CTX_BENCH
+#include <andromeda/kthread.h>
+#include <arch/x86/timer.h>
+#endif
+
+/*
+ * Both live in task.asm. x86_switch_stack pushes the registers the caller
+ * expects to survive a call, stores the stack pointer in *old, and pops the
+ * same registers off the new stack. Everything else has already been given
+ * up by the compiler, as far as it knows it's just calling a function.
+ */
+extern void x86_switch_stack(void** old, void* new);
+extern void x86_thread_start();
+
+/* Where the stack of the very first switch on a cpu goes */
+static void* context_boot_stack[CPU_LIMIT];
 
 /**
- * \fn context_switch(TASK_STATE *task)
+ * \fn x86_thread_setup
+ * \brief Prepare the stack of a thread that hasn't run yet
+ * \param thread
+ * \param entry
+ * \brief Where the thread starts, it must never return
+ * \param arg
+ * \return A standard error code
+ *
+ * The first switch to the thread pops the frame built here, and returns
+ * into x86_thread_start with the entry point in ebx and its argument in esi.
+ */
+int x86_thread_setup(struct thread_state* thread, void (*entry)(void*),
+                void* arg)
+{
+        if (thread == NULL || entry == NULL || thread->ss == NULL)
+                return -E_NULL_PTR;
+        if (thread->ss_size < 0x100)
+                return -E_INVALID_ARG;
+
+        uint32_t* sp = (uint32_t*)(((addr_t)thread->ss + thread->ss_size)
+                        & ~0xF);
+        *(--sp) = (uint32_t)x86_thread_start;
+        *(--sp) = 0;                    /* ebp */
+        *(--sp) = (uint32_t)entry;      /* ebx */
+        *(--sp) = (uint32_t)arg;        /* esi */
+        *(--sp) = 0;                    /* edi */
+        thread->stack = sp;
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn x86_user_start
+ * \brief Drop the calling thread into ring 3
+ * \param entry
+ * \param stack
+ * \brief The user mode stack pointer to start with
+ *
+ * Doesn't return, the thread only comes back into the kernel through
+ * interrupts and system calls, on the kernel stack it is running on now.
+ */
+void x86_user_start(addr_t entry, addr_t stack)
+{
+        disableInterrupts();
+        x86_acct_enter(SCHED_TIME_USER);
+        __asm__ __volatile__ (
+                "mov %w0, %%ds\n\t"
+                "mov %w0, %%es\n\t"
+                "mov %w0, %%fs\n\t"
+                "mov %w0, %%gs\n\t"
+                "pushl %0\n\t"         /* ss */
+                "pushl %1\n\t"         /* esp */
+                "pushl %2\n\t"         /* eflags, interrupts on */
+                "pushl %3\n\t"         /* cs */
+                "pushl %4\n\t"         /* eip */
+                "iret"
+                : : "r" (X86_USER_DS), "r" (stack), "i" (0x202),
+                "i" (X86_USER_CS), "r" (entry) : "memory");
+        __builtin_unreachable();
+}
+
+/**
+ * \fn context_switch
  * \brief Switch to another <i>task</i>.
+ * \param cpuid The cpu we're running on
  * \param task New task to which has to be loaded.
  * \return Error code. See <i>error.h</i> for more information.
  *
- * This function loads a new task and starts the execution.
+ * Returns once something switches back to the calling thread. The caller
+ * has to keep interrupts disabled.
+ *
+ * The address space is left alone when both tasks share it, and the fpu
+ * state is only moved once the new thread actually uses it.
  */
 int context_switch(uint32_t cpuid, struct task* task)
 {
         if (task == NULL)
                 return -E_NULL_PTR;
 
-        /* Get the old task */
         struct task *old = get_current_task();
-        /* Mark the new task as running */
-        set_current_task(task);
-        /* retrieve thread data for easier inline assembly */
+        struct thread_state* thrd = task->current_thread;
         struct thread_state* old_t = NULL;
-        struct thread_state* thrd = NULL;
+        if (old != NULL)
+                old_t = old->current_thread;
+        if (old_t == thrd)
+                return -E_SUCCESS;
+
+        /* The kernel space is the same everywhere */
+        if (old == NULL || old->virtual_memory != task->virtual_memory) {
+                if (old != NULL)
+                        vm_unload_task(cpuid, old->virtual_memory);
+                vm_load_task(cpuid, task->virtual_memory);
+        }
+
+        x86_fpu_switch(old_t, thrd);
+        set_current_task(task);
+        /* Where interrupts from ring 3 land, if the thread ever goes there */
+        x86_percpu_this()->tss.esp0 = (addr_t)thrd->ss + thrd->ss_size;
+
+        if (old_t != NULL)
+                x86_switch_stack(&old_t->stack, thrd->stack);
+        else
+                x86_switch_stack(&context_boot_stack[cpuid], thrd->stack);
+
+        /* We're back, someone switched to us again */
+        return -E_SUCCESS;
+}
+
+#ifdef CTX_BENCH
+#define CTX_BENCH_RUNS 0x10000
+
+static struct task* ctx_bench_ping;
+static struct task* ctx_bench_pong;
+static volatile int ctx_bench_fpu;
+static volatile int ctx_bench_stop;
+static volatile int ctx_bench_done;
 
-        if (old != NULL) {
-                old_t = old->threads->thread[old->current_thread];
+static void ctx_bench_loop(void* arg __attribute__((unused)))
+{
+        while (!ctx_bench_stop) {
+                if (ctx_bench_fpu)
+                        __asm__ __volatile__ ("fnop");
+                context_switch(get_cpu(), ctx_bench_ping);
         }
-        thrd = task->threads->thread[task->current_thread];
-
-        /*
-         * Swap the virtual memory.
-         * If all goes well the kernel space won't change.
-         */
-        if (old != NULL) {
-                vm_unload_task(cpuid, old->virtual_memory);
+
+        /* The last switch here came from sched, finish it like sched does */
+        sched_finish();
+        ctx_bench_done = 1;
+        kthread_exit();
+}
+
+static uint32_t ctx_bench_run(int cpu, int fpu)
+{
+        ctx_bench_fpu = fpu;
+        /* Get both sides into the loop first */
+        context_switch(cpu, ctx_bench_pong);
+
+        uint64_t start = get_cpu_tick();
+        int i = 0;
+        for (; i < CTX_BENCH_RUNS; i++) {
+                if (fpu)
+                        __asm__ __volatile__ ("fnop");
+                context_switch(cpu, ctx_bench_pong);
         }
-        vm_load_task(cpuid, task->virtual_memory);
-
-        /** \todo push floating point registers and push pointer */
-
-        /*
-         * pusha        Push all registers to stack
-         * mov esp, %0  Move the old stack pointer to data structure
-         * mov %0, esp  Move the new stack pointer from data structure
-         * popa         Pop all (the new) registers from stack
-         */
-        __asm__ ("pusha\n\t"
-                        :
-                        :
-                        :
-        );
-
-        if (old != NULL) {
-                __asm__ ("mov %%esp, %0\n\t"
-                                : "=r" (old_t->stack)
-                                :
-                                :
-                );
+        uint64_t cycles = get_cpu_tick() - start;
+
+        /* Every run switches there and back again */
+        return x86_div64_32(cycles, 2 * CTX_BENCH_RUNS);
+}
+
+/**
+ * \fn context_switch_bench
+ * \brief Measure a switch by bouncing between the caller and a second task
+ *
+ * Once with neither side touching the fpu, once with both using it between
+ * switches, so every switch takes the lazy fpu trap.
+ *
+ * The second task is a kernel thread that is switched to directly, bypassing
+ * the scheduler. Afterwards it is handed to the scheduler to exit.
+ */
+void context_switch_bench()
+{
+        struct task* ping = get_current_task();
+        if (ping == NULL) {
+                warning("No task to run the context switch benchmark from\n");
+                return;
+        }
+        struct task* pong = kthread_create(ctx_bench_loop, NULL, "ctx-bench");
+        if (pong == NULL) {
+                warning("Not enough memory for the context switch benchmark\n");
+                return;
         }
-        __asm__ ("mov %0, %%esp\n\t"
-                        "popa\n\t"
-                        :
-                        : "r" (thrd->stack)
-                        :
-        );
 
-        /** \todo pop pointer and pop floating point registers */
+        /* Start straight in the loop, nothing switches to it through sched */
+        x86_thread_setup(pong->current_thread, ctx_bench_loop, NULL);
+        /* Only borrowed, so the switches don't reload the address space */
+        pong->virtual_memory = ping->virtual_memory;
+        ctx_bench_ping = ping;
+        ctx_bench_pong = pong;
+        ctx_bench_stop = 0;
+        ctx_bench_done = 0;
 
-        /* We should now have switched tasks */
-        return -E_SUCCESS;
+        int state = disableInterrupts();
+        int cpu = get_cpu();
+        uint32_t plain = ctx_bench_run(cpu, 0);
+        uint32_t fpu = 0;
+        if (x86_fpu_enabled())
+                fpu = ctx_bench_run(cpu, 1);
+        pong->virtual_memory = NULL;
+        kthread_bind(pong, cpu);
+        if (state)
+                enableInterrupts();
+
+        printf("Context switch: %i cycles, %i with the fpu in use\n", plain,
+                        fpu);
+
+        /* Let it out of the loop, it is freed once it has exited */
+        ctx_bench_stop = 1;
+        sched_enqueue(pong);
+        while (!ctx_bench_done)
+                sched();
 }
+#endif
@@ -20,8 +20,12 @@
 #include <arch/x86/GDT.h>
 #include <stdlib.h>
 #include <mm/paging.h>
+#include <andromeda/system.h>
+#include <arch/x86/percpu.h>
 
-gdtEntry_t GDT[5];
+#define ENTRIES 7
+
+gdtEntry_t GDT[ENTRIES];
 
 /**
  * The code below holds ifdefs called FAST. This is because the code that's
@@ -40,8 +44,29 @@ void setEntry(int num, unsigned int base, unsigned int limit,
 void setEntry(int num, unsigned int base, unsigned int limit,
                                            unsigned int type, unsigned int dpl);
 #endif
+static void gdt_set_base(gdtEntry_t* entry, unsigned int base);
+static void gdt_set_tss(gdtEntry_t* entry, struct x86_tss* tss);
 
-#define ENTRIES 5
+/**
+ * \fn x86_tss_setup
+ * \brief Point the TSS entry of a GDT at the TSS of a cpu, and load it
+ * \param cpu
+ * \param gdt
+ *
+ * Call after loading the GDT. The kernel stack is filled in by every task
+ * switch.
+ */
+static void x86_tss_setup(int cpu, gdtEntry_t* gdt)
+{
+  struct x86_tss* tss = &x86_percpu[cpu].tss;
+  memset(tss, 0, sizeof(*tss));
+  tss->ss0 = 0x10;
+  /* No I/O permission bitmap, ring 3 gets no ports */
+  tss->iomap_base = sizeof(*tss);
+
+  gdt_set_tss(&gdt[X86_TSS_ENTRY], tss);
+  __asm__ __volatile__ ("ltr %w0" : : "r" (X86_TSS_SEL));
+}
 
 /// All this does is set the general descriptor table to a flat memory model.
 /// For all I know this is only necessary on intel machines as they support
@@ -64,6 +89,7 @@ void setGDT()
   setEntry(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Data segment
   setEntry(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // User mode code segment
   setEntry(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User mode data segment
+  setEntry(5, 0, 0xFFFFFFFF, 0x92, 0xCF); // Per cpu data segment
   #else
   //void setEntry (int num, unsigned int base,
   //unsigned int limit, unsigned int type, unsigned int dpl)
@@ -72,8 +98,16 @@ void setGDT()
   setEntry (2, 0, 0xFFFFFFFF, 0x2, 0x0);
   setEntry (3, 0, 0xFFFFFFFF, 0xA, 0x3);
   setEntry (4, 0, 0xFFFFFFFF, 0x2, 0x3);
+  setEntry (5, 0, 0xFFFFFFFF, 0x2, 0x0);
   #endif
 
+  /*
+   * The boot cpu gets the first per cpu area, the others patch in their own
+   * in x86_gdt_cpu_init.
+   */
+  x86_percpu_setup(0);
+  gdt_set_base(&GDT[X86_PERCPU_ENTRY], (unsigned int)&x86_percpu[0]);
+
   /*
    * Load the GDT into the CPU.(1)
    */
@@ -95,11 +129,41 @@ void setGDT()
 
   #endif
   lgdt(&gdt);
+  x86_percpu_load();
+  x86_tss_setup(0, GDT);
   #ifdef GDTTEST
   printf("checkpoint 2\n");
   #endif
 }
 
+/**
+ * \fn x86_gdt_cpu_init
+ * \brief Give an application processor a GDT of its own and load it
+ * \param cpu
+ *
+ * The boot cpu keeps using GDT. The others start out with a copy of it, with
+ * the per cpu entry pointed at their own area.
+ */
+static gdtEntry_t cpu_gdt[CPU_LIMIT][ENTRIES];
+
+void x86_gdt_cpu_init(int cpu)
+{
+  if (cpu <= 0 || cpu >= CPU_LIMIT)
+    return;
+
+  memcpy(cpu_gdt[cpu], GDT, sizeof(GDT));
+  x86_percpu_setup(cpu);
+  gdt_set_base(&cpu_gdt[cpu][X86_PERCPU_ENTRY],
+               (unsigned int)&x86_percpu[cpu]);
+
+  struct gdtPtr gdt;
+  gdt.limit = sizeof(gdtEntry_t)*ENTRIES;
+  gdt.baseAddr = (unsigned int)((void*)cpu_gdt[cpu]);
+  lgdt(&gdt);
+  x86_percpu_load();
+  x86_tss_setup(cpu, cpu_gdt[cpu]);
+}
+
 #ifdef X86
 #ifdef FAST
 void setEntry(int num, unsigned int base, unsigned int limit,
@@ -114,6 +178,20 @@ void setEntry(int num, unsigned int base, unsigned int limit,
    GDT[num].granularity |= gran & 0xF0;
    GDT[num].access      = access;
 }
+
+static void gdt_set_base(gdtEntry_t* entry, unsigned int base)
+{
+   entry->base_low      = (base & 0xFFFFFF);
+   entry->base_high     = (base >> 24) & 0xFF;
+}
+
+static void gdt_set_tss(gdtEntry_t* entry, struct x86_tss* tss)
+{
+   entry->limit_low     = sizeof(*tss) - 1;
+   entry->granularity   = 0;
+   entry->access        = 0x89; // Present, ring 0, available 32 bits TSS
+   gdt_set_base(entry, (unsigned int)tss);
+}
 #else
 void setEntry (int num, unsigned int base, unsigned int limit,
                                             unsigned int type, unsigned int dpl)
@@ -149,6 +227,27 @@ void setEntry (int num, unsigned int base, unsigned int limit,
     GDT[num].mode	= 1;
   }
 }
+
+static void gdt_set_base(gdtEntry_t* entry, unsigned int base)
+{
+  entry->baseLow	= (base & 0xFFFFFF);
+  entry->baseHigh	= (base >> 24) & 0xFF;
+}
+
+static void gdt_set_tss(gdtEntry_t* entry, struct x86_tss* tss)
+{
+  entry->limit		= sizeof(*tss) - 1;
+  entry->limitHigh	= 0;
+  entry->type		= 0x9; // Available 32 bits TSS
+  entry->s		= 0;
+  entry->dpl		= 0;
+  entry->one		= 1;
+  entry->avl		= 0;
+  entry->zero		= 0;
+  entry->mode		= 0;
+  entry->granularity	= 0;
+  gdt_set_base(entry, (unsigned int)tss);
+}
 #endif
 #endif
 
@@ -21,6 +21,7 @@
 #include <types.h>
 #include <andromeda/error.h>
 #include <arch/x86/pte.h>
+#include <arch/x86/timer.h>
 #include "page_table.h"
 
 #ifdef SLOB
@@ -36,22 +37,172 @@ static volatile mutex_t pte_lock = mutex_unlocked;
 
 /**
  * \fn x86_cnt_pt_entries
+ * \brief Count the entries in use in a page table
  * \param pte
- * \return
+ * \return The number of present or unloaded entries
+ * \warning The caller is expected to hold pte_lock
  */
 static int
 x86_cnt_pt_entries(struct page_table* pte)
 {
-        mutex_lock(&pte_lock);
         int cnt, i;
         for (cnt = 0, i = 0; i < 0x400; i++)
-                cnt += pte[i].present;
-
-        mutex_unlock(&pte_lock);
+                cnt += pte[i].present | pte[i].unloaded;
 
         return cnt;
 }
 
+/**
+ * \var x86_pt_pool
+ * \brief Page tables waiting to be reused
+ * \var x86_pt_pool_clean
+ * \brief Number of pre-zeroed page tables at the bottom of the pool
+ * \var x86_pt_pool_cnt
+ * \brief Total number of page tables in the pool
+ *
+ * The pool is split in two halves. The lower x86_pt_pool_clean entries have
+ * been zeroed and can be hooked into the page directory right away. The
+ * entries above that were released by x86_pte_unset_page and still have to be
+ * cleared by x86_pte_pt_pool_refill.
+ */
+static struct page_table* x86_pt_pool[X86_PT_POOL_SIZE];
+static volatile int x86_pt_pool_clean = 0;
+static volatile int x86_pt_pool_cnt = 0;
+
+/**
+ * \fn x86_pte_pt_alloc
+ * \brief Allocate a fresh page table from the allocator
+ * \return A page table, not zeroed, or NULL if out of memory
+ */
+static struct page_table*
+x86_pte_pt_alloc()
+{
+#ifdef SLAB
+        return mm_cache_alloc(x86_pte_pt_cache, 0);
+#elif defined SLOB
+        return alloc(sizeof(struct page_table)*1024, TRUE);
+#endif
+}
+
+/**
+ * \fn x86_pte_pt_release
+ * \brief Hand a page table back to the allocator
+ * \param pt
+ */
+static void
+x86_pte_pt_release(struct page_table* pt)
+{
+#ifdef SLAB
+        mm_cache_free(x86_pte_pt_cache, pt);
+#elif defined SLOB
+        free(pt, sizeof(struct page_table)*1024);
+#endif
+}
+
+/**
+ * \fn x86_pte_pt_get
+ * \brief Get a zeroed page table to hook into the page directory
+ * \return A zeroed page table
+ * \warning The caller is expected to hold pte_lock
+ *
+ * A pre-zeroed table is taken from the pool when available. Dirty tables are
+ * cleared on the spot before resorting to the allocator, so that only an
+ * empty pool costs an allocation.
+ */
+static struct page_table*
+x86_pte_pt_get()
+{
+        struct page_table* pt;
+        if (x86_pt_pool_clean > 0) {
+                x86_pt_pool_clean--;
+                x86_pt_pool_cnt--;
+                pt = x86_pt_pool[x86_pt_pool_clean];
+                x86_pt_pool[x86_pt_pool_clean] = x86_pt_pool[x86_pt_pool_cnt];
+                x86_pt_pool[x86_pt_pool_cnt] = NULL;
+                return pt;
+        }
+        if (x86_pt_pool_cnt > 0) {
+                x86_pt_pool_cnt--;
+                pt = x86_pt_pool[x86_pt_pool_cnt];
+                x86_pt_pool[x86_pt_pool_cnt] = NULL;
+        } else {
+                pt = x86_pte_pt_alloc();
+                if (pt == NULL)
+                        panic("Out of memory! (And unicorns)");
+        }
+        clear_page(pt);
+        return pt;
+}
+
+/**
+ * \fn x86_pte_pt_put
+ * \brief Return an empty page table to the pool
+ * \param pt
+ * \warning The caller is expected to hold pte_lock
+ *
+ * Tables are only handed back to the allocator once the pool holds more than
+ * X86_PT_POOL_HIGH entries, so mapping and unmapping in the same 4 MiB region
+ * doesn't bounce tables through the allocator.
+ */
+static void
+x86_pte_pt_put(struct page_table* pt)
+{
+        if (x86_pt_pool_cnt >= X86_PT_POOL_HIGH) {
+                x86_pte_pt_release(pt);
+                return;
+        }
+        x86_pt_pool[x86_pt_pool_cnt++] = pt;
+}
+
+/**
+ * \fn x86_pte_pt_pool_refill
+ * \brief Zero released page tables and top up the pool
+ * \return A standard error code
+ *
+ * Meant to be called when there is nothing else to do (e.g. from the idle
+ * loop). At most one table is processed per lock acquisition, so the lock is
+ * never held for longer than it takes to clear a single page.
+ */
+int
+x86_pte_pt_pool_refill()
+{
+        struct page_table* pt;
+        for (;;) {
+                if (mutex_test(&pte_lock) != 0)
+                        return -E_LOCKED;
+
+                if (x86_pt_pool_clean < x86_pt_pool_cnt) {
+                        /* Zero the first dirty entry */
+                        pt = x86_pt_pool[x86_pt_pool_clean];
+                        clear_page(pt);
+                        x86_pt_pool_clean++;
+                        mutex_unlock(&pte_lock);
+                        continue;
+                }
+                if (x86_pt_pool_cnt >= X86_PT_POOL_LOW) {
+                        mutex_unlock(&pte_lock);
+                        return -E_SUCCESS;
+                }
+                mutex_unlock(&pte_lock);
+
+                pt = x86_pte_pt_alloc();
+                if (pt == NULL)
+                        return -E_NOMEM;
+                clear_page(pt);
+
+                mutex_lock(&pte_lock);
+                if (x86_pt_pool_cnt >= X86_PT_POOL_SIZE) {
+                        mutex_unlock(&pte_lock);
+                        x86_pte_pt_release(pt);
+                        return -E_SUCCESS;
+                }
+                /* Keep the clean entries contiguous at the bottom */
+                x86_pt_pool[x86_pt_pool_cnt++] = x86_pt_pool[x86_pt_pool_clean];
+                x86_pt_pool[x86_pt_pool_clean++] = pt;
+                mutex_unlock(&pte_lock);
+        }
+}
+
 /**
  * \fn x86_pte_set_page
  * \brief Set the page table entry to the correct value
@@ -112,14 +263,23 @@ static int x86_pte_set_pt(struct page_table* pt, int idx)
  * \brief Disable a page table
  * \param idx
  * \brief The page table to disable
+ *
+ * The page table itself is handed to the pool, to be zeroed and reused.
+ * Tables in the kernel half are shared between all address spaces (and partly
+ * come from the linker script) so those are left in place.
  */
 static int x86_pte_unset_pt(int idx)
 {
         if (idx >= 1024)
                 return -E_INVALID_ARG;
+        if (idx >= X86_PT_KERNEL_IDX)
+                return -E_SUCCESS;
 
         /* find the entry and mark in not present */
         vpd[idx].present = 0;
+        if (vpt[idx] != NULL)
+                x86_pte_pt_put(vpt[idx]);
+        vpt[idx] = NULL;
         return -E_SUCCESS;
 }
 
@@ -146,14 +306,7 @@ int x86_pte_set_page(void* virt, void* phys, int cpl)
         pt = vpt[pde];
         if (pt == NULL || !vpd[pde].present)
         {
-#ifdef SLAB
-                pt = mm_cache_alloc(x86_pte_pt_cache, 0);
-#elif defined SLOB
-                pt = alloc(sizeof(*pt)*1024, TRUE);
-#endif
-                if (pt == NULL)
-                        panic("Out of memory! (And unicorns)");
-                memset(pt, 0, sizeof(*pt)*1024);
+                pt = x86_pte_pt_get();
                 x86_pte_set_pt(get_phys(0,pt), pde);
                 vpt[pde] = pt;
         }
@@ -168,12 +321,14 @@ int x86_pte_set_page(void* virt, void* phys, int cpl)
 }
 
 /**
- * \fn x86_pte_unset_page
- * \brief Disable access to this one virtual address
+ * \fn x86_pte_reset_page
+ * \brief Clear the page table entry of a virtual address
  * \param virt
+ * \param flush
+ * \brief Invalidate the TLB entry if non-zero
  * \return A standard error code
  */
-int x86_pte_unset_page(void* virt)
+static int x86_pte_reset_page(void* virt, int flush)
 {
         if (virt == NULL && ((addr_t)virt & 0xFFF) != 0)
                 panic("Invalid pointer in x86_pte_unset_page");
@@ -191,7 +346,8 @@ int x86_pte_unset_page(void* virt)
         }
 
         int ret = x86_pte_unset(&pt[pte]);
-        asm ("invlpg (%0)" :: "r" (virt) : "memory");
+        if (flush)
+                asm ("invlpg (%0)" :: "r" (virt) : "memory");
         if (x86_cnt_pt_entries(pt) <= 0)
                 x86_pte_unset_pt(pde);
 
@@ -200,11 +356,114 @@ int x86_pte_unset_page(void* virt)
         return ret;
 }
 
+/**
+ * \fn x86_pte_unset_page
+ * \brief Disable access to this one virtual address
+ * \param virt
+ * \return A standard error code
+ */
+int x86_pte_unset_page(void* virt)
+{
+        return x86_pte_reset_page(virt, 1);
+}
+
+/**
+ * \fn x86_pte_unset_page_lazy
+ * \brief Disable access to a virtual address, but leave the TLB alone
+ * \param virt
+ * \return A standard error code
+ *
+ * The translation stays cached until x86_pte_flush is called. This allows a
+ * whole batch of pages to be torn down with a single TLB flush.
+ */
+int x86_pte_unset_page_lazy(void* virt)
+{
+        return x86_pte_reset_page(virt, 0);
+}
+
+/**
+ * \fn x86_pte_flush
+ * \brief Flush all non-global entries from the TLB
+ * \return A standard error code
+ */
+int x86_pte_flush()
+{
+        asm ("mov %%cr3, %%eax\n\t"
+             "mov %%eax, %%cr3\n\t"
+             ::: "%eax", "memory");
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn x86_pte_test_flag
+ * \brief Test and clear the accessed or dirty bit of a mapped page
+ * \param virt
+ * \param dirty
+ * \brief Test the dirty bit if non-zero, the accessed bit otherwise
+ * \return 1 if the bit was set, 0 if not, or an error code
+ */
+static int x86_pte_test_flag(void* virt, int dirty)
+{
+        addr_t v = (addr_t)virt >> 12;
+
+        int pte = v & 0x3FF;
+        int pde = (v >> 10) & 0x3FF;
+
+        mutex_lock(&pte_lock);
+        struct page_table* pt = vpt[pde];
+        if (pt == NULL || !vpd[pde].present || !pt[pte].present)
+        {
+                mutex_unlock(&pte_lock);
+                return -E_NOT_FOUND;
+        }
+
+        int ret;
+        if (dirty)
+        {
+                ret = pt[pte].dirty;
+                pt[pte].dirty = 0;
+        }
+        else
+        {
+                ret = pt[pte].accessed;
+                pt[pte].accessed = 0;
+        }
+        /* Otherwise the cpu won't set the bit again */
+        if (ret)
+                asm ("invlpg (%0)" :: "r" (virt) : "memory");
+        mutex_unlock(&pte_lock);
+
+        return ret;
+}
+
+/**
+ * \fn x86_pte_test_accessed
+ * \brief Test and clear the accessed bit of a mapped page
+ * \param virt
+ * \return 1 if the page was accessed, 0 if not, or an error code
+ */
+int x86_pte_test_accessed(void* virt)
+{
+        return x86_pte_test_flag(virt, 0);
+}
+
+/**
+ * \fn x86_pte_test_dirty
+ * \brief Test and clear the dirty bit of a mapped page
+ * \param virt
+ * \return 1 if the page was written to, 0 if not, or an error code
+ */
+int x86_pte_test_dirty(void* virt)
+{
+        return x86_pte_test_flag(virt, 1);
+}
+
 int idx = 0;
 
 void
 x86_pagefault(isrVal_t* registers)
 {
+        uint64_t start = get_cpu_tick();
         addr_t fault_addr = 0;
         asm ("mov %%cr2, %%eax\n\t"
              "mov %%eax, %0\n\t"
@@ -241,6 +500,7 @@ x86_pagefault(isrVal_t* registers)
                 }
         }
 //      printf("End of interrupt: #%i\n", idx--);
+        vm_fault_account(get_cpu_tick() - start);
 }
 
 /**
@@ -27,6 +27,21 @@
 extern "C" {
 #endif
 
+/**
+ * \def X86_PT_POOL_SIZE
+ * \brief Maximum number of page tables kept around for reuse
+ * \def X86_PT_POOL_LOW
+ * \brief Number of zeroed page tables the refill routine aims for
+ * \def X86_PT_POOL_HIGH
+ * \brief Above this many pooled tables released ones get freed
+ * \def X86_PT_KERNEL_IDX
+ * \brief First page directory entry of the kernel half
+ */
+#define X86_PT_POOL_SIZE 0x20
+#define X86_PT_POOL_LOW  0x8
+#define X86_PT_POOL_HIGH 0x18
+#define X86_PT_KERNEL_IDX 768
+
 #ifdef SLAB
 
 #include <mm/cache.h>
@@ -0,0 +1,422 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/spinlock.h>
+#include <stdio.h>
+#include <thread.h>
+#include <types.h>
+#if defined LOCK_STATS || defined LOCK_TEST
+#include <arch/x86/timer.h>
+#include <mm/vm.h>
+#endif
+#ifdef LOCK_TEST
+#include <arch/x86/smp.h>
+#endif
+
+/**
+ * \addtogroup x86_spinlock
+ * @{
+ *
+ * Taking a lock is a single lock xadd on the ticket half word. Waiters only
+ * read the lock while spinning, and back off in proportion to the number of
+ * cpus ahead of them in the queue, so the cache line isn't hammered and the
+ * lock is handed out in FIFO order.
+ */
+
+#ifdef LOCK_STATS
+/**
+ * \struct spinlock_held
+ * \brief A lock currently held by a cpu, for measuring the hold time
+ */
+struct spinlock_held {
+        spinlock_t* lock;
+        struct spinlock_stats* site;
+        uint64_t start;
+};
+
+static struct spinlock_stats spinlock_sites[SPINLOCK_SITES];
+static struct spinlock_held spinlock_held[CPU_LIMIT][SPINLOCK_HELD];
+static int spinlock_depth[CPU_LIMIT];
+
+static void spinlock_add64(volatile uint64_t* ptr, uint64_t val)
+{
+        int64_t old = *ptr;
+        int64_t prev;
+        while ((prev = x86_atomic_cmpxchg64((volatile int64_t*)ptr, old,
+                        old + val)) != old)
+                old = prev;
+}
+
+/**
+ * \fn spinlock_site
+ * \brief Find or claim the statistics slot for a call site
+ * \return The slot or NULL if the table is full
+ */
+static struct spinlock_stats* spinlock_site(addr_t site)
+{
+        int idx = (site >> 2) % SPINLOCK_SITES;
+        int i = 0;
+        for (; i < SPINLOCK_SITES; i++) {
+                struct spinlock_stats* s = &spinlock_sites[idx];
+                if (s->site == site)
+                        return s;
+                if (s->site == 0 && x86_atomic_cmpxchg(
+                                (volatile uint32_t*)&s->site, 0, site) == 0)
+                        return s;
+                if (s->site == site)
+                        return s;
+                idx = (idx + 1) % SPINLOCK_SITES;
+        }
+        return NULL;
+}
+
+/**
+ * \fn spinlock_account
+ * \brief Record a lock acquisition
+ */
+static void spinlock_account(spinlock_t* lock, addr_t site, uint64_t start,
+                int contended)
+{
+        struct spinlock_stats* s = spinlock_site(site);
+        if (s == NULL)
+                return;
+
+        uint64_t now = get_cpu_tick();
+        uint64_t wait = now - start;
+        x86_atomic_xadd(&s->acquired, 1);
+        if (contended) {
+                x86_atomic_xadd(&s->contended, 1);
+                spinlock_add64(&s->wait, wait);
+                if (wait > s->wait_max)
+                        s->wait_max = wait;
+        }
+
+        int cpu = get_cpu();
+        int depth = spinlock_depth[cpu];
+        if (depth >= SPINLOCK_HELD)
+                return;
+        spinlock_held[cpu][depth].lock = lock;
+        spinlock_held[cpu][depth].site = s;
+        spinlock_held[cpu][depth].start = now;
+        spinlock_depth[cpu] = depth + 1;
+}
+
+/**
+ * \fn spinlock_release
+ * \brief Record the hold time of a lock that is about to be released
+ */
+static void spinlock_release(spinlock_t* lock)
+{
+        int cpu = get_cpu();
+        int depth = spinlock_depth[cpu];
+        int i = depth - 1;
+
+        /* Locks are usually released in reverse order, so start at the top */
+        for (; i >= 0; i--) {
+                if (spinlock_held[cpu][i].lock == lock)
+                        break;
+        }
+        if (i < 0)
+                return;
+
+        struct spinlock_stats* s = spinlock_held[cpu][i].site;
+        uint64_t hold = get_cpu_tick() - spinlock_held[cpu][i].start;
+        spinlock_add64(&s->hold, hold);
+        if (hold > s->hold_max)
+                s->hold_max = hold;
+
+        for (; i < depth - 1; i++)
+                spinlock_held[cpu][i] = spinlock_held[cpu][i + 1];
+        spinlock_depth[cpu] = depth - 1;
+}
+
+/**
+ * \fn spinlock_get_stats
+ * \brief Copy out the statistics of a call site
+ * \param stats
+ * \param idx
+ * \return A standard error code, -E_NOT_FOUND if the slot is unused
+ */
+int spinlock_get_stats(struct spinlock_stats* stats, int idx)
+{
+        if (stats == NULL)
+                return -E_NULL_PTR;
+        if (idx < 0 || idx >= SPINLOCK_SITES)
+                return -E_OUTOFBOUNDS;
+        if (spinlock_sites[idx].site == 0)
+                return -E_NOT_FOUND;
+
+        memcpy(stats, &spinlock_sites[idx], sizeof(*stats));
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn spinlock_dump_stats
+ * \brief Print the statistics of the contended call sites
+ */
+void spinlock_dump_stats()
+{
+        struct spinlock_stats s;
+        int i = 0;
+        for (; i < SPINLOCK_SITES; i++) {
+                if (spinlock_get_stats(&s, i) != -E_SUCCESS)
+                        continue;
+                if (s.contended == 0)
+                        continue;
+                printf("lock at %X: %X taken, %X contended\n", s.site,
+                                s.acquired, s.contended);
+                printf("wait avg %X max %X, hold avg %X max %X\n",
+                                (uint32_t)(s.wait / s.contended), s.wait_max,
+                                (uint32_t)(s.hold / s.acquired), s.hold_max);
+        }
+}
+#endif
+
+/**
+ * \fn spinlock_acquire
+ * \brief Queue up for the lock and wait for our turn
+ * \param lock
+ * \param site
+ * \brief The caller, for the statistics
+ */
+static inline void
+spinlock_acquire(spinlock_t* lock, addr_t site __attribute__((unused)))
+{
+#ifdef LOCK_STATS
+        uint64_t start = get_cpu_tick();
+#endif
+        uint16_t ticket = x86_atomic_xadd16((volatile uint16_t*)lock, 1);
+        uint16_t owner = SPINLOCK_OWNER(*lock);
+        int contended = (owner != ticket);
+
+        while (owner != ticket) {
+                uint32_t spins = (uint16_t)(ticket - owner) * SPINLOCK_BACKOFF;
+                if (spins > SPINLOCK_BACKOFF_MAX)
+                        spins = SPINLOCK_BACKOFF_MAX;
+                for (; spins > 0; spins--)
+                        x86_pause();
+                owner = SPINLOCK_OWNER(*lock);
+        }
+        /* Keep the critical section from being hoisted above the loop */
+        asm volatile ("" ::: "memory");
+
+#ifdef LOCK_STATS
+        spinlock_account(lock, site, start, contended);
+#else
+        (void)contended;
+#endif
+}
+
+void mutex_lock(spinlock_t* lock)
+{
+        spinlock_acquire(lock, (addr_t)__builtin_return_address(0));
+}
+
+/**
+ * \fn mutex_test
+ * \brief Try to take the lock without waiting
+ * \param lock
+ * \return mutex_unlocked if the lock was free and is now ours, mutex_locked
+ * otherwise
+ */
+unsigned int mutex_test(spinlock_t* lock)
+{
+        uint32_t old = *lock;
+        if (SPINLOCK_OWNER(old) != SPINLOCK_TICKET(old))
+                return mutex_locked;
+
+        /* Take the next ticket, without carrying into the owner */
+        uint32_t new = (old & 0xFFFF0000) | SPINLOCK_TICKET(old + 1);
+        if (x86_atomic_cmpxchg(lock, old, new) != old)
+                return mutex_locked;
+
+#ifdef LOCK_STATS
+        spinlock_account(lock, (addr_t)__builtin_return_address(0),
+                        get_cpu_tick(), 0);
+#endif
+        return mutex_unlocked;
+}
+
+void mutex_unlock(spinlock_t* lock)
+{
+#ifdef LOCK_STATS
+        spinlock_release(lock);
+#endif
+        /*
+         * Only the holder ever writes the owner half, so it doesn't need a
+         * lock prefix. Stores aren't reordered with older loads and stores
+         * on x86, so all that's needed is to stop the compiler.
+         */
+        asm volatile ("incw %0"
+                        : "+m" (*((volatile uint16_t*)lock + 1))
+                        :
+                        : "memory", "cc");
+}
+
+/**
+ * \fn mutex_lock_irqsave
+ * \brief Disable interrupts on this cpu and take the lock
+ * \param lock
+ * \return The previous interrupt state, to hand to mutex_unlock_irqrestore
+ */
+int mutex_lock_irqsave(spinlock_t* lock)
+{
+        int state = cpu_disable_interrupts(0);
+        spinlock_acquire(lock, (addr_t)__builtin_return_address(0));
+        return state;
+}
+
+/**
+ * \fn mutex_unlock_irqrestore
+ * \brief Release the lock and restore the interrupt state
+ * \param lock
+ * \param state
+ */
+void mutex_unlock_irqrestore(spinlock_t* lock, int state)
+{
+        mutex_unlock(lock);
+        if (state == INTERRUPTS_ENABLED)
+                cpu_enable_interrupts(0);
+}
+
+#ifdef LOCK_TEST
+#define SPINLOCK_STRESS_RUNS 0x10000
+
+static spinlock_t spinlock_stress_lock = mutex_unlocked;
+static volatile uint32_t spinlock_stress_cnt;
+static atomic_t spinlock_stress_done;
+static volatile int spinlock_stress_ret;
+
+/**
+ * \fn spinlock_stress
+ * \brief Hammer a single lock, run on every cpu at the same time
+ * \param cpus
+ * \brief The number of cpus taking part
+ * \return A standard error code
+ *
+ * The counter is updated with a plain read and write, with a pause in
+ * between to widen the window. Any lost update means mutual exclusion is
+ * broken. The last cpu to finish checks the result.
+ */
+int spinlock_stress(int cpus)
+{
+        uint64_t start = get_cpu_tick();
+        int i = 0;
+        for (; i < SPINLOCK_STRESS_RUNS; i++) {
+                mutex_lock(&spinlock_stress_lock);
+                uint32_t cnt = spinlock_stress_cnt;
+                x86_pause();
+                spinlock_stress_cnt = cnt + 1;
+                mutex_unlock(&spinlock_stress_lock);
+        }
+        uint64_t cycles = get_cpu_tick() - start;
+
+        printf("cpu %X: %i cycles per lock round trip\n", get_cpu(),
+                        (int)(cycles / SPINLOCK_STRESS_RUNS));
+
+        if (atomic_inc(&spinlock_stress_done) != cpus)
+                return -E_SUCCESS;
+
+        if (spinlock_stress_cnt != (uint32_t)cpus * SPINLOCK_STRESS_RUNS) {
+                printf("Lost %X updates\n", (uint32_t)cpus *
+                                SPINLOCK_STRESS_RUNS - spinlock_stress_cnt);
+                return -E_CORRUPT;
+        }
+        return -E_SUCCESS;
+}
+
+/* Whichever cpu finishes last stores the verdict here */
+static void spinlock_stress_ap(void* arg)
+{
+        int ret = spinlock_stress((int)arg);
+        if (ret != -E_SUCCESS)
+                spinlock_stress_ret = ret;
+}
+
+/**
+ * \fn spinlock_test
+ * \brief Check the lock semantics and run the stress test on all cpus
+ * \return A standard error code
+ */
+int spinlock_test()
+{
+        spinlock_t lock = mutex_unlocked;
+
+        if (mutex_test(&lock) != mutex_unlocked)
+                goto err;
+        if (mutex_test(&lock) != mutex_locked)
+                goto err;
+        mutex_unlock(&lock);
+        if (SPINLOCK_OWNER(lock) != SPINLOCK_TICKET(lock))
+                goto err;
+
+        /* The ticket wraps without touching the owner and the other way round */
+        lock = 0xFFFFFFFF;
+        mutex_lock(&lock);
+        if (lock != 0xFFFF0000)
+                goto err;
+        mutex_unlock(&lock);
+        if (lock != 0)
+                goto err;
+
+        lock = 0xFFFFFFFF;
+        if (mutex_test(&lock) != mutex_unlocked || lock != 0xFFFF0000)
+                goto err;
+        mutex_unlock(&lock);
+
+        int state = mutex_lock_irqsave(&lock);
+        if (mutex_test(&lock) != mutex_locked)
+                goto err;
+        mutex_unlock_irqrestore(&lock, state);
+        if (mutex_test(&lock) != mutex_unlocked)
+                goto err;
+        mutex_unlock(&lock);
+
+        int cpus = smp_cpus();
+        spinlock_stress_cnt = 0;
+        spinlock_stress_ret = -E_SUCCESS;
+        atomic_init(&spinlock_stress_done, 0);
+        int i = 1;
+        for (; i < cpus; i++)
+                smp_call(i, spinlock_stress_ap, (void*)cpus);
+        spinlock_stress_ap((void*)cpus);
+        while (atomic_get(&spinlock_stress_done) != cpus)
+                x86_pause();
+        if (spinlock_stress_ret != -E_SUCCESS)
+                goto err;
+
+#ifdef LOCK_STATS
+        spinlock_dump_stats();
+#endif
+        printf("Spinlock test passed\n");
+        return -E_SUCCESS;
+
+err:
+        printf("Spinlock test failed, lock: %X\n", lock);
+        return -E_CORRUPT;
+}
+#endif
+
+/**
+ * @}
+ * \file
+ */
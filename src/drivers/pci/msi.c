@@ -18,11 +18,16 @@
 
 #include <stdlib.h>
 #include <drivers/pci/msi.h>
-//#include <arch/x86/apic/apic.h>
+#include <andromeda/system.h>
+#include <arch/x86/apic.h>
 #include <arch/x86/irq.h>
+#include <arch/x86/irq_balance.h>
 #include <arch/x86/idt.h>
+#include <arch/x86/smp.h>
 #include <sys/dev/pci.h>
 #include <io.h>
+#include <mm/vm.h>
+#include <mm/page_alloc.h>
 
 #ifdef MSI
 
@@ -152,6 +157,30 @@ msi_enable_msix_entry(struct msi_cfg *cfg, int entry)
   ol_pci_write_dword(cfg->dev, MSI_MESSAGE_CONTROL(cfg->attrib.cpos), msg_ctrl);
 }
 
+/**
+ * Messages are sent to a single local APIC, in physical destination mode.
+ */
+static uint32_t
+msi_address(int cpu)
+{
+  return MSI_LOWER_BASE_ADDRESS | MSI_ADDR_DEST_ID(smp_apic_id(cpu)) |
+         MSI_ADDR_REDIR_CPU | MSI_ADDR_DEST_MODE_PHYSICAL;
+}
+
+/**
+ * Point the message at another cpu, called by the interrupt balancer.
+ */
+static int
+msi_retarget(struct irq_route *route, int cpu)
+{
+  struct msi_cfg *cfg = route->data;
+  if (smp_apic_id(cpu) < 0)
+    return -E_INVALID_ARG;
+  cfg->msi->addr = msi_address(cpu);
+  __msi_write_message(cfg, cfg->msi);
+  return -E_SUCCESS;
+}
+
 static int
 __msi_create_msix_entry(struct pci_dev *dev, uint8_t cp, struct irq_data *irq)
 {
@@ -168,12 +197,7 @@ __msi_create_msix_entry(struct pci_dev *dev, uint8_t cp, struct irq_data *irq)
   cfg->attrib.base = msi_calc_msix_base(dev, cp);
   cfg->irq = irq->irq;
 
-  msi->addr = MSI_LOWER_BASE_ADDRESS | MSI_ADDR_DEST_ID(0) |
-              ((apic->delivery_mode == IRQ_LOW_PRI) ? MSI_ADDR_REDIR_LOWPRI :
-                                        MSI_ADDR_REDIR_CPU) |
-              ((apic->dest_mode == 0) ? MSI_ADDR_DEST_MODE_PHYSICAL :
-                                        MSI_ADDR_DEST_MODE_LOGICAL);
-  printf("address: %x + dest_mode %x\n", msi->addr, apic->dest_mode);
+  msi->addr = msi_address(0);
   msi->addr_hi = MSI_HIGH_BASE_ADDRESS;
   msi->msg.vector = irq->irq_config->vector;
   msi->msg.dm = irq->irq_config->delivery_mode;
@@ -187,8 +211,11 @@ __msi_create_msix_entry(struct pci_dev *dev, uint8_t cp, struct irq_data *irq)
   irq->irq_config->msi = cfg;
   __msi_write_message(cfg, msi);
   msi_enable_msix_entry(cfg, 0); /* enable first entry */
+  irq_route_register(msi->msg.vector, 0, msi_retarget, cfg);
 
+#ifdef MSIX_DEBUG
   debug_msix_entry(cfg);
+#endif
   return 0;
 }
 
@@ -214,8 +241,8 @@ msi_calc_msix_base(struct pci_dev *dev, uint8_t cp)
   else
     bar &= ~0xf;
 
-  page_map_kernel_entry(bar,bar); /* map the address 1:1 */
-  return (volatile void*)bar;
+  /* map the table into the kernel virtual area */
+  return (volatile void*)vmap((void*)(addr_t)bar, PAGE_SIZE);
 }
 
 static uint32_t
@@ -111,6 +111,8 @@
 
 #define SERIAL_MAGIC                    0xC0DE
 
+#define SERIAL_RX_SIZE                  0x100
+
 struct serial_port_data {
         uint16_t magic;
         uint8_t port_status;
@@ -124,49 +126,36 @@ struct serial_port_data {
         uint32_t opened;
         mutex_t port_lock;
         struct vfile* dev_file;
+
+        /* Received bytes, filled by the interrupt handler */
+        char rx_buf[SERIAL_RX_SIZE];
+        volatile uint16_t rx_head;
+        volatile uint16_t rx_tail;
+        struct wait_queue rx_wait;
 };
 
-static int serial_read_data(uint16_t io_port, char* buffer, size_t len)
+/**
+ * \fn serial_receive
+ * \brief Move the received bytes into the ring buffer and wake the readers
+ */
+static int serial_receive(struct serial_port_data* data)
 {
-        if (buffer == NULL || len == 0) {
-                return 0;
-        }
-        size_t i = 0;
-        while ((inb(io_port + SERIAL_LINE_STATUS) & SERIAL_STATUS_RX_READ)) {
-                buffer[i] = inb(io_port);
-                i++;
-                if (i >= len) {
-                        break;
+        int received = 0;
+        while ((inb(data->io_port + SERIAL_LINE_STATUS) & SERIAL_STATUS_RX_READ)) {
+                char c = inb(data->io_port);
+                uint16_t next = (data->rx_head + 1) % SERIAL_RX_SIZE;
+                /* Drop the byte if nobody is reading */
+                if (next == data->rx_tail) {
+                        continue;
                 }
+                data->rx_buf[data->rx_head] = c;
+                data->rx_head = next;
+                received++;
         }
 
-        return i;
-}
-
-#define BUF_LEN 32
-static int serial_read(uint16_t io_port, int timeout)
-{
-        char* buf = kmalloc(BUF_LEN);
-        if (buf == NULL) {
-                inb(io_port);
-                return -E_SUCCESS;
-        }
-        memset(buf, 0, BUF_LEN);
-
-        serial_read_data(io_port, buf, BUF_LEN);
-
-        if (timeout) {
-                printf("timeout: %s\n", buf);
-        } else {
-                printf("out: %s\n", buf);
+        if (received > 0) {
+                wait_queue_wake_all(&data->rx_wait);
         }
-
-        outb(io_port, buf[0]);
-        outb(io_port, '\t');
-        outb(io_port, 'a');
-        outb(io_port, 'c');
-        outb(io_port, 'k');
-        outb(io_port, '\n');
         return -E_SUCCESS;
 }
 
@@ -203,7 +192,7 @@ static int serial_interrupt(uint16_t int_no __attribute__((unused)),
                         break;
                 case SERIAL_IRQ_RX_READY:
                         /* Read receive buffer to clear interrupt */
-                        serial_read(data->io_port, 0);
+                        serial_receive(data);
                         break;
                 case SERIAL_IRQ_TX_EMPTY:
                         /* Read the interrupt identification register or write
@@ -215,7 +204,7 @@ static int serial_interrupt(uint16_t int_no __attribute__((unused)),
                         break;
                 case SERIAL_IRQ_TIMEOUT:
                         /* Read Receive buffer register to clear interrupt */
-                        serial_read(data->io_port, 1);
+                        serial_receive(data);
                         break;
                 default:
                         break;
@@ -311,6 +300,20 @@ static void drv_serial_connect(struct serial_port_data* port)
         return;
 }
 
+static struct serial_port_data* serial_get_port(struct vfile* this)
+{
+        struct device* dev = device_find_id(this->fs_data.device_id);
+        if (dev == NULL) {
+                return NULL;
+        }
+
+        struct serial_port_data* data = dev->device_data;
+        if (dev->device_data_size != sizeof(*data)) {
+                return NULL;
+        }
+        return data;
+}
+
 static size_t drv_serial_io_write(struct vfile* this, char* buffer,
                 size_t idx __attribute__((unused)), size_t len)
 {
@@ -318,13 +321,8 @@ static size_t drv_serial_io_write(struct vfile* this, char* buffer,
                 return 0;
         }
 
-        struct device* dev = device_find_id(this->fs_data.device_id);
-        if (dev == NULL) {
-                return 0;
-        }
-
-        struct serial_port_data* data = dev->device_data;
-        if (dev->device_data_size == sizeof(*data)) {
+        struct serial_port_data* data = serial_get_port(this);
+        if (data == NULL) {
                 return 0;
         }
 
@@ -337,12 +335,42 @@ static size_t drv_serial_io_write(struct vfile* this, char* buffer,
         return 0;
 }
 
-static size_t drv_serial_io_read(struct vfile* this __attribute__((unused)),
-                char* buffer __attribute__((unused)),
-                size_t idx __attribute__((unused)),
-                size_t len __attribute__((unused)))
+static int serial_rx_ready(void* arg)
 {
-        return 0;
+        struct serial_port_data* data = arg;
+        return data->rx_head != data->rx_tail;
+}
+
+/**
+ * \fn drv_serial_io_read
+ * \brief Read received bytes, sleep until at least one has come in
+ */
+static size_t drv_serial_io_read(struct vfile* this, char* buffer,
+                size_t idx __attribute__((unused)), size_t len)
+{
+        if (this == NULL || buffer == NULL || len == 0) {
+                return 0;
+        }
+
+        struct serial_port_data* data = serial_get_port(this);
+        if (data == NULL) {
+                return 0;
+        }
+
+        if (wait_queue_sleep(&data->rx_wait, serial_rx_ready, data, 1)
+                        != -E_SUCCESS) {
+                return 0;
+        }
+
+        mutex_lock(&data->port_lock);
+        size_t i = 0;
+        for (; i < len && data->rx_tail != data->rx_head; i++) {
+                buffer[i] = data->rx_buf[data->rx_tail];
+                data->rx_tail = (data->rx_tail + 1) % SERIAL_RX_SIZE;
+        }
+        mutex_unlock(&data->port_lock);
+
+        return i;
 }
 
 static int drv_serial_ioctl(struct vfile* this, ioctl_t request, void* data)
@@ -520,6 +548,7 @@ static int dev_serial_init(struct device* parent, uint16_t com_port, char* name)
         port->parity = SERIAL_PARITY_NONE;
         port->port_lock = mutex_unlocked;
         port->port_status = 0;
+        wait_queue_init(&port->rx_wait);
 
         /* Configured, now attach to the device structure */
         serial_device->device_data = port;
@@ -210,7 +210,7 @@ int formatDouble(void* buffer, double num, unsigned int base, boolean capital,
                 precision = count - 1;
                 if (precision != 0) // if we should print scientific AND we have more than 1 digit before dot.
                                 {
-                        memcpy((char*) buffer + 2, (char*) buffer + 1, count); // all digits after first digit are moved 1 place to left. (e.g. 12345 becomes 122345)
+                        memmove((char*) buffer + 2, (char*) buffer + 1, count); // all digits after first digit are moved 1 place to left. (e.g. 12345 becomes 122345)
                         *((char*) (buffer + 1)) = '.'; // replace seccond digit with a dot (e.g. 122345 becomes 1.2345)
                         count++;
                 }
@@ -213,6 +213,30 @@ static inline int pipe_read(struct pipe* pipe, char* data, size_t len)
         return ret;
 }
 
+static int pipe_has_data(void* arg)
+{
+        struct pipe* pipe = arg;
+        return pipe->writing_idx != pipe->reading_idx;
+}
+
+/**
+ * \fn pipe_read_block
+ * \brief Read from pipe, sleep until there's at least something to read
+ */
+static int pipe_read_block(struct pipe* pipe, char* data, size_t len)
+{
+        if (pipe == NULL || data == NULL || len == 0) {
+                return -E_INVALID_ARG;
+        }
+
+        int ret = wait_queue_sleep(&pipe->data_wait, pipe_has_data, pipe, 1);
+        if (ret != -E_SUCCESS) {
+                return ret;
+        }
+
+        return pipe_read(pipe, data, len);
+}
+
 /**
  * \fn pipe_write
  * \brief Write to pipe
@@ -275,6 +299,9 @@ static int pipe_write(struct pipe* pipe, char* data, size_t len)
         pipe->writing_idx += i;
 
         err_written: mutex_unlock(&pipe->lock);
+        if (i > 0) {
+                wait_queue_wake_all(&pipe->data_wait);
+        }
         return i;
 
         err: mutex_unlock(&pipe->lock);
@@ -401,6 +428,9 @@ static int pipe_seek_write(struct pipe* this, int shift)
         this->writing_idx = write_idx;
 
         mutex_unlock(&this->lock);
+        if (shifted > 0) {
+                wait_queue_wake_all(&this->data_wait);
+        }
 
         return shifted;
 }
@@ -528,6 +558,7 @@ struct pipe* pipe_new(struct vfile* in_file, struct vfile* out_file)
         memset(p, 0, sizeof(*p));
 
         p->read = pipe_read;
+        p->read_block = pipe_read_block;
         p->write = pipe_write;
         p->seek_read = pipe_seek_read;
         p->seek_write = pipe_seek_write;
@@ -540,6 +571,7 @@ struct pipe* pipe_new(struct vfile* in_file, struct vfile* out_file)
         p->input_file = in_file;
 
         p->data = tree_new_avl();
+        wait_queue_init(&p->data_wait);
 
         return p;
 }
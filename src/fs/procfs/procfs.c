@@ -18,8 +18,29 @@
 
 #warning PROCFS still requires an implementation
 
+#include <fs/procfs.h>
 #include <fs/vfs.h>
 #include <andromeda/system.h>
+
+/**
+ * \addtogroup procfs
+ * @{
+ *
+ * The files of procfs have no contents of their own, they show the state of
+ * the kernel at the moment they're read. Every subsystem registers a show
+ * function for its files, which writes out the whole file.
+ *
+ * Until the vfs can mount, the files are opened by name with
+ * proc_fs_open_file.
+ */
+
+struct proc_fs_file {
+        char name[PROC_FS_NAME_SIZE];
+        proc_fs_show_t show;
+};
+
+static struct proc_fs_file proc_fs_files[PROC_FS_FILES];
+static spinlock_t proc_fs_lock = mutex_unlocked;
 struct vsuper_block*
 proc_fs_init(struct device* drive)
 {
@@ -70,3 +91,109 @@ proc_fs_write(struct vfile* this, char* buf, size_t num)
                 return -E_INVALID_ARG;
         return -E_NOFUNCTION;
 }
+
+/**
+ * \fn proc_fs_register
+ * \brief Add a file to procfs
+ * \param name
+ * \param show
+ * \brief Called to write out the file every time it is read
+ * \return A standard error code
+ */
+int proc_fs_register(char* name, proc_fs_show_t show)
+{
+        if (name == NULL || show == NULL)
+                return -E_NULL_PTR;
+        size_t len = strlen(name);
+        if (len == 0 || len >= PROC_FS_NAME_SIZE)
+                return -E_INVALID_ARG;
+
+        int ret = -E_OUT_OF_RESOURCES;
+        mutex_lock(&proc_fs_lock);
+        int i = 0;
+        for (; i < PROC_FS_FILES; i++) {
+                struct proc_fs_file* f = &proc_fs_files[i];
+                if (f->show != NULL && memcmp(f->name, name, len + 1) == 0) {
+                        ret = -E_ALREADY_INITIALISED;
+                        break;
+                }
+                if (f->show == NULL) {
+                        memcpy(f->name, name, len + 1);
+                        f->show = show;
+                        ret = -E_SUCCESS;
+                        break;
+                }
+        }
+        mutex_unlock(&proc_fs_lock);
+        return ret;
+}
+
+/**
+ * \fn proc_fs_file_read
+ * \brief The fs_data read hook of a procfs file
+ *
+ * Every read shows the file anew, so read it in one go to get a consistent
+ * view.
+ */
+static size_t proc_fs_file_read(struct vfile* file, char* buf, size_t start,
+                size_t len)
+{
+        struct proc_fs_file* f = file->fs_data.fs_data_struct;
+        if (f == NULL || buf == NULL)
+                return 0;
+
+        char* contents = kmalloc(PROC_FS_FILE_SIZE);
+        if (contents == NULL)
+                return 0;
+        size_t size = f->show(contents, PROC_FS_FILE_SIZE);
+        if (size > PROC_FS_FILE_SIZE)
+                size = PROC_FS_FILE_SIZE;
+
+        size_t ret = 0;
+        if (start < size) {
+                ret = (len < size - start) ? len : size - start;
+                memcpy(buf, contents + start, ret);
+        }
+        kfree_s(contents, PROC_FS_FILE_SIZE);
+        return ret;
+}
+
+/**
+ * \fn proc_fs_open_file
+ * \brief Open a procfs file by name
+ * \param name
+ * \return The file, or NULL if there's no such file or no memory
+ */
+struct vfile* proc_fs_open_file(char* name)
+{
+        if (name == NULL)
+                return NULL;
+        size_t len = strlen(name);
+
+        struct proc_fs_file* found = NULL;
+        mutex_lock(&proc_fs_lock);
+        int i = 0;
+        for (; i < PROC_FS_FILES && found == NULL; i++) {
+                struct proc_fs_file* f = &proc_fs_files[i];
+                if (f->show != NULL && len < PROC_FS_NAME_SIZE &&
+                                memcmp(f->name, name, len + 1) == 0)
+                        found = f;
+        }
+        mutex_unlock(&proc_fs_lock);
+        if (found == NULL)
+                return NULL;
+
+        struct vfile* file = vfs_create();
+        if (file == NULL)
+                return NULL;
+        memcpy(file->fs_data.fs_type, "procfs", 7);
+        file->fs_data.fs_data_struct = found;
+        file->fs_data.fs_data_size = sizeof(*found);
+        file->fs_data.read = proc_fs_file_read;
+        return file;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -20,6 +20,15 @@
 #include <stdlib.h>
 #include <mm/paging.h>
 #include <mm/heap.h>
+#include <mm/page_alloc.h>
+#ifdef X86
+#include <arch/x86/cpu.h>
+#endif
+#ifdef MEM_BENCH
+#include <stdio.h>
+#include <andromeda/system.h>
+#include <arch/x86/timer.h>
+#endif
 
 #ifndef SLAB
 #define BASE_HEAP_SIZE 0x400000
@@ -42,6 +51,289 @@ init_heap()
         return -E_SUCCESS;
 }
 #endif
+#ifdef X86
+/*
+ * The string instructions are used for everything. Copies and clears of a
+ * page and up go through the SSE2 non-temporal stores once the cpu has been
+ * found to support them, so they don't flush the rest of the cache.
+ */
+#define MEM_NT_THRESHOLD 0x1000
+/* Interrupts are held off for at most this many bytes at a time */
+#define MEM_NT_CHUNK 0x1000
+
+static int mem_sse2 = 0;
+
+/**
+ * \fn mem_enable_sse2
+ * \brief Start using the SSE2 paths, to be called once SSE is enabled
+ */
+void mem_enable_sse2()
+{
+        mem_sse2 = 1;
+}
+
+/**
+ * \fn mem_disable_sse2
+ * \brief Go back to the string instructions only
+ */
+void mem_disable_sse2()
+{
+        mem_sse2 = 0;
+}
+
+static inline void mem_stos(void* dest, unsigned int val, size_t count)
+{
+        size_t head = (-(addr_t)dest) & 3;
+        if (head > count)
+                head = count;
+        count -= head;
+        size_t dwords = count >> 2;
+        size_t tail = count & 3;
+
+        __asm__ __volatile__ ("cld\n\t"
+                        "rep stosb\n\t"
+                        "mov %3, %%ecx\n\t"
+                        "rep stosl\n\t"
+                        "mov %4, %%ecx\n\t"
+                        "rep stosb"
+                        : "+D" (dest), "+c" (head)
+                        : "a" (val), "g" (dwords), "g" (tail)
+                        : "memory", "cc");
+}
+
+static inline void mem_movs(void* dest, void* src, size_t count)
+{
+        size_t dwords = count >> 2;
+        size_t tail = count & 3;
+
+        __asm__ __volatile__ ("cld\n\t"
+                        "rep movsl\n\t"
+                        "mov %3, %%ecx\n\t"
+                        "rep movsb"
+                        : "+D" (dest), "+S" (src), "+c" (dwords)
+                        : "g" (tail)
+                        : "memory", "cc");
+}
+
+/*
+ * The xmm registers may hold the state of any thread, as the fpu is switched
+ * lazily. Every SSE2 chunk runs with interrupts off, clears CR0.TS so it
+ * doesn't trap into the lazy switch and puts back the registers it used and
+ * TS. Nobody can see them change that way, not even an interrupt handler
+ * doing a copy of its own.
+ */
+struct mem_simd {
+        char save[64];
+        unsigned int flags;
+        unsigned int cr0;
+};
+
+static inline void mem_simd_begin(struct mem_simd* s)
+{
+        __asm__ __volatile__ ("pushfl\n\t"
+                        "popl %0\n\t"
+                        "cli\n\t"
+                        "mov %%cr0, %1\n\t"
+                        "clts\n\t"
+                        "movdqu %%xmm0, (%2)\n\t"
+                        "movdqu %%xmm1, 16(%2)\n\t"
+                        "movdqu %%xmm2, 32(%2)\n\t"
+                        "movdqu %%xmm3, 48(%2)"
+                        : "=&r" (s->flags), "=&r" (s->cr0)
+                        : "r" (s->save)
+                        : "memory");
+}
+
+static inline void mem_simd_end(struct mem_simd* s)
+{
+        __asm__ __volatile__ ("sfence\n\t"
+                        "movdqu (%0), %%xmm0\n\t"
+                        "movdqu 16(%0), %%xmm1\n\t"
+                        "movdqu 32(%0), %%xmm2\n\t"
+                        "movdqu 48(%0), %%xmm3"
+                        :
+                        : "r" (s->save)
+                        : "memory");
+        /* Writing CR0 is slow, only do so when TS was set */
+        if (s->cr0 & X86_CR0_TS)
+                __asm__ __volatile__ ("mov %0, %%cr0" : : "r" (s->cr0)
+                                : "memory");
+        __asm__ __volatile__ ("pushl %0\n\t"
+                        "popfl"
+                        :
+                        : "r" (s->flags)
+                        : "memory", "cc");
+}
+
+/**
+ * \fn mem_set_nt
+ * \brief Clear memory with non-temporal stores, 64 bytes at a time
+ */
+static void mem_set_nt(void* dest, unsigned int val, size_t count)
+{
+        struct mem_simd simd;
+        size_t head = (-(addr_t)dest) & 0xF;
+        mem_stos(dest, val, head);
+        dest += head;
+        count -= head;
+
+        while (count >= 64) {
+                size_t chunk = (count > MEM_NT_CHUNK) ? MEM_NT_CHUNK : count;
+                chunk &= ~63;
+                mem_simd_begin(&simd);
+                __asm__ __volatile__ ("movd %0, %%xmm0\n\t"
+                                "pshufd $0, %%xmm0, %%xmm0"
+                                :
+                                : "r" (val));
+                size_t i = 0;
+                for (; i < chunk; i += 64) {
+                        __asm__ __volatile__ ("movntdq %%xmm0, (%0)\n\t"
+                                        "movntdq %%xmm0, 16(%0)\n\t"
+                                        "movntdq %%xmm0, 32(%0)\n\t"
+                                        "movntdq %%xmm0, 48(%0)"
+                                        :
+                                        : "r" (dest + i)
+                                        : "memory");
+                }
+                mem_simd_end(&simd);
+                dest += chunk;
+                count -= chunk;
+        }
+        mem_stos(dest, val, count);
+}
+
+/**
+ * \fn mem_copy_nt
+ * \brief Copy memory with non-temporal stores, 64 bytes at a time
+ */
+static void mem_copy_nt(void* dest, void* src, size_t count)
+{
+        struct mem_simd simd;
+        size_t head = (-(addr_t)dest) & 0xF;
+        mem_movs(dest, src, head);
+        dest += head;
+        src += head;
+        count -= head;
+
+        while (count >= 64) {
+                size_t chunk = (count > MEM_NT_CHUNK) ? MEM_NT_CHUNK : count;
+                chunk &= ~63;
+                mem_simd_begin(&simd);
+                size_t i = 0;
+                for (; i < chunk; i += 64) {
+                        __asm__ __volatile__ ("movdqu (%1), %%xmm0\n\t"
+                                        "movdqu 16(%1), %%xmm1\n\t"
+                                        "movdqu 32(%1), %%xmm2\n\t"
+                                        "movdqu 48(%1), %%xmm3\n\t"
+                                        "movntdq %%xmm0, (%0)\n\t"
+                                        "movntdq %%xmm1, 16(%0)\n\t"
+                                        "movntdq %%xmm2, 32(%0)\n\t"
+                                        "movntdq %%xmm3, 48(%0)"
+                                        :
+                                        : "r" (dest + i), "r" (src + i)
+                                        : "memory");
+                }
+                mem_simd_end(&simd);
+                dest += chunk;
+                src += chunk;
+                count -= chunk;
+        }
+        mem_movs(dest, src, count);
+}
+
+void memset(void *dest, int sval, size_t count)
+{
+        unsigned int val = sval & 0xFF;
+        val |= val << 8;
+        val |= val << 16;
+
+        if (mem_sse2 && count >= MEM_NT_THRESHOLD)
+                mem_set_nt(dest, val, count);
+        else
+                mem_stos(dest, val, count);
+}
+
+/**
+ * \fn memcpy
+ * \brief Copy count bytes from src to dest
+ * \warning The regions must not overlap, use memmove for that
+ */
+void memcpy(void *dest, void *src, size_t count)
+{
+        if (mem_sse2 && count >= MEM_NT_THRESHOLD)
+                mem_copy_nt(dest, src, count);
+        else
+                mem_movs(dest, src, count);
+}
+
+/**
+ * \fn memmove
+ * \brief Copy count bytes from src to dest, the regions may overlap
+ */
+void memmove(void *dest, void *src, size_t count)
+{
+        if ((addr_t)dest <= (addr_t)src ||
+                        (addr_t)dest >= (addr_t)src + count) {
+                /* A forward copy never overwrites what's still to be read */
+                mem_movs(dest, src, count);
+                return;
+        }
+
+        /* Copy backwards, starting with the odd bytes at the very end */
+        char* d = (char*)dest + count - 1;
+        char* s = (char*)src + count - 1;
+        size_t tail = count & 3;
+        size_t dwords = count >> 2;
+
+        /*
+         * The direction flag may only be set for as long as this statement
+         * runs, the compiler assumes it's clear everywhere else.
+         */
+        __asm__ __volatile__ ("std\n\t"
+                        "rep movsb\n\t"
+                        "sub $3, %%edi\n\t"
+                        "sub $3, %%esi\n\t"
+                        "mov %3, %%ecx\n\t"
+                        "rep movsl\n\t"
+                        "cld"
+                        : "+D" (d), "+S" (s), "+c" (tail)
+                        : "r" (dwords)
+                        : "memory", "cc");
+}
+
+/**
+ * \fn clear_page
+ * \brief Zero a single page
+ * \param page
+ * \brief Page aligned virtual address
+ *
+ * Pages are cleared with non-temporal stores when possible, as a freshly
+ * cleared page usually isn't touched again until much later and shouldn't
+ * push the working set out of the cache.
+ */
+void clear_page(void* page)
+{
+        if (mem_sse2 && ((addr_t)page & 0xF) == 0)
+                mem_set_nt(page, 0, PAGE_SIZE);
+        else
+                mem_stos(page, 0, PAGE_SIZE);
+}
+
+/**
+ * \fn copy_page
+ * \brief Copy a single page
+ * \param dest
+ * \param src
+ * \brief Page aligned virtual addresses, which don't overlap
+ */
+void copy_page(void* dest, void* src)
+{
+        if (mem_sse2 && ((addr_t)dest & 0xF) == 0)
+                mem_copy_nt(dest, src, PAGE_SIZE);
+        else
+                mem_movs(dest, src, PAGE_SIZE);
+}
+#else
 void memset(void *dest, int sval, size_t count)
 {
         if (!count)
@@ -49,12 +341,12 @@ void memset(void *dest, int sval, size_t count)
                 return;
         }
         sval &= 0x000000ff;
-#ifndef X86 //64 bit int is only faster at X86, X64 prefers 2 time 32 int
+        //64 bit int is only faster at X86, X64 prefers 2 time 32 int
         unsigned long long val = (unsigned long long) sval;
         char i = 8;
         for (; i < 64; i += 8)
         {
-                val |= (sval << i);
+                val |= (val << i);
         }
         while (count >= 8)
         {
@@ -62,95 +354,17 @@ void memset(void *dest, int sval, size_t count)
                 dest += 8;
                 count -= 8;
         }
-        if (count >= 4)
-        {
-                *(unsigned int*) dest = (unsigned int) val;
-                dest += 4;
-                count -= 4;
-        }
-#else
-        unsigned int val = (unsigned int) sval;
-        char i = 8;
-        for (; i < 32; i += 8)
-        {
-                val |= (sval << i);
-        }
-        while (count >= 4)
-        {
-                *(unsigned int*) dest = (unsigned int) val;
-                dest += 4;
-                count -= 4;
-        }
-#endif
-        if (count >= 2)
-        {
-                *(unsigned short*) dest = (unsigned short) val;
-                dest += 2;
-                count -= 2;
-        }
-        if (count >= 1)
+        while (count >= 1)
         {
                 *(unsigned char*) dest = (unsigned char) val;
-        }
-        return;
-}
-
-// void memset(void* var, int val, size_t count)
-// {
-//         for (;count != 0; count --)
-//         {
-//                 *(char*)((long)var+count) = (char) val;
-//         }
-// }
-
-void memcpyBack(void *dest, void *src, size_t count)
-{
-        dest += count;
-        src  += count;
-#ifndef X86
-//64 bit int is only faster at 64-bit PC's, 32 bits prefers 2 time 32 int
-        while (count >= 8)
-        {
-                *(unsigned long long*) dest = *(unsigned long long*) src;
-                dest -= 8;
-                src -= 8;
-                count -= 8;
-        }
-        if (count >= 4)
-        {
-                *(unsigned long long*) dest = *(unsigned long long*) src;
-                dest -= 4;
-                src -= 4;
-                count -= 4;
-        }
-#else
-        while (count >= 4)
-        {
-                *(unsigned int*) dest = *(unsigned int*) src;
-                dest -= 4;
-                src -= 4;
-                count -= 4;
-        }
-#endif
-        if (count >= 2)
-        {
-                *(unsigned short*) dest = *(unsigned short*) src;
-                dest -= 2;
-                src -= 2;
-                count -= 2;
-        }
-        if (count >= 1)
-        {
-                *(unsigned char*) dest = *(unsigned char*) src;
+                dest++;
+                count--;
         }
         return;
 }
 
 void memcpy(void *dest, void *src, size_t count)
 {
-        if ((addr_t)src+count>(addr_t)dest)
-                memcpyBack(dest,src,count);
-#ifndef X86
         //64 bit int is only faster at 64-bit PC's, 32 bits prefers 2 time 32 int
         while (count >= 8)
         {
@@ -159,77 +373,67 @@ void memcpy(void *dest, void *src, size_t count)
                 src += 8;
                 count -= 8;
         }
-        if (count >= 4)
-        {
-                *(unsigned long long*) dest = *(unsigned long long*) src;
-                dest += 4;
-                src += 4;
-                count -= 4;
-        }
-#else
-        while (count >= 4)
-        {
-                *(unsigned int*) dest = *(unsigned int*) src;
-                dest += 4;
-                src += 4;
-                count -= 4;
-        }
-#endif
-        if (count >= 2)
-        {
-                *(unsigned short*) dest = *(unsigned short*) src;
-                dest += 2;
-                src += 2;
-                count -= 2;
-        }
-        if (count >= 1)
+        while (count >= 1)
         {
                 *(unsigned char*) dest = *(unsigned char*) src;
+                dest++;
+                src++;
+                count--;
         }
         return;
 }
 
-int memcmp(void *ptr1, void* ptr2, size_t count)
+void memmove(void *dest, void *src, size_t count)
 {
-#ifndef X86
-        //64 bit int is only faster at X86, X64 prefers 2 time 32 int
-        while (count >= 8)
-        {
-                if (*(unsigned long long*) ptr1 - *(unsigned long long*) ptr2)
-                        return 1;
-                ptr1 += 8;
-                ptr2 += 8;
-                count -= 8;
-        }
-        if (count >= 4)
+        if ((addr_t)dest <= (addr_t)src ||
+                        (addr_t)dest >= (addr_t)src + count)
         {
-                if (*(unsigned long long*) ptr1 - *(unsigned long long*) ptr2)
-                        return 1;
-                ptr1 += 4;
-                ptr2 += 4;
-                count -= 4;
+                memcpy(dest, src, count);
+                return;
         }
-#else
-        while (count >= 4)
+        while (count >= 1)
         {
-                if (*(unsigned int*) ptr1 - *(unsigned int*) ptr2)
-                        return 1;
-                ptr1 += 4;
-                ptr2 += 4;
-                count -= 4;
+                count--;
+                *((unsigned char*) dest + count) =
+                                *((unsigned char*) src + count);
         }
+        return;
+}
+
+void clear_page(void* page)
+{
+        memset(page, 0, PAGE_SIZE);
+}
+
+void copy_page(void* dest, void* src)
+{
+        memcpy(dest, src, PAGE_SIZE);
+}
 #endif
-        while(count >= 2)
+
+/**
+ * \fn memcmp
+ * \brief Compare two regions
+ * \return 0 if equal, otherwise the sign tells which one is larger at the
+ * first byte that differs
+ */
+int memcmp(void *ptr1, void* ptr2, size_t count)
+{
+        unsigned char* p1 = ptr1;
+        unsigned char* p2 = ptr2;
+
+        /* Skip over the equal words, and let the bytes tell the difference */
+        while (count >= sizeof(unsigned long)
+                        && *(unsigned long*) p1 == *(unsigned long*) p2)
         {
-                if (*(unsigned short*) ptr1 - *(unsigned short*) ptr2)
-                        return 1;
-                ptr1 += 2;
-                ptr2 += 2;
-                count -= 2;
+                p1 += sizeof(unsigned long);
+                p2 += sizeof(unsigned long);
+                count -= sizeof(unsigned long);
         }
-        if ((count == 1)&&(*(unsigned char*) ptr1 - *(unsigned char*) ptr2))
+        for (; count > 0; count--, p1++, p2++)
         {
-                return 1;
+                if (*p1 != *p2)
+                        return (int)*p1 - (int)*p2;
         }
         return 0;
 }
@@ -241,4 +445,110 @@ size_t strlen(char* string)
         return i;
 }
 
+#ifdef MEM_BENCH
+#define MEM_BENCH_MIN 0x8
+#define MEM_BENCH_MAX 0x100000
+/* Move roughly this many bytes per measurement, whatever the size */
+#define MEM_BENCH_BYTES 0x400000
+
+static int mem_bench_check(unsigned char* buf, size_t count)
+{
+        size_t i = 0;
+        for (i = 0; i < count; i++)
+                buf[i] = i & 0xFF;
+
+        /* Overlapping both ways, at an odd offset */
+        memmove(buf + 3, buf, count - 3);
+        for (i = 3; i < count; i++)
+                if (buf[i] != ((i - 3) & 0xFF))
+                        return -E_GENERIC;
+        memmove(buf, buf + 3, count - 3);
+        for (i = 0; i < count - 6; i++)
+                if (buf[i] != (i & 0xFF))
+                        return -E_GENERIC;
+
+        memset(buf + 1, 0xA5, count - 2);
+        if (buf[0] != 0 || buf[count - 1] != ((count - 4) & 0xFF))
+                return -E_GENERIC;
+        for (i = 1; i < count - 1; i++)
+                if (buf[i] != 0xA5)
+                        return -E_GENERIC;
+        return -E_SUCCESS;
+}
+
+static uint32_t mem_bench_copy(void* dest, void* src, size_t size)
+{
+        size_t runs = MEM_BENCH_BYTES / size;
+        size_t i = 0;
+        uint64_t start = get_cpu_tick();
+        for (; i < runs; i++)
+                memcpy(dest, src, size);
+        uint64_t cycles = get_cpu_tick() - start;
+        /* Cycles per KiB */
+        return (uint32_t)((cycles * 0x400) / MEM_BENCH_BYTES);
+}
+
+static uint32_t mem_bench_set(void* dest, size_t size)
+{
+        size_t runs = MEM_BENCH_BYTES / size;
+        size_t i = 0;
+        uint64_t start = get_cpu_tick();
+        for (; i < runs; i++)
+                memset(dest, 0, size);
+        uint64_t cycles = get_cpu_tick() - start;
+        return (uint32_t)((cycles * 0x400) / MEM_BENCH_BYTES);
+}
+
+/**
+ * \fn mem_bench
+ * \brief Check memmove and print the copy and clear bandwidth per size
+ *
+ * The numbers are in cycles per KiB, lower is better. From a page and up the
+ * string instructions are measured against the SSE2 stores, if available.
+ */
+void mem_bench()
+{
+        unsigned char* src = kmalloc(MEM_BENCH_MAX);
+        unsigned char* dest = kmalloc(MEM_BENCH_MAX);
+        if (src == NULL || dest == NULL) {
+                warning("No memory for the copy benchmark\n");
+                if (src != NULL)
+                        kfree(src);
+                if (dest != NULL)
+                        kfree(dest);
+                return;
+        }
+
+        if (mem_bench_check(dest, 0x1003) != -E_SUCCESS)
+                panic("memmove or memset is broken!");
+        memset(src, 0x5A, MEM_BENCH_MAX);
+
+        printf("Cycles per KiB\nsize\tcopy\tset\n");
+        size_t size = MEM_BENCH_MIN;
+        for (; size <= MEM_BENCH_MAX; size <<= 1) {
+                uint32_t copy = mem_bench_copy(dest, src, size);
+                uint32_t set = mem_bench_set(dest, size);
+                printf("%X\t%i\t%i\n", size, copy, set);
+        }
+
+#ifdef X86
+        if (!mem_sse2) {
+                kfree(src);
+                kfree(dest);
+                return;
+        }
+        printf("Without SSE2\nsize\tcopy\tset\n");
+        mem_disable_sse2();
+        for (size = MEM_NT_THRESHOLD; size <= MEM_BENCH_MAX; size <<= 1) {
+                uint32_t copy = mem_bench_copy(dest, src, size);
+                uint32_t set = mem_bench_set(dest, size);
+                printf("%X\t%i\t%i\n", size, copy, set);
+        }
+        mem_enable_sse2();
+#endif
+        kfree(src);
+        kfree(dest);
+}
+#endif
+
 /** \file */
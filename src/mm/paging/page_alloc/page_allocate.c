@@ -21,21 +21,90 @@
 #include <andromeda/error.h>
 #include <mm/page_alloc.h>
 #include <thread.h>
+#ifdef X86
+#include <arch/x86/atomic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/percpu.h>
+#endif
 /**
  * \addtogroup Page_alloc
  * @{
+ *
+ * On x86 every cpu keeps a few freed pages for itself in its per cpu area.
+ * Those are handed out again without taking page_alloc_lock. A cached page is
+ * marked PAGE_LIST_CACHED in the page map, so page_claim can still take it
+ * from under the cpu that holds it.
  */
 extern int pagemap[];
 extern int first_free;
 
 spinlock_t page_alloc_lock = mutex_unlocked;
 
+#ifdef X86
+/**
+ * \fn page_cache_get
+ * \brief Take a page from the cache of the calling cpu
+ * \return The page or NULL if the cache is empty
+ */
+static void* page_cache_get()
+{
+        void* page = NULL;
+        int state = disableInterrupts();
+        struct x86_percpu* pc = x86_percpu_this();
+        while (page == NULL && pc->pages > 0) {
+                void* p = pc->page_cache[--pc->pages];
+                volatile uint32_t* entry = (volatile uint32_t*)
+                                &pagemap[(addr_t)p / PAGE_ALLOC_FACTOR];
+                /* If someone claimed it in the mean time, it's theirs */
+                if (x86_atomic_cmpxchg(entry, PAGE_LIST_CACHED, -1)
+                                == PAGE_LIST_CACHED)
+                        page = p;
+        }
+        if (page != NULL)
+                x86_percpu_inc(page_cache_hits);
+        else
+                x86_percpu_inc(page_cache_misses);
+        if (state)
+                enableInterrupts();
+        return page;
+}
+
+/**
+ * \fn page_cache_put
+ * \brief Keep a page with a single reference in the cache of the calling cpu
+ * \param page
+ * \return 1 if the page was cached, 0 if the cache is full
+ *
+ * The caller holds the only reference, so nobody else touches the entry in the
+ * page map.
+ */
+static int page_cache_put(void* page)
+{
+        int cached = 0;
+        int state = disableInterrupts();
+        struct x86_percpu* pc = x86_percpu_this();
+        if (pc->pages < X86_PERCPU_PAGES) {
+                pagemap[(addr_t)page / PAGE_ALLOC_FACTOR] = PAGE_LIST_CACHED;
+                pc->page_cache[pc->pages++] = page;
+                cached = 1;
+        }
+        if (state)
+                enableInterrupts();
+        return cached;
+}
+#endif
+
 /**
  * \fn page_alloc
  * \brief Allocate a predefined number of physical pages
  */
 void* page_alloc()
 {
+#ifdef X86
+        void* page = page_cache_get();
+        if (page != NULL)
+                return page;
+#endif
         /* Is there still memory left? */
         if (first_free <= 0)
                 return NULL;
@@ -81,7 +150,8 @@ void* page_realloc(void* ptr)
 
         mutex_lock(&page_alloc_lock);
 
-        if (pagemap[idx] >= 0 || (unsigned long)(pagemap[idx]) == PAGE_LIST_MARKED)
+        if (pagemap[idx] >= 0 || (unsigned long)(pagemap[idx]) == PAGE_LIST_MARKED
+                        || (unsigned long)(pagemap[idx]) == PAGE_LIST_CACHED)
                 goto err;
 
         pagemap[idx]--;
@@ -129,6 +199,14 @@ void* page_claim(void* page)
         idx /= PAGE_ALLOC_FACTOR;
 
         mutex_lock(&page_alloc_lock);
+#ifdef X86
+        /* Sitting in the cache of some cpu, not on the free list */
+        if (x86_atomic_cmpxchg((volatile uint32_t*)&pagemap[idx],
+                        PAGE_LIST_CACHED, -1) == PAGE_LIST_CACHED) {
+                mutex_unlock(&page_alloc_lock);
+                return page;
+        }
+#endif
         int ref = pagemap_find_reference(idx);
         if (ref != -E_INVALID_ARG)
                 pagemap[ref] = pagemap[idx];
@@ -227,20 +305,17 @@ err:
 }
 
 /**
- * \fn page_free
- * \brief Mark a physical page as free
+ * \fn page_release
+ * \brief Drop a reference, the last one puts the page on the free list
+ * \param p
+ * \brief Index of the page
  */
-int page_free(void* page)
+static void page_release(addr_t p)
 {
-        /* Determine validity of the pointer */
-        if ((addr_t)page % PAGE_ALLOC_FACTOR != 0)
-                return -E_INVALID_ARG;
-        addr_t p = (addr_t)page / PAGE_ALLOC_FACTOR;
-
         /* Enter critical */
         mutex_lock(&page_alloc_lock);
 
-        if (pagemap[p] >= 0)
+        if (pagemap[p] >= 0 || (unsigned long)(pagemap[p]) == PAGE_LIST_CACHED)
                 goto err;
         if (++pagemap[p] == 0)
         {
@@ -253,9 +328,46 @@ int page_free(void* page)
 err:
         /* Leave critical */
         mutex_unlock(&page_alloc_lock);
+}
+
+/**
+ * \fn page_free
+ * \brief Mark a physical page as free
+ */
+int page_free(void* page)
+{
+        /* Determine validity of the pointer */
+        if ((addr_t)page % PAGE_ALLOC_FACTOR != 0)
+                return -E_INVALID_ARG;
+        addr_t p = (addr_t)page / PAGE_ALLOC_FACTOR;
+
+#ifdef X86
+        /* The last reference can go to the cache without locking */
+        if (pagemap[p] == -1 && page_cache_put(page))
+                return -E_SUCCESS;
+#endif
+        page_release(p);
         return -E_SUCCESS;
 }
 
+/**
+ * \fn page_cache_drain
+ * \brief Put the pages cached by the calling cpu back on the free list
+ * \return The number of blocks of PAGE_ALLOC_FACTOR bytes released
+ */
+int page_cache_drain()
+{
+        int released = 0;
+#ifdef X86
+        void* page;
+        while ((page = page_cache_get()) != NULL) {
+                page_release((addr_t)page / PAGE_ALLOC_FACTOR);
+                released++;
+        }
+#endif
+        return released;
+}
+
 #ifdef PA_DBG
 void page_dump()
 {
@@ -0,0 +1,137 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <andromeda/error.h>
+#include <mm/page_alloc.h>
+#include <mm/vm.h>
+#include <thread.h>
+
+/**
+ * \addtogroup Page_alloc
+ * @{
+ *
+ * A small stock of physical pages that have already been cleared.
+ *
+ * Whoever needs a zeroed page (e.g. an anonymous page fault) takes one from
+ * here, so it doesn't have to clear the page itself. The stock is topped up
+ * from the idle loop by page_zero_refill, which maps every page into a
+ * temporary kernel window to clear it.
+ */
+
+static void* page_zero_pool[PAGE_ZERO_POOL_SIZE];
+static volatile int page_zero_cnt = 0;
+static spinlock_t page_zero_lock = mutex_unlocked;
+
+/**
+ * \fn page_alloc_zeroed
+ * \brief Take a pre-zeroed page from the pool
+ * \return The physical address of the page or NULL if the pool is empty
+ *
+ * Like page_alloc, the page is to be returned with page_free.
+ */
+void* page_alloc_zeroed()
+{
+        void* page = NULL;
+
+        mutex_lock(&page_zero_lock);
+        if (page_zero_cnt > 0) {
+                page_zero_cnt--;
+                page = page_zero_pool[page_zero_cnt];
+                page_zero_pool[page_zero_cnt] = NULL;
+        }
+        mutex_unlock(&page_zero_lock);
+
+        return page;
+}
+
+/**
+ * \fn page_zero
+ * \brief Clear a physical page through a temporary mapping
+ * \param phys
+ * \return A standard error code
+ */
+static int page_zero(void* phys)
+{
+        char* virt = vmap(phys, PAGE_ALLOC_FACTOR);
+        if (virt == NULL)
+                return -E_NOMEM;
+
+        size_t i = 0;
+        for (; i < PAGE_ALLOC_FACTOR; i += PAGE_SIZE)
+                clear_page(virt + i);
+
+        vunmap(virt);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn page_zero_refill
+ * \brief Clear free pages until the pool is full
+ * \return A standard error code
+ *
+ * Meant to be called when there is nothing else to do. The pages are cleared
+ * without the pool lock held, so page_alloc_zeroed doesn't have to wait.
+ */
+int page_zero_refill()
+{
+        for (;;) {
+                if (page_zero_cnt >= PAGE_ZERO_POOL_LOW)
+                        return -E_SUCCESS;
+
+                void* phys = page_alloc();
+                if (phys == NULL)
+                        return -E_NOMEM;
+                if (page_zero(phys) != -E_SUCCESS) {
+                        page_free(phys);
+                        return -E_NOMEM;
+                }
+
+                mutex_lock(&page_zero_lock);
+                if (page_zero_cnt >= PAGE_ZERO_POOL_SIZE) {
+                        mutex_unlock(&page_zero_lock);
+                        page_free(phys);
+                        return -E_SUCCESS;
+                }
+                page_zero_pool[page_zero_cnt++] = phys;
+                mutex_unlock(&page_zero_lock);
+        }
+}
+
+/**
+ * \fn page_zero_drain
+ * \brief Hand all pages in the pool back to the allocator
+ * \return The number of blocks of PAGE_ALLOC_FACTOR bytes released
+ *
+ * For when memory runs low, the pool is only a cache.
+ */
+int page_zero_drain()
+{
+        int released = 0;
+        void* phys;
+        while ((phys = page_alloc_zeroed()) != NULL) {
+                page_free(phys);
+                released++;
+        }
+        return released;
+}
+
+/**
+ * @}
+ * \file
+ */
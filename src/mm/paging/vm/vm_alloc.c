@@ -30,11 +30,12 @@
  * \addtogroup VM
  * @{
  */
+#ifndef X86
 int get_cpu()
 {
-        /** \todo Detect cpu number, for now simply return 0 */
         return 0;
 }
+#endif
 
 #ifdef VM_RANGE_LOOP_DETECT
 struct db_t {
@@ -525,7 +526,7 @@ void* vm_map(void* virt, void* phys, struct vm_segment* s)
         {
                 if (page_claim((void*) (p + i)) == NULL)
                         goto gofixit;
-                page_map(0, (void*) (v + i), (void*) (p + 1), 0);
+                page_map(0, (void*) (v + i), (void*) (p + i), 0);
         }
 
         err: mutex_unlock(&s->lock);
@@ -578,17 +579,13 @@ int vm_unmap(void* virt, struct vm_segment* s)
         return (r == NULL ) ? -E_NULL_PTR : -E_SUCCESS;
 }
 
+#ifdef VM_DBG
 /**
  * \fn vm_find_segment
  * \param name
  * \return The requested segment or 0
  */
-#ifndef VM_DBG
-static struct vm_segment*
-#else
-struct vm_segment*
-#endif
-vm_find_segment(char* name)
+struct vm_segment* vm_find_segment(char* name)
 {
         if (name == NULL) {
                 return NULL ;
@@ -612,6 +609,7 @@ vm_find_segment(char* name)
         printf("Not found!\n");
         return NULL ;
 }
+#endif
 
 /**
  * \fn vm_free_kernel_heap_pages
@@ -623,16 +621,13 @@ int vm_free_kernel_heap_pages(void* ptr)
         if (ptr == NULL)
                 return -E_NULL_PTR;
 
-        struct vm_segment* heap = vm_find_segment(".heap");
-        if (heap == NULL)
-                return -E_HEAP_GENERIC;
-
-        return vm_segment_free(heap, ptr);
+        return vfree(ptr);
 }
 
 /**
  * \fn vm_get_kernel_heap_pages
  * \param size
+ * \brief Served by the kernel virtual area allocator
  */
 void*
 vm_get_kernel_heap_pages(size_t size)
@@ -640,16 +635,7 @@ vm_get_kernel_heap_pages(size_t size)
         if (size == 0)
                 return NULL ;
 
-        if (size % PAGE_ALLOC_FACTOR != 0)
-                size += PAGE_ALLOC_FACTOR - size % PAGE_ALLOC_FACTOR;
-
-        struct vm_segment* heap = vm_find_segment(".heap");
-        if (heap == NULL) {
-                warning("Heap not found!\n");
-                return NULL ;
-        }
-
-        return vm_segment_alloc(heap, size);
+        return vmalloc(size);
 }
 
 /**
@@ -664,17 +650,7 @@ vm_map_heap(void* phys, size_t size)
         if (phys == NULL || size == 0)
                 return NULL ;
 
-        struct vm_segment* heap = vm_find_segment(".heap");
-        if (heap == NULL)
-                return NULL ;
-
-        void* virt = vm_segment_alloc(heap, size);
-        if (vm_map(virt, phys, heap) != virt) {
-                vm_segment_free(heap, virt);
-                return NULL ;
-        }
-
-        return virt;
+        return vmap(phys, size);
 }
 
 /**
@@ -687,13 +663,7 @@ int vm_unmap_heap(void* virt)
         if (virt == NULL)
                 return -E_NULL_PTR;
 
-        struct vm_segment* heap = vm_find_segment(".heap");
-        if (heap == NULL)
-                return -E_HEAP_GENERIC;
-
-        int ret = vm_unmap(virt, heap);
-        ret |= vm_segment_free(heap, virt);
-        return ret;
+        return vunmap(virt);
 }
 
 /**
@@ -0,0 +1,297 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <defines.h>
+#include <fs/vfs.h>
+#include <mm/vm.h>
+#include <mm/page_alloc.h>
+#include <types.h>
+
+/**
+ * \addtogroup VM
+ * @{
+ *
+ * File backed segments.
+ *
+ * A segment can be backed by a range of a file. Nothing is read up front.
+ * Pages are filled from the fs_data read hook of the file the first time they
+ * fault, and pages that have their dirty bit set are written back through the
+ * write hook on vm_msync and vm_munmap, or when reclaim evicts them.
+ *
+ * Private mappings, as used for executables, only ever read. Only the part
+ * of the segment the file covers is read, the rest comes up zeroed. Reclaim
+ * drops their code pages, they can simply be read again. The other pages may
+ * have been written to, so they stay until the segment goes.
+ */
+
+/**
+ * \fn vm_file_io
+ * \brief Move one page between memory and the backing file
+ * \param s
+ * \param virt
+ * \brief Page aligned address within the segment
+ * \param write
+ * \brief Write the page to the file if non-zero, read it otherwise
+ * \return The number of bytes transferred
+ */
+static size_t vm_file_io(struct vm_segment* s, addr_t virt, int write)
+{
+        struct vfile* file = s->file;
+        size_t start = virt - (addr_t)s->virt_base;
+        size_t end = (s->file_private) ? s->file_size : s->size;
+        if (start >= end)
+                return 0;
+        size_t offset = s->file_offset + start;
+        size_t len = PAGE_SIZE;
+        if (start + len > end)
+                len = end - start;
+
+        size_t ret;
+        mutex_lock(&file->file_lock);
+        if (write)
+                ret = file->fs_data.write(file, (char*)virt, offset, len);
+        else
+                ret = file->fs_data.read(file, (char*)virt, offset, len);
+        mutex_unlock(&file->file_lock);
+
+        return ret;
+}
+
+/**
+ * \fn vm_segment_map_file
+ * \brief Back a segment by a file
+ * \param s
+ * \param file
+ * \param offset
+ * \brief Page aligned offset into the file at which the segment starts
+ * \return A standard error code
+ */
+int vm_segment_map_file(struct vm_segment* s, struct vfile* file,
+                size_t offset)
+{
+        if (s == NULL || file == NULL || file->fs_data.read == NULL)
+                return -E_NULL_PTR;
+        if (offset % PAGE_SIZE != 0)
+                return -E_INVALID_ARG;
+
+        mutex_lock(&s->lock);
+        if (s->file != NULL) {
+                mutex_unlock(&s->lock);
+                return -E_ALREADY_INITIALISED;
+        }
+        s->file = file;
+        s->file_offset = offset;
+        s->file_size = s->size;
+        mutex_unlock(&s->lock);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_mmap
+ * \brief Create a new segment mapping a range of a file
+ * \param p
+ * \brief The descriptor to add the segment to
+ * \param virt
+ * \param size
+ * \param file
+ * \param offset
+ * \return The new segment or NULL
+ */
+struct vm_segment*
+vm_mmap(struct vm_descriptor* p, void* virt, size_t size, struct vfile* file,
+                size_t offset)
+{
+        if (p == NULL || file == NULL || size == 0)
+                return NULL;
+        if (!PAGE_ALIGNED((addr_t)virt))
+                return NULL;
+
+        struct vm_segment* s = vm_new_segment(virt, size, p);
+        if (s == NULL)
+                return NULL;
+
+        if (vm_segment_map_file(s, file, offset) != -E_SUCCESS) {
+                vm_segment_clean(s);
+                return NULL;
+        }
+
+        return s;
+}
+
+/**
+ * \fn vm_mmap_private
+ * \brief Create a new segment with a private copy of a range of a file
+ * \param p
+ * \param virt
+ * \param size
+ * \param file
+ * \param offset
+ * \param file_size
+ * \brief How much of the segment comes from the file, at most size
+ * \return The new segment or NULL
+ */
+struct vm_segment*
+vm_mmap_private(struct vm_descriptor* p, void* virt, size_t size,
+                struct vfile* file, size_t offset, size_t file_size)
+{
+        if (file_size > size)
+                return NULL;
+
+        struct vm_segment* s = vm_mmap(p, virt, size, file, offset);
+        if (s == NULL)
+                return NULL;
+
+        s->file_private = TRUE;
+        s->file_size = file_size;
+        return s;
+}
+
+/**
+ * \fn vm_file_fault
+ * \brief Fill a page of a file backed segment
+ * \param cpu
+ * \param s
+ * \param virt
+ * \return -E_NOT_FOUND if the segment isn't file backed
+ */
+int vm_file_fault(int cpu, struct vm_segment* s, void* virt)
+{
+        if (s == NULL)
+                return -E_NULL_PTR;
+        if (s->file == NULL)
+                return -E_NOT_FOUND;
+
+        addr_t v = (addr_t)virt & ~(PAGE_SIZE - 1);
+        void* phys = page_alloc();
+        if (phys == NULL) {
+                vm_reclaim(cpu, VM_SWAP_BATCH);
+                phys = page_alloc();
+                if (phys == NULL)
+                        return -E_NOMEM;
+        }
+        page_map(cpu, (void*)v, phys, s->parent->cpl);
+
+        size_t read = vm_file_io(s, v, 0);
+        /* Errors come back negative */
+        if (read > PAGE_SIZE) {
+                page_unmap(cpu, (void*)v);
+                page_free(phys);
+                return -E_STREAM_FAILURE;
+        }
+        /* Past the end of the file reads as zero */
+        if (read < PAGE_SIZE)
+                memset((void*)(v + read), 0, PAGE_SIZE - read);
+
+        /* Filling the page doesn't make it dirty */
+        page_test_dirty(cpu, (void*)v);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_file_evict
+ * \brief Write back a page if needed, and drop it
+ * \param cpu
+ * \param s
+ * \param virt
+ * \return A standard error code
+ */
+int vm_file_evict(int cpu, struct vm_segment* s, void* virt)
+{
+        if (s == NULL || s->file == NULL)
+                return -E_NULL_PTR;
+
+        addr_t v = (addr_t)virt & ~(PAGE_SIZE - 1);
+        void* phys = vm_evict_block(cpu, (void*)v);
+        if (phys == NULL)
+                return -E_INVALID_ARG;
+        /* Whatever was written to it can't go anywhere */
+        if (s->file_private && !s->code)
+                return -E_LOCKED;
+
+        if (!s->file_private && page_test_dirty(cpu, (void*)v) == 1) {
+                if (s->file->fs_data.write == NULL)
+                        return -E_NOFUNCTION;
+                if (vm_file_io(s, v, 1) == 0)
+                        return -E_STREAM_FAILURE;
+        }
+
+        page_unmap(cpu, (void*)v);
+        page_free(phys);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_msync
+ * \brief Write all dirty pages of a loaded segment back to its file
+ * \param cpu
+ * \param s
+ * \return A standard error code
+ */
+int vm_msync(int cpu, struct vm_segment* s)
+{
+        if (s == NULL)
+                return -E_NULL_PTR;
+        if (s->file == NULL)
+                return -E_INVALID_ARG;
+        if (s->file_private)
+                return -E_SUCCESS;
+        if (s->file->fs_data.write == NULL)
+                return -E_NOFUNCTION;
+
+        int ret = -E_SUCCESS;
+        addr_t v = (addr_t)s->virt_base;
+        addr_t end = v + s->size;
+        for (; v < end; v += PAGE_SIZE) {
+                if (page_test_dirty(cpu, (void*)v) != 1)
+                        continue;
+                if (vm_file_io(s, v, 1) == 0)
+                        ret = -E_STREAM_FAILURE;
+        }
+
+        return ret;
+}
+
+/**
+ * \fn vm_munmap
+ * \brief Write back and tear down a file backed segment
+ * \param cpu
+ * \param s
+ * \return A standard error code
+ * \warning The segment is gone afterwards, even if writing back failed
+ */
+int vm_munmap(int cpu, struct vm_segment* s)
+{
+        if (s == NULL)
+                return -E_NULL_PTR;
+
+        int ret = vm_msync(cpu, s);
+        vm_segment_unload(cpu, s);
+        vm_segment_clean(s);
+
+        return ret;
+}
+
+/**
+ * @}
+ * \file
+ */
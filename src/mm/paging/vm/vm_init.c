@@ -295,6 +295,9 @@ int vm_init()
 
         mm_vm_range_buffer_start = 1;
 
+        if (vm_vmap_init() != -E_SUCCESS)
+                panic("Unable to set up the kernel virtual area allocator!");
+
 #ifdef VM_TEST
         if (vm_test() != -E_SUCCESS) {
                 panic("Failure in vm_test code!");
@@ -0,0 +1,423 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <defines.h>
+#include <fs/vfs.h>
+#include <lib/tree.h>
+#include <mm/vm.h>
+#include <mm/page_alloc.h>
+#include <types.h>
+
+/**
+ * \addtogroup VM
+ * @{
+ *
+ * Page reclaim for swappable segments.
+ *
+ * Cold pages are found with a clock sweep over the segments loaded on a cpu.
+ * A page that has its accessed bit set gets that bit cleared and is passed
+ * over, a page that hasn't been touched since the last sweep is written to
+ * the swap device and unmapped. Every segment keeps a tree from page index to
+ * swap slot, so the fault handlers can read the page back in.
+ *
+ * The swap device is any vfile with fs_data read and write hooks, which take
+ * an absolute offset. A ramdisk or a file backed block device will do.
+ *
+ * Memory is given back to the page allocator a block of PAGE_ALLOC_FACTOR
+ * bytes at a time, so that is what reclaim counts in. A page can only be
+ * evicted if it is the one page using its block.
+ */
+
+/**
+ * \struct vm_swap_area
+ * \brief The currently active swap device
+ * \var dev
+ * \brief The file to write the pages to
+ * \var slots
+ * \brief Number of pages that fit on the device
+ * \var map
+ * \brief Bitmap of the slots in use
+ * \var hint
+ * \brief Where to start looking for a free slot
+ */
+struct vm_swap_area {
+        struct vfile* dev;
+        size_t slots;
+        size_t used;
+        uint32_t* map;
+        size_t hint;
+
+        mutex_t lock;
+        mutex_t io_lock;
+};
+
+static struct vm_swap_area vm_swap;
+static addr_t vm_swap_hand[CPU_LIMIT];
+
+#define VM_SWAP_BITS (sizeof(*vm_swap.map)*8)
+
+static int vm_swap_slot_alloc()
+{
+        mutex_lock(&vm_swap.lock);
+        size_t i = 0;
+        size_t words = (vm_swap.slots + VM_SWAP_BITS - 1) / VM_SWAP_BITS;
+        for (; i < words; i++) {
+                size_t w = (vm_swap.hint + i) % words;
+                if (vm_swap.map[w] == 0xFFFFFFFF)
+                        continue;
+                size_t b = 0;
+                for (; b < VM_SWAP_BITS; b++) {
+                        size_t slot = w * VM_SWAP_BITS + b;
+                        if (slot >= vm_swap.slots)
+                                break;
+                        if (vm_swap.map[w] & (1 << b))
+                                continue;
+                        vm_swap.map[w] |= (1 << b);
+                        vm_swap.hint = w;
+                        vm_swap.used++;
+                        mutex_unlock(&vm_swap.lock);
+                        return slot;
+                }
+        }
+        mutex_unlock(&vm_swap.lock);
+        return -E_OUT_OF_RESOURCES;
+}
+
+static void vm_swap_slot_free(size_t slot)
+{
+        mutex_lock(&vm_swap.lock);
+        if (vm_swap.map != NULL && slot < vm_swap.slots) {
+                vm_swap.map[slot / VM_SWAP_BITS] &= ~(1 << (slot % VM_SWAP_BITS));
+                vm_swap.used--;
+        }
+        mutex_unlock(&vm_swap.lock);
+}
+
+/**
+ * \fn vm_swap_enable
+ * \brief Start using a file as swap device
+ * \param dev
+ * \param size
+ * \brief Number of bytes available on the device
+ * \return A standard error code
+ */
+int vm_swap_enable(struct vfile* dev, size_t size)
+{
+        if (dev == NULL || dev->fs_data.read == NULL ||
+                        dev->fs_data.write == NULL)
+                return -E_NULL_PTR;
+        if (size < PAGE_SIZE)
+                return -E_INVALID_ARG;
+        if (vm_swap.dev != NULL)
+                return -E_ALREADY_INITIALISED;
+
+        size_t slots = size / PAGE_SIZE;
+        size_t map_size = ((slots + VM_SWAP_BITS - 1) / VM_SWAP_BITS)
+                        * sizeof(*vm_swap.map);
+        uint32_t* map = kmalloc(map_size);
+        if (map == NULL)
+                return -E_NOMEM;
+        memset(map, 0, map_size);
+
+        mutex_lock(&vm_swap.lock);
+        vm_swap.map = map;
+        vm_swap.slots = slots;
+        vm_swap.used = 0;
+        vm_swap.hint = 0;
+        vm_swap.dev = dev;
+        mutex_unlock(&vm_swap.lock);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_swap_disable
+ * \brief Stop swapping to the current device
+ * \return A standard error code
+ * \warning Only possible once all pages have been read back in
+ */
+int vm_swap_disable()
+{
+        mutex_lock(&vm_swap.lock);
+        if (vm_swap.dev == NULL) {
+                mutex_unlock(&vm_swap.lock);
+                return -E_NOT_YET_INITIALISED;
+        }
+        if (vm_swap.used != 0) {
+                mutex_unlock(&vm_swap.lock);
+                return -E_LOCKED;
+        }
+        uint32_t* map = vm_swap.map;
+        vm_swap.dev = NULL;
+        vm_swap.map = NULL;
+        vm_swap.slots = 0;
+        mutex_unlock(&vm_swap.lock);
+
+        kfree(map);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_evict_block
+ * \brief Find the allocator block that evicting a page would free
+ * \param cpu
+ * \param virt
+ * \return The physical block, or NULL if the page can't be evicted by itself
+ *
+ * The page has to sit at the start of its block, and none of the pages after
+ * it may map the rest of the block.
+ */
+void* vm_evict_block(int cpu, void* virt)
+{
+        addr_t v = (addr_t)virt & ~(PAGE_SIZE - 1);
+        void* phys = get_phys(cpu, (void*)v);
+        if (phys == NULL || (addr_t)phys % PAGE_ALLOC_FACTOR != 0)
+                return NULL;
+
+        addr_t i = PAGE_SIZE;
+        for (; i < PAGE_ALLOC_FACTOR; i += PAGE_SIZE) {
+                if ((addr_t)get_phys(cpu, (void*)(v + i)) == (addr_t)phys + i)
+                        return NULL;
+        }
+        return phys;
+}
+
+/**
+ * \fn vm_swap_out_page
+ * \brief Write a page to the swap device and release it
+ * \param cpu
+ * \param s
+ * \param virt
+ * \return A standard error code
+ */
+static int vm_swap_out_page(int cpu, struct vm_segment* s, addr_t virt)
+{
+        /* File backed pages go back to their file instead */
+        if (s->file != NULL)
+                return vm_file_evict(cpu, s, (void*)virt);
+
+        /* Only pages that own their physical allocation can go */
+        void* phys = vm_evict_block(cpu, (void*)virt);
+        if (phys == NULL)
+                return -E_INVALID_ARG;
+
+        if (s->swapped == NULL) {
+                s->swapped = tree_new_avl();
+                if (s->swapped == NULL)
+                        return -E_NOMEM;
+        }
+
+        int slot = vm_swap_slot_alloc();
+        if (slot < 0)
+                return slot;
+
+        int key = (virt - (addr_t)s->virt_base) / PAGE_SIZE;
+        if (s->swapped->add(key, (void*)(slot + 1), s->swapped)
+                        != -E_SUCCESS) {
+                vm_swap_slot_free(slot);
+                return -E_NOMEM;
+        }
+
+        /*
+         * Take the page away from the task before writing it out, anything
+         * stored to it during the write would be lost otherwise. The write
+         * goes through a mapping of its own.
+         */
+        page_unmap(cpu, (void*)virt);
+        char* copy = vmap(phys, PAGE_SIZE);
+        size_t written = 0;
+        if (copy != NULL) {
+                mutex_lock(&vm_swap.io_lock);
+                written = vm_swap.dev->fs_data.write(vm_swap.dev, copy,
+                                slot * PAGE_SIZE, PAGE_SIZE);
+                mutex_unlock(&vm_swap.io_lock);
+                vunmap(copy);
+        }
+        if (written != PAGE_SIZE) {
+                page_map(cpu, (void*)virt, phys, s->parent->cpl);
+                s->swapped->delete(key, s->swapped);
+                vm_swap_slot_free(slot);
+                return (copy == NULL) ? -E_NOMEM : -E_STREAM_FAILURE;
+        }
+
+        page_free(phys);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_swap_in
+ * \brief Read a previously swapped out page back in
+ * \param cpu
+ * \param s
+ * \param virt
+ * \return -E_NOT_FOUND if the page isn't on the swap device
+ */
+int vm_swap_in(int cpu, struct vm_segment* s, void* virt)
+{
+        if (s == NULL)
+                return -E_NULL_PTR;
+        if (s->swapped == NULL || vm_swap.dev == NULL)
+                return -E_NOT_FOUND;
+
+        addr_t v = (addr_t)virt & ~(PAGE_SIZE - 1);
+        int key = (v - (addr_t)s->virt_base) / PAGE_SIZE;
+        addr_t entry = (addr_t)s->swapped->find(key, s->swapped);
+        if (entry == 0)
+                return -E_NOT_FOUND;
+        size_t slot = entry - 1;
+
+        void* phys = page_alloc();
+        if (phys == NULL) {
+                vm_reclaim(cpu, VM_SWAP_BATCH);
+                phys = page_alloc();
+                if (phys == NULL)
+                        return -E_NOMEM;
+        }
+        page_map(cpu, (void*)v, phys, s->parent->cpl);
+
+        mutex_lock(&vm_swap.io_lock);
+        size_t read = vm_swap.dev->fs_data.read(vm_swap.dev, (char*)v,
+                        slot * PAGE_SIZE, PAGE_SIZE);
+        mutex_unlock(&vm_swap.io_lock);
+        if (read != PAGE_SIZE)
+                panic("Unable to read page back from swap!");
+
+        s->swapped->delete(key, s->swapped);
+        vm_swap_slot_free(slot);
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_reclaim_segment
+ * \brief Run the clock hand over one segment
+ * \return The number of allocator blocks reclaimed
+ */
+static size_t vm_reclaim_segment(int cpu, struct vm_segment* s, size_t blocks)
+{
+        size_t reclaimed = 0;
+        addr_t end = (addr_t)s->virt_base + s->size;
+        addr_t v = vm_swap_hand[cpu];
+        if (v < (addr_t)s->virt_base || v >= end)
+                v = (addr_t)s->virt_base;
+
+        for (; v < end && reclaimed < blocks; v += PAGE_SIZE) {
+                int accessed = page_test_accessed(cpu, (void*)v);
+                /* Not mapped, or recently used: second chance */
+                if (accessed != 0)
+                        continue;
+                /* Every page that goes frees a block of its own */
+                if (vm_swap_out_page(cpu, s, v) == -E_SUCCESS)
+                        reclaimed++;
+        }
+        vm_swap_hand[cpu] = v;
+
+        return reclaimed;
+}
+
+/**
+ * \fn vm_reclaim
+ * \brief Free up memory by swapping out cold pages
+ * \param cpu
+ * \param blocks
+ * \brief The number of allocator blocks (PAGE_ALLOC_FACTOR bytes each) wanted
+ * \return The number of allocator blocks actually reclaimed
+ *
+ * The clock hand sweeps the swappable segments loaded on the cpu, file
+ * backed segments included. It finishes the round it left off last time, and
+ * then makes at most two full rounds. The first round clears the accessed
+ * bits, so the second round finds the pages that really weren't in use.
+ */
+size_t vm_reclaim(int cpu, size_t blocks)
+{
+        if (cpu >= CPU_LIMIT)
+                return 0;
+
+        struct tree_root* loaded = vm_loaded[cpu];
+        if (loaded == NULL || loaded->tree == NULL)
+                return 0;
+
+        /* The pre-zeroed and cached blocks are the cheapest to give back */
+        size_t reclaimed = page_zero_drain();
+        reclaimed += page_cache_drain();
+        int rounds = 0;
+        while (reclaimed < blocks && rounds < 3) {
+                /* Find the first segment at or after the clock hand */
+                struct tree* t = loaded->tree;
+                while (t->left != NULL)
+                        t = t->left;
+                for (; t != NULL; t = t->next) {
+                        struct vm_segment* s = t->data;
+                        if ((addr_t)s->virt_base + s->size > vm_swap_hand[cpu])
+                                break;
+                }
+                if (t == NULL) {
+                        /* Wrap around */
+                        vm_swap_hand[cpu] = 0;
+                        rounds++;
+                        continue;
+                }
+                for (; t != NULL && reclaimed < blocks; t = t->next) {
+                        struct vm_segment* s = t->data;
+                        if (!s->swappable && s->file == NULL)
+                                continue;
+                        if (s->file == NULL && vm_swap.dev == NULL)
+                                continue;
+                        reclaimed += vm_reclaim_segment(cpu, s,
+                                        blocks - reclaimed);
+                }
+                if (t == NULL) {
+                        vm_swap_hand[cpu] = 0;
+                        rounds++;
+                }
+        }
+
+        return reclaimed;
+}
+
+static int vm_swap_release_slot(void* data, void* arg __attribute__((unused)))
+{
+        vm_swap_slot_free((addr_t)data - 1);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_swap_release
+ * \brief Drop all swapped out pages of a segment that is going away
+ * \param s
+ * \return A standard error code
+ */
+int vm_swap_release(struct vm_segment* s)
+{
+        if (s == NULL)
+                return -E_NULL_PTR;
+        if (s->swapped == NULL)
+                return -E_SUCCESS;
+
+        int ret = s->swapped->purge(s->swapped, vm_swap_release_slot, NULL);
+        s->swapped = NULL;
+        return ret;
+}
+
+/**
+ * @}
+ * \file
+ */
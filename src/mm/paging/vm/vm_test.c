@@ -18,6 +18,8 @@
 
 #include <andromeda/system.h>
 #include <mm/vm.h>
+#include <mm/page_alloc.h>
+#include <fs/vfs.h>
 #include <andromeda/core.h>
 
 /**
@@ -233,8 +235,8 @@ static int vm_test_alloc()
         size_t free_state = heap->free->size;
 
         debug("vm_test2.2\n");
-        void* tst = vm_get_kernel_heap_pages(0x1000);
-        void* tst2 = vm_get_kernel_heap_pages(0xb1aa7);
+        void* tst = vm_segment_alloc(heap, 0x1000);
+        void* tst2 = vm_segment_alloc(heap, 0xb1aa7);
 
         if (heap->free == NULL)
                 return -E_HEAP_GENERIC;
@@ -252,7 +254,7 @@ static int vm_test_alloc()
         }
 
         debug("vm_test2.4\n");
-        vm_free_kernel_heap_pages(tst2);
+        vm_segment_free(heap, tst2);
 
         predicted += 0xb1aa7;
         predicted += (0x4000 - (predicted % 0x4000));
@@ -266,7 +268,7 @@ static int vm_test_alloc()
         }
 
         debug("vm_test2.6\n");
-        vm_free_kernel_heap_pages(tst);
+        vm_segment_free(heap, tst);
 
         debug("vm_test2.7\n");
         if (heap->free->size != free_state) {
@@ -432,6 +434,219 @@ static int vm_test_awkward()
         return ret;
 }
 
+static int vm_test_vmap()
+{
+        struct vm_vmap_stats before;
+        struct vm_vmap_stats after;
+        vm_vmap_get_stats(&before);
+
+        char* a = vmalloc(0x1000);
+        char* b = vmalloc(0x9000);
+        if (a == NULL || b == NULL) {
+                warning("vmalloc failed!\n");
+                return -E_NOMEM;
+        }
+        /* Area a is rounded up and followed by a guard page */
+        if ((addr_t)b < (addr_t)a + PAGE_ALLOC_FACTOR + PAGE_SIZE) {
+                warning("vmalloc areas overlap or lack a guard page!\n");
+                return -E_GENERIC;
+        }
+        memset(a, 'g', 0x1000);
+        memset(b, 'h', 0x9000);
+        if (a[0xFFF] != 'g' || b[0x8FFF] != 'h') {
+                warning("vmalloc memory got damaged!\n");
+                return -E_GENERIC;
+        }
+
+        void* phys = vm_get_phys(0, b);
+        char* c = vmap(phys + 0x10, 0x20);
+        if (c == NULL || c[0] != 'h') {
+                warning("vmap doesn't map the right memory!\n");
+                return -E_GENERIC;
+        }
+
+        if (vunmap(c) != -E_SUCCESS || vfree(b) != -E_SUCCESS ||
+                        vfree(a) != -E_SUCCESS) {
+                warning("Freeing vmap areas failed!\n");
+                return -E_GENERIC;
+        }
+        if (vfree(a) != -E_INVALID_ARG) {
+                warning("Double vfree went unnoticed!\n");
+                return -E_GENERIC;
+        }
+
+        vm_vmap_get_stats(&after);
+        if (after.busy != before.busy ||
+                        after.free + after.lazy != before.free + before.lazy) {
+                warning("vmap accounting is off!\n");
+                return -E_GENERIC;
+        }
+        debug("vmap: allocs %X frees %X purges %X areas %X\n",
+                        after.allocations, after.frees, after.purges,
+                        after.areas);
+
+        return -E_SUCCESS;
+}
+
+/*
+ * A ram backed swap device, so swapping can be tested without a disk.
+ */
+#define SWAP_TEST_SIZE 0x10000
+static char* swap_test_buf = NULL;
+
+static size_t swap_test_read(struct vfile* file __attribute__((unused)),
+                char* buf, size_t start, size_t len)
+{
+        if (start + len > SWAP_TEST_SIZE)
+                return 0;
+        memcpy(buf, swap_test_buf + start, len);
+        return len;
+}
+
+static size_t swap_test_write(struct vfile* file __attribute__((unused)),
+                char* buf, size_t start, size_t len)
+{
+        if (start + len > SWAP_TEST_SIZE)
+                return 0;
+        memcpy(swap_test_buf + start, buf, len);
+        return len;
+}
+
+/*
+ * Point file at the ram device and make a descriptor for pid to map it into.
+ * Undone by vm_test_io_teardown.
+ */
+static struct vm_descriptor*
+vm_test_io_setup(struct vfile* file, file_type_t type, unsigned int pid)
+{
+        memset(file, 0, sizeof(*file));
+        file->type = type;
+        file->fs_data.read = swap_test_read;
+        file->fs_data.write = swap_test_write;
+
+        swap_test_buf = vmalloc(SWAP_TEST_SIZE);
+        if (swap_test_buf == NULL)
+                return NULL;
+
+        struct vm_descriptor* vm = vm_new(pid);
+        if (vm == NULL) {
+                vfree(swap_test_buf);
+                swap_test_buf = NULL;
+        }
+        return vm;
+}
+
+static void vm_test_io_teardown(struct vm_descriptor* vm)
+{
+        vm_free(vm);
+        vfree(swap_test_buf);
+        swap_test_buf = NULL;
+}
+
+static int vm_test_swap()
+{
+        int ret = -E_SUCCESS;
+        struct vfile dev;
+        struct vm_descriptor* vm = vm_test_io_setup(&dev, BLOCK_DEV, 4);
+        if (vm == NULL)
+                return -E_NOMEM;
+        if (vm_swap_enable(&dev, SWAP_TEST_SIZE) != -E_SUCCESS) {
+                vm_test_io_teardown(vm);
+                return -E_GENERIC;
+        }
+
+        struct vm_segment* seg;
+        seg = vm_new_segment(SEG_BASE_SIMPLE, SEG_SIZE_SMALL * 4, vm);
+        if (seg == NULL) {
+                ret = -E_NOMEM;
+                goto err;
+        }
+        seg->swappable = TRUE;
+
+        if (vm_segment_load(0, seg) != -E_SUCCESS) {
+                warning("Could not load the swap test segment!\n");
+                ret = -E_GENERIC;
+                goto err;
+        }
+
+        char* str = SEG_BASE_SIMPLE;
+        idx_t i = 0;
+        for (; i < 4; i++)
+                memset(str + i * SEG_SIZE_SMALL, 'p' + i, SEG_SIZE_SMALL);
+
+        size_t reclaimed = vm_reclaim(0, 4);
+        if (reclaimed != 4 || vm_get_phys(0, str) != NULL) {
+                warning("Reclaimed %X pages out of 4!\n", reclaimed);
+                ret = -E_GENERIC;
+                goto unload;
+        }
+
+        /* Reading the pages faults them back in */
+        for (i = 0; i < 4; i++) {
+                char* page = str + i * SEG_SIZE_SMALL;
+                if (page[0] != (char)('p' + i) ||
+                                page[SEG_SIZE_SMALL - 1] != (char)('p' + i)) {
+                        warning("Page %X came back from swap damaged!\n", i);
+                        ret = -E_GENERIC;
+                        goto unload;
+                }
+        }
+
+        unload: vm_segment_unload(0, seg);
+        /* Freeing the descriptor hands the swap slots back */
+        err: vm_test_io_teardown(vm);
+        if (vm_swap_disable() != -E_SUCCESS) {
+                warning("Swap slots leaked!\n");
+                ret = -E_GENERIC;
+        }
+        return ret;
+}
+
+static int vm_test_mmap()
+{
+        int ret = -E_SUCCESS;
+        struct vfile file;
+        struct vm_descriptor* vm = vm_test_io_setup(&file, FILE, 5);
+        if (vm == NULL)
+                return -E_NOMEM;
+        memset(swap_test_buf, 'm', SEG_SIZE_SMALL);
+        memset(swap_test_buf + SEG_SIZE_SMALL, 'n', SEG_SIZE_SMALL);
+
+        struct vm_segment* seg;
+        seg = vm_mmap(vm, SEG_BASE_SIMPLE, SEG_SIZE_SMALL * 2, &file, 0);
+        if (seg == NULL) {
+                ret = -E_NOMEM;
+                goto err;
+        }
+
+        if (vm_segment_load(0, seg) != -E_SUCCESS) {
+                warning("Could not load the mmap test segment!\n");
+                ret = -E_GENERIC;
+                goto err;
+        }
+
+        char* str = SEG_BASE_SIMPLE;
+        if (str[0] != 'm' || str[SEG_SIZE_SMALL] != 'n') {
+                warning("mmap didn't read the file!\n");
+                ret = -E_GENERIC;
+        }
+
+        /* Only the page that was written to may go back to the file */
+        str[5] = 'w';
+        swap_test_buf[SEG_SIZE_SMALL + 1] = 'x';
+        if (vm_munmap(0, seg) != -E_SUCCESS) {
+                warning("munmap failed!\n");
+                ret = -E_GENERIC;
+        }
+        if (swap_test_buf[5] != 'w' || swap_test_buf[SEG_SIZE_SMALL + 1] != 'x') {
+                warning("Dirty pages weren't written back correctly!\n");
+                ret = -E_GENERIC;
+        }
+
+        err: vm_test_io_teardown(vm);
+        return ret;
+}
+
 #ifdef VM_TEST_DESTRUCTIVE
 int vm_test_error()
 {
@@ -470,8 +685,27 @@ int vm_test()
         if (ret != -E_SUCCESS)
                 return ret;
 
-#ifdef VM_TEST_DESTRUCTIVE
         debug("vm_test6\n");
+        ret = vm_test_vmap();
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        debug("vm_test7\n");
+        ret = vm_test_swap();
+        if (ret != -E_SUCCESS)
+                return ret;
+
+        debug("vm_test8\n");
+        ret = vm_test_mmap();
+        if (ret != -E_SUCCESS)
+                return ret;
+
+#ifdef VM_DBG
+        vm_fault_dump();
+#endif
+
+#ifdef VM_TEST_DESTRUCTIVE
+        debug("vm_test9\n");
         if (vm_test_error())
         {
                 panic("Test error was not meant to return a value!");
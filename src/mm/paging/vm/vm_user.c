@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <andromeda/error.h>
 #include <andromeda/system.h>
 #include <defines.h>
@@ -36,6 +37,59 @@ int vm_segment_mark_loaded_global(struct vm_segment* s)
         return -E_SUCCESS;
 }
 
+/**
+ * \var vm_loaded_last
+ * \brief The segment the last lookup on each cpu resolved to
+ * \var vm_loaded_slot
+ * \brief Per cpu, per page directory slot, the segment last seen there
+ *
+ * These cache the results of vm_get_loaded, so that the fault handlers don't
+ * have to walk the vm_loaded trees on every fault. An entry is only trusted
+ * after checking the address really falls within the segment, so a slot
+ * shared by several small segments just costs an occasional tree walk.
+ *
+ * \var vm_fault_stats
+ * \brief Cache hit counters and the fault latency histogram, per cpu
+ *
+ * Only the cpu taking the fault writes to its own counters, so they don't
+ * need atomics. vm_get_fault_stats adds them up.
+ */
+static struct vm_segment* vm_loaded_last[CPU_LIMIT];
+static struct vm_segment* vm_loaded_slot[CPU_LIMIT][PTE_SIZE];
+static struct vm_fault_stats vm_fault_stats[CPU_LIMIT];
+
+#define VM_SLOT(a) (((addr_t)(a)) / VM_MEM_SIZE)
+
+static inline boolean
+vm_segment_contains(struct vm_segment* s, addr_t a)
+{
+        return s != NULL && (addr_t)s->virt_base <= a &&
+                        a - (addr_t)s->virt_base < s->size;
+}
+
+static void vm_loaded_cache_fill(int cpuid, struct vm_segment* s)
+{
+        if (s->size == 0)
+                return;
+        addr_t slot = VM_SLOT(s->virt_base);
+        addr_t last = VM_SLOT((addr_t)s->virt_base + s->size - 1);
+        for (; slot <= last; slot++)
+                vm_loaded_slot[cpuid][slot] = s;
+}
+
+static void vm_loaded_cache_drop(int cpuid, struct vm_segment* s)
+{
+        if (vm_loaded_last[cpuid] == s)
+                vm_loaded_last[cpuid] = NULL;
+        if (s->size == 0)
+                return;
+        addr_t slot = VM_SLOT(s->virt_base);
+        addr_t last = VM_SLOT((addr_t)s->virt_base + s->size - 1);
+        for (; slot <= last; slot++)
+                if (vm_loaded_slot[cpuid][slot] == s)
+                        vm_loaded_slot[cpuid][slot] = NULL;
+}
+
 int vm_segment_mark_loaded(int cpuid, struct vm_segment* s)
 {
         if (vm_loaded[cpuid]->find((int)s->virt_base, vm_loaded[cpuid]) != NULL)
@@ -44,6 +98,7 @@ int vm_segment_mark_loaded(int cpuid, struct vm_segment* s)
         if (vm_loaded[cpuid]->add((int)s->virt_base, s,
                         vm_loaded[cpuid]) != -E_SUCCESS)
                 return -E_GENERIC;
+        vm_loaded_cache_fill(cpuid, s);
         return -E_SUCCESS;
 }
 
@@ -52,6 +107,7 @@ int vm_segment_mark_unloaded(int cpuid, struct vm_segment* s)
         if (vm_loaded[cpuid]->find((int)s->virt_base, vm_loaded[cpuid]) == NULL)
                 return -E_NOT_YET_INITIALISED;
 
+        vm_loaded_cache_drop(cpuid, s);
         if (vm_loaded[cpuid]->delete((int)s->virt_base,
                         vm_loaded[cpuid]) != -E_SUCCESS) {
                 return -E_GENERIC;
@@ -61,19 +117,21 @@ int vm_segment_mark_unloaded(int cpuid, struct vm_segment* s)
 }
 
 /**
- * \fn vm_get_loaded
+ * \fn vm_get_loaded_slow
  * \param cpuid
  * \param addr
  * \return The segment that currently has this address mapped
  */
-static inline struct vm_segment*
-vm_get_loaded(int cpuid, void* addr)
+static struct vm_segment*
+vm_get_loaded_slow(int cpuid, void* addr)
 {
         addr_t a = (addr_t)addr;
-        a &= ~0x3FF;
+        a &= ~0xFFF;
 
         struct tree* tree = vm_loaded[cpuid]->find_close((int)addr,
                         vm_loaded[cpuid]);
+        if (tree == NULL)
+                return NULL;
 
         struct vm_segment* segment = tree->data;
         boolean go_back = FALSE;
@@ -104,6 +162,103 @@ vm_get_loaded(int cpuid, void* addr)
         return NULL ;
 }
 
+/**
+ * \fn vm_get_loaded
+ * \param cpuid
+ * \param addr
+ * \return The segment that currently has this address mapped
+ *
+ * Tries the last hit and the page directory slot table before falling back
+ * to the vm_loaded tree.
+ */
+static inline struct vm_segment*
+vm_get_loaded(int cpuid, void* addr)
+{
+        addr_t a = (addr_t)addr;
+        struct vm_segment* s = vm_loaded_last[cpuid];
+        if (vm_segment_contains(s, a)) {
+                vm_fault_stats[cpuid].last_hits++;
+                return s;
+        }
+
+        s = vm_loaded_slot[cpuid][VM_SLOT(a)];
+        if (vm_segment_contains(s, a)) {
+                vm_fault_stats[cpuid].slot_hits++;
+                vm_loaded_last[cpuid] = s;
+                return s;
+        }
+
+        vm_fault_stats[cpuid].misses++;
+        s = vm_get_loaded_slow(cpuid, addr);
+        if (s != NULL) {
+                vm_loaded_slot[cpuid][VM_SLOT(a)] = s;
+                vm_loaded_last[cpuid] = s;
+        }
+        return s;
+}
+
+/**
+ * \fn vm_fault_account
+ * \brief Add a page fault to the latency histogram
+ * \param cycles
+ * \brief The time it took to handle the fault, in cpu cycles
+ *
+ * Bucket i counts the faults that took between 2^i and 2^(i+1) cycles.
+ */
+void vm_fault_account(uint64_t cycles)
+{
+        int bucket = 0;
+        while (cycles > 1 && bucket < VM_FAULT_HIST_SIZE - 1) {
+                cycles >>= 1;
+                bucket++;
+        }
+        vm_fault_stats[get_cpu()].hist[bucket]++;
+}
+
+/**
+ * \fn vm_get_fault_stats
+ * \brief Add up the fault statistics of all cpus
+ * \param stats
+ * \return A standard error code
+ */
+int vm_get_fault_stats(struct vm_fault_stats* stats)
+{
+        if (stats == NULL)
+                return -E_NULL_PTR;
+        memset(stats, 0, sizeof(*stats));
+        int cpu = 0;
+        for (; cpu < CPU_LIMIT; cpu++) {
+                struct vm_fault_stats* s = &vm_fault_stats[cpu];
+                stats->last_hits += s->last_hits;
+                stats->slot_hits += s->slot_hits;
+                stats->misses += s->misses;
+                int i = 0;
+                for (; i < VM_FAULT_HIST_SIZE; i++)
+                        stats->hist[i] += s->hist[i];
+        }
+        return -E_SUCCESS;
+}
+
+#ifdef VM_DBG
+/**
+ * \fn vm_fault_dump
+ * \brief Print the fault statistics
+ */
+void vm_fault_dump()
+{
+        struct vm_fault_stats stats;
+        vm_get_fault_stats(&stats);
+        printf("Segment lookups: last %X, slot %X, tree %X\n",
+                        stats.last_hits, stats.slot_hits, stats.misses);
+        int i = 0;
+        for (; i < VM_FAULT_HIST_SIZE; i++) {
+                if (stats.hist[i] == 0)
+                        continue;
+                printf("2^%i cycles: %X\n", i, stats.hist[i]);
+        }
+}
+#endif
+
 /**
  * \fn vm_alloc
  * \brief Allocate a new vm descriptor for a specific task
@@ -362,6 +517,9 @@ int vm_segment_clean(struct vm_segment* s)
                 goto itterate;
         }
 
+        /* Give back the swap space */
+        vm_swap_release(s);
+
         /* If we still have physical pages, clean those up */
         if (s->pages != NULL) {
                 page_range_cleanup(0, s->pages);
@@ -388,7 +546,7 @@ int vm_free(struct vm_descriptor* p)
         /* Lock it, even though it won't get unlocked */
         mutex_lock(&p->lock);
         struct vm_segment* this = p->segments;
-        struct vm_segment* next = this->next;
+        struct vm_segment* next = (this == NULL) ? NULL : this->next;
 
         while (this != NULL ) {
                 if (vm_segment_clean(this) != -E_SUCCESS) {
@@ -494,12 +652,85 @@ error:
         return -E_GENERIC; /* Return statement to keep the compiler happy! */
 }
 
+/**
+ * \fn vm_anon_fault
+ * \brief Give a page that isn't backed by anything a fresh zeroed page
+ * \param cpu
+ * \param fault_addr
+ * \param cpl
+ * \return A standard error code
+ */
+static int vm_anon_fault(int cpu, addr_t fault_addr, int cpl)
+{
+        /* Fresh pages read as zero, preferably cleared ahead of time */
+        int dirty = 0;
+        void* phys = page_alloc_zeroed();
+        if (phys == NULL) {
+                dirty = 1;
+                phys = page_alloc();
+        }
+        if (phys == NULL) {
+                /* Try to make some room before giving up */
+                vm_reclaim(cpu, VM_SWAP_BATCH);
+                phys = page_alloc();
+        }
+        if (phys == NULL)
+                return -E_NOMEM;
+
+        page_map(cpu, (void*)(fault_addr & ~0xFFF), phys, cpl);
+        if (dirty)
+                clear_page((void*)(fault_addr & ~0xFFF));
+
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_user_fault
+ * \brief Fill in a page of a segment of the running task
+ * \param fault_addr
+ * \return -E_NOT_FOUND if no segment covers the address
+ *
+ * The page comes from swap or the file backing the segment. Only anonymous
+ * segments get a fresh zeroed page, a file that fails to fill the page is an
+ * error. Private mappings are zeroed past the end of the file by
+ * vm_file_fault itself.
+ */
+static int vm_user_fault(addr_t fault_addr)
+{
+        int cpu = get_cpu();
+        struct vm_segment* segment = vm_get_loaded(cpu, (void*)fault_addr);
+        if (segment == NULL)
+                return -E_NOT_FOUND;
+
+        if (vm_swap_in(cpu, segment, (void*)fault_addr) == -E_SUCCESS)
+                return -E_SUCCESS;
+        if (segment->file != NULL)
+                return vm_file_fault(cpu, segment, (void*)fault_addr);
+        return vm_anon_fault(cpu, fault_addr, segment->parent->cpl);
+}
+
+/**
+ * \fn vm_user_fault_panic
+ * \brief Give up on a user space page fault
+ * \param fault_addr
+ */
+static void vm_user_fault_panic(addr_t fault_addr)
+{
+        char msg[64];
+        memset(msg, 0, sizeof(msg));
+        sprintf(msg, "Unhandled user space page fault at %X",
+                        (uint32_t)fault_addr);
+        panic(msg);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 int vm_user_fault_write(addr_t fault_addr, int mapped)
 {
-        panic("User space page faults currently remain unhandled");
+        if (!mapped && vm_user_fault(fault_addr) == -E_SUCCESS)
+                return -E_SUCCESS;
+        vm_user_fault_panic(fault_addr);
         return -E_NOFUNCTION;
 }
 
@@ -523,16 +754,23 @@ int vm_kernel_fault_write(addr_t fault_addr, int mapped)
                  */
         }
 
-        void* phys = get_phys(0, (void*)(fault_addr & ~0x3FF));
+        void* phys = get_phys(0, (void*)(fault_addr & ~0xFFF));
         if (phys != NULL) {
                 panic("Faulting on existing page ... wtf!");
         }
 
-        phys = page_alloc();
-        if (phys == NULL)
-                panic("Out of memory!!!");
+        if (vm_swap_in(0, segment, (void*)fault_addr) == -E_SUCCESS)
+                return -E_SUCCESS;
+        if (segment->file != NULL) {
+                if (vm_file_fault(0, segment, (void*)fault_addr)
+                                != -E_SUCCESS)
+                        panic("Unable to read a page in from its file!");
+                return -E_SUCCESS;
+        }
 
-        page_map(0, (void*)(fault_addr & ~0x3FF), phys, 0);
+        /* A user segment, written to by a system call, stays user memory */
+        if (vm_anon_fault(0, fault_addr, segment->parent->cpl) != -E_SUCCESS)
+                panic("Out of memory!!!");
 
         return -E_SUCCESS;
 
@@ -543,20 +781,27 @@ int vm_kernel_fault_write(addr_t fault_addr, int mapped)
 
 int vm_user_fault_read(addr_t fault_addr, int mapped)
 {
+        if (!mapped && vm_user_fault(fault_addr) == -E_SUCCESS)
+                return -E_SUCCESS;
         /**
          * \todo Add permission checking
          * \todo Add correct handling
          */
-        panic("User space page faults currently remain unhandled");
+        vm_user_fault_panic(fault_addr);
         return -E_NOFUNCTION;
 }
 
 int vm_kernel_fault_read(addr_t fault_addr, int mapped, addr_t eip)
 {
         if (!mapped) {
-                /**
-                 * \todo Reload pages here when swapping is written
-                 */
+                struct vm_segment* segment;
+                segment = vm_get_loaded(0, (void*)fault_addr);
+                if (vm_swap_in(0, segment, (void*)fault_addr) == -E_SUCCESS)
+                        return -E_SUCCESS;
+                if (vm_file_fault(0, segment, (void*)fault_addr)
+                                == -E_SUCCESS)
+                        return -E_SUCCESS;
+
                 printf(
                                 "The kernel wants to read garbage from invalid memory.\n");
                 printf("Address:   %X\n", (int)fault_addr);
@@ -0,0 +1,570 @@
+/*
+ * Andromeda
+ * Copyright (C) 2015  Bart Kuivenhoven
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <andromeda/error.h>
+#include <andromeda/system.h>
+#include <defines.h>
+#include <mm/vm.h>
+#include <mm/page_alloc.h>
+#include <types.h>
+#ifdef X86
+#include <arch/x86/smp.h>
+#endif
+
+/**
+ * \addtogroup VM
+ * @{
+ *
+ * The kernel virtual area allocator hands out ranges from a dedicated window
+ * in kernel space. Free space is kept in a treap ordered by address, where
+ * every node also tracks the largest free range in its subtree. This allows
+ * the lowest fitting range to be found in O(log n).
+ *
+ * Every area is followed by an unmapped guard page, so running off the end of
+ * an area faults instead of silently corrupting the neighbour.
+ *
+ * Freed areas are unmapped without invalidating the TLB. They are parked on a
+ * lazy list until enough of them have accumulated, at which point the TLBs
+ * of all cpus are flushed once and the ranges are returned to the free tree.
+ *
+ * The area descriptors come from a static pool rather than the slab allocator,
+ * as the slab allocator gets its pages from here.
+ */
+
+#define VMAP_POOL_SIZE  0x400
+#define VMAP_LAZY_MAX   0x800000
+#define VMAP_GUARD_SIZE PAGE_SIZE
+
+#ifdef X86
+#define vmap_flush() smp_flush_tlbs()
+#else
+#define vmap_flush() page_flush(get_cpu())
+#endif
+
+struct vm_area {
+        addr_t base;
+        size_t size;
+        /* Largest free range in this subtree */
+        size_t max;
+        uint32_t prio;
+        bool io;
+
+        struct vm_area* left;
+        struct vm_area* right;
+        struct vm_area* next;
+};
+
+static struct vm_area vmap_pool[VMAP_POOL_SIZE];
+static struct vm_area* vmap_pool_head = NULL;
+
+static struct vm_area* vmap_free_tree = NULL;
+static struct vm_area* vmap_busy_tree = NULL;
+static struct vm_area* vmap_lazy = NULL;
+
+static struct vm_vmap_stats vmap_stats;
+static uint32_t vmap_seed = 0x2545F491;
+static mutex_t vmap_lock = mutex_unlocked;
+/* Purges that have let go of vmap_lock to flush */
+static volatile int vmap_purging = 0;
+
+/**
+ * \fn vmap_rand
+ * \brief Generate treap priorities (xorshift)
+ */
+static uint32_t vmap_rand()
+{
+        vmap_seed ^= vmap_seed << 13;
+        vmap_seed ^= vmap_seed >> 17;
+        vmap_seed ^= vmap_seed << 5;
+        return vmap_seed;
+}
+
+static struct vm_area* vmap_area_get()
+{
+        struct vm_area* a = vmap_pool_head;
+        if (a == NULL)
+                return NULL;
+        vmap_pool_head = a->next;
+        memset(a, 0, sizeof(*a));
+        a->prio = vmap_rand();
+        vmap_stats.areas++;
+        return a;
+}
+
+static void vmap_area_put(struct vm_area* a)
+{
+        a->next = vmap_pool_head;
+        vmap_pool_head = a;
+        vmap_stats.areas--;
+}
+
+static void vmap_update(struct vm_area* a)
+{
+        a->max = a->size;
+        if (a->left != NULL && a->left->max > a->max)
+                a->max = a->left->max;
+        if (a->right != NULL && a->right->max > a->max)
+                a->max = a->right->max;
+}
+
+/**
+ * \fn vmap_merge
+ * \brief Join two treaps where all of a lies below all of b
+ */
+static struct vm_area* vmap_merge(struct vm_area* a, struct vm_area* b)
+{
+        if (a == NULL)
+                return b;
+        if (b == NULL)
+                return a;
+        if (a->prio > b->prio) {
+                a->right = vmap_merge(a->right, b);
+                vmap_update(a);
+                return a;
+        }
+        b->left = vmap_merge(a, b->left);
+        vmap_update(b);
+        return b;
+}
+
+/**
+ * \fn vmap_split
+ * \brief Split a treap in nodes below key and nodes at or above key
+ */
+static void vmap_split(struct vm_area* t, addr_t key, struct vm_area** l,
+                struct vm_area** r)
+{
+        if (t == NULL) {
+                *l = NULL;
+                *r = NULL;
+                return;
+        }
+        if (t->base < key) {
+                vmap_split(t->right, key, &t->right, r);
+                *l = t;
+        } else {
+                vmap_split(t->left, key, l, &t->left);
+                *r = t;
+        }
+        vmap_update(t);
+}
+
+static struct vm_area* vmap_insert(struct vm_area* root, struct vm_area* a)
+{
+        struct vm_area* l;
+        struct vm_area* r;
+        a->left = NULL;
+        a->right = NULL;
+        vmap_update(a);
+        vmap_split(root, a->base, &l, &r);
+        return vmap_merge(vmap_merge(l, a), r);
+}
+
+static struct vm_area* vmap_remove(struct vm_area* t, addr_t base,
+                struct vm_area** out)
+{
+        if (t == NULL)
+                return NULL;
+        if (t->base == base) {
+                *out = t;
+                return vmap_merge(t->left, t->right);
+        }
+        if (base < t->base)
+                t->left = vmap_remove(t->left, base, out);
+        else
+                t->right = vmap_remove(t->right, base, out);
+        vmap_update(t);
+        return t;
+}
+
+/**
+ * \fn vmap_find_fit
+ * \brief Find the lowest addressed free range of at least size bytes
+ */
+static struct vm_area* vmap_find_fit(struct vm_area* t, size_t size)
+{
+        while (t != NULL) {
+                if (t->left != NULL && t->left->max >= size)
+                        t = t->left;
+                else if (t->size >= size)
+                        return t;
+                else if (t->right != NULL && t->right->max >= size)
+                        t = t->right;
+                else
+                        return NULL;
+        }
+        return NULL;
+}
+
+/**
+ * \fn vmap_find_below
+ * \brief Find the node with the highest base below key
+ */
+static struct vm_area* vmap_find_below(struct vm_area* t, addr_t key)
+{
+        struct vm_area* ret = NULL;
+        while (t != NULL) {
+                if (t->base < key) {
+                        ret = t;
+                        t = t->right;
+                } else {
+                        t = t->left;
+                }
+        }
+        return ret;
+}
+
+/**
+ * \fn vmap_find_above
+ * \brief Find the node with the lowest base above key
+ */
+static struct vm_area* vmap_find_above(struct vm_area* t, addr_t key)
+{
+        struct vm_area* ret = NULL;
+        while (t != NULL) {
+                if (t->base > key) {
+                        ret = t;
+                        t = t->left;
+                } else {
+                        t = t->right;
+                }
+        }
+        return ret;
+}
+
+/**
+ * \fn vmap_free_insert
+ * \brief Return a range to the free tree, merging it with its neighbours
+ * \warning The caller is expected to hold vmap_lock
+ */
+static void vmap_free_insert(struct vm_area* a)
+{
+        struct vm_area* tmp = NULL;
+        struct vm_area* n = vmap_find_below(vmap_free_tree, a->base);
+        if (n != NULL && n->base + n->size == a->base) {
+                vmap_free_tree = vmap_remove(vmap_free_tree, n->base, &tmp);
+                n->size += a->size;
+                vmap_area_put(a);
+                a = n;
+        }
+        n = vmap_find_above(vmap_free_tree, a->base);
+        if (n != NULL && a->base + a->size == n->base) {
+                vmap_free_tree = vmap_remove(vmap_free_tree, n->base, &tmp);
+                a->size += n->size;
+                vmap_area_put(n);
+        }
+        a->io = FALSE;
+        vmap_free_tree = vmap_insert(vmap_free_tree, a);
+}
+
+/**
+ * \fn vmap_purge
+ * \brief Flush the TLBs and make all lazily freed ranges available again
+ * \warning The caller is expected to hold vmap_lock, which is dropped and
+ * taken again in between
+ *
+ * Other cpus may still hold translations to the ranges, and the pages behind
+ * them are back in the page allocator. None of the ranges is handed out
+ * before every cpu has acknowledged the flush. A cpu spinning on vmap_lock
+ * with interrupts off can't acknowledge anything, so the lock isn't held
+ * while waiting for that.
+ */
+static void vmap_purge()
+{
+        if (vmap_lazy == NULL)
+                return;
+
+        /* Later frees start a new batch */
+        struct vm_area* batch = vmap_lazy;
+        size_t size = vmap_stats.lazy;
+        vmap_lazy = NULL;
+        vmap_stats.lazy = 0;
+        vmap_purging++;
+        mutex_unlock(&vmap_lock);
+
+        vmap_flush();
+
+        mutex_lock(&vmap_lock);
+        vmap_purging--;
+        while (batch != NULL) {
+                struct vm_area* a = batch;
+                batch = a->next;
+                vmap_free_insert(a);
+        }
+        vmap_stats.free += size;
+        vmap_stats.purges++;
+}
+
+/**
+ * \fn vmap_get_area
+ * \brief Reserve a range of virtual memory (guard page included)
+ * \param size
+ * \brief Size in bytes, must be page aligned
+ */
+static struct vm_area* vmap_get_area(size_t size)
+{
+        mutex_lock(&vmap_lock);
+        struct vm_area* f = vmap_find_fit(vmap_free_tree, size);
+        while (f == NULL && (vmap_lazy != NULL || vmap_purging != 0)) {
+                if (vmap_lazy != NULL) {
+                        vmap_purge();
+                } else {
+                        /* Another cpu is about to hand ranges back */
+                        mutex_unlock(&vmap_lock);
+                        mutex_lock(&vmap_lock);
+                }
+                f = vmap_find_fit(vmap_free_tree, size);
+        }
+        if (f == NULL) {
+                mutex_unlock(&vmap_lock);
+                return NULL;
+        }
+
+        struct vm_area* a = f;
+        if (f->size > size) {
+                a = vmap_area_get();
+                if (a == NULL) {
+                        mutex_unlock(&vmap_lock);
+                        return NULL;
+                }
+        }
+        vmap_free_tree = vmap_remove(vmap_free_tree, f->base, &f);
+        if (a != f) {
+                /* Carve the area out of the bottom of the free range */
+                a->base = f->base;
+                a->size = size;
+                f->base += size;
+                f->size -= size;
+                vmap_free_tree = vmap_insert(vmap_free_tree, f);
+        }
+
+        vmap_busy_tree = vmap_insert(vmap_busy_tree, a);
+        vmap_stats.free -= size;
+        vmap_stats.busy += size;
+        vmap_stats.allocations++;
+        mutex_unlock(&vmap_lock);
+        return a;
+}
+
+/**
+ * \fn vmap_release
+ * \brief Unmap an area and park it on the lazy list
+ * \param a
+ * \param mapped
+ * \brief Number of bytes actually mapped into the area
+ */
+static void vmap_release(struct vm_area* a, size_t mapped)
+{
+        int cpu = get_cpu();
+        addr_t v = a->base;
+        addr_t end = a->base + mapped;
+
+        for (; v < end; v += PAGE_SIZE) {
+                if (!a->io && (v - a->base) % PAGE_ALLOC_FACTOR == 0) {
+                        void* phys = get_phys(cpu, (void*)v);
+                        if (phys != NULL)
+                                page_free(phys);
+                }
+                page_unmap_lazy(cpu, (void*)v);
+        }
+
+        mutex_lock(&vmap_lock);
+        a->next = vmap_lazy;
+        vmap_lazy = a;
+        vmap_stats.busy -= a->size;
+        vmap_stats.lazy += a->size;
+        vmap_stats.frees++;
+        if (vmap_stats.lazy >= VMAP_LAZY_MAX)
+                vmap_purge();
+        mutex_unlock(&vmap_lock);
+}
+
+/**
+ * \fn vmap_take_area
+ * \brief Remove an area from the busy tree by its (unaligned) address
+ */
+static struct vm_area* vmap_take_area(void* ptr)
+{
+        struct vm_area* a = NULL;
+        addr_t base = (addr_t)ptr & ~(PAGE_SIZE - 1);
+        mutex_lock(&vmap_lock);
+        vmap_busy_tree = vmap_remove(vmap_busy_tree, base, &a);
+        mutex_unlock(&vmap_lock);
+        return a;
+}
+
+/**
+ * \fn vmalloc
+ * \brief Allocate virtually contiguous, physically backed kernel memory
+ * \param size
+ * \return A pointer to the memory or NULL
+ */
+void* vmalloc(size_t size)
+{
+        if (size == 0)
+                return NULL;
+
+        if (size % PAGE_ALLOC_FACTOR != 0)
+                size += PAGE_ALLOC_FACTOR - size % PAGE_ALLOC_FACTOR;
+
+        struct vm_area* a = vmap_get_area(size + VMAP_GUARD_SIZE);
+        if (a == NULL)
+                return NULL;
+
+        int cpu = get_cpu();
+        size_t i = 0;
+        for (; i < size; i += PAGE_ALLOC_FACTOR) {
+                addr_t phys = (addr_t)page_alloc();
+                if (phys == 0)
+                        goto err;
+                size_t j = 0;
+                for (; j < PAGE_ALLOC_FACTOR; j += PAGE_SIZE)
+                        page_map(cpu, (void*)(a->base + i + j),
+                                        (void*)(phys + j), VM_CPL_CORE);
+        }
+
+        return (void*)a->base;
+
+err:
+        mutex_lock(&vmap_lock);
+        vmap_busy_tree = vmap_remove(vmap_busy_tree, a->base, &a);
+        mutex_unlock(&vmap_lock);
+        vmap_release(a, i);
+        return NULL;
+}
+
+/**
+ * \fn vfree
+ * \brief Release memory obtained through vmalloc
+ * \param ptr
+ * \return A standard error code
+ */
+int vfree(void* ptr)
+{
+        if (ptr == NULL)
+                return -E_NULL_PTR;
+
+        struct vm_area* a = vmap_take_area(ptr);
+        if (a == NULL)
+                return -E_INVALID_ARG;
+
+        vmap_release(a, a->size - VMAP_GUARD_SIZE);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vmap
+ * \brief Map a physical range (e.g. MMIO) into kernel space
+ * \param phys
+ * \param size
+ * \return The virtual address corresponding to phys or NULL
+ *
+ * The physical pages are not claimed from the page allocator, so this can be
+ * used on device memory as well.
+ */
+void* vmap(void* phys, size_t size)
+{
+        if (phys == NULL || size == 0)
+                return NULL;
+
+        addr_t offset = (addr_t)phys & (PAGE_SIZE - 1);
+        addr_t p = (addr_t)phys - offset;
+        size += offset;
+        if (size % PAGE_SIZE != 0)
+                size += PAGE_SIZE - size % PAGE_SIZE;
+
+        struct vm_area* a = vmap_get_area(size + VMAP_GUARD_SIZE);
+        if (a == NULL)
+                return NULL;
+        a->io = TRUE;
+
+        int cpu = get_cpu();
+        size_t i = 0;
+        for (; i < size; i += PAGE_SIZE)
+                page_map(cpu, (void*)(a->base + i), (void*)(p + i),
+                                VM_CPL_CORE);
+
+        return (void*)(a->base + offset);
+}
+
+/**
+ * \fn vunmap
+ * \brief Remove a mapping created by vmap
+ * \param virt
+ * \return A standard error code
+ */
+int vunmap(void* virt)
+{
+        if (virt == NULL)
+                return -E_NULL_PTR;
+
+        struct vm_area* a = vmap_take_area(virt);
+        if (a == NULL)
+                return -E_INVALID_ARG;
+
+        vmap_release(a, a->size - VMAP_GUARD_SIZE);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_vmap_get_stats
+ * \brief Copy the allocator statistics
+ * \param stats
+ * \return A standard error code
+ */
+int vm_vmap_get_stats(struct vm_vmap_stats* stats)
+{
+        if (stats == NULL)
+                return -E_NULL_PTR;
+
+        mutex_lock(&vmap_lock);
+        memcpy(stats, &vmap_stats, sizeof(*stats));
+        mutex_unlock(&vmap_lock);
+        return -E_SUCCESS;
+}
+
+/**
+ * \fn vm_vmap_init
+ * \brief Set up the free tree to cover the whole vmap window
+ * \return A standard error code
+ */
+int vm_vmap_init()
+{
+        memset(vmap_pool, 0, sizeof(vmap_pool));
+        memset(&vmap_stats, 0, sizeof(vmap_stats));
+
+        int i = 0;
+        for (; i < VMAP_POOL_SIZE - 1; i++)
+                vmap_pool[i].next = &vmap_pool[i + 1];
+        vmap_pool_head = vmap_pool;
+
+        struct vm_area* a = vmap_area_get();
+        a->base = VM_VMAP_BASE;
+        a->size = VM_VMAP_SIZE;
+        vmap_free_tree = vmap_insert(NULL, a);
+        vmap_busy_tree = NULL;
+        vmap_lazy = NULL;
+        vmap_stats.free = VM_VMAP_SIZE;
+
+        return -E_SUCCESS;
+}
+
+/**
+ * @}
+ * \file
+ */
@@ -198,7 +198,13 @@ register size_t no_elements;
                 return -E_INVALID_ARG;
         register size_t data_offset = calc_data_offset(cache->alignment, slab);
 
-        memset(slab, 0, no_pages);
+        if ((addr_t)slab % PAGE_SIZE == 0 && no_pages % PAGE_SIZE == 0) {
+                size_t i = 0;
+                for (; i < no_pages; i += PAGE_SIZE)
+                        clear_page((void*)slab + i);
+        } else {
+                memset(slab, 0, no_pages);
+        }
         slab->obj_ptr = (void*)slab + data_offset;
         /*if ((size_t)slab->obj_ptr % cache->alignment != 0)
                 slab->obj_ptr += cache->alignment - ((size_t) slab->obj_ptr % cache->alignment);*/